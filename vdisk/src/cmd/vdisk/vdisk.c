@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <strings.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -102,6 +103,9 @@ typedef struct vd_state_s {
 	/* vbox handle */
 	PVBOXHDD		vboxh;
 
+	/* changed block tracking, NULL if not enabled */
+	vd_cbt_t		*cbt;
+
 	/* xpvtap minor node file descriptor */
 	int			xfd;
 
@@ -129,7 +133,8 @@ static vd_option_t vd_options[] = {
 
 #define	VD_WRITE	0
 #define	VD_READ		1
-vd_rw_t vd_wr[2] = {{"WR", (void *)VDWrite}, {"RD", (void *)VDRead}};
+static int vd_write(PVBOXHDD vboxh, uint64_t off, void *addr, size_t size);
+vd_rw_t vd_wr[2] = {{"WR", vd_write}, {"RD", (void *)VDRead}};
 
 /* vd_ log is a separate global because it lives across the fork */
 vdisk_log_t vd_log;
@@ -144,8 +149,10 @@ static void vd_run(char *vdiskpath, char *xpvpath);
 static int vd_req_rw(vd_state_t *st, blkif_request_t *req, vd_rw_t *rw);
 static int vd_req_write_barrier(vd_state_t *st, blkif_request_t *req);
 static int vd_req_flush(vd_state_t *st, blkif_request_t *req);
+static int vd_flush(vd_state_t *st);
 static int vd_resp_push(vd_state_t *st, uint64_t id, uint8_t operation,
     int16_t status);
+static void vd_cbt_close(vd_state_t *st);
 static void vd_cleanup(int signo);
 
 
@@ -211,6 +218,9 @@ main(int argc, char *argv[])
 		exit(-1);
 	}
 
+	/* Nothing here writes the store, so it may be read from its cache */
+	vdisk_set_store_flags(VD_STORE_CACHED);
+
 	if (query != NULL) {
 		return (vd_query(vdiskpath, query));
 	}
@@ -407,6 +417,20 @@ vd_run(char *vdiskpath, char *xpvpath)
 	}
 	st->vboxh = ((vd_handle_t *)st->vdh)->hdd;
 
+	/*
+	 * Don't run untracked when tracking is enabled, a backup relying
+	 * on the bitmap would miss the guest's writes.
+	 */
+	if (!((vd_handle_t *)st->vdh)->unmanaged) {
+		st->cbt = vdisk_cbt_open(vdiskpath);
+		if ((st->cbt == NULL) && (errno != ENOENT)) {
+			VDISK_LOG(vd_log, VDISK_LFLG_ERR, "%s: \"%s\"\n",
+			    gettext("ERROR: Unable to open changed block "
+			    "bitmap"), vdiskpath);
+			goto out;
+		}
+	}
+
 	sigact.sa_flags = 0;
 	sigact.sa_handler = vd_cleanup;
 	rc = sigemptyset(&sigact.sa_mask);
@@ -529,6 +553,7 @@ out:
 			    gettext("ERROR: Unable to set noflush_on_close"));
 	}
 	vdisk_close(st->vdh);
+	vd_cbt_close(st);
 }
 
 
@@ -677,8 +702,8 @@ vd_req_write_barrier(vd_state_t *st, blkif_request_t *req)
 	int rc;
 
 
-	rc = VDFlush(st->vboxh);
-	if (!VBOX_SUCCESS(rc)) {
+	rc = vd_flush(st);
+	if (rc != 0) {
 		status = BLKIF_RSP_ERROR;
 	} else {
 		status = BLKIF_RSP_OKAY;
@@ -708,8 +733,8 @@ vd_req_flush(vd_state_t *st, blkif_request_t *req)
 	int rc;
 
 
-	rc = VDFlush(st->vboxh);
-	if (!VBOX_SUCCESS(rc)) {
+	rc = vd_flush(st);
+	if (rc != 0) {
 		status = BLKIF_RSP_ERROR;
 	} else {
 		status = BLKIF_RSP_OKAY;
@@ -729,6 +754,69 @@ vd_req_flush(vd_state_t *st, blkif_request_t *req)
 }
 
 
+/*
+ * vd_flush()
+ *    flush the images, then the writes' bits in the changed block bitmap
+ */
+static int
+vd_flush(vd_state_t *st)
+{
+	int rc;
+
+
+	rc = VDFlush(st->vboxh);
+	if (!VBOX_SUCCESS(rc)) {
+		return (-1);
+	}
+
+	if ((st->cbt != NULL) && (vdisk_cbt_sync(st->cbt) != 0)) {
+		VDISK_LOG(vd_log, VDISK_LFLG_ERR, "%s\n",
+		    gettext("ERROR: Unable to write changed block bitmap"));
+		return (-1);
+	}
+
+	return (0);
+}
+
+
+/*
+ * vd_write()
+ *    write to the disk, recording the blocks written if tracking
+ */
+static int
+vd_write(PVBOXHDD vboxh, uint64_t off, void *addr, size_t size)
+{
+	if (vd_statep->cbt != NULL) {
+		vdisk_cbt_mark(vd_statep->cbt, off, size);
+	}
+
+	return (VDWrite(vboxh, off, addr, size));
+}
+
+
+/*
+ * vd_cbt_close()
+ *    write out the changed block bitmap once the images are closed
+ */
+static void
+vd_cbt_close(vd_state_t *st)
+{
+	int rc;
+
+
+	if (st->cbt == NULL) {
+		return;
+	}
+
+	rc = vdisk_cbt_close(st->cbt);
+	st->cbt = NULL;
+	if (rc != 0) {
+		VDISK_LOG(vd_log, VDISK_LFLG_ERR, "%s\n",
+		    gettext("ERROR: Unable to write changed block bitmap"));
+	}
+}
+
+
 /*
  * vd_resp_push()
  */
@@ -771,6 +859,7 @@ vd_cleanup(int signo)
 			    gettext("ERROR: Unable to set noflush_on_close"));
 	}
 	vdisk_close(vd_statep->vdh);
+	vd_cbt_close(vd_statep);
 	VDISK_LOG(vd_log, VDISK_LFLG_INFO, "shutting down\n");
 	vdisk_log_fini(&vd_log);
 	exit(0);
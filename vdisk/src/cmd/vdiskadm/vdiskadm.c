@@ -28,10 +28,15 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <grp.h>
 
@@ -45,6 +50,14 @@
 #include "iprt/string.h"
 
 #include "vdisk.h"
+#include "vdiskadm_copy.h"
+#include "vdiskadm_stream.h"
+#include "vdiskadm_verify.h"
+#include "vdiskadm_index.h"
+#include "vdiskadm_sync.h"
+#include "vdiskadm_serve.h"
+#include "vdiskadm_batch.h"
+#include "vdiskadm_scan.h"
 
 #define	VDI_MAX_BACKENDS	15
 static VDBACKENDINFO vdi_backend_info[VDI_MAX_BACKENDS];
@@ -72,8 +85,14 @@ typedef struct vdi_cmd_s {
  *	vdi_rollback_cmd - rollback virtual disk to a snapshot
  *	vdi_clone_cmd - clone a virtual disk
  *	vdi_verify_cmd - verify that path is a virtual disk
+ *	vdi_index_cmd - build the content indexes of the images
+ *	vdi_compare_cmd - compare virtual disks or snapshots by their indexes
+ *	vdi_sync_cmd - write the blocks that differ into another virtual disk
+ *	vdi_compact_cmd - reclaim the space of zeroed blocks in place
  *	vdi_refinc_cmd - increment reference count on virtual disk
  *	vdi_refdec_cmd - decrement reference count on virtual disk
+ *	vdi_serve_cmd - run the commands sent over a socket
+ *	vdi_batch_cmd - run a list of commands
  *	vdi_propadd_cmd - add a user defined property to virtual disk
  *	vdi_propdel_cmd - delete a user defined property
  *	vdi_propget_cmd - get a native or user define property
@@ -94,14 +113,25 @@ static int vdi_snapshot_cmd(int argc, char *argv[]);
 static int vdi_rollback_cmd(int argc, char *argv[]);
 static int vdi_clone_cmd(int argc, char *argv[]);
 static int vdi_verify_cmd(int argc, char *argv[]);
+static int vdi_index_cmd(int argc, char *argv[]);
+static int vdi_compare_cmd(int argc, char *argv[]);
+static int vdi_sync_cmd(int argc, char *argv[]);
+static int vdi_compact_cmd(int argc, char *argv[]);
+static int vdi_cbt_enable_cmd(int argc, char *argv[]);
+static int vdi_cbt_disable_cmd(int argc, char *argv[]);
+static int vdi_changes_cmd(int argc, char *argv[]);
 static int vdi_refinc_cmd(int argc, char *argv[]);
 static int vdi_refdec_cmd(int argc, char *argv[]);
+static int vdi_attach_info_cmd(int argc, char *argv[]);
+static int vdi_serve_cmd(int argc, char *argv[]);
+static int vdi_batch_cmd(int argc, char *argv[]);
 static int vdi_propadd_cmd(int argc, char *argv[]);
 static int vdi_propdel_cmd(int argc, char *argv[]);
 static int vdi_propget_cmd(int argc, char *argv[]);
 static int vdi_propset_cmd(int argc, char *argv[]);
 static int vdi_move_cmd(int argc, char *argv[]);
 static int vdi_rename_cmd(int argc, char *argv[]);
+static int vdi_run(int argc, char *argv[]);
 
 const char vdi_help_desc[] = "List commands or show help on a command\n";
 const char vdi_help_help[] =
@@ -111,9 +141,16 @@ const char vdi_help_help[] =
 const char vdi_list_desc[] = "list images in a virtual disk\n";
 const char vdi_list_help[] =
 	"USAGE:\n"
-	"  vdiskadm list [-pf] vdname\n\n"
+	"  vdiskadm list [-pf] vdname\n"
+	"  vdiskadm list -R [-j <threads>] dir\n\n"
+	"  With -R lists every vdisk under dir, reading only their stores,\n"
+	"  as a line per vdisk and snapshot:\n"
+	"    disk:vtype:max-size:allocated:depth:rwcnt:rocnt:vdname\n"
+	"    snapshot:allocated:depth:clones:vdname@snapname\n"
+	"  allocated is in bytes, depth counts the images of the chain.\n"
 	" EXAMPLE:\n"
-	"  vdiskadm list -f /export/guests/winxp/winxp-001\n";
+	"  vdiskadm list -f /export/guests/winxp/winxp-001\n"
+	"  vdiskadm list -R /export/guests\n";
 
 const char vdi_create_desc[] = "create a virtual disk\n";
 const char vdi_create_help[] =
@@ -142,23 +179,49 @@ const char vdi_destroy_help[] =
 const char vdi_import_desc[] = "import a zvol, raw file, or virtual disk\n";
 const char vdi_import_help[] =
 	"USAGE:\n"
-	" vdiskadm import [-fnpqm] [-x <type>] -d <file|zvol|dsk> "
-	"[-t <type[:opt]>] vdname\n\n"
+	" vdiskadm import [-fnpqmv] [-j <threads>] [-x <type>] "
+	"-d <file|zvol|dsk|-> [-t <type[:opt]>] vdname\n"
+	" vdiskadm import -i [-v] -d <file|-> vdname\n\n"
+	"  -x stream imports a stream written by export -x stream or\n"
+	"  -x zstream; -j decompresses a zstream on several threads.\n"
+	"  -d - reads a stream, or with -x raw and -t raw a raw export,\n"
+	"  from stdin.\n"
+	"  -i applies a stream written by export -i to a vdname whose\n"
+	"  latest snapshot is the one it starts at, then takes the\n"
+	"  snapshot it ends at.\n"
 	"EXAMPLE:\n"
-	"  vdiskadm import -d /downloads/image.vmdk /export/new_guests/disk1\n";
+	"  vdiskadm import -d /downloads/image.vmdk /export/new_guests/disk1\n"
+	"  ssh host vdiskadm export -x stream -d - /export/guests/disk1 | "
+	"vdiskadm import -d - /export/new_guests/disk1\n"
+	"  ssh host vdiskadm export -i snap1 -x stream -d - "
+	"/export/guests/disk1@snap2 | vdiskadm import -i -d - "
+	"/export/replicas/disk1\n";
 
 const char vdi_export_desc[] = "export virtual disk to raw file, disk, zvol\n";
 const char vdi_export_help[] =
 	"USAGE:\n"
-	" vdiskadm export -x <type>[:opt] -d <file|zvol|dsk> vdname\n\n"
+	" vdiskadm export [-pv] [-j <threads>] -x <type>[:opt] "
+	"-d <file|zvol|dsk|-> vdname\n"
+	" vdiskadm export [-pv] -i <snap> -x stream -d <file|-> "
+	"vdname[@snap]\n\n"
+	"  -x stream writes a sparse stream that only holds the data.\n"
+	"  -x zstream[:1-9] writes it compressed in chunks, on -j threads,\n"
+	"  with an index for parallel import.\n"
+	"  -d - writes a raw or stream export to stdout; -p can't be used.\n"
+	"  -i writes only what changed since an older snapshot, up to\n"
+	"  the snapshot given or the current contents, for import -i.\n"
 	"EXAMPLE:\n"
 	"  vdiskadm export -x raw -d /dev/zvol/dsk/pool/t1 "
-	" /export/new_guests/disk1\n";
+	" /export/new_guests/disk1\n"
+	"  vdiskadm export -x stream -d - /export/guests/disk1 | "
+	"gzip > disk1.gz\n"
+	"  vdiskadm export -j 8 -x zstream -d /archive/disk1.vdz "
+	"/export/guests/disk1\n";
 
 const char vdi_convert_desc[] = "convert a virtual disk to different type\n";
 const char vdi_convert_help[] =
 	"USAGE:\n"
-	"  vdiskadm convert [-t <type[:opt]>] vdname\n\n"
+	"  vdiskadm convert [-pv] [-j <threads>] [-t <type[:opt]>] vdname\n\n"
 	"  TYPES AND OPTIONS SUPPORTED\n"
 	"    vmdk:sparse\n"
 	"    vmdk:fixed\n"
@@ -167,6 +230,9 @@ const char vdi_convert_help[] =
 	"    vhd:sparse\n"
 	"    vhd:fixed\n"
 	"    raw\n"
+	"  A raw, vdi:fixed or vhd:fixed vdisk without snapshots converted to\n"
+	"  one of raw, vdi:fixed or vhd:fixed keeps its data; only the image\n"
+	"  metadata is written.\n"
 	"EXAMPLE:\n"
 	"  vdiskadm convert -t vmdk:fixed /guests/winxp/winxp-001\n";
 
@@ -174,8 +240,8 @@ const char vdi_translate_desc[] = "translate virtual disk data to a "
 	"different type\n";
 const char vdi_translate_help[] =
 	"USAGE:\n"
-	"  vdiskadm translate [-i type[:opt]] -I input_file -x type[:opt] "
-	    "-d output_file\n\n"
+	"  vdiskadm translate [-pv] [-j threads] [-i type[:opt]] -I input_file "
+	    "-x type[:opt] -d output_file\n\n"
 	"  TYPES AND OPTIONS SUPPORTED\n"
 	"    vmdk:sparse\n"
 	"    vmdk:fixed\n"
@@ -190,9 +256,18 @@ const char vdi_translate_help[] =
 const char vdi_snapshot_desc[] = "create a snapshot of a virtual disk\n";
 const char vdi_snapshot_help[] =
 	"USAGE:\n"
-	" vdiskadm snapshot vdname@snap_name\n\n"
+	" vdiskadm snapshot vdname@snap_name\n"
+	" vdiskadm snapshot -g snap_name vdname ...\n\n"
+	"  -g takes snapshot snap_name of every vdname at the same point in\n"
+	"  time, such as of all the disks of a guest.  The locks of all the\n"
+	"  disks are taken first and held until the snapshots are taken, so\n"
+	"  none can be put in use in between; the disks are made ready in\n"
+	"  parallel.  If the snapshot of any disk fails, the snapshots\n"
+	"  already taken are undone and no disk keeps snapshot snap_name.\n"
 	"EXAMPLE:\n"
-	"  vdiskadm snapshot /export/guests/winxp/winxp-001@snap1";
+	"  vdiskadm snapshot /export/guests/winxp/winxp-001@snap1\n"
+	"  vdiskadm snapshot -g nightly /export/guests/db/disk0 "
+	"/export/guests/db/disk1";
 
 const char vdi_rollback_desc[] = "revert to a snapshot of a virtual disk\n";
 const char vdi_rollback_help[] =
@@ -204,21 +279,111 @@ const char vdi_rollback_help[] =
 const char vdi_clone_desc[] = "clone a snapshot\n";
 const char vdi_clone_help[] =
 	"USAGE:\n"
-	" vdiskadm clone [-c <comment>] vdname[@snap_name] vdname\n\n"
+	" vdiskadm clone [-pv] [-j <threads>] [-c <comment>] "
+	"vdname[@snap_name] vdname\n"
+	" vdiskadm clone -l [-c <comment>] vdname@snap_name vdname\n\n"
 	"EXAMPLE:\n"
 	"  vdiskadm clone -c \"Cloned Disk\" "
-	"/export/guests/winxp/winxp-001@snap1 /export/new_guests/winxp-clone\n";
+	"/export/guests/winxp/winxp-001@snap1 /export/new_guests/winxp-clone\n"
+	"  vdiskadm clone -l "
+	"/export/guests/winxp/winxp-001@snap1 /export/new_guests/winxp-l1\n";
 
 const char vdi_verify_desc[] = "verify a disk is valid\n";
 const char vdi_verify_help[] =
 	"USAGE:\n"
-	" vdiskadm verify vdname\n\n";
+	" vdiskadm verify vdname\n"
+	" vdiskadm verify -f [-pvR] [-j <threads>] [-r <rate>] "
+	"[-c record|check] vdname\n\n"
+	"  -f reads every allocated block of every image and checks the\n"
+	"  image metadata; -r limits the reads to <rate> bytes a second.\n"
+	"  -c record saves checksums of the snapshot images, -c check\n"
+	"  compares them.  An interrupted -f resumes where it stopped\n"
+	"  unless -R is given.\n"
+	"EXAMPLE:\n"
+	"  vdiskadm verify -f -j 4 -r 50m -c check /export/guests/disk1\n";
+
+const char vdi_index_desc[] = "build the content indexes of a virtual disk\n";
+const char vdi_index_help[] =
+	"USAGE:\n"
+	"  vdiskadm index [-pv] [-j <threads>] vdname\n\n"
+	"  Hashes the blocks of every image without an up to date index\n"
+	"  into a hash tree kept beside the image, on -j threads.  An image\n"
+	"  above an indexed one only has the blocks it writes hashed.\n"
+	"EXAMPLE:\n"
+	"  vdiskadm index -j 4 /export/guests/winxp/winxp-001\n";
+
+const char vdi_compare_desc[] = "compare virtual disks or snapshots\n";
+const char vdi_compare_help[] =
+	"USAGE:\n"
+	"  vdiskadm compare [-p] vdname[@snap_name] vdname[@snap_name]\n\n"
+	"  Lists the ranges that are equal or differ using the indexes\n"
+	"  built by vdiskadm index, without reading any data.  Ranges\n"
+	"  without an up to date index on both sides are unknown.\n"
+	"EXAMPLE:\n"
+	"  vdiskadm compare /export/guests/winxp/winxp-001@snap1 "
+	"/export/guests/winxp/winxp-002\n";
+
+const char vdi_sync_desc[] = "make a virtual disk read the same as another\n";
+const char vdi_sync_help[] =
+	"USAGE:\n"
+	"  vdiskadm sync [-pv] [-j <threads>] vdname[@snap_name] vdname\n\n"
+	"  Compares the two disks block by block on -j threads and writes\n"
+	"  the blocks that differ into the second one, which keeps its\n"
+	"  type and snapshots.  Only the ranges up to date indexes of both\n"
+	"  don't show as equal, or else the ranges written above images\n"
+	"  both share, are compared.  A disk in use can only be synced\n"
+	"  from a snapshot.\n"
+	"EXAMPLE:\n"
+	"  vdiskadm sync -j 4 /export/guests/db1@nightly "
+	"/standby/guests/db1\n";
+
+const char vdi_compact_desc[] = "shrink the sparse images of a virtual disk\n";
+const char vdi_compact_help[] =
+	"USAGE:\n"
+	"  vdiskadm compact [-pv] vdname\n\n"
+	"  Frees the blocks of every image that are all zeroes, moves the\n"
+	"  blocks at the end of the file into the gaps and truncates it,\n"
+	"  in place.  Only sparse vdi images can be compacted; others need\n"
+	"  vdiskadm convert.  Snapshots linked clones were created from,\n"
+	"  and older ones, are left alone.  An interrupted compact resumes\n"
+	"  where it stopped.\n"
+	"EXAMPLE:\n"
+	"  vdiskadm compact -v /export/guests/winxp/winxp-001\n";
+
+const char vdi_cbt_enable_desc[] = "start tracking the blocks a guest writes\n";
+const char vdi_cbt_enable_help[] =
+	"USAGE:\n"
+	"  vdiskadm cbt-enable [-b <block size>] vdname\n\n"
+	"  Each bit of the bitmap covers a block of -b bytes (default 64k).\n"
+	"  Every snapshot starts a new generation of the bitmap.\n"
+	"EXAMPLE:\n"
+	"  vdiskadm cbt-enable -b 256k /export/guests/winxp/winxp-001\n";
+
+const char vdi_cbt_disable_desc[] = "stop tracking the blocks a guest "
+	"writes\n";
+const char vdi_cbt_disable_help[] =
+	"USAGE:\n"
+	"  vdiskadm cbt-disable vdname\n\n"
+	"EXAMPLE:\n"
+	"  vdiskadm cbt-disable /export/guests/winxp/winxp-001\n";
+
+const char vdi_changes_desc[] = "list the blocks changed since a snapshot\n";
+const char vdi_changes_help[] =
+	"USAGE:\n"
+	"  vdiskadm changes [-p] [-g <generation>] vdname[@snap_name]\n\n"
+	"  Lists the ranges written since the snapshot was taken, since\n"
+	"  generation -g of the bitmap started, or else since the latest\n"
+	"  snapshot.  Writes a running guest hasn't flushed aren't listed.\n"
+	"EXAMPLE:\n"
+	"  vdiskadm changes /export/guests/winxp/winxp-001@snap4\n";
 
 const char vdi_refinc_desc[] = "try to increment a rw or ro reference count "
 	"on a virtual disk\n";
 const char vdi_refinc_help[] =
 	"USAGE:\n"
-	"  vdiskadm ref-inc [-r] vdname\n\n"
+	"  vdiskadm ref-inc [-r] [-t <seconds>] vdname\n\n"
+	"  -t waits that long for the lock of the store, -1 for as long as\n"
+	"  it takes (default 60)\n"
 	"EXAMPLE: add a rw reference on vdisk (fails if rwcnt or rocnt > 0)\n"
 	"  vdiskadm ref-inc /export/guests/winxp/winxp-001\n"
 	"EXAMPLE: add a ro reference on vdisk (fails if rwcnt > 0)\n"
@@ -227,10 +392,55 @@ const char vdi_refinc_help[] =
 const char vdi_refdec_desc[] = "try to decrement a rw or ro reference count\n";
 const char vdi_refdec_help[] =
 	"USAGE:\n"
-	"  vdiskadm ref-dec vdname\n\n"
+	"  vdiskadm ref-dec [-t <seconds>] vdname\n\n"
 	"EXAMPLE: decrement the rw or ro reference on the vdisk\n"
 	"  vdiskadm ref-dec /export/guests/winxp/winxp-001\n";
 
+const char vdi_attach_info_desc[] = "prepare a virtual disk for a domain and "
+	"describe it\n";
+const char vdi_attach_info_help[] =
+	"USAGE:\n"
+	"  vdiskadm attach-info [-r] [-o <owner>] [-t <seconds>] vdname\n\n"
+	"  Does what attaching a vdisk to a domain needs in one pass over\n"
+	"  the store: sets the owner, opens the images, takes a rw (or with\n"
+	"  -r a ro) reference and prints sectors:info:ref, where info has\n"
+	"  0x1 set for a cdrom, 0x2 for removable and 0x4 for readonly and\n"
+	"  ref is \"ok\" or \"busy\" if the reference couldn't be taken.\n"
+	"  With -o the checks are made as the new owner.  -t is as for\n"
+	"  ref-inc.\n"
+	"EXAMPLE:\n"
+	"  vdiskadm attach-info -o xvm /export/guests/winxp/winxp-001\n";
+
+const char vdi_serve_desc[] = "run the commands sent over a socket\n";
+const char vdi_serve_help[] =
+	"USAGE:\n"
+	"  vdiskadm serve [-j <jobs>] [-n <stores>] [-s <socket>]\n\n"
+	"  Runs the vdiskadm commands sent to the socket (default\n"
+	"  " VDI_SERVE_SOCKET ") until killed, keeping the formats\n"
+	"  loaded and the last <stores> stores read (default 256) parsed.\n"
+	"  Commands for the same vdisk run in turn; up to <jobs> (default\n"
+	"  8) commands for other vdisks run at the same time.  Commands\n"
+	"  are sent with \"vdiskadm -S <socket> command args ...\", which\n"
+	"  runs the command itself if no server listens on the socket.\n"
+	"EXAMPLE:\n"
+	"  vdiskadm serve -j 16\n"
+	"  vdiskadm -S /var/run/vdiskadm.sock prop-get -p all "
+	"/export/guests/winxp/winxp-001\n";
+
+const char vdi_batch_desc[] = "run a list of commands\n";
+const char vdi_batch_help[] =
+	"USAGE:\n"
+	"  vdiskadm batch [-k] [-j <jobs>] [file]\n\n"
+	"  Runs the vdiskadm commands in file (default stdin), one per\n"
+	"  line, as they would be given to vdiskadm.  Consecutive commands\n"
+	"  for the same vdisk run in order, with consecutive prop-add,\n"
+	"  prop-del and prop-set commands sharing one update of the store;\n"
+	"  up to <jobs> (default 8) such runs for other vdisks run at the\n"
+	"  same time, so their output may be interleaved.  Stops at the\n"
+	"  first command that fails, or with -k runs all the others.\n"
+	"EXAMPLE:\n"
+	"  vdiskadm batch /export/guests/provision.cmds\n";
+
 const char vdi_propadd_desc[] = "add a user property to the disk state\n";
 const char vdi_propadd_help[] =
 	"USAGE:\n"
@@ -262,7 +472,7 @@ const char vdi_propset_help[] =
 const char vdi_move_desc[] = "move a virtual disk to a different location\n";
 const char vdi_move_help[] =
 	"USAGE:\n"
-	"  vdiskadm move vdname <new_dir>\n\n"
+	"  vdiskadm move [-pv] vdname <new_dir>\n\n"
 	"EXAMPLE:\n"
 	"  vdiskadm move /export/guests/winxp/winxp-001 /export/new_dir\n";
 
@@ -307,11 +517,32 @@ static vdi_cmd_t vdi_cmd_list[] = {
 
 	{"verify", B_FALSE,
 	    vdi_verify_cmd, vdi_verify_desc, vdi_verify_help},
+	{"index", B_FALSE,
+	    vdi_index_cmd, vdi_index_desc, vdi_index_help},
+	{"compare", B_FALSE,
+	    vdi_compare_cmd, vdi_compare_desc, vdi_compare_help},
+	{"sync", B_FALSE,
+	    vdi_sync_cmd, vdi_sync_desc, vdi_sync_help},
+	{"compact", B_FALSE,
+	    vdi_compact_cmd, vdi_compact_desc, vdi_compact_help},
+
+	{"cbt-enable", B_FALSE,
+	    vdi_cbt_enable_cmd, vdi_cbt_enable_desc, vdi_cbt_enable_help},
+	{"cbt-disable", B_FALSE,
+	    vdi_cbt_disable_cmd, vdi_cbt_disable_desc, vdi_cbt_disable_help},
+	{"changes", B_FALSE,
+	    vdi_changes_cmd, vdi_changes_desc, vdi_changes_help},
 
 	{"ref-inc", B_TRUE,
 	    vdi_refinc_cmd, vdi_refinc_desc, vdi_refinc_help},
 	{"ref-dec", B_TRUE,
 	    vdi_refdec_cmd, vdi_refdec_desc, vdi_refdec_help},
+	{"attach-info", B_TRUE,
+	    vdi_attach_info_cmd, vdi_attach_info_desc, vdi_attach_info_help},
+	{"serve", B_FALSE,
+	    vdi_serve_cmd, vdi_serve_desc, vdi_serve_help},
+	{"batch", B_FALSE,
+	    vdi_batch_cmd, vdi_batch_desc, vdi_batch_help},
 
 	{"prop-add", B_FALSE,
 	    vdi_propadd_cmd, vdi_propadd_desc, vdi_propadd_help},
@@ -328,6 +559,9 @@ static vdi_cmd_t vdi_cmd_list[] = {
 
 #define	MIN(a, b)	((a) < (b) ? (a) : (b))
 
+/* largest block of a changed block bitmap */
+#define	VDI_CBT_MAX_BLOCK	(1024 * 1024 * 1024)
+
 static uint_t vdi_heads[] = {16, 32, 64, 128};
 #define	VDI_HEADS_CNT	(sizeof (vdi_heads) / sizeof (uint_t))
 
@@ -339,9 +573,14 @@ static int vdi_cmd_print_help(FILE *stream, char *str);
 static int zfs_nicestrtonum(const char *value, uint64_t *num);
 static int str2shift(const char *buf);
 static void copy_add_ext(char *name_ext, char *name, char *ext);
+static boolean_t vdi_file_copy_format(const char *pszformat);
+static boolean_t vdi_fixed_format(const char *pszformat, uint_t flags);
 static int vdi_get_type_flags(VDBACKENDINFO *backend, char *optarg,
     uint_t *type_flags);
 int check_vdisk_in_use(vd_handle_t *vdh, char *print_name);
+static int vdi_snapshot(char *name);
+static int vdi_lock(char *vdname, int timeout);
+static int vdi_lock_flags(char *vdname, int flags, int timeout);
 
 /* print help */
 static int
@@ -387,6 +626,8 @@ helpfail_usage:
  * Opens a virtual disk and print the list of images.
  * -f option: gives a full list including extents and store file
  * -p option: prints files in parsable list
+ * -R option: lists the virtual disks in a tree, see vdi_scan()
+ * -j option: number of threads scanning the tree
  *
  * Returns:
  *	0: success
@@ -403,9 +644,13 @@ vdi_list_cmd(int argc, char *argv[])
 	int c;
 	int print_all = 0;
 	int parsable_output = 0;
+	int recurse = 0;
+	int nthreads = VDI_SCAN_THREADS;
 	PVBOXHDD pdisk;
+	char *end;
+	int lockfd = -1;
 
-	while ((c = getopt(argc, argv, "fp")) != -1) {
+	while ((c = getopt(argc, argv, "fpRj:")) != -1) {
 		switch (c) {
 		case 'f':
 			print_all = 1;
@@ -415,6 +660,22 @@ vdi_list_cmd(int argc, char *argv[])
 			parsable_output = 1;
 			break;
 
+		case 'R':
+			recurse = 1;
+			break;
+
+		case 'j':
+			errno = 0;
+			nthreads = strtol(optarg, &end, 10);
+			if ((errno != 0) || (end == optarg) || (*end != '\0') ||
+			    (nthreads < 1) || (nthreads > 1024)) {
+				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+				    gettext("ERROR: Invalid count"), optarg);
+				(void) vdi_cmd_print_help(stderr, "list");
+				return (-1);
+			}
+			break;
+
 		case '?':
 			(void) fprintf(stderr, "\n%s: \"%c\"\n\n",
 			    gettext("ERROR: invalid option"), optopt);
@@ -433,6 +694,18 @@ vdi_list_cmd(int argc, char *argv[])
 		goto fail;
 	}
 
+	/* Only reads the store */
+	vdisk_set_store_flags(VD_STORE_CACHED);
+
+	if (recurse)
+		return (vdi_scan(argv[0], nthreads));
+
+	/* Images can't be replaced while they are looked at */
+	vdisk_get_vdname(vdname, argv[0], MAXPATHLEN);
+	lockfd = vdi_lock_flags(vdname, VD_LOCK_SHARED, VD_LOCK_TIMEOUT);
+	if (lockfd == -1)
+		return (-1);
+
 	if (vdisk_find_create_storepath(argv[0], vdname, NULL,
 	    extname, &pszformat, 0, &vdh) == -1) {
 		goto fail;
@@ -461,7 +734,7 @@ vdi_list_cmd(int argc, char *argv[])
 	/* Close all and free pdisk */
 	VDDestroy(vdh->hdd);
 	vdisk_free_tree(vdh);
-	return (0);
+	return (vdisk_unlock(lockfd, vdname));
 
 fail:
 	if (pszformat)
@@ -469,6 +742,8 @@ fail:
 	if ((vdh != NULL) && (vdh->hdd != NULL))
 		VDDestroy(vdh->hdd);
 	vdisk_free_tree(vdh);
+	if (lockfd != -1)
+		(void) vdisk_unlock(lockfd, vdname);
 	return (-1);
 }
 
@@ -712,10 +987,23 @@ vdi_create_cmd(int argc, char *argv[])
 		goto fail;
 	}
 
-	/* Create the base (i.e. non-COW) virtual disk */
-	rc = VDCreateBase(pdisk, pszformat, vdname_ext, disk_size,
-	    uImageFlags, comment, &PCHSGeometry, &LCHSGeometry, NULL,
-	    uOpenFlags, NULL, NULL);
+	/*
+	 * Create the base (i.e. non-COW) virtual disk.  A fixed image is
+	 * allocated and only its metadata written where we know the format;
+	 * VBox would write out every zero of the disk.
+	 */
+	rc = VERR_NOT_SUPPORTED;
+	if (uImageFlags & VD_IMAGE_FLAGS_FIXED) {
+		if (vdisk_create_fixed(vdname_ext, pszformat, disk_size,
+		    comment) == 0)
+			rc = VINF_SUCCESS;
+		else if (errno != ENOTSUP)
+			rc = VERR_GENERAL_FAILURE;
+	}
+	if (rc == VERR_NOT_SUPPORTED)
+		rc = VDCreateBase(pdisk, pszformat, vdname_ext, disk_size,
+		    uImageFlags, comment, &PCHSGeometry, &LCHSGeometry, NULL,
+		    uOpenFlags, NULL, NULL);
 	if (!(VBOX_SUCCESS(rc))) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 		    gettext("ERROR: Unable to create virtual disk"),
@@ -765,9 +1053,11 @@ fail:
 	/* unlink vdfile */
 	(void) unlink(vdname_ext);
 
-	/* unlink store file */
+	/* unlink store file, its cache and lock file */
 	vdisk_get_xmlfile(vdfilebase, vdname, MAXPATHLEN);
 	(void) unlink(vdfilebase);
+	vdisk_cache_remove(vdname);
+	vdisk_lock_remove(vdname);
 
 	/* Remove directory */
 	rm_name = strrchr(vdfilebase, '/');
@@ -798,15 +1088,18 @@ vdi_destroy_cmd(int argc, char *argv[])
 	char snapname_ext[MAXPATHLEN];	/* snapshot with extension */
 	char vdname_ext[MAXPATHLEN];	/* virtual disk name with extension */
 	char storename[MAXPATHLEN];
+	char real_vdname[MAXPATHLEN];	/* full path to virtual disk */
 	char *rm_name, *rm_name_ext;
 	vd_handle_t *vdh = NULL;
 	int rc;
 	int rm_image_number = 0, total_image_number;
+	int clone_image_number;
 	int destroy_children = 0;
 	int c;
 	int i;
 	char *snapshot;
 	PVBOXHDD pdisk;
+	int lockfd;
 
 	while ((c = getopt(argc, argv, "r")) != -1) {
 		switch (c) {
@@ -833,6 +1126,11 @@ vdi_destroy_cmd(int argc, char *argv[])
 		exit(-1);
 	}
 
+	/* The store is read, changed and written under its lock */
+	vdisk_get_vdname(vdname, argv[0], MAXPATHLEN);
+	if ((lockfd = vdi_lock(vdname, VD_LOCK_TIMEOUT)) == -1)
+		return (-1);
+
 	if (vdisk_find_create_storepath(argv[0], vdname, snapname,
 	    extname, &pszformat, 0, &vdh) == -1) {
 		goto fail;
@@ -884,9 +1182,20 @@ vdi_destroy_cmd(int argc, char *argv[])
 		goto fail;
 	}
 
+	/* Not allowed to remove images linked clones are using */
+	clone_image_number = vdisk_find_cow_clone_image(vdh);
+	if ((clone_image_number != -1) && ((snapname[0] == '\0') ||
+	    (rm_image_number <= clone_image_number))) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Cannot destroy file; linked clones "
+		    "depend on it"), rm_name);
+		goto fail;
+	}
+
 	/* Not allowed to remove base file if any shapshots exist. */
 	if (total_image_number == (rm_image_number + 1)) {
-		if ((total_image_number > 1) && (destroy_children == 0)) {
+		if (((total_image_number - vdh->parent_images) > 1) &&
+		    (destroy_children == 0)) {
 			(void) fprintf(stderr, "\n%s: \"%s\"\n",
 			    gettext("ERROR: Cannot destroy file; file "
 			    "has children"), rm_name);
@@ -896,13 +1205,28 @@ vdi_destroy_cmd(int argc, char *argv[])
 			/* don't yet list snapshots like zfs does */
 			goto fail;
 		} else {
-			/* Remove all images and extent files */
-			for (i = 0; i < total_image_number; i++) {
+			/* A linked clone drops out of its parent's store */
+			if ((realpath(vdname, real_vdname) == NULL) ||
+			    (vdisk_update_cow_clone(vdh, real_vdname,
+			    NULL) == -1)) {
+				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+				    gettext("ERROR: Unable to release parent "
+				    "of linked clone"), rm_name);
+				goto fail;
+			}
+			/* Remove all images and extent files, not parent's */
+			for (i = vdh->parent_images; i < total_image_number;
+			    i++) {
 				(void) VDClose(vdh->hdd, true);
 			}
-			/* Remove storepath file */
+			/* Remove bitmaps, indexes and storepath file */
+			(void) vdisk_cbt_disable(vdname);
+			vdi_index_prune(NULL, vdname);
 			vdisk_get_xmlfile(storename, vdname, MAXPATHLEN);
 			(void) unlink(storename);
+			vdisk_cache_remove(vdname);
+			vdisk_lock_remove(vdname);
+			(void) vdisk_unlock(lockfd, vdname);
 			vdisk_free_tree(vdh);
 			/* Remove directory */
 			rm_name = strrchr(storename, '/');
@@ -943,19 +1267,286 @@ vdi_destroy_cmd(int argc, char *argv[])
 		    gettext("ERROR: Unable to update store file"), vdname);
 		goto fail;
 	}
+	vdi_index_prune(vdh, vdname);
 
 	/* Close all and free pdisk */
 	VDDestroy(vdh->hdd);
 	vdisk_free_tree(vdh);
 
+	return (vdisk_unlock(lockfd, vdname));
+
+fail:
+	if (pszformat)
+		RTStrFree(pszformat);
+	if ((vdh != NULL) && (vdh->hdd != NULL))
+		VDDestroy(vdh->hdd);
+	vdisk_free_tree(vdh);
+	(void) vdisk_unlock(lockfd, vdname);
+	return (-1);
+}
+
+/*
+ * Imports a raw or stream export read from stdin or a file into a new
+ * virtual disk.
+ *	name - path of the virtual disk to create
+ *	import_file - "-" for stdin or the file holding the stream
+ *	pszformat_in - "raw", VDI_STREAM_FORMAT, VDI_ZSTREAM_FORMAT or NULL
+ *	    for either stream
+ *	pszformat_out - VBox format of the new image
+ *	uimageflags - image flags of the new image
+ *	opts - progress options
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_import_stream(char *name, char *import_file, char *pszformat_in,
+    char *pszformat_out, uint_t uimageflags, vdi_copy_opts_t *opts)
+{
+	char vdname[MAXPATHLEN];	/* path to virtual disk */
+	char vdfilebase[MAXPATHLEN];
+	char vdfilename_ext[MAXPATHLEN];	/* virtual disk with ext */
+	char extname[MAXPATHLEN];	/* extension type of virtual disk */
+	char create_time_str[MAXPATHLEN];
+	char disk_size_str[MAXPATHLEN];
+	char sector_str[MAXPATHLEN];
+	char none[] = "none";
+	struct stat64 stat64buf;
+	struct passwd *pw;
+	vd_handle_t *vdh = NULL;
+	PVBOXHDD pdisk_import = NULL;
+	uint64_t disk_size;
+	boolean_t raw = B_FALSE;
+	boolean_t imported = B_FALSE;
+	int fd = STDIN_FILENO;
+	int rc;
+
+	vdname[0] = '\0';
+	if ((pszformat_in != NULL) && (strcasecmp(pszformat_in, "raw") == 0)) {
+		raw = B_TRUE;
+	} else if ((pszformat_in != NULL) &&
+	    (strcmp(pszformat_in, VDI_STREAM_FORMAT) != 0) &&
+	    (strcmp(pszformat_in, VDI_ZSTREAM_FORMAT) != 0)) {
+		(void) fprintf(stderr, "\n%s\n\n", gettext(
+		    "ERROR: Only raw and stream imports can be read from "
+		    "stdin"));
+		return (-1);
+	}
+	if (raw && (strcasecmp(pszformat_out, "raw") != 0)) {
+		(void) fprintf(stderr, "\n%s\n\n", gettext(
+		    "ERROR: A raw stream can only be imported as raw"));
+		return (-1);
+	}
+
+	if (strcmp(import_file, "-") != 0) {
+		fd = open(import_file, O_RDONLY);
+		if (fd == -1) {
+			(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+			    gettext("ERROR: Unable to access file to import"),
+			    import_file, strerror(errno));
+			return (-1);
+		}
+	}
+
+	/* Create the store file */
+	if (vdisk_find_create_storepath(name, vdname, NULL,
+	    NULL, NULL, 1, NULL) == -1) {
+		vdname[0] = '\0';
+		goto fail;
+	}
+	vdisk_get_vdfilebase(NULL, vdfilebase, vdname, MAXPATHLEN);
+	if (vdisk_format2ext(pszformat_out, extname) == -1) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to handle type."));
+		goto fail;
+	}
+	copy_add_ext(vdfilename_ext, vdfilebase, extname);
+
+	rc = VDCreate(NULL, &pdisk_import);
+	if (!VBOX_SUCCESS(rc)) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate handle space."));
+		goto fail;
+	}
+	if (vdi_stream_import(fd, raw, pdisk_import, pszformat_out,
+	    vdfilename_ext, uimageflags, opts) == -1)
+		goto fail;
+	imported = B_TRUE;
+
+	disk_size = VDGetSize(pdisk_import, 0);
+	(void) snprintf(disk_size_str, MAXPATHLEN, "%lld",
+	    (long long)disk_size);
+	(void) snprintf(sector_str, MAXPATHLEN, "%lld",
+	    (long long)(disk_size / 512));
+
+	/* get create time of virtual disk */
+	if (stat64(vdfilename_ext, &stat64buf) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+		    gettext("ERROR: Unable to stat virtual disk file "),
+		    vdfilename_ext, strerror(errno));
+		goto fail;
+	}
+	(void) snprintf(create_time_str, MAXPATHLEN, "%ld",
+	    stat64buf.st_ctime);
+	pw = getpwuid(stat64buf.st_uid);
+
+	if (vdisk_create_tree(vdname, extname,
+	    (uimageflags & VD_IMAGE_FLAGS_FIXED), NULL, create_time_str,
+	    disk_size_str, sector_str, none, pw->pw_name, &vdh) == -1) {
+		goto fail;
+	}
+	if (vdisk_write_tree(vdh, vdname) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to update store file"), vdname);
+		goto fail;
+	}
+
+	VDDestroy(pdisk_import);
+	vdisk_free_tree(vdh);
+	if (fd != STDIN_FILENO)
+		(void) close(fd);
 	return (0);
 
+fail:
+	if (imported)
+		(void) VDClose(pdisk_import, true);
+	if (pdisk_import)
+		VDDestroy(pdisk_import);
+	vdisk_free_tree(vdh);
+	if (vdname[0] != '\0') {
+		vdisk_get_xmlfile(vdfilebase, vdname, MAXPATHLEN);
+		(void) unlink(vdfilebase);
+		vdisk_cache_remove(vdname);
+		vdisk_lock_remove(vdname);
+		(void) rmdir(vdname);
+	}
+	if (fd != STDIN_FILENO)
+		(void) close(fd);
+	return (-1);
+}
+
+/*
+ * Applies a delta stream read from stdin or a file to a replica, a
+ * virtual disk holding the snapshot the delta starts at as its latest
+ * snapshot and unchanged since.  When the delta ends at a snapshot the
+ * replica gets a snapshot of the same name, so the next delta applies.
+ *	name - path of the replica
+ *	import_file - "-" for stdin or the file holding the stream
+ *	opts - progress options
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_import_delta(char *name, char *import_file, vdi_copy_opts_t *opts)
+{
+	char vdname[MAXPATHLEN];	/* path to virtual disk */
+	char snapname[MAXPATHLEN];	/* snapshot of disk */
+	char extname[MAXPATHLEN];	/* extension type of virtual disk */
+	char to_snap[VDI_STREAM_MAX_NAME + 1];
+	char snaplistname[MAXPATHLEN];
+	char base[MAXPATHLEN];		/* latest snapshot of the replica */
+	char *pszformat = NULL;		/* VBox's extension type of disk */
+	char *snapfile, *at, *dot;
+	vd_handle_t *vdh = NULL;
+	vd_extent_t *extents = NULL;
+	PVBOXHDD pdisk;
+	int fd = STDIN_FILENO;
+	int count, nextents;
+	int rc;
+
+	if (strcmp(import_file, "-") != 0) {
+		fd = open(import_file, O_RDONLY);
+		if (fd == -1) {
+			(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+			    gettext("ERROR: Unable to access file to import"),
+			    import_file, strerror(errno));
+			return (-1);
+		}
+	}
+
+	if (vdisk_find_create_storepath(name, vdname, snapname,
+	    extname, &pszformat, 0, &vdh) == -1) {
+		goto fail;
+	}
+	if (snapname[0] != '\0') {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Changes can't be applied to a snapshot"),
+		    name);
+		goto fail;
+	}
+
+	if (check_vdisk_in_use(vdh, name))
+		goto fail;
+
+	/* Alloc handle space */
+	rc = VDCreate(NULL, &pdisk);
+	if (!VBOX_SUCCESS(rc)) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate handle space."));
+		goto fail;
+	}
+	vdh->hdd = pdisk;
+
+	if ((vdisk_load_snapshots(vdh, pszformat, vdname, 0)) == -1) {
+		goto fail;
+	}
+
+	/* The delta goes on top of the latest snapshot, as it was taken */
+	count = VDGetCount(vdh->hdd);
+	if ((count < vdh->parent_images + 2) ||
+	    ((snapfile = vdisk_find_snapshot_name(vdh, count - 2)) == NULL) ||
+	    ((at = strrchr(snapfile, '@')) == NULL)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Virtual disk has no snapshot to apply "
+		    "changes to"), name);
+		goto fail;
+	}
+	(void) strlcpy(base, at + 1, MAXPATHLEN);
+	if ((dot = strrchr(base, '.')) != NULL)
+		*dot = '\0';
+	if (vdisk_get_delta(vdh, count - 2, count - 1, &extents,
+	    &nextents) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+		    gettext("ERROR: Unable to find changes since snapshot"),
+		    base, strerror(errno));
+		goto fail;
+	}
+	vdisk_free_allocation(extents);
+	if (nextents != 0) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Virtual disk has changed since snapshot; "
+		    "roll it back first"), base);
+		goto fail;
+	}
+
+	if (vdi_stream_apply(fd, vdh->hdd, base, to_snap, sizeof (to_snap),
+	    opts) == -1)
+		goto fail;
+
+	RTStrFree(pszformat);
+	VDDestroy(vdh->hdd);
+	vdisk_free_tree(vdh);
+	if (fd != STDIN_FILENO)
+		(void) close(fd);
+
+	if (to_snap[0] == '\0')
+		return (0);
+
+	/* Take the snapshot the delta ended at */
+	(void) snprintf(snaplistname, MAXPATHLEN, "%s@%s", vdname, to_snap);
+	return (vdi_snapshot(snaplistname));
+
 fail:
 	if (pszformat)
 		RTStrFree(pszformat);
 	if ((vdh != NULL) && (vdh->hdd != NULL))
 		VDDestroy(vdh->hdd);
 	vdisk_free_tree(vdh);
+	if (fd != STDIN_FILENO)
+		(void) close(fd);
 	return (-1);
 }
 
@@ -965,6 +1556,7 @@ fail:
  * -n option: dryrun
  * -p option: prints files in parsable list
  * -m option: moves the given file instead of copying it
+ * -i option: applies a delta stream to an existing virtual disk
  * -q option: runs in quiet mode with no output to stdout
  *
  * Returns:
@@ -992,6 +1584,7 @@ vdi_import_cmd(int argc, char *argv[])
 	int parsable_output = 0;
 	int dry_run = 0;
 	int mv_not_cpy = 0;
+	int delta = 0;
 	int c, i;
 	int rc;
 	uint64_t disk_size = 0;
@@ -1004,7 +1597,6 @@ vdi_import_cmd(int argc, char *argv[])
 	struct passwd *pw;
 	char none[] = "none";
 	char *com_ptr;
-	char system_command[MAXPATHLEN];
 	char old_dir[MAXPATHLEN];
 	char *slash;
 	char inplace_path[MAXPATHLEN];
@@ -1014,10 +1606,13 @@ vdi_import_cmd(int argc, char *argv[])
 	int import_reg_file = 0;
 	size_t backend_len, optarg_len;
 	char *colon = NULL;
+	vdi_copy_opts_t copy_opts;
 
 	uimageflags = VD_IMAGE_FLAGS_NONE;
 	pszformat_out = "VMDK";
 	vdname[0] = '\0';
+	bzero(&copy_opts, sizeof (copy_opts));
+	copy_opts.co_nthreads = 1;
 
 	rc = VDBackendInfo(VDI_MAX_BACKENDS, vdi_backend_info, &cnt);
 	if (rc != VINF_SUCCESS) {
@@ -1026,7 +1621,7 @@ vdi_import_cmd(int argc, char *argv[])
 		exit(-1);
 	}
 
-	while ((c = getopt(argc, argv, "fnpqmx::d:t::")) != -1) {
+	while ((c = getopt(argc, argv, "fnpqmivj:x::d:t::")) != -1) {
 		switch (c) {
 		case 'f':
 			print_files = 1;
@@ -1038,6 +1633,7 @@ vdi_import_cmd(int argc, char *argv[])
 
 		case 'p':
 			parsable_output = 1;
+			copy_opts.co_parsable = B_TRUE;
 			break;
 
 		case 'q':
@@ -1048,7 +1644,34 @@ vdi_import_cmd(int argc, char *argv[])
 			mv_not_cpy = 1;
 			break;
 
+		case 'i':
+			delta = 1;
+			break;
+
+		case 'v':
+			copy_opts.co_progress = B_TRUE;
+			break;
+
+		case 'j':
+			if (vdi_copy_parse_threads(optarg,
+			    &copy_opts.co_nthreads) != 0) {
+				(void) fprintf(stderr, "\n%s: %s\n\n",
+				    gettext("ERROR: Invalid number of threads "
+				    "specified"), optarg);
+				(void) vdi_cmd_print_help(stderr, "import");
+				exit(-1);
+			}
+			break;
+
 		case 'x':
+			if (strcasecmp(optarg, VDI_STREAM_FORMAT) == 0) {
+				pszformat_in = VDI_STREAM_FORMAT;
+				break;
+			}
+			if (strcasecmp(optarg, VDI_ZSTREAM_FORMAT) == 0) {
+				pszformat_in = VDI_ZSTREAM_FORMAT;
+				break;
+			}
 			/* Check type against available backends */
 			colon = strchr(optarg, ':');
 			if (colon)
@@ -1163,6 +1786,24 @@ vdi_import_cmd(int argc, char *argv[])
 		return (-1);
 	}
 
+	/* A delta stream is applied to an existing replica */
+	if (delta) {
+		if (import_file == NULL) {
+			(void) fprintf(stderr, "\n%s\n\n",
+			    gettext("ERROR: import file must be given"));
+			return (-1);
+		}
+		if (print_files || dry_run || mv_not_cpy ||
+		    ((pszformat_in != NULL) &&
+		    (strcmp(pszformat_in, VDI_STREAM_FORMAT) != 0))) {
+			(void) fprintf(stderr, "\n%s\n\n", gettext(
+			    "ERROR: -i only applies a stream; -f, -n, -m and "
+			    "other -x types can't be used"));
+			return (-1);
+		}
+		return (vdi_import_delta(argv[0], import_file, &copy_opts));
+	}
+
 	/* vdisk should not exist */
 	rc = stat64(argv[0], &stat64buf);
 	if (rc != -1) {
@@ -1179,6 +1820,20 @@ vdi_import_cmd(int argc, char *argv[])
 		goto fail;
 	}
 
+	/* A stream is read sequentially, straight into the new image */
+	if ((strcmp(import_file, "-") == 0) || ((pszformat_in != NULL) &&
+	    ((strcmp(pszformat_in, VDI_STREAM_FORMAT) == 0) ||
+	    (strcmp(pszformat_in, VDI_ZSTREAM_FORMAT) == 0)))) {
+		if (print_files || dry_run || mv_not_cpy) {
+			(void) fprintf(stderr, "\n%s\n\n", gettext(
+			    "ERROR: -f, -n and -m can't be used to import "
+			    "a stream"));
+			return (-1);
+		}
+		return (vdi_import_stream(argv[0], import_file, pszformat_in,
+		    pszformat_out, uimageflags, &copy_opts));
+	}
+
 	rc = stat64(import_file, &stat64buf);
 	if (rc == -1) {
 		(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
@@ -1367,9 +2022,8 @@ vdi_import_cmd(int argc, char *argv[])
 		}
 
 		/* Now move file into given directory */
-		snprintf(system_command, MAXPATHLEN, "mv %s/vdisk* %s\n",
-		    old_dir, vdname);
-		rc = system(system_command);
+		rc = vdi_copy_move_files(old_dir, VD_BASE, vdname,
+		    &copy_opts);
 		if (rc != 0) {
 			(void) fprintf(stderr, "\n%s: %s\n\n",
 			    gettext("ERROR: Unable to move virtual disk: \n"
@@ -1377,9 +2031,9 @@ vdi_import_cmd(int argc, char *argv[])
 			goto fail;
 		}
 	} else {
-		rc = VDCopy(vdh->hdd, 0, pdisk_import, pszformat_out,
-		    vdfilename_ext, false, 0, uimageflags, NULL, NULL,
-		    NULL, NULL);
+		rc = vdi_copy(vdh->hdd, 0, pszformat_in, pdisk_import,
+		    pszformat_out, vdfilename_ext, 0, uimageflags,
+		    &copy_opts);
 		if (!(VBOX_SUCCESS(rc))) {
 			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 			    gettext("ERROR: Unable to copy file"),
@@ -1439,9 +2093,11 @@ fail:
 	if (pdisk_import)
 		VDDestroy(pdisk_import);
 
-	/* unlink store file */
+	/* unlink store file, its cache and lock file */
 	vdisk_get_xmlfile(vdfilebase, vdname, MAXPATHLEN);
 	(void) unlink(vdfilebase);
+	vdisk_cache_remove(vdname);
+	vdisk_lock_remove(vdname);
 
 	if ((free_pszformat_in) & (pszformat_in != NULL))
 		RTStrFree(pszformat_in);
@@ -1454,26 +2110,229 @@ fail:
 }
 
 /*
- * Copies virtual disk in the same format as base image.
+ * Parse the argument to export -x for a compressed stream, "zstream" or
+ * "zstream:<level>".
  *
  * Returns:
- *	0: success
- *	-1: on failure
+ *	0: success, *levelp set if a level was given
+ *	-1: not a compressed stream or an invalid level
  */
 static int
-vdi_export_cmd(int argc, char *argv[])
+vdi_parse_zstream(const char *arg, int *levelp)
 {
-	char vdname[MAXPATHLEN];	/* path to virtual disk */
-	char extname_in[MAXPATHLEN];	/* extension type of virtual disk */
-	char *pszformat_in = NULL;	/* VBox's extension type of disk */
-	char *pszformat_out = NULL;	/* VBox's extension type of export */
-	vd_handle_t *vdh = NULL;
-	vd_handle_t *vdh_export = NULL;
-	int rc;
-	PVBOXHDD pdisk, pdisk_export = NULL;
-	char c;
-	size_t backend_len, optarg_len;
-	char *colon = NULL;
+	size_t len = strlen(VDI_ZSTREAM_FORMAT);
+	char *end;
+	long level;
+
+	if (strncasecmp(arg, VDI_ZSTREAM_FORMAT, len) != 0)
+		return (-1);
+	if (arg[len] == '\0')
+		return (0);
+	if (arg[len] != ':')
+		return (-1);
+
+	errno = 0;
+	level = strtol(arg + len + 1, &end, 10);
+	if ((errno != 0) || (end == arg + len + 1) || (*end != '\0') ||
+	    (level < 1) || (level > 9))
+		return (-1);
+	*levelp = (int)level;
+	return (0);
+}
+
+/*
+ * Opens the target of an export written sequentially.
+ *	export_file - "-" for stdout or the file to create
+ *	opts - progress options
+ *
+ * Returns:
+ *	descriptor to write to
+ *	-1: on failure
+ */
+static int
+vdi_export_open(char *export_file, vdi_copy_opts_t *opts)
+{
+	int fd;
+
+	if (strcmp(export_file, "-") == 0) {
+		/* Parsable progress goes to stdout too */
+		if (opts->co_parsable) {
+			(void) fprintf(stderr, "\n%s\n\n", gettext(
+			    "ERROR: -p can't be used when exporting to "
+			    "stdout"));
+			return (-1);
+		}
+		/* Report a reader going away as an error, don't die */
+		(void) signal(SIGPIPE, SIG_IGN);
+		return (STDOUT_FILENO);
+	}
+
+	fd = open(export_file, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+		    gettext("ERROR: Unable to create export file"),
+		    export_file, strerror(errno));
+	}
+	return (fd);
+}
+
+/*
+ * Closes the target of an export opened by vdi_export_open(), removing
+ * the file if the export failed.
+ *	fd - descriptor written to
+ *	export_file - "-" for stdout or the file created
+ *	rc - result of the export
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_export_close(int fd, char *export_file, int rc)
+{
+	if (fd == STDOUT_FILENO)
+		return (rc);
+
+	if ((rc == 0) && (fsync(fd) == -1)) {
+		(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+		    gettext("ERROR: Unable to create export file"),
+		    export_file, strerror(errno));
+		rc = -1;
+	}
+	(void) close(fd);
+	if (rc == -1)
+		(void) unlink(export_file);
+	return (rc);
+}
+
+/*
+ * Writes a raw or stream export of a virtual disk to stdout or a new file.
+ *	vdh - handle with the virtual disk's image chain opened
+ *	export_file - "-" for stdout or the file to create
+ *	pszformat_in - VBox format of the virtual disk's images
+ *	pszformat_out - "raw", VDI_STREAM_FORMAT or VDI_ZSTREAM_FORMAT
+ *	zlevel - compression level of VDI_ZSTREAM_FORMAT
+ *	opts - threads and progress options
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_export_stream(vd_handle_t *vdh, char *export_file, char *pszformat_in,
+    char *pszformat_out, int zlevel, vdi_copy_opts_t *opts)
+{
+	boolean_t raw, zstream;
+	int fd;
+	int rc;
+
+	raw = (strcasecmp(pszformat_out, "raw") == 0) ? B_TRUE : B_FALSE;
+	zstream = (strcmp(pszformat_out, VDI_ZSTREAM_FORMAT) == 0) ?
+	    B_TRUE : B_FALSE;
+	if (!raw && !zstream &&
+	    (strcmp(pszformat_out, VDI_STREAM_FORMAT) != 0)) {
+		(void) fprintf(stderr, "\n%s\n\n", gettext(
+		    "ERROR: Only raw and stream exports can be written to "
+		    "stdout"));
+		return (-1);
+	}
+
+	if ((fd = vdi_export_open(export_file, opts)) == -1)
+		return (-1);
+	if (zstream)
+		rc = vdi_zstream_export(vdh, pszformat_in, fd, zlevel, opts);
+	else
+		rc = vdi_stream_export(vdh, fd, raw, opts);
+	return (vdi_export_close(fd, export_file, rc));
+}
+
+/*
+ * Writes the changes between a snapshot and a later snapshot, or the
+ * current contents, of a virtual disk as a delta stream.
+ *	vdh - handle with the virtual disk's image chain opened
+ *	export_file - "-" for stdout or the file to create
+ *	pszformat - VBox format of the virtual disk's images
+ *	extname - extension of the virtual disk's images
+ *	vdname - path to the virtual disk
+ *	snapname - snapshot the delta runs up to, empty for the current
+ *	    contents
+ *	from_snap - name of the older snapshot the delta starts at
+ *	opts - progress options
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_export_delta(vd_handle_t *vdh, char *export_file, char *pszformat,
+    char *extname, char *vdname, char *snapname, char *from_snap,
+    vdi_copy_opts_t *opts)
+{
+	char from_base[MAXPATHLEN];
+	char from_ext[MAXPATHLEN];
+	char to_ext[MAXPATHLEN];
+	char *to_snap = NULL;
+	int from, to, total;
+	int fd;
+	int rc;
+
+	vdisk_get_vdfilebase(vdh, from_base, vdname, MAXPATHLEN);
+	(void) strlcat(from_base, "@", MAXPATHLEN);
+	(void) strlcat(from_base, from_snap, MAXPATHLEN);
+	copy_add_ext(from_ext, from_base, extname);
+	if (vdisk_find_snapshots(vdh, from_ext, &from, &total) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to find snapshot"), from_snap);
+		return (-1);
+	}
+
+	to = total - 1;
+	if (snapname[0] != '\0') {
+		to_snap = strrchr(snapname, '@') + 1;
+		copy_add_ext(to_ext, snapname, extname);
+		if (vdisk_find_snapshots(vdh, to_ext, &to, NULL) == -1) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to find snapshot"),
+			    to_snap);
+			return (-1);
+		}
+	}
+	if (to <= from) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Snapshot isn't older than the point "
+		    "exported"), from_snap);
+		return (-1);
+	}
+
+	if ((fd = vdi_export_open(export_file, opts)) == -1)
+		return (-1);
+	rc = vdi_stream_export_delta(vdh, pszformat, from, to, from_snap,
+	    to_snap, fd, opts);
+	return (vdi_export_close(fd, export_file, rc));
+}
+
+/*
+ * Copies virtual disk in the same format as base image.
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_export_cmd(int argc, char *argv[])
+{
+	char vdname[MAXPATHLEN];	/* path to virtual disk */
+	char extname_in[MAXPATHLEN];	/* extension type of virtual disk */
+	char snapname[MAXPATHLEN];	/* snapshot a delta runs up to */
+	char *pszformat_in = NULL;	/* VBox's extension type of disk */
+	char *pszformat_out = NULL;	/* VBox's extension type of export */
+	vd_handle_t *vdh = NULL;
+	vd_handle_t *vdh_export = NULL;
+	int rc;
+	PVBOXHDD pdisk, pdisk_export = NULL;
+	char c;
+	size_t backend_len, optarg_len;
+	char *colon = NULL;
 	int i;
 	char *export_file = NULL;
 	uint_t uimageflags_exp;
@@ -1482,9 +2341,14 @@ vdi_export_cmd(int argc, char *argv[])
 	uint64_t disk_size_in = 0;
 	uint64_t disk_size_out = 0;
 	int export_block_dev = 0;
+	int zlevel = VDI_ZSTREAM_DEF_LEVEL;
+	char *from_snap = NULL;
+	vdi_copy_opts_t copy_opts;
 
 	uimageflags_exp = VD_IMAGE_FLAGS_NONE;
 	pszformat_out = "VMDK";
+	bzero(&copy_opts, sizeof (copy_opts));
+	copy_opts.co_nthreads = 1;
 
 	rc = VDBackendInfo(VDI_MAX_BACKENDS, vdi_backend_info, &cnt);
 	if (rc != VINF_SUCCESS) {
@@ -1493,13 +2357,54 @@ vdi_export_cmd(int argc, char *argv[])
 		exit(-1);
 	}
 
-	while ((c = getopt(argc, argv, "x::d:")) != -1) {
+	while ((c = getopt(argc, argv, "pvi:j:x::d:")) != -1) {
 		switch (c) {
+		case 'p':
+			copy_opts.co_parsable = B_TRUE;
+			break;
+
+		case 'v':
+			copy_opts.co_progress = B_TRUE;
+			break;
+
 		case 'd':
 			export_file = optarg;
 			break;
 
+		case 'i':
+			/* Take snap, @snap or vdname@snap */
+			from_snap = strrchr(optarg, '@');
+			from_snap = (from_snap != NULL) ? from_snap + 1 :
+			    optarg;
+			if (*from_snap == '\0') {
+				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+				    gettext("ERROR: Invalid snapshot name"),
+				    optarg);
+				(void) vdi_cmd_print_help(stderr, "export");
+				exit(-1);
+			}
+			break;
+
+		case 'j':
+			if (vdi_copy_parse_threads(optarg,
+			    &copy_opts.co_nthreads) != 0) {
+				(void) fprintf(stderr, "\n%s: %s\n\n",
+				    gettext("ERROR: Invalid number of threads "
+				    "specified"), optarg);
+				(void) vdi_cmd_print_help(stderr, "export");
+				exit(-1);
+			}
+			break;
+
 		case 'x':
+			if (strcasecmp(optarg, VDI_STREAM_FORMAT) == 0) {
+				pszformat_out = VDI_STREAM_FORMAT;
+				break;
+			}
+			if (vdi_parse_zstream(optarg, &zlevel) == 0) {
+				pszformat_out = VDI_ZSTREAM_FORMAT;
+				break;
+			}
 			/* Get length of type not including option */
 			colon = strchr(optarg, ':');
 			if (colon)
@@ -1582,8 +2487,18 @@ vdi_export_cmd(int argc, char *argv[])
 		return (-1);
 	}
 
-	if (vdisk_find_create_storepath(argv[0], vdname, NULL,
-	    extname_in, &pszformat_in, 0, &vdh) == -1) {
+	/* Only a delta stream can end at a snapshot */
+	if ((from_snap != NULL) &&
+	    (strcmp(pszformat_out, VDI_STREAM_FORMAT) != 0)) {
+		(void) fprintf(stderr,
+		    gettext("ERROR: -i needs -x stream\n"));
+		vdi_usage();
+		return (-1);
+	}
+
+	if (vdisk_find_create_storepath(argv[0], vdname,
+	    (from_snap != NULL) ? snapname : NULL, extname_in,
+	    &pszformat_in, 0, &vdh) == -1) {
 		goto fail;
 	}
 
@@ -1604,6 +2519,28 @@ vdi_export_cmd(int argc, char *argv[])
 		goto fail;
 	}
 
+	if (from_snap != NULL) {
+		if (vdi_export_delta(vdh, export_file, pszformat_in,
+		    extname_in, vdname, snapname, from_snap,
+		    &copy_opts) == -1)
+			goto fail;
+		VDDestroy(vdh->hdd);
+		vdisk_free_tree(vdh);
+		return (0);
+	}
+
+	/* Streams are written sequentially and need no seekable target */
+	if ((strcmp(export_file, "-") == 0) ||
+	    (strcmp(pszformat_out, VDI_STREAM_FORMAT) == 0) ||
+	    (strcmp(pszformat_out, VDI_ZSTREAM_FORMAT) == 0)) {
+		if (vdi_export_stream(vdh, export_file, pszformat_in,
+		    pszformat_out, zlevel, &copy_opts) == -1)
+			goto fail;
+		VDDestroy(vdh->hdd);
+		vdisk_free_tree(vdh);
+		return (0);
+	}
+
 	vdh_export = malloc(sizeof (vd_handle_t));
 	if (vdh_export == NULL) {
 		errno = ENOMEM;
@@ -1648,8 +2585,8 @@ vdi_export_cmd(int argc, char *argv[])
 		}
 	}
 
-	rc = VDCopy(vdh->hdd, 0, pdisk_export, pszformat_out, export_file,
-	    false, 0, uimageflags_exp, NULL, NULL, NULL, NULL);
+	rc = vdi_copy(vdh->hdd, 0, pszformat_in, pdisk_export, pszformat_out,
+	    export_file, 0, uimageflags_exp, &copy_opts);
 	if (!(VBOX_SUCCESS(rc)) && (rc != VERR_VD_IMAGE_READ_ONLY)) {
 		if (export_block_dev)
 			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
@@ -1717,10 +2654,13 @@ vdi_convert_cmd(int argc, char *argv[])
 	int rm_image_number = 0, total_image_number;
 	char storename[MAXPATHLEN];
 	char *rm_name = NULL;
+	vdi_copy_opts_t copy_opts;
 
 	/* Setup defaults for type and option for converted image */
 	uimageflags_conv = VD_IMAGE_FLAGS_NONE;
 	pszformat_conv = "VMDK";
+	bzero(&copy_opts, sizeof (copy_opts));
+	copy_opts.co_nthreads = 1;
 	rc = VDBackendInfo(VDI_MAX_BACKENDS, vdi_backend_info, &cnt);
 	if (rc != VINF_SUCCESS) {
 		(void) fprintf(stderr, "\n%s\n\n",
@@ -1728,8 +2668,27 @@ vdi_convert_cmd(int argc, char *argv[])
 		exit(-1);
 	}
 
-	while ((c = getopt(argc, argv, "t::")) != -1) {
+	while ((c = getopt(argc, argv, "pvj:t::")) != -1) {
 		switch (c) {
+		case 'p':
+			copy_opts.co_parsable = B_TRUE;
+			break;
+
+		case 'v':
+			copy_opts.co_progress = B_TRUE;
+			break;
+
+		case 'j':
+			if (vdi_copy_parse_threads(optarg,
+			    &copy_opts.co_nthreads) != 0) {
+				(void) fprintf(stderr, "\n%s: %s\n\n",
+				    gettext("ERROR: Invalid number of threads "
+				    "specified"), optarg);
+				(void) vdi_cmd_print_help(stderr, "convert");
+				exit(-1);
+			}
+			break;
+
 		case 't':
 			/* Get length of type not including option */
 			colon = strchr(optarg, ':');
@@ -1879,6 +2838,15 @@ vdi_convert_cmd(int argc, char *argv[])
 		goto fail_noremove;
 	}
 
+	/* Images shared with linked clones can't be replaced */
+	if ((vdh->parent_images != 0) ||
+	    (vdisk_find_cow_clone_image(vdh) != -1)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Cannot convert a linked clone or a "
+		    "virtual disk with linked clones"), argv[0]);
+		goto fail_noremove;
+	}
+
 	/* If types are the same don't convert */
 	if (strcmp(pszformat, pszformat_conv) == NULL) {
 		(void) VDGetImageFlags(vdh->hdd, 0, &uimageflags_in);
@@ -1895,6 +2863,26 @@ vdi_convert_cmd(int argc, char *argv[])
 		}
 	}
 
+	/* Between fixed layouts only the metadata around the data changes */
+	vdisk_get_vdfilebase(vdh, vdname_ext, vdname, MAXPATHLEN);
+	(void) strlcat(vdname_ext, ".", MAXPATHLEN);
+	(void) strlcat(vdname_ext, extname, MAXPATHLEN);
+	(void) VDGetImageFlags(vdh->hdd, 0, &uimageflags_in);
+	if ((VDGetCount(vdh->hdd) == 1) &&
+	    (strcasecmp(pszformat, pszformat_conv) != 0) &&
+	    vdi_fixed_format(pszformat, uimageflags_in) &&
+	    vdi_fixed_format(pszformat_conv, uimageflags_conv) &&
+	    (vdisk_fixed_layout(vdname_ext, pszformat, NULL) == 0)) {
+		(void) VDCloseAll(vdh->hdd);
+		if (vdi_copy_convert_fixed(vdh, vdname, pszformat,
+		    pszformat_conv, &copy_opts) == -1) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to convert file"), argv[0]);
+			goto fail_noremove;
+		}
+		goto converted;
+	}
+
 	/* Alloc handle space for converted file */
 	rc = VDCreate(NULL, &pdisk_conv);
 	if (!VBOX_SUCCESS(rc)) {
@@ -1919,8 +2907,8 @@ vdi_convert_cmd(int argc, char *argv[])
 	vdisk_get_vdfilebase(NULL, vdfilebase_conv, vdname_conv, MAXPATHLEN);
 	copy_add_ext(vdname_conv_ext, vdfilebase_conv, extname_conv);
 
-	rc = VDCopy(vdh->hdd, 0, pdisk_conv, pszformat_conv, vdname_conv_ext,
-	    false, 0, uimageflags_conv, NULL, NULL, NULL, NULL);
+	rc = vdi_copy(vdh->hdd, 0, pszformat, pdisk_conv, pszformat_conv,
+	    vdname_conv_ext, 0, uimageflags_conv, &copy_opts);
 
 	if (!(VBOX_SUCCESS(rc)) && (rc != VERR_VD_IMAGE_READ_ONLY)) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
@@ -1980,9 +2968,11 @@ vdi_convert_cmd(int argc, char *argv[])
 	for (i = 0; i < total_image_number; i++) {
 		(void) VDClose(vdh->hdd, true);
 	}
-	/* Remove storepath file */
+	/* Remove storepath file, its cache and lock file */
 	vdisk_get_xmlfile(storename, vdname, MAXPATHLEN);
 	(void) unlink(storename);
+	vdisk_cache_remove(vdname);
+	vdisk_lock_remove(vdname);
 	/* Remove directory */
 	rm_name = strrchr(storename, '/');
 	if (rm_name) {
@@ -2000,7 +2990,9 @@ vdi_convert_cmd(int argc, char *argv[])
 		goto fail_noremove;
 	}
 
-	VDDestroy(pdisk_conv);
+converted:
+	if (pdisk_conv)
+		VDDestroy(pdisk_conv);
 	if (pszformat)
 		RTStrFree(pszformat);
 
@@ -2019,6 +3011,8 @@ fail:
 	if (vdname_conv[0] != '\0') {
 		vdisk_get_xmlfile(storename, vdname_conv, MAXPATHLEN);
 		(void) unlink(storename);
+		vdisk_cache_remove(vdname_conv);
+		vdisk_lock_remove(vdname_conv);
 		if ((vdh_conv != NULL) && (vdh_conv->hdd != NULL))
 			(void) VDClose(vdh_conv->hdd, true);
 		rmdir(vdname_conv);
@@ -2079,6 +3073,10 @@ vdi_translate_cmd(int argc, char *argv[])
 	uint64_t disk_size_out = 0;
 	struct stat64 stat64buf;
 	char *colon = NULL;
+	vdi_copy_opts_t copy_opts;
+
+	bzero(&copy_opts, sizeof (copy_opts));
+	copy_opts.co_nthreads = 1;
 
 	rc = VDBackendInfo(VDI_MAX_BACKENDS, vdi_backend_info, &cnt);
 	if (rc != VINF_SUCCESS) {
@@ -2087,8 +3085,27 @@ vdi_translate_cmd(int argc, char *argv[])
 		exit(-1);
 	}
 
-	while ((c = getopt(argc, argv, "i::I:x::d:")) != -1) {
+	while ((c = getopt(argc, argv, "pvj:i::I:x::d:")) != -1) {
 		switch (c) {
+		case 'p':
+			copy_opts.co_parsable = B_TRUE;
+			break;
+
+		case 'v':
+			copy_opts.co_progress = B_TRUE;
+			break;
+
+		case 'j':
+			if (vdi_copy_parse_threads(optarg,
+			    &copy_opts.co_nthreads) != 0) {
+				(void) fprintf(stderr, "\n%s: %s\n\n",
+				    gettext("ERROR: Invalid number of threads "
+				    "specified"), optarg);
+				(void) vdi_cmd_print_help(stderr, "translate");
+				exit(-1);
+			}
+			break;
+
 		case 'i':
 			/* Check type against available backends */
 			colon = strchr(optarg, ':');
@@ -2309,6 +3326,7 @@ vdi_translate_cmd(int argc, char *argv[])
 			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 			    gettext("ERROR: Output file must not exist"),
 			    out_file);
+			goto fail;
 		}
 	}
 
@@ -2327,8 +3345,17 @@ vdi_translate_cmd(int argc, char *argv[])
 	}
 
 
-	rc = VDCopy(pdisk_in, 0, pdisk_out, pszformat_out, out_file,
-	    false, 0, uimageflags_out, NULL, NULL, NULL, NULL);
+	/* Raw to raw is a plain file copy */
+	if ((strcasecmp(pszformat_in, "raw") == 0) &&
+	    (strcasecmp(pszformat_out, "raw") == 0)) {
+		if (vdi_copy_file(in_file, out_file, &copy_opts) == -1)
+			rc = VERR_GENERAL_FAILURE;
+		else
+			rc = VINF_SUCCESS;
+	} else {
+		rc = vdi_copy(pdisk_in, 0, pszformat_in, pdisk_out,
+		    pszformat_out, out_file, 0, uimageflags_out, &copy_opts);
+	}
 	if (!(VBOX_SUCCESS(rc)) && (rc != VERR_VD_IMAGE_READ_ONLY)) {
 		if (out_block_dev)
 			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
@@ -2362,97 +3389,94 @@ fail:
 	return (-1);
 }
 
+/* How far vdi_snap_commit() got, for vdi_snap_undo() */
+#define	VDI_SNAP_RENAMED	1	/* image renamed to the snapshot's */
+#define	VDI_SNAP_DIFF		2	/* new image created on top of it */
+#define	VDI_SNAP_STORE		3	/* store lists the snapshot */
+#define	VDI_SNAP_CBT		4	/* new changed block generation */
+
+/* A snapshot being taken of one virtual disk, see vdi_snap_prepare() */
+typedef struct vdi_snap_s {
+	char		vs_name[MAXPATHLEN];	/* <vdname>@<snapname> */
+	char		vs_vdname[MAXPATHLEN];	/* path to virtual disk */
+	char		vs_real[MAXPATHLEN];	/* real path to it */
+	char		vs_snaplistname[MAXPATHLEN];
+	char		vs_snapname_ext[MAXPATHLEN];
+	char		vs_vdname_ext[MAXPATHLEN];
+	char		*vs_pszformat;		/* VBox's type of disk */
+	vd_handle_t	*vs_vdh;
+	uint_t		vs_nbackends;		/* in vdi_backend_info */
+	int		vs_image;		/* image the snapshot is of */
+	int		vs_lockfd;
+	int		vs_done;		/* VDI_SNAP_* step reached */
+	int		vs_rc;			/* vdi_snap_prepare() result */
+	pthread_t	vs_tid;
+	boolean_t	vs_started;
+} vdi_snap_t;
+
 /*
- * Take a snapshot of the virtual disk.
- * Snapshot name is of the form <virtual disk>@<snap name>
+ * Get a virtual disk ready for a snapshot: find its store, check it isn't
+ * in use and load its images.  vs_name and vs_nbackends have to be set,
+ * and the store's lock held.  Runs on a thread of its own for each disk
+ * of a group, so it uses no state but that of its disk.
  *
  * Returns:
  *	0: success
  *	-1: on failure
  */
 static int
-vdi_snapshot_cmd(int argc, char *argv[])
+vdi_snap_prepare(vdi_snap_t *vs)
 {
-	char vdname[MAXPATHLEN];	/* path to virtual disk */
 	char snapname[MAXPATHLEN];	/* snapshot of disk */
-	char snaplistname[MAXPATHLEN];	/* name to use for list command */
 	char extname[MAXPATHLEN];	/* extension type of virtual disk */
-	char *pszformat = NULL;		/* VBox's extension type of disk */
-	char snapname_ext[MAXPATHLEN];	/* snapshot with extension */
-	char vdname_ext[MAXPATHLEN];	/* virtual disk name with extension */
 	char vdfilebase[MAXPATHLEN];	/* virtual disk file base name */
 	char *snap_loc;
-	vd_handle_t *vdh = NULL;
-	int rc;
-	char *name_at;
-	int mv_image_number = 0;
-	uint_t cnt, i;
 	PVBOXHDD pdisk;
-	unsigned int uimageflags;
-
-	if (argc < 2) {
-		(void) fprintf(stderr, "\n%s\n\n",
-		    gettext("ERROR: Missing name argument"));
-		(void) vdi_cmd_print_help(stderr, "snapshot");
-		exit(-1);
-	}
+	uint_t i;
+	int rc;
 
-	name_at = strchr(argv[1], '@');
-	if ((name_at == NULL) || (strlen(name_at + 1) == 0)) {
-		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-		    gettext("ERROR: name must be of snapshot form "
-		    "<name@snapshot>: "), argv[1]);
+	if (vdisk_find_create_storepath(vs->vs_name, vs->vs_vdname, NULL,
+	    extname, &vs->vs_pszformat, 0, &vs->vs_vdh) == -1)
 		return (-1);
-	}
-	if (vdisk_find_create_storepath(argv[1], vdname, NULL,
-	    extname, &pszformat, 0, &vdh) == -1) {
-		goto fail;
-	}
 
-	if (check_vdisk_in_use(vdh, argv[1]))
-		goto fail;
+	if (check_vdisk_in_use(vs->vs_vdh, vs->vs_name))
+		return (-1);
 
 	/* Formulate snapshot name */
-	snap_loc = strrchr(argv[1], '@');
+	snap_loc = strrchr(vs->vs_name, '@');
 	/* Check name length allowing for '.'  + 9 letter ext */
-	if ((strlen(vdname) + strlen(snap_loc) + 10) > MAXPATHLEN) {
+	if ((strlen(vs->vs_vdname) + strlen(snap_loc) + 10) > MAXPATHLEN) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-		    gettext("ERROR: Name is too long"), argv[1]);
-		goto fail;
+		    gettext("ERROR: Name is too long"), vs->vs_name);
+		return (-1);
 	}
 
 	/* Get name of snapshot of vdname@snapname */
-	(void) strlcpy(snaplistname, vdname, MAXPATHLEN);
-	(void) strlcat(snaplistname, snap_loc, MAXPATHLEN);
+	(void) strlcpy(vs->vs_snaplistname, vs->vs_vdname, MAXPATHLEN);
+	(void) strlcat(vs->vs_snaplistname, snap_loc, MAXPATHLEN);
 
-	vdisk_get_vdfilebase(vdh, snapname, vdname, MAXPATHLEN);
+	vdisk_get_vdfilebase(vs->vs_vdh, snapname, vs->vs_vdname, MAXPATHLEN);
 	(void) strlcat(snapname, snap_loc, MAXPATHLEN);
 
 	/* Finish setting up snapshot name adding extension */
-	copy_add_ext(snapname_ext, snapname, extname);
-
-	cnt = 0;
-	rc = VDBackendInfo(VDI_MAX_BACKENDS, vdi_backend_info, &cnt);
-	if (rc != VINF_SUCCESS) {
-		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-		    gettext("ERROR: Unable to load formats"), argv[1]);
-		goto fail;
-	}
+	copy_add_ext(vs->vs_snapname_ext, snapname, extname);
 
-	for (i = 0; i < cnt; i++) {
+	for (i = 0; i < vs->vs_nbackends; i++) {
 		rc = strncasecmp(vdi_backend_info[i].pszBackend,
-		    pszformat, (size_t)strlen(vdi_backend_info[i].pszBackend));
+		    vs->vs_pszformat,
+		    (size_t)strlen(vdi_backend_info[i].pszBackend));
 		if (rc == NULL) {
 			break;
 		}
 	}
 
-	if ((vdi_backend_info[i].uBackendCaps & VD_CAP_DIFF) == 0) {
+	if ((i == vs->vs_nbackends) ||
+	    ((vdi_backend_info[i].uBackendCaps & VD_CAP_DIFF) == 0)) {
 		(void) fprintf(stderr, "\n%s: %s\n\n",
 		    gettext("ERROR: Disk type does not support snapshots"),
-		    pszformat);
+		    vs->vs_pszformat);
 		(void) vdi_cmd_print_help(stderr, "snapshot");
-		goto fail;
+		return (-1);
 	}
 
 	/* Alloc handle space */
@@ -2460,76 +3484,439 @@ vdi_snapshot_cmd(int argc, char *argv[])
 	if (!VBOX_SUCCESS(rc)) {
 		(void) fprintf(stderr, "\n%s\n\n", gettext(
 		    "ERROR: Unable to allocate handle space."));
-		goto fail;
+		return (-1);
 	}
-	vdh->hdd = pdisk;
+	vs->vs_vdh->hdd = pdisk;
 
-	if ((vdisk_load_snapshots(vdh, pszformat, vdname, 0)) == -1) {
-		goto fail;
+	if ((vdisk_load_snapshots(vs->vs_vdh, vs->vs_pszformat,
+	    vs->vs_vdname, 0)) == -1) {
+		return (-1);
 	}
 
-	vdisk_get_vdfilebase(vdh, vdfilebase, vdname, MAXPATHLEN);
-	copy_add_ext(vdname_ext, vdfilebase, extname);
+	vdisk_get_vdfilebase(vs->vs_vdh, vdfilebase, vs->vs_vdname,
+	    MAXPATHLEN);
+	copy_add_ext(vs->vs_vdname_ext, vdfilebase, extname);
 
-	if ((vdisk_find_snapshots(vdh, vdname_ext, &mv_image_number,
-	    NULL)) == -1) {
+	if ((vdisk_find_snapshots(vs->vs_vdh, vs->vs_vdname_ext,
+	    &vs->vs_image, NULL)) == -1) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 		    gettext("ERROR: Unable to find file to snapshot"),
-		    vdname_ext);
-		goto fail;
+		    vs->vs_vdname_ext);
+		return (-1);
 	}
 
-	(void) VDGetImageFlags(vdh->hdd, 0, &uimageflags);
-	/* Renaming current active file to snapshot name using VDCopy. */
-	rc = VDCopy(vdh->hdd, mv_image_number, vdh->hdd, pszformat,
-	    snapname_ext, true, 0, uimageflags, NULL, NULL, NULL, NULL);
-	if (!(VBOX_SUCCESS(rc))) {
-		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-		    gettext("ERROR: Unable to rename snapshot of file"),
-		    vdname);
-		goto fail;
-	}
+	return (0);
+}
 
-	rc = VDCreateDiff(vdh->hdd, pszformat, vdname_ext,
+/*
+ * Take a snapshot of a virtual disk made ready by vdi_snap_prepare():
+ * the current image becomes the snapshot and a new one on top of it
+ * takes its place.  vs_done records each step taken, so that
+ * vdi_snap_undo() can take them back.
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_snap_commit(vdi_snap_t *vs)
+{
+	vd_handle_t *vdh = vs->vs_vdh;
+	char *snap_loc = strrchr(vs->vs_name, '@');
+	unsigned int uimageflags;
+	int rc;
+
+	(void) VDGetImageFlags(vdh->hdd, 0, &uimageflags);
+	/* Renaming current active file to snapshot name using VDCopy. */
+	rc = VDCopy(vdh->hdd, vs->vs_image, vdh->hdd, vs->vs_pszformat,
+	    vs->vs_snapname_ext, true, 0, uimageflags, NULL, NULL, NULL, NULL);
+	if (!(VBOX_SUCCESS(rc))) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to rename snapshot of file"),
+		    vs->vs_vdname);
+		return (-1);
+	}
+	vs->vs_done = VDI_SNAP_RENAMED;
+
+	rc = VDCreateDiff(vdh->hdd, vs->vs_pszformat, vs->vs_vdname_ext,
 	    VD_IMAGE_FLAGS_NONE, "Snapshot image", NULL, NULL,
 	    VD_OPEN_FLAGS_NORMAL, NULL, NULL);
 	if (!(VBOX_SUCCESS(rc))) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 		    gettext("ERROR: Unable to create snapshot of file"),
-		    vdname);
-		goto fail;
+		    vs->vs_vdname);
+		return (-1);
 	}
-
-	RTStrFree(pszformat);
-	pszformat = NULL;
+	vs->vs_done = VDI_SNAP_DIFF;
 
 	/* Add snapshot to xml tree */
-	if (vdisk_add_snap(vdh, snaplistname, snapname_ext) == -1) {
-		goto fail;
+	if (vdisk_add_snap(vdh, vs->vs_snaplistname,
+	    vs->vs_snapname_ext) == -1) {
+		return (-1);
 	}
 
 	/* Write new snapshot list to store */
-	if (vdisk_write_tree(vdh, vdname) == -1) {
+	if (vdisk_write_tree(vdh, vs->vs_vdname) == -1) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-		    gettext("ERROR: Unable to update store file"), vdname);
-		goto fail;
+		    gettext("ERROR: Unable to update store file"),
+		    vs->vs_vdname);
+		return (-1);
 	}
+	vs->vs_done = VDI_SNAP_STORE;
 
-	/* Close all and free pdisk */
-	VDDestroy(vdh->hdd);
-	vdisk_free_tree(vdh);
+	/* Writes from here on belong to a new changed block generation */
+	if (vdisk_cbt_snapshot(vs->vs_vdname, snap_loc + 1) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+		    gettext("ERROR: Unable to start changed block "
+		    "generation"), vs->vs_name, strerror(errno));
+		return (-1);
+	}
+	vs->vs_done = VDI_SNAP_CBT;
+
+	return (0);
+}
+
+/*
+ * Take back the steps vdi_snap_commit() took, last first, leaving the
+ * disk as it was before the snapshot.  The store's lock must still be
+ * held, so nothing can have written to the new image.  Stops at the
+ * first step that can't be taken back, as the ones before it depend
+ * on it.
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_snap_undo(vdi_snap_t *vs)
+{
+	vd_handle_t *vdh = vs->vs_vdh;
+	char *snap_loc = strrchr(vs->vs_name, '@');
+	unsigned int uimageflags;
+	int rc;
+
+	if (vs->vs_done >= VDI_SNAP_CBT) {
+		if (vdisk_cbt_unsnapshot(vs->vs_vdname, snap_loc + 1) == -1) {
+			(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+			    gettext("ERROR: Unable to restore changed block "
+			    "generation"), vs->vs_name, strerror(errno));
+			goto fail;
+		}
+		vs->vs_done = VDI_SNAP_STORE;
+	}
+
+	if (vs->vs_done >= VDI_SNAP_STORE) {
+		if ((vdisk_delete_snap(vdh, vs->vs_snaplistname) == -1) ||
+		    (vdisk_write_tree(vdh, vs->vs_vdname) == -1)) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to update store file"),
+			    vs->vs_vdname);
+			goto fail;
+		}
+		vs->vs_done = VDI_SNAP_DIFF;
+	}
+
+	/* The new image is the last one opened; close and delete it */
+	if (vs->vs_done >= VDI_SNAP_DIFF) {
+		if (!VBOX_SUCCESS(VDClose(vdh->hdd, true))) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to remove file"),
+			    vs->vs_vdname_ext);
+			goto fail;
+		}
+		vs->vs_done = VDI_SNAP_RENAMED;
+	}
+
+	if (vs->vs_done >= VDI_SNAP_RENAMED) {
+		(void) VDGetImageFlags(vdh->hdd, 0, &uimageflags);
+		rc = VDCopy(vdh->hdd, vs->vs_image, vdh->hdd,
+		    vs->vs_pszformat, vs->vs_vdname_ext, true, 0, uimageflags,
+		    NULL, NULL, NULL, NULL);
+		if (!(VBOX_SUCCESS(rc))) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to rename file"),
+			    vs->vs_snapname_ext);
+			goto fail;
+		}
+		vs->vs_done = 0;
+	}
 
 	return (0);
 
 fail:
-	if (pszformat)
-		RTStrFree(pszformat);
-	if ((vdh != NULL) && (vdh->hdd != NULL))
-		VDDestroy(vdh->hdd);
-	vdisk_free_tree(vdh);
+	(void) fprintf(stderr, "%s: \"%s\"\n",
+	    gettext("Snapshot could not be undone"), vs->vs_snaplistname);
 	return (-1);
 }
 
+/*
+ * Release what vdi_snap_prepare() set up.
+ */
+static void
+vdi_snap_free(vdi_snap_t *vs)
+{
+	if (vs->vs_pszformat)
+		RTStrFree(vs->vs_pszformat);
+	if ((vs->vs_vdh != NULL) && (vs->vs_vdh->hdd != NULL))
+		VDDestroy(vs->vs_vdh->hdd);
+	vdisk_free_tree(vs->vs_vdh);
+	if (vs->vs_lockfd != -1)
+		(void) vdisk_unlock(vs->vs_lockfd, vs->vs_vdname);
+}
+
+/*
+ * Load the capabilities of the disk types for vdi_snap_prepare().
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_snap_backends(char *name, uint_t *cntp)
+{
+	*cntp = 0;
+	if (VDBackendInfo(VDI_MAX_BACKENDS, vdi_backend_info, cntp) !=
+	    VINF_SUCCESS) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to load formats"), name);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Take a snapshot of one virtual disk.
+ * Snapshot name is of the form <virtual disk>@<snap name>
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_snapshot(char *name)
+{
+	vdi_snap_t vs;
+	char *name_at;
+	int rc = -1;
+
+	name_at = strchr(name, '@');
+	if ((name_at == NULL) || (strlen(name_at + 1) == 0)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: name must be of snapshot form "
+		    "<name@snapshot>: "), name);
+		return (-1);
+	}
+
+	bzero(&vs, sizeof (vs));
+	vs.vs_lockfd = -1;
+	if (strlcpy(vs.vs_name, name, MAXPATHLEN) >= MAXPATHLEN) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Name is too long"), name);
+		return (-1);
+	}
+
+	if (vdi_snap_backends(name, &vs.vs_nbackends) == -1)
+		return (-1);
+
+	/* The store is read, changed and written under its lock */
+	vdisk_get_vdname(vs.vs_vdname, name, MAXPATHLEN);
+	if ((vs.vs_lockfd = vdi_lock(vs.vs_vdname, VD_LOCK_TIMEOUT)) == -1)
+		return (-1);
+
+	if ((vdi_snap_prepare(&vs) == 0) && (vdi_snap_commit(&vs) == 0))
+		rc = 0;
+	else
+		(void) vdi_snap_undo(&vs);
+
+	vdi_snap_free(&vs);
+	return (rc);
+}
+
+static void *
+vdi_snap_thread(void *arg)
+{
+	vdi_snap_t *vs = arg;
+
+	vs->vs_rc = vdi_snap_prepare(vs);
+	return (NULL);
+}
+
+static int
+vdi_snap_compare(const void *a, const void *b)
+{
+	return (strcmp(((const vdi_snap_t *)a)->vs_real,
+	    ((const vdi_snap_t *)b)->vs_real));
+}
+
+/*
+ * Take snapshot snapname of several virtual disks at one point in time.
+ * The locks of all the stores are taken first, in the order of the
+ * disks' real paths so groups sharing disks don't deadlock, and held
+ * until all the snapshots are taken: no disk can be put in use, or its
+ * store changed, from the time it is read.  The disks are then prepared
+ * on a thread each; loading their stores and images is what takes long,
+ * and each uses a VD container of its own.  If any snapshot fails,
+ * those already taken are undone before the locks are dropped, so
+ * either every disk gets the snapshot or none does.
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_snapshot_group(char *snapname, int ndisks, char **disks)
+{
+	vdi_snap_t *vs;
+	uint_t cnt;
+	int i, j;
+	int rc = -1;
+
+	if ((snapname[0] == '\0') || (strchr(snapname, '@') != NULL) ||
+	    (strchr(snapname, '/') != NULL)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Invalid snapshot name"), snapname);
+		return (-1);
+	}
+
+	if ((vs = calloc(ndisks, sizeof (vdi_snap_t))) == NULL) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate memory."));
+		return (-1);
+	}
+	for (i = 0; i < ndisks; i++)
+		vs[i].vs_lockfd = -1;
+
+	for (i = 0; i < ndisks; i++) {
+		if (strchr(disks[i], '@') != NULL) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Cannot give snapshot with -g"),
+			    disks[i]);
+			goto out;
+		}
+		if (snprintf(vs[i].vs_name, MAXPATHLEN, "%s@%s", disks[i],
+		    snapname) >= MAXPATHLEN) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Name is too long"), disks[i]);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < ndisks; i++) {
+		vdisk_get_vdname(vs[i].vs_vdname, vs[i].vs_name, MAXPATHLEN);
+		if (realpath(vs[i].vs_vdname, vs[i].vs_real) == NULL) {
+			(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+			    gettext("ERROR: Unable to access virtual disk"),
+			    vs[i].vs_vdname, strerror(errno));
+			goto out;
+		}
+	}
+
+	qsort(vs, ndisks, sizeof (vdi_snap_t), vdi_snap_compare);
+	for (i = 1; i < ndisks; i++) {
+		if (strcmp(vs[i - 1].vs_real, vs[i].vs_real) == 0) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Virtual disk given more than once"),
+			    vs[i].vs_vdname);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < ndisks; i++) {
+		vs[i].vs_lockfd = vdi_lock(vs[i].vs_vdname, VD_LOCK_TIMEOUT);
+		if (vs[i].vs_lockfd == -1)
+			goto out;
+	}
+
+	/* Set up the disk types and libxml before threads use them */
+	if (vdi_snap_backends(disks[0], &cnt) == -1)
+		goto out;
+	xmlInitParser();
+
+	for (i = 0; i < ndisks; i++) {
+		vs[i].vs_nbackends = cnt;
+		if (pthread_create(&vs[i].vs_tid, NULL, vdi_snap_thread,
+		    &vs[i]) == 0)
+			vs[i].vs_started = B_TRUE;
+		else
+			vs[i].vs_rc = vdi_snap_prepare(&vs[i]);
+	}
+	for (i = 0; i < ndisks; i++) {
+		if (vs[i].vs_started)
+			(void) pthread_join(vs[i].vs_tid, NULL);
+	}
+	for (i = 0; i < ndisks; i++) {
+		if (vs[i].vs_rc != 0)
+			goto out;
+	}
+
+	for (i = 0; i < ndisks; i++) {
+		if (vdi_snap_commit(&vs[i]) == -1) {
+			for (j = i; j >= 0; j--)
+				(void) vdi_snap_undo(&vs[j]);
+			goto out;
+		}
+	}
+	rc = 0;
+
+out:
+	for (i = 0; i < ndisks; i++)
+		vdi_snap_free(&vs[i]);
+	free(vs);
+	return (rc);
+}
+
+/*
+ * Take a snapshot of the virtual disk.
+ * Snapshot name is of the form <virtual disk>@<snap name>
+ * -g option: take snapshot <snap name> of each virtual disk given
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_snapshot_cmd(int argc, char *argv[])
+{
+	char *group = NULL;
+	int c;
+
+	while ((c = getopt(argc, argv, "g:")) != -1) {
+		switch (c) {
+		case 'g':
+			group = optarg;
+			break;
+
+		case '?':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Invalid option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "snapshot");
+			exit(-1);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Missing name argument"));
+		(void) vdi_cmd_print_help(stderr, "snapshot");
+		exit(-1);
+	}
+
+	if (group != NULL)
+		return (vdi_snapshot_group(group, argc, argv));
+
+	if (argc > 1) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Too many arguments"));
+		(void) vdi_cmd_print_help(stderr, "snapshot");
+		exit(-1);
+	}
+	return (vdi_snapshot(argv[0]));
+}
+
 /*
  * Rollback a virtual disk to a given snapshot.
  * -r option: Rollbacks to the given snapshot even if snapshot is
@@ -2559,6 +3946,7 @@ vdi_rollback_cmd(int argc, char *argv[])
 	char *snapshot;
 	PVBOXHDD pdisk;
 	unsigned save_open_flags;
+	int lockfd;
 
 	while ((c = getopt(argc, argv, "r")) != -1) {
 		switch (c) {
@@ -2592,6 +3980,12 @@ vdi_rollback_cmd(int argc, char *argv[])
 		    "form <name@snapshot>"), argv[0]);
 		return (-1);
 	}
+
+	/* The store is read, changed and written under its lock */
+	vdisk_get_vdname(vdname, argv[0], MAXPATHLEN);
+	if ((lockfd = vdi_lock(vdname, VD_LOCK_TIMEOUT)) == -1)
+		return (-1);
+
 	if (vdisk_find_create_storepath(argv[0], vdname, snapname,
 	    extname, &pszformat, 0, &vdh) == -1) {
 		goto fail;
@@ -2662,6 +4056,14 @@ vdi_rollback_cmd(int argc, char *argv[])
 		goto fail;
 	}
 
+	/* Not allowed to remove images linked clones are using */
+	if (rb_image_number < vdisk_find_cow_clone_image(vdh)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Cannot rollback file; linked clones "
+		    "depend on a more recent snapshot"), snapname);
+		goto fail;
+	}
+
 	/* If given top level image - shouldn't get there, but check anyway */
 	if (total_image_number == (rb_image_number + 1)) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
@@ -2736,11 +4138,20 @@ vdi_rollback_cmd(int argc, char *argv[])
 		goto fail;
 	}
 
+	/* Blocks changed since the snapshot are back to what it holds */
+	if (vdisk_cbt_rollback(vdname, strrchr(argv[0], '@') + 1) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+		    gettext("ERROR: Unable to update changed block bitmap"),
+		    argv[0], strerror(errno));
+		goto fail;
+	}
+	vdi_index_prune(vdh, vdname);
+
 	/* Close all and free pdisk */
 	VDDestroy(vdh->hdd);
 	vdisk_free_tree(vdh);
 
-	return (0);
+	return (vdisk_unlock(lockfd, vdname));
 
 fail:
 	if (pszformat)
@@ -2748,12 +4159,15 @@ fail:
 	if ((vdh != NULL) && (vdh->hdd != NULL))
 		VDDestroy(vdh->hdd);
 	vdisk_free_tree(vdh);
+	(void) vdisk_unlock(lockfd, vdname);
 	return (-1);
 }
 
 /*
  * Clones the virtual disk.
  * -c option: give comment or description of new virtual disk
+ * -l option: create a linked clone sharing the snapshot's images
+ *	read-only; the snapshot can't be destroyed while the clone exists
  *
  * Returns:
  *	0: success
@@ -2771,6 +4185,11 @@ vdi_clone_cmd(int argc, char *argv[])
 	char snapname_ext[MAXPATHLEN];	/* snapshot with extension */
 	char vdfilebase[MAXPATHLEN];	/* path to virtual disk file */
 	char vdfilebaseclone[MAXPATHLEN];	/* path to virtual disk file */
+	char image_file[MAXPATHLEN];	/* image shared by linked clone */
+	char real_vdname[MAXPATHLEN];	/* full path to virtual disk */
+	char real_clone_vdname[MAXPATHLEN];	/* full path to clone disk */
+	char parent[MAXPATHLEN];	/* snapshot a linked clone refers to */
+	char storename[MAXPATHLEN];	/* store file of clone */
 	unsigned int save_open_flags;
 	PVBOXHDD pdisk;
 	PVBOXHDD pclonedisk = NULL;
@@ -2780,29 +4199,61 @@ vdi_clone_cmd(int argc, char *argv[])
 	int c;
 	int i;
 	int image_number = 0, total_image_number;
+	int clone_image = 0;
+	int linked_clone = 0;
+	int clone_dir = 0;		/* clone directory was created */
+	int clone_created = 0;		/* clone image was created */
+	int lockfd = -1;
 	char *disk_size_str = NULL, *disk_size_bytes_str = NULL;
 	char *sector_str = NULL;
 	char create_time_str[MAXPATHLEN];
 	int create_flag;
 	char *sparse = NULL;
 	struct stat64 stat64buf;
-	vd_handle_t *vdh = NULL, *vdh_clone = NULL;
+	vd_handle_t *vdh = NULL, *vdh_clone = NULL, *pvdh = NULL;
 	struct passwd *pw;
 	char *slash = NULL;
 	char *at = NULL;
 	unsigned int uimageflags;
 	char none[] = "none";
+	vdi_copy_opts_t copy_opts;
 
 	comment = NULL;
 	cnt = 0;
 	clone_vdname[0] = '\0';
+	clone_vdname_ext[0] = '\0';
+	bzero(&copy_opts, sizeof (copy_opts));
+	copy_opts.co_nthreads = 1;
 
-	while ((c = getopt(argc, argv, "c:")) != -1) {
+	while ((c = getopt(argc, argv, "lpvj:c:")) != -1) {
 		switch (c) {
+		case 'l':
+			linked_clone = 1;
+			break;
+
+		case 'p':
+			copy_opts.co_parsable = B_TRUE;
+			break;
+
+		case 'v':
+			copy_opts.co_progress = B_TRUE;
+			break;
+
 		case 'c':
 			comment = optarg;
 			break;
 
+		case 'j':
+			if (vdi_copy_parse_threads(optarg,
+			    &copy_opts.co_nthreads) != 0) {
+				(void) fprintf(stderr, "\n%s: %s\n\n",
+				    gettext("ERROR: Invalid number of threads "
+				    "specified"), optarg);
+				(void) vdi_cmd_print_help(stderr, "clone");
+				exit(-1);
+			}
+			break;
+
 		case ':':
 			(void) fprintf(stderr, "\n%s: %c\n\n",
 			    gettext("ERROR: Missing argument for option"),
@@ -2834,6 +4285,15 @@ vdi_clone_cmd(int argc, char *argv[])
 		goto fail;
 	}
 
+	/* A linked clone needs a snapshot that won't change underneath it */
+	if ((linked_clone) && (snapname[0] == '\0')) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Linked clone must be of a snapshot"),
+		    argv[0]);
+		(void) vdi_cmd_print_help(stderr, "clone");
+		goto fail;
+	}
+
 	if (check_vdisk_in_use(vdh, argv[0]))
 		goto fail;
 
@@ -2878,6 +4338,7 @@ vdi_clone_cmd(int argc, char *argv[])
 	    NULL, NULL, 1, NULL) == -1) {
 		goto fail;
 	}
+	clone_dir = 1;
 
 	rc = VDCreate(NULL, &pclonedisk);
 	if (!VBOX_SUCCESS(rc)) {
@@ -2910,43 +4371,101 @@ vdi_clone_cmd(int argc, char *argv[])
 		goto fail;
 	}
 
-	/* Turn off readonly flag since will be set for snapshots */
-	rc = VDGetOpenFlags(vdh->hdd, image_number, &save_open_flags);
-	if (!(VBOX_SUCCESS(rc))) {
-		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-		    gettext("ERROR: Unable to get open flags of file"),
-		    argv[0]);
-		goto fail;
-	}
-	rc = VDSetOpenFlags(vdh->hdd, image_number,
-	    (save_open_flags & ~VD_OPEN_FLAGS_READONLY));
-	if (!(VBOX_SUCCESS(rc))) {
-		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-		    gettext("ERROR: Unable to set write mode on file"),
-		    argv[0]);
-		goto fail;
-	}
-
 	/* Clone gets conventional name */
 	vdisk_get_vdfilebase(NULL, vdfilebaseclone, clone_vdname, MAXPATHLEN);
 	copy_add_ext(clone_vdname_ext, vdfilebaseclone, extname);
 
-	/* Copy current active file to clone name using VDCopy. */
-	(void) VDGetImageFlags(vdh->hdd, 0, &uimageflags);
-	rc = VDCopy(vdh->hdd, image_number, pclonedisk, pszformat,
-	    clone_vdname_ext, false, 0, uimageflags, NULL, NULL, NULL, NULL);
-	if (!(VBOX_SUCCESS(rc))) {
-		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-		    gettext("ERROR: Unable to create clone of file"),
-		    argv[0]);
-		goto fail;
+	if (linked_clone) {
+		/* Share the snapshot's images and put a diff on top */
+		for (i = 0; i <= image_number; i++) {
+			rc = VDGetFilename(vdh->hdd, i, image_file,
+			    MAXPATHLEN);
+			if (VBOX_SUCCESS(rc)) {
+				rc = VDOpen(pclonedisk, pszformat, image_file,
+				    (VD_OPEN_FLAGS_NORMAL |
+				    VD_OPEN_FLAGS_READONLY), NULL);
+			}
+			if (!(VBOX_SUCCESS(rc))) {
+				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+				    gettext("ERROR: Unable to open file"),
+				    image_file);
+				goto fail;
+			}
+		}
+		rc = VDCreateDiff(pclonedisk, pszformat, clone_vdname_ext,
+		    VD_IMAGE_FLAGS_NONE, "Linked clone image", NULL, NULL,
+		    VD_OPEN_FLAGS_NORMAL, NULL, NULL);
+		if (!(VBOX_SUCCESS(rc))) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to create clone of file"),
+			    argv[0]);
+			goto fail;
+		}
+		clone_created = 1;
+		clone_image = image_number + 1;
+	} else if ((image_number == 0) && vdi_file_copy_format(pszformat)) {
+		/* A lone base image can be copied as a file */
+		rc = VDGetFilename(vdh->hdd, 0, image_file, MAXPATHLEN);
+		if (!(VBOX_SUCCESS(rc)) || (vdi_copy_file(image_file,
+		    clone_vdname_ext, &copy_opts) == -1)) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to create clone of file"),
+			    argv[0]);
+			goto fail;
+		}
+
+		/* The copy is a disk of its own, give it a new uuid */
+		rc = VDOpen(pclonedisk, pszformat, clone_vdname_ext,
+		    VD_OPEN_FLAGS_NORMAL, NULL);
+		if (VBOX_SUCCESS(rc)) {
+			rc = VDSetUuid(pclonedisk, 0, NULL);
+			if (rc == VERR_NOT_SUPPORTED)
+				rc = VINF_SUCCESS;
+		}
+		if (!(VBOX_SUCCESS(rc))) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to create clone of file"),
+			    argv[0]);
+			(void) unlink(clone_vdname_ext);
+			goto fail;
+		}
+		clone_created = 1;
+	} else {
+		/* Turn off readonly flag since will be set for snapshots */
+		rc = VDGetOpenFlags(vdh->hdd, image_number, &save_open_flags);
+		if (!(VBOX_SUCCESS(rc))) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to get open flags of file"),
+			    argv[0]);
+			goto fail;
+		}
+		rc = VDSetOpenFlags(vdh->hdd, image_number,
+		    (save_open_flags & ~VD_OPEN_FLAGS_READONLY));
+		if (!(VBOX_SUCCESS(rc))) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to set write mode on file"),
+			    argv[0]);
+			goto fail;
+		}
+
+		/* Copy current active file to clone name. */
+		(void) VDGetImageFlags(vdh->hdd, 0, &uimageflags);
+		rc = vdi_copy(vdh->hdd, image_number, pszformat, pclonedisk,
+		    pszformat, clone_vdname_ext, 0, uimageflags, &copy_opts);
+		if (!(VBOX_SUCCESS(rc))) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to create clone of file"),
+			    argv[0]);
+			goto fail;
+		}
+		clone_created = 1;
 	}
 
 	RTStrFree(pszformat);
 	pszformat = NULL;
 
 	if (comment) {
-		rc = VDSetComment(pclonedisk, 0, comment);
+		rc = VDSetComment(pclonedisk, clone_image, comment);
 		if (!(VBOX_SUCCESS(rc))) {
 			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 			    gettext("ERROR: Unable to add clone comment"),
@@ -2972,13 +4491,26 @@ vdi_clone_cmd(int argc, char *argv[])
 	(void) vdisk_get_prop_str(vdh, "max-size", &disk_size_str);
 	(void) vdisk_get_prop_str(vdh, "sectors", &sector_str);
 	create_flag = 0;
-	if (strcmp(sparse, "false") == 0)
+	if ((strcmp(sparse, "false") == 0) && (linked_clone == 0))
 		create_flag = VD_IMAGE_FLAGS_FIXED;
 
+	/* A linked clone records the full path of the snapshot it uses */
+	if (linked_clone) {
+		if ((realpath(vdname, real_vdname) == NULL) ||
+		    (realpath(clone_vdname, real_clone_vdname) == NULL)) {
+			(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+			    gettext("ERROR: Unable to resolve path of "
+			    "virtual disk"), argv[0], strerror(errno));
+			goto fail;
+		}
+		(void) snprintf(parent, MAXPATHLEN, "%s%s", real_vdname,
+		    strrchr(snapname, '@'));
+	}
+
 	pw = getpwuid(stat64buf.st_uid);
 	if (vdisk_create_tree(clone_vdname, extname, create_flag,
-	    NULL, create_time_str, disk_size_str, sector_str,
-	    comment, pw->pw_name, &vdh_clone) == -1) {
+	    (linked_clone ? parent : NULL), create_time_str, disk_size_str,
+	    sector_str, comment, pw->pw_name, &vdh_clone) == -1) {
 		goto fail;
 	}
 	vdh_clone->hdd = pclonedisk;
@@ -2997,6 +4529,28 @@ vdi_clone_cmd(int argc, char *argv[])
 		goto fail;
 	}
 
+	/*
+	 * Record the linked clone so its snapshot is kept.  The store is
+	 * read again under its lock, so ref counts and other changes made
+	 * to it since it was read above aren't lost.
+	 */
+	if (linked_clone) {
+		if ((lockfd = vdi_lock(vdname, VD_LOCK_TIMEOUT)) == -1)
+			goto fail;
+		if ((vdisk_read_tree(&pvdh, vdname) == -1) ||
+		    (vdisk_add_cow_clone(pvdh, snapname,
+		    real_clone_vdname) == -1) ||
+		    (vdisk_write_tree(pvdh, vdname) == -1)) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to update store file"),
+			    vdname);
+			goto fail;
+		}
+		(void) vdisk_unlock(lockfd, vdname);
+		lockfd = -1;
+		vdisk_free_tree(pvdh);
+	}
+
 	/* Close all and free pdisk and pclonedisk */
 	VDDestroy(vdh->hdd);
 	VDDestroy(pclonedisk);
@@ -3011,6 +4565,11 @@ fail:
 	if ((vdh != NULL) && (vdh->hdd != NULL))
 		VDDestroy(vdh->hdd);
 	vdisk_free_tree(vdh);
+	vdisk_free_tree(pvdh);
+	if (lockfd != -1)
+		(void) vdisk_unlock(lockfd, vdname);
+	if (clone_created)
+		(void) VDClose(pclonedisk, true);
 	if (pclonedisk)
 		VDDestroy(pclonedisk);
 	vdisk_free_tree(vdh_clone);
@@ -3020,13 +4579,28 @@ fail:
 		free(disk_size_str);
 	if (disk_size_bytes_str)
 		free(disk_size_bytes_str);
-	if (clone_vdname[0] != '\0')
-		rmdir(clone_vdname);
+	if (clone_dir) {
+		/* Remove the clone's image, store file, cache and lock file */
+		if (clone_vdname_ext[0] != '\0')
+			(void) unlink(clone_vdname_ext);
+		vdisk_get_xmlfile(storename, clone_vdname, MAXPATHLEN);
+		(void) unlink(storename);
+		vdisk_cache_remove(clone_vdname);
+		vdisk_lock_remove(clone_vdname);
+		(void) rmdir(clone_vdname);
+	}
 	return (-1);
 }
 
 /*
  * Verifies that the given name is a virtual disk.
+ * -f option: reads and checks everything, see vdiskadm_verify.c
+ * -j option: number of threads reading
+ * -r option: bytes read per second
+ * -c option: record or check checksums of the snapshot images
+ * -R option: starts over instead of resuming an interrupted -f
+ * -v option: reports progress
+ * -p option: ... in parsable format
  *
  * Returns:
  *	0: success
@@ -3035,60 +4609,88 @@ fail:
 static int
 vdi_verify_cmd(int argc, char *argv[])
 {
-	vd_handle_t *vdh = NULL;
-
-	if (argc != 2) {
-		(void) fprintf(stderr, "\n%s\n\n",
-		    gettext("ERROR: Missing name argument"));
-		(void) vdi_cmd_print_help(stderr, "verify");
-		exit(-1);
-	}
-
-	vdh = vdisk_open(argv[1]);
-	if ((vdh == NULL) || (vdh->hdd == NULL) || (vdh->unmanaged)) {
-		return (-1);
-	}
-
-	vdisk_close(vdh);
-	return (0);
-}
-
-/*
- * Increment the reference count of a virtual disk.
- * -w option: increment the write count (default if no option given)
- * -r option: increment the reader count
- *
- * Returns:
- *	0: success
- *	-1: on failure
- */
-static int
-vdi_refinc_cmd(int argc, char *argv[])
-{
-	int rwcnt;
-	int rocnt;
 	char vdname[MAXPATHLEN];	/* path to virtual disk */
 	char extname[MAXPATHLEN];	/* extension type of virtual disk */
 	char *pszformat = NULL;		/* VBox's extension type of disk */
-	int lockfd = -1;
+	char *rwcnt_str = NULL;
 	vd_handle_t *vdh = NULL;
+	PVBOXHDD pdisk;
+	vdi_verify_opts_t verify_opts;
+	vdi_copy_opts_t copy_opts;
+	int deep = 0;
 	int c;
-	int reader_flag = 0;
-	int ret = 0;
+	int rc;
 
-	while ((c = getopt(argc, argv, "wr")) != -1) {
+	bzero(&verify_opts, sizeof (verify_opts));
+	bzero(&copy_opts, sizeof (copy_opts));
+	copy_opts.co_nthreads = 1;
+
+	while ((c = getopt(argc, argv, "fpvRj:r:c:")) != -1) {
 		switch (c) {
-		case 'w':
+		case 'f':
+			deep = 1;
+			break;
+
+		case 'p':
+			copy_opts.co_parsable = B_TRUE;
+			break;
+
+		case 'v':
+			copy_opts.co_progress = B_TRUE;
+			break;
+
+		case 'R':
+			verify_opts.vo_restart = B_TRUE;
+			break;
+
+		case 'j':
+			if (vdi_copy_parse_threads(optarg,
+			    &copy_opts.co_nthreads) != 0) {
+				(void) fprintf(stderr, "\n%s: %s\n\n",
+				    gettext("ERROR: Invalid number of threads "
+				    "specified"), optarg);
+				(void) vdi_cmd_print_help(stderr, "verify");
+				exit(-1);
+			}
 			break;
 
 		case 'r':
-			reader_flag = 1;
+			if ((zfs_nicestrtonum(optarg,
+			    &verify_opts.vo_rate) != 0) ||
+			    (verify_opts.vo_rate == 0)) {
+				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+				    gettext("ERROR: Invalid rate"), optarg);
+				(void) vdi_cmd_print_help(stderr, "verify");
+				exit(-1);
+			}
 			break;
 
+		case 'c':
+			if (strcmp(optarg, "record") == 0) {
+				verify_opts.vo_sums = VDI_VERIFY_SUMS_RECORD;
+			} else if (strcmp(optarg, "check") == 0) {
+				verify_opts.vo_sums = VDI_VERIFY_SUMS_CHECK;
+			} else {
+				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+				    gettext("ERROR: Invalid checksum action"),
+				    optarg);
+				(void) vdi_cmd_print_help(stderr, "verify");
+				exit(-1);
+			}
+			break;
+
+		case ':':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Missing argument for option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "verify");
+			exit(-1);
+
 		case '?':
 			(void) fprintf(stderr, "\n%s: %c\n\n",
 			    gettext("ERROR: Invalid option"),
 			    optopt);
+			(void) vdi_cmd_print_help(stderr, "verify");
 			exit(-1);
 		}
 	}
@@ -3096,172 +4698,2046 @@ vdi_refinc_cmd(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc < 1) {
+	if (argc != 1) {
 		(void) fprintf(stderr, "\n%s\n\n",
 		    gettext("ERROR: Missing name argument"));
-		(void) vdi_cmd_print_help(stderr, "refinc");
+		(void) vdi_cmd_print_help(stderr, "verify");
 		exit(-1);
 	}
 
-	if (vdisk_find_create_storepath(argv[0], vdname, NULL,
-	    extname, &pszformat, 0, &vdh) == -1) {
-		ret = -1;
-		goto fail;
+	if (!deep) {
+		if ((copy_opts.co_nthreads != 1) || copy_opts.co_progress ||
+		    copy_opts.co_parsable || verify_opts.vo_restart ||
+		    (verify_opts.vo_rate != 0) || (verify_opts.vo_sums != 0)) {
+			(void) fprintf(stderr, "\n%s\n\n",
+			    gettext("ERROR: Options other than -f need -f"));
+			(void) vdi_cmd_print_help(stderr, "verify");
+			exit(-1);
+		}
+		vdh = vdisk_open(argv[0]);
+		if ((vdh == NULL) || (vdh->hdd == NULL) || (vdh->unmanaged)) {
+			return (-1);
+		}
+
+		vdisk_close(vdh);
+		return (0);
 	}
 
-	if ((lockfd = vdisk_lock(vdname)) == -1) {
-		ret = -1;
-		goto fail;
+	if (strrchr(argv[0], '@') != NULL) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Must use vdname not snapshot"));
+		(void) vdi_cmd_print_help(stderr, "verify");
+		exit(-1);
 	}
 
-	if (vdisk_read_tree(&vdh, vdname) == -1) {
-		ret = -1;
+	if (vdisk_find_create_storepath(argv[0], vdname, NULL,
+	    extname, &pszformat, 0, &vdh) == -1) {
 		goto fail;
 	}
 
-	if (vdisk_get_prop_val(vdh, "rwcnt", &rwcnt) == -1) {
-		ret = -1;
+	/* Alloc handle space */
+	rc = VDCreate(NULL, &pdisk);
+	if (!VBOX_SUCCESS(rc)) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate handle space."));
 		goto fail;
 	}
-	if (vdisk_get_prop_val(vdh, "rocnt", &rocnt) == -1) {
-		ret = -1;
+	vdh->hdd = pdisk;
+
+	/* Never write, the disk may be in use */
+	if ((vdisk_load_snapshots(vdh, pszformat, vdname,
+	    VD_OPEN_FLAGS_READONLY)) == -1) {
 		goto fail;
 	}
-	if (reader_flag) {
-		/* rwcnt must be 0 to grab reader lock */
-		if (rwcnt != 0) {
-			(void) fprintf(stderr, "\n%s: \"%s\"\n",
-			    gettext("ERROR: unable to grab reader lock"),
-			    argv[0]);
-			ret = -1;
-			goto fail;
-		}
-		rocnt++;
-		if (vdisk_set_prop_val(vdh, "rocnt", rocnt,
-		    VD_PROP_NORMAL) == -1) {
-			ret = -1;
-			goto fail;
-		}
-	} else {
-		/* To grab writer lock both rocnt and rwcnt should be 0 */
-		if ((rwcnt != 0) || (rocnt != 0)) {
-			(void) fprintf(stderr, "\n%s: \"%s\"\n",
-			    gettext("ERROR: unable to grab writer lock"),
-			    argv[0]);
-			ret = -1;
-			goto fail;
-		}
-		rwcnt++;
-		if (vdisk_set_prop_val(vdh, "rwcnt", rwcnt,
-		    VD_PROP_NORMAL) == -1) {
-			ret = -1;
-			goto fail;
-		}
+
+	/* A guest writing the top image would make its reads race */
+	(void) vdisk_get_prop_str(vdh, "rwcnt", &rwcnt_str);
+	if ((rwcnt_str != NULL) && (atoi(rwcnt_str) > 0)) {
+		verify_opts.vo_skip_top = B_TRUE;
+		(void) fprintf(stderr, "%s\n", gettext("Virtual disk is in "
+		    "use; only the images below the top one are read."));
 	}
-	(void) vdisk_write_tree(vdh, vdname);
+	free(rwcnt_str);
+
+	rc = vdi_verify(vdh, vdname, pszformat, &verify_opts, &copy_opts);
+
+	RTStrFree(pszformat);
+	VDDestroy(vdh->hdd);
+	vdisk_free_tree(vdh);
+	return (rc);
 
 fail:
 	if (pszformat)
 		RTStrFree(pszformat);
+	if ((vdh != NULL) && (vdh->hdd != NULL))
+		VDDestroy(vdh->hdd);
 	vdisk_free_tree(vdh);
-	if (lockfd != -1) {
-		if (vdisk_unlock(lockfd, vdname) == -1) {
-			ret = -1;
-		}
-	}
-	return (ret);
+	return (-1);
 }
 
 /*
- * Decrement the reference count of a virtual disk.
- * Descrement either the reader or writer count whichever one is
- * non-zero.
+ * Builds the missing or stale content indexes of a virtual disk.
+ * -j option: number of threads hashing blocks
+ * -v option: reports progress
+ * -p option: ... in parsable format
  *
  * Returns:
  *	0: success
  *	-1: on failure
  */
 static int
-vdi_refdec_cmd(int argc, char *argv[])
+vdi_index_cmd(int argc, char *argv[])
 {
-	int refcnt;
-	char reftype_str[MAXPATHLEN];
 	char vdname[MAXPATHLEN];	/* path to virtual disk */
 	char extname[MAXPATHLEN];	/* extension type of virtual disk */
 	char *pszformat = NULL;		/* VBox's extension type of disk */
-	int lockfd = -1;
+	char *rwcnt_str = NULL;
 	vd_handle_t *vdh = NULL;
-	int ret = 0;
+	PVBOXHDD pdisk;
+	vdi_copy_opts_t copy_opts;
+	boolean_t skip_top = B_FALSE;
+	int c;
+	int rc;
+
+	bzero(&copy_opts, sizeof (copy_opts));
+	copy_opts.co_nthreads = 1;
+
+	while ((c = getopt(argc, argv, "pvj:")) != -1) {
+		switch (c) {
+		case 'p':
+			copy_opts.co_parsable = B_TRUE;
+			break;
+
+		case 'v':
+			copy_opts.co_progress = B_TRUE;
+			break;
+
+		case 'j':
+			if (vdi_copy_parse_threads(optarg,
+			    &copy_opts.co_nthreads) != 0) {
+				(void) fprintf(stderr, "\n%s: %s\n\n",
+				    gettext("ERROR: Invalid number of threads "
+				    "specified"), optarg);
+				(void) vdi_cmd_print_help(stderr, "index");
+				exit(-1);
+			}
+			break;
+
+		case ':':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Missing argument for option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "index");
+			exit(-1);
+
+		case '?':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Invalid option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "index");
+			exit(-1);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Missing name argument"));
+		(void) vdi_cmd_print_help(stderr, "index");
+		exit(-1);
+	}
+	if (strrchr(argv[0], '@') != NULL) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Must use vdname not snapshot"));
+		(void) vdi_cmd_print_help(stderr, "index");
+		exit(-1);
+	}
+
+	if (vdisk_find_create_storepath(argv[0], vdname, NULL,
+	    extname, &pszformat, 0, &vdh) == -1) {
+		goto fail;
+	}
+
+	/* Alloc handle space */
+	rc = VDCreate(NULL, &pdisk);
+	if (!VBOX_SUCCESS(rc)) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate handle space."));
+		goto fail;
+	}
+	vdh->hdd = pdisk;
+
+	if ((vdisk_load_snapshots(vdh, pszformat, vdname,
+	    VD_OPEN_FLAGS_READONLY)) == -1) {
+		goto fail;
+	}
+
+	/* The index of an image a guest is writing is stale at once */
+	(void) vdisk_get_prop_str(vdh, "rwcnt", &rwcnt_str);
+	if ((rwcnt_str != NULL) && (atoi(rwcnt_str) > 0)) {
+		skip_top = B_TRUE;
+		(void) fprintf(stderr, "%s\n", gettext("Virtual disk is in "
+		    "use; only the images below the top one are indexed."));
+	}
+	free(rwcnt_str);
+
+	rc = vdi_index_build(vdh, pszformat, skip_top, &copy_opts);
+
+	RTStrFree(pszformat);
+	VDDestroy(vdh->hdd);
+	vdisk_free_tree(vdh);
+	return (rc);
+
+fail:
+	if (pszformat)
+		RTStrFree(pszformat);
+	if ((vdh != NULL) && (vdh->hdd != NULL))
+		VDDestroy(vdh->hdd);
+	vdisk_free_tree(vdh);
+	return (-1);
+}
+
+typedef struct vdi_compare_totals_s {
+	int		ct_parsable;
+	uint64_t	ct_bytes[3];	/* by VDI_INDEX_* state */
+} vdi_compare_totals_t;
+
+static const char *vdi_compare_states[] = { "equal", "differ", "unknown" };
+
+static void
+vdi_compare_print(uint64_t off, uint64_t len, int state, void *arg)
+{
+	vdi_compare_totals_t *ct = arg;
+
+	if (ct->ct_parsable)
+		(void) printf("range:%llu:%llu:%s\n",
+		    (unsigned long long)off, (unsigned long long)len,
+		    vdi_compare_states[state]);
+	else
+		(void) printf("%-20llu %-20llu %s\n",
+		    (unsigned long long)off, (unsigned long long)len,
+		    gettext(vdi_compare_states[state]));
+	ct->ct_bytes[state] += len;
+}
+
+/*
+ * Load the index of a virtual disk or one of its snapshots, leaving
+ * *xip NULL with a message if it has none that is up to date.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+static int
+vdi_compare_load(char *name, vdi_index_t **xip)
+{
+	char vdname[MAXPATHLEN];	/* path to virtual disk */
+	char snapname[MAXPATHLEN];	/* snapshot of disk */
+	char extname[MAXPATHLEN];	/* extension type of virtual disk */
+	char snapname_ext[MAXPATHLEN];	/* snapshot with extension */
+	char *pszformat = NULL;		/* VBox's extension type of disk */
+	vd_handle_t *vdh = NULL;
+	PVBOXHDD pdisk;
+	int image, total;
+	int rc;
+
+	*xip = NULL;
+	if (vdisk_find_create_storepath(name, vdname, snapname,
+	    extname, &pszformat, 0, &vdh) == -1) {
+		goto fail;
+	}
+
+	/* Alloc handle space */
+	rc = VDCreate(NULL, &pdisk);
+	if (!VBOX_SUCCESS(rc)) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate handle space."));
+		goto fail;
+	}
+	vdh->hdd = pdisk;
+
+	if ((vdisk_load_snapshots(vdh, pszformat, vdname,
+	    VD_OPEN_FLAGS_READONLY)) == -1) {
+		goto fail;
+	}
+
+	if (snapname[0] == '\0') {
+		image = VDGetCount(vdh->hdd) - 1;
+	} else {
+		copy_add_ext(snapname_ext, snapname, extname);
+		if (vdisk_find_snapshots(vdh, snapname_ext, &image,
+		    &total) == -1) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to find snapshot"), name);
+			goto fail;
+		}
+	}
+
+	if (vdi_index_load(vdh, image, xip) == -1) {
+		*xip = NULL;
+		(void) fprintf(stderr, "%s: \"%s\"\n", (errno == ESTALE) ?
+		    gettext("Index is out of date") :
+		    gettext("No index"), name);
+	}
+
+	RTStrFree(pszformat);
+	VDDestroy(vdh->hdd);
+	vdisk_free_tree(vdh);
+	return (0);
+
+fail:
+	if (pszformat)
+		RTStrFree(pszformat);
+	if ((vdh != NULL) && (vdh->hdd != NULL))
+		VDDestroy(vdh->hdd);
+	vdisk_free_tree(vdh);
+	return (-1);
+}
+
+/*
+ * Compares two virtual disks or snapshots by their content indexes.
+ * -p option: parsable output
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_compare_cmd(int argc, char *argv[])
+{
+	vdi_index_t *a = NULL, *b = NULL;
+	vdi_compare_totals_t ct;
+	int c;
+	int rc = -1;
+
+	bzero(&ct, sizeof (ct));
+
+	while ((c = getopt(argc, argv, "p")) != -1) {
+		switch (c) {
+		case 'p':
+			ct.ct_parsable = 1;
+			break;
+
+		case '?':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Invalid option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "compare");
+			exit(-1);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Missing name argument"));
+		(void) vdi_cmd_print_help(stderr, "compare");
+		exit(-1);
+	}
+
+	if ((vdi_compare_load(argv[0], &a) == -1) ||
+	    (vdi_compare_load(argv[1], &b) == -1))
+		goto out;
+
+	if (!ct.ct_parsable)
+		(void) printf("%-20s %-20s %s\n", gettext("OFFSET"),
+		    gettext("LENGTH"), gettext("STATE"));
+	(void) vdi_index_compare(a, b, vdi_compare_print, &ct);
+	for (c = VDI_INDEX_EQUAL; c <= VDI_INDEX_UNKNOWN; c++) {
+		if (ct.ct_parsable)
+			(void) printf("%s:%llu\n", vdi_compare_states[c],
+			    (unsigned long long)ct.ct_bytes[c]);
+		else
+			(void) printf("%-20s %llu\n",
+			    gettext(vdi_compare_states[c]),
+			    (unsigned long long)ct.ct_bytes[c]);
+	}
+	rc = 0;
+out:
+	vdi_index_free(a);
+	vdi_index_free(b);
+	return (rc);
+}
+
+/*
+ * Makes a virtual disk read the same as another one or a snapshot of
+ * it, writing only the blocks that differ.
+ * -j option: number of threads comparing blocks
+ * -v option: reports progress
+ * -p option: ... in parsable format
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_sync_cmd(int argc, char *argv[])
+{
+	char vdname[MAXPATHLEN];	/* path to source virtual disk */
+	char snapname[MAXPATHLEN];	/* snapshot of source */
+	char extname[MAXPATHLEN];	/* extension type of source */
+	char snapname_ext[MAXPATHLEN];	/* snapshot with extension */
+	char to_vdname[MAXPATHLEN];	/* path to destination */
+	char to_extname[MAXPATHLEN];	/* extension type of destination */
+	char real_from[MAXPATHLEN];
+	char real_to[MAXPATHLEN];
+	char *pszformat = NULL;		/* VBox's extension type of source */
+	char *to_pszformat = NULL;	/* ... of destination */
+	char *rwcnt_str = NULL;
+	vd_handle_t *vdh = NULL;
+	vd_handle_t *to_vdh = NULL;
+	PVBOXHDD pdisk;
+	vdi_copy_opts_t copy_opts;
+	int image, total;
+	int c;
+	int rc;
+
+	bzero(&copy_opts, sizeof (copy_opts));
+	copy_opts.co_nthreads = 1;
+
+	while ((c = getopt(argc, argv, "pvj:")) != -1) {
+		switch (c) {
+		case 'p':
+			copy_opts.co_parsable = B_TRUE;
+			break;
+
+		case 'v':
+			copy_opts.co_progress = B_TRUE;
+			break;
+
+		case 'j':
+			if (vdi_copy_parse_threads(optarg,
+			    &copy_opts.co_nthreads) != 0) {
+				(void) fprintf(stderr, "\n%s: %s\n\n",
+				    gettext("ERROR: Invalid number of threads "
+				    "specified"), optarg);
+				(void) vdi_cmd_print_help(stderr, "sync");
+				exit(-1);
+			}
+			break;
+
+		case ':':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Missing argument for option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "sync");
+			exit(-1);
+
+		case '?':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Invalid option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "sync");
+			exit(-1);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Missing name argument"));
+		(void) vdi_cmd_print_help(stderr, "sync");
+		exit(-1);
+	}
+	if (strrchr(argv[1], '@') != NULL) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Must use vdname not snapshot"));
+		(void) vdi_cmd_print_help(stderr, "sync");
+		exit(-1);
+	}
+
+	/* Source, read-only */
+	if (vdisk_find_create_storepath(argv[0], vdname, snapname,
+	    extname, &pszformat, 0, &vdh) == -1) {
+		goto fail;
+	}
+	rc = VDCreate(NULL, &pdisk);
+	if (!VBOX_SUCCESS(rc)) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate handle space."));
+		goto fail;
+	}
+	vdh->hdd = pdisk;
+	if ((vdisk_load_snapshots(vdh, pszformat, vdname,
+	    VD_OPEN_FLAGS_READONLY)) == -1) {
+		goto fail;
+	}
+	if (snapname[0] == '\0') {
+		/* The guest would change it under us */
+		(void) vdisk_get_prop_str(vdh, "rwcnt", &rwcnt_str);
+		if ((rwcnt_str != NULL) && (atoi(rwcnt_str) > 0)) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Virtual disk is in use; sync a "
+			    "snapshot of it"), argv[0]);
+			free(rwcnt_str);
+			goto fail;
+		}
+		free(rwcnt_str);
+		image = VDGetCount(vdh->hdd) - 1;
+	} else {
+		copy_add_ext(snapname_ext, snapname, extname);
+		if (vdisk_find_snapshots(vdh, snapname_ext, &image,
+		    &total) == -1) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to find snapshot"),
+			    argv[0]);
+			goto fail;
+		}
+	}
+
+	/* Destination, written through its top image */
+	if (vdisk_find_create_storepath(argv[1], to_vdname, NULL,
+	    to_extname, &to_pszformat, 0, &to_vdh) == -1) {
+		goto fail;
+	}
+	if ((realpath(vdname, real_from) == NULL) ||
+	    (realpath(to_vdname, real_to) == NULL) ||
+	    (strcmp(real_from, real_to) == 0)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Cannot sync a virtual disk into itself"),
+		    argv[1]);
+		goto fail;
+	}
+	if (check_vdisk_in_use(to_vdh, argv[1]))
+		goto fail;
+	rc = VDCreate(NULL, &pdisk);
+	if (!VBOX_SUCCESS(rc)) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate handle space."));
+		goto fail;
+	}
+	to_vdh->hdd = pdisk;
+	if ((vdisk_load_snapshots(to_vdh, to_pszformat, to_vdname,
+	    0)) == -1) {
+		goto fail;
+	}
+
+	if (VDGetSize(vdh->hdd, image) !=
+	    VDGetSize(to_vdh->hdd, VDGetCount(to_vdh->hdd) - 1)) {
+		(void) fprintf(stderr, "\n%s: \"%s\" \"%s\"\n\n",
+		    gettext("ERROR: Virtual disks differ in size"),
+		    argv[0], argv[1]);
+		goto fail;
+	}
+
+	rc = vdi_sync(vdh, image, pszformat, to_vdh, to_pszformat,
+	    to_vdname, &copy_opts);
+
+	RTStrFree(pszformat);
+	RTStrFree(to_pszformat);
+	VDDestroy(vdh->hdd);
+	vdisk_free_tree(vdh);
+	VDDestroy(to_vdh->hdd);
+	vdisk_free_tree(to_vdh);
+	return (rc);
+
+fail:
+	if (pszformat)
+		RTStrFree(pszformat);
+	if (to_pszformat)
+		RTStrFree(to_pszformat);
+	if ((vdh != NULL) && (vdh->hdd != NULL))
+		VDDestroy(vdh->hdd);
+	vdisk_free_tree(vdh);
+	if ((to_vdh != NULL) && (to_vdh->hdd != NULL))
+		VDDestroy(to_vdh->hdd);
+	vdisk_free_tree(to_vdh);
+	return (-1);
+}
+
+/*
+ * Compacts the sparse images of a virtual disk in place.
+ * -v option: reports progress and the space reclaimed
+ * -p option: ... in parsable format
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_compact_cmd(int argc, char *argv[])
+{
+	char vdname[MAXPATHLEN];	/* path to virtual disk */
+	char extname[MAXPATHLEN];	/* extension type of virtual disk */
+	char *pszformat = NULL;		/* VBox's extension type of disk */
+	char (*files)[MAXPATHLEN] = NULL;
+	vd_handle_t *vdh = NULL;
+	PVBOXHDD pdisk;
+	vdi_copy_opts_t copy_opts;
+	uint64_t freed, total = 0;
+	int clone_image_number;
+	int nfiles = 0;
+	int first;
+	int i, c;
+	int rc;
+
+	bzero(&copy_opts, sizeof (copy_opts));
+
+	while ((c = getopt(argc, argv, "pv")) != -1) {
+		switch (c) {
+		case 'p':
+			copy_opts.co_parsable = B_TRUE;
+			break;
+
+		case 'v':
+			copy_opts.co_progress = B_TRUE;
+			break;
+
+		case '?':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Invalid option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "compact");
+			exit(-1);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Missing name argument"));
+		(void) vdi_cmd_print_help(stderr, "compact");
+		exit(-1);
+	}
+	if (strrchr(argv[0], '@') != NULL) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Must use vdname not snapshot"));
+		(void) vdi_cmd_print_help(stderr, "compact");
+		exit(-1);
+	}
+
+	if (vdisk_find_create_storepath(argv[0], vdname, NULL,
+	    extname, &pszformat, 0, &vdh) == -1) {
+		goto fail;
+	}
+
+	/* The images are rewritten behind VBox's back */
+	if (check_vdisk_in_use(vdh, argv[0]))
+		goto fail;
+
+	if (strcasecmp(pszformat, "vdi") != 0) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Only vdi images can be compacted in "
+		    "place; use vdiskadm convert"), argv[0]);
+		goto fail;
+	}
+
+	/* Alloc handle space */
+	rc = VDCreate(NULL, &pdisk);
+	if (!VBOX_SUCCESS(rc)) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate handle space."));
+		goto fail;
+	}
+	vdh->hdd = pdisk;
+
+	if ((vdisk_load_snapshots(vdh, pszformat, vdname,
+	    VD_OPEN_FLAGS_READONLY)) == -1) {
+		goto fail;
+	}
+
+	/*
+	 * Only the vdisk's own images, a linked clone's parent is shared.
+	 * Snapshots linked clones were created from, and those below them,
+	 * are read by the clones, which cache their block maps.
+	 */
+	first = vdh->parent_images;
+	clone_image_number = vdisk_find_cow_clone_image(vdh);
+	if (clone_image_number >= first)
+		first = clone_image_number + 1;
+	nfiles = VDGetCount(vdh->hdd) - first;
+	files = calloc(nfiles, MAXPATHLEN);
+	if (files == NULL) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate memory."));
+		goto fail;
+	}
+	for (i = 0; i < nfiles; i++) {
+		if (!VBOX_SUCCESS(VDGetFilename(vdh->hdd,
+		    first + i, files[i], MAXPATHLEN))) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to get image file name"),
+			    argv[0]);
+			goto fail;
+		}
+	}
+	VDDestroy(vdh->hdd);
+	vdh->hdd = NULL;
+
+	for (i = 0; i < nfiles; i++) {
+		if (vdi_copy_compact(files[i], &freed, &copy_opts) == -1) {
+			/* Fixed images have nothing to reclaim */
+			if (errno == ENOTSUP)
+				continue;
+			(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+			    gettext("ERROR: Unable to compact image"),
+			    files[i], strerror(errno));
+			goto fail;
+		}
+		total += freed;
+	}
+
+	if (copy_opts.co_progress) {
+		if (copy_opts.co_parsable)
+			(void) printf("compacted:%llu\n",
+			    (unsigned long long)total);
+		else
+			(void) fprintf(stderr, "%s %.1f MB\n",
+			    gettext("Reclaimed"),
+			    (double)total / (1024 * 1024));
+	}
+
+	free(files);
+	RTStrFree(pszformat);
+	vdisk_free_tree(vdh);
+	return (0);
+
+fail:
+	free(files);
+	if (pszformat)
+		RTStrFree(pszformat);
+	if ((vdh != NULL) && (vdh->hdd != NULL))
+		VDDestroy(vdh->hdd);
+	vdisk_free_tree(vdh);
+	return (-1);
+}
+
+/*
+ * Starts changed block tracking of a virtual disk.
+ * -b option: bytes covered by one bit of the bitmap
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_cbt_enable_cmd(int argc, char *argv[])
+{
+	char vdname[MAXPATHLEN];	/* path to virtual disk */
+	char extname[MAXPATHLEN];	/* extension type of virtual disk */
+	char *pszformat = NULL;		/* VBox's extension type of disk */
+	char *sectors = NULL;
+	vd_handle_t *vdh = NULL;
+	uint64_t block = VD_CBT_DEF_BLOCK;
+	uint64_t size;
+	int c;
+
+	while ((c = getopt(argc, argv, "b:")) != -1) {
+		switch (c) {
+		case 'b':
+			if ((zfs_nicestrtonum(optarg, &block) != 0) ||
+			    (block < 512) || (block > VDI_CBT_MAX_BLOCK) ||
+			    ((block % 512) != 0)) {
+				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+				    gettext("ERROR: Invalid block size"),
+				    optarg);
+				(void) vdi_cmd_print_help(stderr,
+				    "cbt-enable");
+				exit(-1);
+			}
+			break;
+
+		case '?':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Invalid option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "cbt-enable");
+			exit(-1);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Missing name argument"));
+		(void) vdi_cmd_print_help(stderr, "cbt-enable");
+		exit(-1);
+	}
+	if (strrchr(argv[0], '@') != NULL) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Must use vdname not snapshot"));
+		(void) vdi_cmd_print_help(stderr, "cbt-enable");
+		exit(-1);
+	}
+
+	if (vdisk_find_create_storepath(argv[0], vdname, NULL,
+	    extname, &pszformat, 0, &vdh) == -1) {
+		goto fail;
+	}
+
+	/* A running guest wouldn't pick up the bitmap */
+	if (check_vdisk_in_use(vdh, argv[0]))
+		goto fail;
+
+	if ((vdisk_get_prop_str(vdh, "sectors", &sectors) == -1) ||
+	    ((size = strtoull(sectors, NULL, 10) * 512) == 0)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to get size of virtual disk"),
+		    argv[0]);
+		goto fail;
+	}
+
+	if (vdisk_cbt_enable(vdname, size, (uint32_t)block) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+		    gettext("ERROR: Unable to enable changed block "
+		    "tracking"), argv[0], strerror(errno));
+		goto fail;
+	}
+
+	free(sectors);
+	RTStrFree(pszformat);
+	vdisk_free_tree(vdh);
+	return (0);
+
+fail:
+	free(sectors);
+	if (pszformat)
+		RTStrFree(pszformat);
+	vdisk_free_tree(vdh);
+	return (-1);
+}
+
+/*
+ * Stops changed block tracking of a virtual disk, removing its bitmaps.
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_cbt_disable_cmd(int argc, char *argv[])
+{
+	char vdname[MAXPATHLEN];	/* path to virtual disk */
+	char extname[MAXPATHLEN];	/* extension type of virtual disk */
+	char *pszformat = NULL;		/* VBox's extension type of disk */
+	vd_handle_t *vdh = NULL;
+
+	if (argc != 2) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Missing name argument"));
+		(void) vdi_cmd_print_help(stderr, "cbt-disable");
+		exit(-1);
+	}
+	if (strrchr(argv[1], '@') != NULL) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Must use vdname not snapshot"));
+		(void) vdi_cmd_print_help(stderr, "cbt-disable");
+		exit(-1);
+	}
+
+	if (vdisk_find_create_storepath(argv[1], vdname, NULL,
+	    extname, &pszformat, 0, &vdh) == -1) {
+		goto fail;
+	}
+
+	if (check_vdisk_in_use(vdh, argv[1]))
+		goto fail;
+
+	if (vdisk_cbt_disable(vdname) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+		    gettext("ERROR: Unable to disable changed block "
+		    "tracking"), argv[1], strerror(errno));
+		goto fail;
+	}
+
+	RTStrFree(pszformat);
+	vdisk_free_tree(vdh);
+	return (0);
+
+fail:
+	if (pszformat)
+		RTStrFree(pszformat);
+	vdisk_free_tree(vdh);
+	return (-1);
+}
+
+/*
+ * Lists the ranges of a virtual disk written since a snapshot or since
+ * a generation of its changed block bitmap started.
+ * -p option: parsable output
+ * -g option: generation to start at
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_changes_cmd(int argc, char *argv[])
+{
+	char vdname[MAXPATHLEN];	/* path to virtual disk */
+	char snapname[MAXPATHLEN];	/* snapshot of disk */
+	char extname[MAXPATHLEN];	/* extension type of virtual disk */
+	char *pszformat = NULL;		/* VBox's extension type of disk */
+	vd_handle_t *vdh = NULL;
+	vd_extent_t *extents = NULL;
+	char *snap = NULL;
+	char *end;
+	uint64_t gen = 0, cur, total = 0;
+	int parsable = 0;
+	int nextents, i, c;
+
+	while ((c = getopt(argc, argv, "pg:")) != -1) {
+		switch (c) {
+		case 'p':
+			parsable = 1;
+			break;
+
+		case 'g':
+			errno = 0;
+			gen = strtoull(optarg, &end, 10);
+			if ((errno != 0) || (end == optarg) ||
+			    (*end != '\0') || (gen == 0)) {
+				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+				    gettext("ERROR: Invalid generation"),
+				    optarg);
+				(void) vdi_cmd_print_help(stderr, "changes");
+				exit(-1);
+			}
+			break;
+
+		case '?':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Invalid option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "changes");
+			exit(-1);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Missing name argument"));
+		(void) vdi_cmd_print_help(stderr, "changes");
+		exit(-1);
+	}
+
+	if (vdisk_find_create_storepath(argv[0], vdname, snapname,
+	    extname, &pszformat, 0, &vdh) == -1) {
+		goto fail;
+	}
+	if (snapname[0] != '\0') {
+		snap = strrchr(argv[0], '@') + 1;
+		if (gen != 0) {
+			(void) fprintf(stderr, "\n%s\n\n",
+			    gettext("ERROR: -g can't be used with a "
+			    "snapshot"));
+			goto fail;
+		}
+	}
+
+	if (vdisk_cbt_get_changes(vdname, snap, &gen, &cur, &extents,
+	    &nextents) == -1) {
+		if (errno == ENOENT)
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Changes aren't tracked since"),
+			    argv[0]);
+		else
+			(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+			    gettext("ERROR: Unable to read changed block "
+			    "bitmap"), argv[0], strerror(errno));
+		goto fail;
+	}
+
+	if (parsable) {
+		(void) printf("generation:%llu\n", (unsigned long long)gen);
+		(void) printf("current:%llu\n", (unsigned long long)cur);
+	} else {
+		(void) printf("%s %llu (%s %llu)\n", gettext("GENERATION"),
+		    (unsigned long long)gen, gettext("current"),
+		    (unsigned long long)cur);
+		(void) printf("%-20s %s\n", gettext("OFFSET"),
+		    gettext("LENGTH"));
+	}
+	for (i = 0; i < nextents; i++) {
+		if (parsable)
+			(void) printf("extent:%llu:%llu\n",
+			    (unsigned long long)extents[i].ve_offset,
+			    (unsigned long long)extents[i].ve_length);
+		else
+			(void) printf("%-20llu %llu\n",
+			    (unsigned long long)extents[i].ve_offset,
+			    (unsigned long long)extents[i].ve_length);
+		total += extents[i].ve_length;
+	}
+	if (parsable)
+		(void) printf("total:%llu\n", (unsigned long long)total);
+	else
+		(void) printf("%-20s %llu\n", gettext("TOTAL"),
+		    (unsigned long long)total);
+
+	vdisk_free_allocation(extents);
+	RTStrFree(pszformat);
+	vdisk_free_tree(vdh);
+	return (0);
+
+fail:
+	if (pszformat)
+		RTStrFree(pszformat);
+	vdisk_free_tree(vdh);
+	return (-1);
+}
+
+/*
+ * Parse the -t option of the commands taking the lock of a store.
+ *
+ * Returns:
+ *	timeout in seconds, exits on an invalid one
+ */
+static int
+vdi_lock_timeout(const char *arg, char *cmd)
+{
+	char *end;
+	long timeout;
+
+	errno = 0;
+	timeout = strtol(arg, &end, 10);
+	if ((errno != 0) || (end == arg) || (*end != '\0') ||
+	    (timeout < -1) || (timeout > INT_MAX)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Invalid timeout"), arg);
+		(void) vdi_cmd_print_help(stderr, cmd);
+		exit(-1);
+	}
+	return ((int)timeout);
+}
+
+/*
+ * Take the lock of a store, reporting how long it took if another
+ * command held it.
+ *
+ * Returns:
+ *	lock file descriptor: success
+ *	-1: on failure
+ */
+static int
+vdi_lock(char *vdname, int timeout)
+{
+	return (vdi_lock_flags(vdname, 0, timeout));
+}
+
+/*
+ * Take the lock of a store with vdisk_lock_wait() flags, VD_LOCK_SHARED
+ * for a command that only reads the store and its images.  See
+ * vdi_lock().
+ *
+ * Returns:
+ *	lock file descriptor: success
+ *	-1: on failure
+ */
+static int
+vdi_lock_flags(char *vdname, int flags, int timeout)
+{
+	hrtime_t waited;
+	int lockfd;
+
+	lockfd = vdisk_lock_wait(vdname, flags, timeout, &waited);
+	if ((lockfd != -1) && (waited >= NANOSEC / 1000)) {
+		(void) fprintf(stderr, "%s \"%s\": %.3f s\n",
+		    gettext("Waited for lock of"), vdname,
+		    (double)waited / NANOSEC);
+	}
+	return (lockfd);
+}
+
+/*
+ * Increment the reference count of a virtual disk.
+ * -w option: increment the write count (default if no option given)
+ * -r option: increment the reader count
+ * -t option: seconds to wait for the lock
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_refinc_cmd(int argc, char *argv[])
+{
+	int rwcnt;
+	int rocnt;
+	char vdname[MAXPATHLEN];	/* path to virtual disk */
+	char extname[MAXPATHLEN];	/* extension type of virtual disk */
+	char *pszformat = NULL;		/* VBox's extension type of disk */
+	int lockfd = -1;
+	vd_handle_t *vdh = NULL;
+	int c;
+	int reader_flag = 0;
+	int timeout = VD_LOCK_TIMEOUT;
+	int ret = 0;
+
+	while ((c = getopt(argc, argv, "wrt:")) != -1) {
+		switch (c) {
+		case 'w':
+			break;
+
+		case 'r':
+			reader_flag = 1;
+			break;
+
+		case 't':
+			timeout = vdi_lock_timeout(optarg, "ref-inc");
+			break;
+
+		case '?':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Invalid option"),
+			    optopt);
+			exit(-1);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Missing name argument"));
+		(void) vdi_cmd_print_help(stderr, "refinc");
+		exit(-1);
+	}
+
+	if (vdisk_find_create_storepath(argv[0], vdname, NULL,
+	    extname, &pszformat, 0, &vdh) == -1) {
+		ret = -1;
+		goto fail;
+	}
+
+	if ((lockfd = vdi_lock(vdname, timeout)) == -1) {
+		ret = -1;
+		goto fail;
+	}
+
+	if (vdisk_read_tree(&vdh, vdname) == -1) {
+		ret = -1;
+		goto fail;
+	}
+
+	if (vdisk_get_prop_val(vdh, "rwcnt", &rwcnt) == -1) {
+		ret = -1;
+		goto fail;
+	}
+	if (vdisk_get_prop_val(vdh, "rocnt", &rocnt) == -1) {
+		ret = -1;
+		goto fail;
+	}
+	if (reader_flag) {
+		/* rwcnt must be 0 to grab reader lock */
+		if (rwcnt != 0) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n",
+			    gettext("ERROR: unable to grab reader lock"),
+			    argv[0]);
+			ret = -1;
+			goto fail;
+		}
+		rocnt++;
+		if (vdisk_set_prop_val(vdh, "rocnt", rocnt,
+		    VD_PROP_NORMAL) == -1) {
+			ret = -1;
+			goto fail;
+		}
+	} else {
+		/* To grab writer lock both rocnt and rwcnt should be 0 */
+		if ((rwcnt != 0) || (rocnt != 0)) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n",
+			    gettext("ERROR: unable to grab writer lock"),
+			    argv[0]);
+			ret = -1;
+			goto fail;
+		}
+		rwcnt++;
+		if (vdisk_set_prop_val(vdh, "rwcnt", rwcnt,
+		    VD_PROP_NORMAL) == -1) {
+			ret = -1;
+			goto fail;
+		}
+	}
+	(void) vdisk_write_tree(vdh, vdname);
+
+fail:
+	if (pszformat)
+		RTStrFree(pszformat);
+	vdisk_free_tree(vdh);
+	if (lockfd != -1) {
+		if (vdisk_unlock(lockfd, vdname) == -1) {
+			ret = -1;
+		}
+	}
+	return (ret);
+}
+
+/*
+ * Decrement the reference count of a virtual disk.
+ * Descrement either the reader or writer count whichever one is
+ * non-zero.
+ * -t option: seconds to wait for the lock
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_refdec_cmd(int argc, char *argv[])
+{
+	int refcnt;
+	char reftype_str[MAXPATHLEN];
+	char vdname[MAXPATHLEN];	/* path to virtual disk */
+	char extname[MAXPATHLEN];	/* extension type of virtual disk */
+	char *pszformat = NULL;		/* VBox's extension type of disk */
+	int lockfd = -1;
+	vd_handle_t *vdh = NULL;
+	int timeout = VD_LOCK_TIMEOUT;
+	int c;
+	int ret = 0;
+
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			timeout = vdi_lock_timeout(optarg, "ref-dec");
+			break;
+
+		case '?':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Invalid option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "ref-dec");
+			exit(-1);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Missing name argument"));
+		(void) vdi_cmd_print_help(stderr, "refdec");
+		exit(-1);
+	}
+
+	if (vdisk_find_create_storepath(argv[0], vdname, NULL,
+	    extname, &pszformat, 0, &vdh) == -1) {
+		ret = -1;
+		goto fail;
+	}
+
+	if ((lockfd = vdi_lock(vdname, timeout)) == -1) {
+		ret = -1;
+		goto fail;
+	}
+
+	if (vdisk_read_tree(&vdh, vdname) == -1) {
+		ret = -1;
+		goto fail;
+	}
+
+	/*
+	 * rwcnt and rocnt are mutual exclusive (only one of these should be
+	 * non zero). First, see if rwcnt is set to one. If so, we'll decrement
+	 * rwcnt. else we'll try rocnt.
+	 */
+	(void) strlcpy(reftype_str, "rwcnt", MAXPATHLEN);
+	if (vdisk_get_prop_val(vdh, reftype_str, &refcnt) == -1) {
+		ret = -1;
+		goto fail;
+	}
+
+	if (refcnt == 0) {
+		(void) strlcpy(reftype_str, "rocnt", MAXPATHLEN);
+		if (vdisk_get_prop_val(vdh, reftype_str, &refcnt) == -1) {
+			ret = -1;
+			goto fail;
+		}
+	}
+	if (refcnt == 0) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n",
+		    gettext("ERROR: reference counts are already zero"),
+		    argv[0]);
+		ret = -1;
+		goto fail;
+	}
+
+	refcnt--;
+	if (vdisk_set_prop_val(vdh, reftype_str, refcnt, VD_PROP_NORMAL)) {
+		ret = -1;
+		goto fail;
+	}
+	(void) vdisk_write_tree(vdh, vdname);
+
+fail:
+	if (pszformat)
+		RTStrFree(pszformat);
+	vdisk_free_tree(vdh);
+	if (lockfd != -1) {
+		if (vdisk_unlock(lockfd, vdname) == -1) {
+			ret = -1;
+		}
+	}
+	return (ret);
+}
+
+/*
+ * Give up root for the given user, as -u does.
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_switch_user(struct passwd *pw)
+{
+	if (setgroups(0, NULL) != 0) {
+		(void) fprintf(stderr, "\n%s\n",
+		    gettext("unable to clear groups"));
+		return (-1);
+	}
+	if (setregid(pw->pw_gid, pw->pw_gid) != 0) {
+		(void) fprintf(stderr, "\n%s: %d\n",
+		    gettext("unable to switch to gid"), (int)pw->pw_gid);
+		return (-1);
+	}
+	if (setreuid(pw->pw_uid, pw->pw_uid) != 0) {
+		(void) fprintf(stderr, "\n%s: %s\n",
+		    gettext("unable to switch to user"), pw->pw_name);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Does in one process, under one lock and with one parse of the store
+ * what attaching a virtual disk to a domain used to take prop-set owner,
+ * prop-get of readonly, sectors, cdrom and removable, verify and ref-inc
+ * for.  Prints sectors:info:ref, info being the blkif flags of the disk.
+ * A reference that can't be taken is reported as busy, not as a failure,
+ * as the disk is most likely left over from a domain that wasn't shut
+ * down.
+ * -o option: make the given user the owner and check as that user
+ * -w option: take a rw reference (default if no option given)
+ * -r option: take a ro reference and open the disk for reading only
+ * -t option: seconds to wait for the lock
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_attach_info_cmd(int argc, char *argv[])
+{
+	char vdname[MAXPATHLEN];	/* path to virtual disk */
+	char extname[MAXPATHLEN];	/* extension type of virtual disk */
+	char xmlname[MAXPATHLEN];
+	char image_file[MAXPATHLEN];
+	char *pszformat = NULL;		/* VBox's extension type of disk */
+	char *sectors = NULL;
+	char *owner = NULL;
+	struct passwd *pw = NULL;
+	vd_handle_t *vdh = NULL;
+	PVBOXHDD pdisk;
+	int reader_flag = 0;
+	int lockfd = -1;
+	int rwcnt, rocnt;
+	int cdrom = 0, removable = 0, readonly = 0;
+	int timeout = VD_LOCK_TIMEOUT;
+	int info = 0;
+	int busy = 0;
+	int mode;
+	int i, last;
+	int c;
+	int rc;
+	int ret = -1;
+
+	while ((c = getopt(argc, argv, "o:rt:w")) != -1) {
+		switch (c) {
+		case 'o':
+			owner = optarg;
+			break;
+
+		case 't':
+			timeout = vdi_lock_timeout(optarg, "attach-info");
+			break;
+
+		case 'w':
+			break;
+
+		case 'r':
+			reader_flag = 1;
+			break;
+
+		case ':':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Missing argument for option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "attach-info");
+			exit(-1);
+
+		case '?':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Invalid option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "attach-info");
+			exit(-1);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Missing name argument"));
+		(void) vdi_cmd_print_help(stderr, "attach-info");
+		exit(-1);
+	}
+
+	if (owner != NULL) {
+		pw = getpwnam(owner);
+		if (pw == NULL) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: owner invalid"), owner);
+			return (-1);
+		}
+	}
+
+	/* The store is read only once, under the lock ref-inc takes */
+	vdisk_get_vdname(vdname, argv[0], MAXPATHLEN);
+	if ((lockfd = vdi_lock(vdname, timeout)) == -1)
+		return (-1);
+
+	if (vdisk_find_create_storepath(argv[0], vdname, NULL,
+	    extname, &pszformat, 0, &vdh) == -1) {
+		goto fail;
+	}
+
+	(void) vdisk_get_prop_bool(vdh, "readonly", &readonly);
+	(void) vdisk_get_prop_bool(vdh, "cdrom", &cdrom);
+	(void) vdisk_get_prop_bool(vdh, "removable", &removable);
+	if ((readonly == 1) && !reader_flag) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Virtual disk is readonly"), argv[0]);
+		goto fail;
+	}
+	if (vdisk_get_prop_str(vdh, "sectors", &sectors) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Property must exist"), "sectors");
+		goto fail;
+	}
+
+	/* Opening every image is what verify checks */
+	rc = VDCreate(NULL, &pdisk);
+	if (!VBOX_SUCCESS(rc)) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate handle space."));
+		goto fail;
+	}
+	vdh->hdd = pdisk;
+	if ((vdisk_load_snapshots(vdh, pszformat, vdname,
+	    reader_flag ? VD_OPEN_FLAGS_READONLY : 0)) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Virtual disk is invalid or corrupt"),
+		    argv[0]);
+		goto fail;
+	}
+
+	if (pw != NULL) {
+		/*
+		 * Store, images and directory, as prop-set owner does, and
+		 * the lock file the new owner takes for ref-dec.
+		 */
+		vdisk_get_xmlfile(xmlname, vdname, MAXPATHLEN);
+		if ((chown(xmlname, pw->pw_uid, -1) != 0) ||
+		    (!VBOX_SUCCESS(VDSetAttr(vdh->hdd, "SetOwner",
+		    pw->pw_uid))) ||
+		    (chown(vdname, pw->pw_uid, -1) != 0) ||
+		    (fchown(lockfd, pw->pw_uid, -1) != 0)) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to change owner of virtual "
+			    "disk"), argv[0]);
+			goto fail;
+		}
+		if (vdisk_set_prop_str(vdh, "owner", owner,
+		    VD_PROP_NORMAL) == -1) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n",
+			    gettext("ERROR: unable to store owner"), owner);
+			goto fail;
+		}
+
+		/* The rest is checked as the user the domain's disk runs as */
+		if (vdi_switch_user(pw) == -1)
+			goto fail;
+		last = VDGetCount(vdh->hdd) - 1;
+		for (i = 0; i <= last; i++) {
+			mode = ((i == last) && !reader_flag) ?
+			    (R_OK | W_OK) : R_OK;
+			if (!VBOX_SUCCESS(VDGetFilename(vdh->hdd, i,
+			    image_file, MAXPATHLEN)) ||
+			    (access(image_file, mode) != 0)) {
+				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+				    gettext("ERROR: Insufficient permission "
+				    "for virtual disk"), argv[0]);
+				goto fail;
+			}
+		}
+	}
+
+	if (cdrom == 1)
+		info |= 0x1;
+	if (removable == 1)
+		info |= 0x2;
+	if (readonly == 1)
+		info |= 0x4;
+
+	/* Same rules as ref-inc */
+	if ((vdisk_get_prop_val(vdh, "rwcnt", &rwcnt) == -1) ||
+	    (vdisk_get_prop_val(vdh, "rocnt", &rocnt) == -1))
+		goto fail;
+	if (reader_flag) {
+		if (rwcnt != 0)
+			busy = 1;
+		else if (vdisk_set_prop_val(vdh, "rocnt", rocnt + 1,
+		    VD_PROP_NORMAL) == -1)
+			goto fail;
+	} else {
+		if ((rwcnt != 0) || (rocnt != 0))
+			busy = 1;
+		else if (vdisk_set_prop_val(vdh, "rwcnt", rwcnt + 1,
+		    VD_PROP_NORMAL) == -1)
+			goto fail;
+	}
+
+	if (((pw != NULL) || !busy) &&
+	    (vdisk_write_tree(vdh, vdname) == -1)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to update store file"), vdname);
+		goto fail;
+	}
+
+	(void) printf("%s:%d:%s\n", sectors, info, busy ? "busy" : "ok");
+	ret = 0;
+
+fail:
+	if (pszformat)
+		RTStrFree(pszformat);
+	if ((vdh != NULL) && (vdh->hdd != NULL))
+		VDDestroy(vdh->hdd);
+	vdisk_free_tree(vdh);
+	free(sectors);
+	if (vdisk_unlock(lockfd, vdname) == -1)
+		ret = -1;
+	return (ret);
+}
+
+/*
+ * Runs the vdiskadm commands sent over a socket until killed.
+ * -j option: number of commands run at a time
+ * -n option: number of stores kept parsed
+ * -s option: path of the socket
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_serve_cmd(int argc, char *argv[])
+{
+	char *path = VDI_SERVE_SOCKET;
+	int jobs = VDI_SERVE_JOBS;
+	int keep = VDI_SERVE_KEEP;
+	char *end;
+	long val;
+	int cnt;
+	int rc;
+	int c;
+
+	while ((c = getopt(argc, argv, ":j:n:s:")) != -1) {
+		switch (c) {
+		case 'j':
+		case 'n':
+			errno = 0;
+			val = strtol(optarg, &end, 10);
+			if ((errno != 0) || (end == optarg) || (*end != '\0') ||
+			    (val < ((c == 'j') ? 1 : 0)) || (val > INT_MAX)) {
+				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+				    gettext("ERROR: Invalid count"), optarg);
+				(void) vdi_cmd_print_help(stderr, "serve");
+				exit(-1);
+			}
+			if (c == 'j')
+				jobs = (int)val;
+			else
+				keep = (int)val;
+			break;
+
+		case 's':
+			path = optarg;
+			break;
+
+		case ':':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Missing argument for option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "serve");
+			exit(-1);
+
+		case '?':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Invalid option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "serve");
+			exit(-1);
+		}
+	}
+
+	if (argc != optind) {
+		(void) vdi_cmd_print_help(stderr, "serve");
+		exit(-1);
+	}
+
+	/* Load the formats once, for all the commands run */
+	rc = VDBackendInfo(VDI_MAX_BACKENDS, vdi_backend_info, &cnt);
+	if (rc != VINF_SUCCESS) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Unable to load formats"));
+		exit(-1);
+	}
+	vdisk_set_store_keep(keep);
+
+	return (vdi_serve(path, jobs, vdi_run));
+}
+
+/*
+ * Add a user defined property to the tree of a virtual disk.
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_propadd_apply(vd_handle_t *vdh, char *property, char *value)
+{
+	if (vdisk_peek_prop_str(vdh, property) != NULL) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Property already exists"), property);
+		return (-1);
+	}
+
+	if (vdisk_add_prop_str(vdh, property, value) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to add property"), property);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Check that a user defined property may be deleted.
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_propdel_check(char *property)
+{
+	if (strrchr(property, ':') == NULL) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n",
+		    gettext("ERROR: Cannot delete native property"),
+		    property);
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: User property must contain colon"));
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Delete a user defined property from the tree of a virtual disk.
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_propdel_apply(vd_handle_t *vdh, char *property)
+{
+	if (vdisk_del_prop_str(vdh, property) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to delete property"), property);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Check that a property other than owner may be set to a value.
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_propset_check(char *property, char *value)
+{
+	if ((strcmp(property, "creation-time") == 0) ||
+	    (strcmp(property, "modification-time") == 0) ||
+	    (strcmp(property, "modification-time-epoch") == 0) ||
+	    (strcmp(property, "effective-size") == 0)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Property is readonly"), property);
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to set property"), property);
+		return (-1);
+	}
+
+	if ((strcmp(property, "rwcnt") == 0) &&
+	    (strcmp(value, "0") != 0)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Can only set rwcnt to 0"),
+		    property);
+		return (-1);
+	}
+
+	if ((strcmp(property, "rocnt") == 0) &&
+	    (strcmp(value, "0") != 0)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Can only set rocnt to 0"),
+		    property);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Set a property other than owner in the tree of a virtual disk.
+ *	name - name of the virtual disk as given, for messages
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_propset_apply(vd_handle_t *vdh, char *name, char *property, char *value)
+{
+	/* Can't change description on active files */
+	if ((strcmp(property, "description") == 0) &&
+	    (check_vdisk_in_use(vdh, name)))
+		return (-1);
+
+	if (vdisk_peek_prop_str(vdh, property) == NULL) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Property must exist"), property);
+		return (-1);
+	}
+
+	if (vdisk_set_prop_str(vdh, property, value,
+	    VD_PROP_NORMAL) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to set property"), property);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Property change of a batch, see vdi_batch_prop().
+ */
+typedef struct vdi_batch_prop_s {
+	char	*bp_cmd;	/* prop-add, prop-del or prop-set */
+	char	*bp_property;
+	char	*bp_value;	/* NULL for prop-del */
+} vdi_batch_prop_t;
+
+/*
+ * Take a command of a batch apart if it is a property change that can be
+ * made along with the ones next to it: a prop-add, prop-del or prop-set
+ * given as "-p <property>[=<value>] vdname", other than a change of owner,
+ * which also changes the owner of the files.
+ *
+ * Returns:
+ *	0: success, bp is set
+ *	-1: the command is run by itself
+ */
+static int
+vdi_batch_prop(vdi_batch_cmd_t *cmd, vdi_batch_prop_t *bp)
+{
+	char *spec;
+	char *value;
+
+	if ((cmd->bc_argc == 5) && (strcmp(cmd->bc_argv[2], "-p") == 0))
+		spec = cmd->bc_argv[3];
+	else if ((cmd->bc_argc == 4) &&
+	    (strncmp(cmd->bc_argv[2], "-p", 2) == 0) &&
+	    (cmd->bc_argv[2][2] != '\0'))
+		spec = &cmd->bc_argv[2][2];
+	else
+		return (-1);
+
+	bp->bp_cmd = cmd->bc_argv[1];
+	if (strcmp(bp->bp_cmd, "prop-del") == 0) {
+		bp->bp_property = spec;
+		bp->bp_value = NULL;
+		return (0);
+	}
+	if ((strcmp(bp->bp_cmd, "prop-add") != 0) &&
+	    (strcmp(bp->bp_cmd, "prop-set") != 0))
+		return (-1);
+
+	value = strrchr(spec, '=');
+	if ((value == NULL) || ((value - spec == 5) &&
+	    (strncmp(spec, "owner", 5) == 0)))
+		return (-1);
+	*value = '\0';
+	bp->bp_property = spec;
+	bp->bp_value = value + 1;
+	return (0);
+}
+
+/*
+ * Make the property changes of consecutive commands of a batch for the
+ * same virtual disk with one load, lock and write of its store.  Changes
+ * made before one that fails are written.
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure, *donep is the number of changes made
+ */
+static int
+vdi_batch_props(vdi_batch_cmd_t *cmds, vdi_batch_prop_t *props, int cnt,
+    int *donep)
+{
+	char *name = cmds[0].bc_argv[cmds[0].bc_argc - 1];
+	vdi_batch_prop_t *bp;
+	vd_handle_t *vdh = NULL;
+	char *pszformat = NULL;
+	char vdname[MAXPATHLEN];
+	char extname[MAXPATHLEN];
+	PVBOXHDD pdisk;
+	int lockfd;
+	int ret = -1;
+	int rc;
+	int i;
+
+	*donep = 0;
+	vdisk_get_vdname(vdname, name, MAXPATHLEN);
+	if ((lockfd = vdi_lock(vdname, VD_LOCK_TIMEOUT)) == -1)
+		return (-1);
+
+	if (vdisk_find_create_storepath(name, vdname, NULL, extname,
+	    &pszformat, 0, &vdh) == -1)
+		goto fail;
+
+	rc = VDCreate(NULL, &pdisk);
+	if (!VBOX_SUCCESS(rc)) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate handle space."));
+		goto fail;
+	}
+	vdh->hdd = pdisk;
+
+	if ((vdisk_load_snapshots(vdh, pszformat, vdname,
+	    VD_OPEN_FLAGS_READONLY)) == -1)
+		goto fail;
+
+	for (i = 0; i < cnt; i++) {
+		bp = &props[i];
+		if (strcmp(bp->bp_cmd, "prop-add") == 0) {
+			rc = vdi_propadd_apply(vdh, bp->bp_property,
+			    bp->bp_value);
+		} else if (strcmp(bp->bp_cmd, "prop-del") == 0) {
+			rc = vdi_propdel_check(bp->bp_property);
+			if (rc == 0)
+				rc = vdi_propdel_apply(vdh, bp->bp_property);
+		} else {
+			rc = vdi_propset_check(bp->bp_property, bp->bp_value);
+			if (rc == 0)
+				rc = vdi_propset_apply(vdh,
+				    cmds[i].bc_argv[cmds[i].bc_argc - 1],
+				    bp->bp_property, bp->bp_value);
+		}
+		if (rc == -1)
+			break;
+	}
+
+	if ((i > 0) && (vdisk_write_tree(vdh, vdname) == -1)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to update store file"), vdname);
+		goto fail;
+	}
+	*donep = i;
+	if (i == cnt)
+		ret = 0;
+
+fail:
+	if (pszformat)
+		RTStrFree(pszformat);
+	if ((vdh != NULL) && (vdh->hdd != NULL))
+		VDDestroy(vdh->hdd);
+	vdisk_free_tree(vdh);
+	if (vdisk_unlock(lockfd, vdname) == -1)
+		ret = -1;
+	return (ret);
+}
+
+/*
+ * Run the commands of a batch for the same virtual disks, in order, see
+ * vdi_batch().  Runs of property changes are made together; other
+ * commands each run in a process of their own, as they may exit.
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure, *donep is the number of commands that succeeded
+ */
+static int
+vdi_batch_run(vdi_batch_cmd_t *cmds, int ncmds, int *donep)
+{
+	vdi_batch_prop_t *props;
+	int status;
+	pid_t pid;
+	int done;
+	int i;
+	int n;
+
+	*donep = 0;
+	if ((props = calloc(ncmds, sizeof (vdi_batch_prop_t))) == NULL)
+		return (-1);
+
+	for (i = 0; i < ncmds; i += n) {
+		for (n = 0; (i + n < ncmds) &&
+		    (vdi_batch_prop(&cmds[i + n], &props[n]) == 0); n++)
+			;
+		if (n > 0) {
+			status = vdi_batch_props(&cmds[i], props, n, &done);
+			*donep += done;
+			if (status == -1)
+				break;
+			continue;
+		}
+
+		n = 1;
+		(void) fflush(stdout);
+		(void) fflush(stderr);
+		if ((pid = fork()) == -1) {
+			status = -1;
+			break;
+		}
+		if (pid == 0) {
+			optind = 1;
+			exit(vdi_run(cmds[i].bc_argc, cmds[i].bc_argv));
+		}
+		while (waitpid(pid, &status, 0) == -1) {
+			if (errno != EINTR) {
+				status = -1;
+				break;
+			}
+		}
+		if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+			status = -1;
+			break;
+		}
+		status = 0;
+		(*donep)++;
+	}
+
+	free(props);
+	return (status);
+}
+
+/*
+ * Runs a list of vdiskadm commands.
+ * -j option: number of runs of commands for other vdisks run at a time
+ * -k option: run the commands after one that fails
+ *
+ * Returns:
+ *	0: success
+ *	-1: on failure
+ */
+static int
+vdi_batch_cmd(int argc, char *argv[])
+{
+	boolean_t keep_going = B_FALSE;
+	int jobs = VDI_BATCH_JOBS;
+	char *name = "-";
+	FILE *fp = stdin;
+	char *end;
+	long val;
+	int cnt;
+	int rc;
+	int c;
 
-	argc--;
-	argv++;
+	while ((c = getopt(argc, argv, ":j:k")) != -1) {
+		switch (c) {
+		case 'j':
+			errno = 0;
+			val = strtol(optarg, &end, 10);
+			if ((errno != 0) || (end == optarg) || (*end != '\0') ||
+			    (val < 1) || (val > INT_MAX)) {
+				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+				    gettext("ERROR: Invalid count"), optarg);
+				(void) vdi_cmd_print_help(stderr, "batch");
+				exit(-1);
+			}
+			jobs = (int)val;
+			break;
 
-	if (argc < 1) {
-		(void) fprintf(stderr, "\n%s\n\n",
-		    gettext("ERROR: Missing name argument"));
-		(void) vdi_cmd_print_help(stderr, "refdec");
-		exit(-1);
-	}
+		case 'k':
+			keep_going = B_TRUE;
+			break;
 
-	if (vdisk_find_create_storepath(argv[0], vdname, NULL,
-	    extname, &pszformat, 0, &vdh) == -1) {
-		ret = -1;
-		goto fail;
-	}
+		case ':':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Missing argument for option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "batch");
+			exit(-1);
 
-	if ((lockfd = vdisk_lock(vdname)) == -1) {
-		ret = -1;
-		goto fail;
+		case '?':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Invalid option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "batch");
+			exit(-1);
+		}
 	}
 
-	if (vdisk_read_tree(&vdh, vdname) == -1) {
-		ret = -1;
-		goto fail;
-	}
+	argc -= optind;
+	argv += optind;
 
-	/*
-	 * rwcnt and rocnt are mutual exclusive (only one of these should be
-	 * non zero). First, see if rwcnt is set to one. If so, we'll decrement
-	 * rwcnt. else we'll try rocnt.
-	 */
-	(void) strlcpy(reftype_str, "rwcnt", MAXPATHLEN);
-	if (vdisk_get_prop_val(vdh, reftype_str, &refcnt) == -1) {
-		ret = -1;
-		goto fail;
+	if (argc > 1) {
+		(void) vdi_cmd_print_help(stderr, "batch");
+		exit(-1);
 	}
-
-	if (refcnt == 0) {
-		(void) strlcpy(reftype_str, "rocnt", MAXPATHLEN);
-		if (vdisk_get_prop_val(vdh, reftype_str, &refcnt) == -1) {
-			ret = -1;
-			goto fail;
+	if ((argc == 1) && (strcmp(argv[0], "-") != 0)) {
+		name = argv[0];
+		if ((fp = fopen(name, "r")) == NULL) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to open batch"), name);
+			return (-1);
 		}
 	}
-	if (refcnt == 0) {
-		(void) fprintf(stderr, "\n%s: \"%s\"\n",
-		    gettext("ERROR: reference counts are already zero"),
-		    argv[0]);
-		ret = -1;
-		goto fail;
-	}
 
-	refcnt--;
-	if (vdisk_set_prop_val(vdh, reftype_str, refcnt, VD_PROP_NORMAL)) {
-		ret = -1;
-		goto fail;
+	/* Load the formats once, for all the commands run */
+	rc = VDBackendInfo(VDI_MAX_BACKENDS, vdi_backend_info, &cnt);
+	if (rc != VINF_SUCCESS) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Unable to load formats"));
+		exit(-1);
 	}
-	(void) vdisk_write_tree(vdh, vdname);
 
-fail:
-	if (pszformat)
-		RTStrFree(pszformat);
-	vdisk_free_tree(vdh);
-	if (lockfd != -1) {
-		if (vdisk_unlock(lockfd, vdname) == -1) {
-			ret = -1;
-		}
-	}
-	return (ret);
+	rc = vdi_batch(fp, name, jobs, keep_going, vdi_batch_run);
+	if (fp != stdin)
+		(void) fclose(fp);
+	return (rc);
 }
 
 /*
@@ -3283,8 +6759,8 @@ vdi_propadd_cmd(int argc, char *argv[])
 	char extname[MAXPATHLEN];
 	int rc;
 	char *value = NULL;
-	char *tst_value = NULL;
 	PVBOXHDD pdisk;
+	int lockfd;
 
 	/* option defaults */
 	property = NULL;
@@ -3326,6 +6802,11 @@ vdi_propadd_cmd(int argc, char *argv[])
 		return (-1);
 	}
 
+	/* The store is read, changed and written under its lock */
+	vdisk_get_vdname(vdname, argv[0], MAXPATHLEN);
+	if ((lockfd = vdi_lock(vdname, VD_LOCK_TIMEOUT)) == -1)
+		return (-1);
+
 	if (vdisk_find_create_storepath(argv[0], vdname, NULL, extname,
 	    &pszformat, 0, &vdh) == -1) {
 		goto fail;
@@ -3348,17 +6829,8 @@ vdi_propadd_cmd(int argc, char *argv[])
 	RTStrFree(pszformat);
 	pszformat = NULL;
 
-	if (vdisk_get_prop_str(vdh, property, &tst_value) != -1) {
-		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-		    gettext("ERROR: Property already exists"), property);
-		goto fail;
-	}
-
-	if (vdisk_add_prop_str(vdh, property, value) == -1) {
-		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-		    gettext("ERROR: Unable to add property"), property);
+	if (vdi_propadd_apply(vdh, property, value) == -1)
 		goto fail;
-	}
 
 	if (vdisk_write_tree(vdh, vdname) == -1) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
@@ -3366,21 +6838,18 @@ vdi_propadd_cmd(int argc, char *argv[])
 		goto fail;
 	}
 
-	if (tst_value)
-		free(tst_value);
 	VDDestroy(vdh->hdd);
 	vdisk_free_tree(vdh);
 
-	return (0);
+	return (vdisk_unlock(lockfd, vdname));
 
 fail:
 	if (pszformat)
 		RTStrFree(pszformat);
 	if ((vdh != NULL) && (vdh->hdd != NULL))
 		VDDestroy(vdh->hdd);
-	if (tst_value)
-		free(tst_value);
 	vdisk_free_tree(vdh);
+	(void) vdisk_unlock(lockfd, vdname);
 	return (-1);
 }
 
@@ -3404,6 +6873,7 @@ vdi_propdel_cmd(int argc, char *argv[])
 	char extname[MAXPATHLEN];
 	int rc;
 	PVBOXHDD pdisk;
+	int lockfd;
 
 	/* option defaults */
 	property = NULL;
@@ -3438,14 +6908,13 @@ vdi_propdel_cmd(int argc, char *argv[])
 		return (-1);
 	}
 
-	if (strrchr(property, ':') == NULL) {
-		(void) fprintf(stderr, "\n%s: \"%s\"\n",
-		    gettext("ERROR: Cannot delete native property"),
-		    property);
-		(void) fprintf(stderr, "\n%s\n\n",
-		    gettext("ERROR: User property must contain colon"));
-		goto fail;
-	}
+	if (vdi_propdel_check(property) == -1)
+		return (-1);
+
+	/* The store is read, changed and written under its lock */
+	vdisk_get_vdname(vdname, argv[0], MAXPATHLEN);
+	if ((lockfd = vdi_lock(vdname, VD_LOCK_TIMEOUT)) == -1)
+		return (-1);
 
 	if (vdisk_find_create_storepath(argv[0], vdname, NULL, extname,
 	    &pszformat, 0, &vdh) == -1) {
@@ -3469,11 +6938,8 @@ vdi_propdel_cmd(int argc, char *argv[])
 	RTStrFree(pszformat);
 	pszformat = NULL;
 
-	if (vdisk_del_prop_str(vdh, property) == -1) {
-		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-		    gettext("ERROR: Unable to delete property"), property);
+	if (vdi_propdel_apply(vdh, property) == -1)
 		goto fail;
-	}
 	if (vdisk_write_tree(vdh, vdname) == -1) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 		    gettext("ERROR: Unable to update store file"), vdname);
@@ -3483,7 +6949,7 @@ vdi_propdel_cmd(int argc, char *argv[])
 	VDDestroy(vdh->hdd);
 	vdisk_free_tree(vdh);
 
-	return (0);
+	return (vdisk_unlock(lockfd, vdname));
 
 fail:
 	if (pszformat)
@@ -3491,6 +6957,7 @@ fail:
 	if ((vdh != NULL) && (vdh->hdd != NULL))
 		VDDestroy(vdh->hdd);
 	vdisk_free_tree(vdh);
+	(void) vdisk_unlock(lockfd, vdname);
 	return (-1);
 }
 
@@ -3521,6 +6988,7 @@ vdi_propget_cmd(int argc, char *argv[])
 	char *val_str = NULL;
 	char *create_time;
 	time_t cr_time;
+	int lockfd;
 
 	/* option defaults */
 	property = NULL;
@@ -3559,6 +7027,15 @@ vdi_propget_cmd(int argc, char *argv[])
 		return (-1);
 	}
 
+	/* Only reads the store */
+	vdisk_set_store_flags(VD_STORE_CACHED);
+
+	/* Images can't be replaced while they are looked at */
+	vdisk_get_vdname(vdname, argv[0], MAXPATHLEN);
+	lockfd = vdi_lock_flags(vdname, VD_LOCK_SHARED, VD_LOCK_TIMEOUT);
+	if (lockfd == -1)
+		return (-1);
+
 	if (vdisk_find_create_storepath(argv[0], vdname, NULL, extname,
 	    &pszformat, 0, &vdh) == -1) {
 		goto fail;
@@ -3615,6 +7092,10 @@ vdi_propget_cmd(int argc, char *argv[])
 		goto fail;
 	}
 
+	/* Everything else comes from the store already read */
+	(void) vdisk_unlock(lockfd, vdname);
+	lockfd = -1;
+
 	if (vdisk_get_prop_str(vdh, "creation-time-epoch", &create_time) == -1)
 		goto fail;
 	cr_time = (time_t)atoi((char *)create_time);
@@ -3743,6 +7224,8 @@ fail:
 	if (val_str)
 		free(val_str);
 	vdisk_free_tree(vdh);
+	if (lockfd != -1)
+		(void) vdisk_unlock(lockfd, vdname);
 	return (-1);
 }
 
@@ -3773,7 +7256,7 @@ vdi_propset_cmd(int argc, char *argv[])
 	vd_handle_t *vdh = NULL;
 	PVBOXHDD pdisk;
 	char *vtype;
-	char *tst_value = NULL;
+	int lockfd;
 
 	property = NULL;
 	value = NULL;
@@ -3819,45 +7302,21 @@ vdi_propset_cmd(int argc, char *argv[])
 		return (-1);
 	}
 
+	/* The store is read, changed and written under its lock */
+	vdisk_get_vdname(vdname, argv[0], MAXPATHLEN);
+	if ((lockfd = vdi_lock(vdname, VD_LOCK_TIMEOUT)) == -1)
+		return (-1);
+
 	/* 'owner' is handled differently since it must chown the files */
 	if (strcmp(property, "owner") != 0) {
-		if ((strcmp(property, "creation-time") == 0) ||
-		    (strcmp(property, "modification-time") == 0) ||
-		    (strcmp(property, "modification-time-epoch") == 0) ||
-		    (strcmp(property, "effective-size") == 0)) {
-			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-			    gettext("ERROR: Property is readonly"), property);
-			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-			    gettext("ERROR: Unable to set property"), property);
-			goto fail;
-		}
-
-		if ((strcmp(property, "rwcnt") == 0) &&
-		    (strcmp(value, "0") != 0)) {
-			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-			    gettext("ERROR: Can only set rwcnt to 0"),
-			    property);
+		if (vdi_propset_check(property, value) == -1)
 			goto fail;
-		}
-
-		if ((strcmp(property, "rocnt") == 0) &&
-		    (strcmp(value, "0") != 0)) {
-			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-			    gettext("ERROR: Can only set rocnt to 0"),
-			    property);
-			goto fail;
-		}
 
 		if (vdisk_find_create_storepath(argv[0], vdname, NULL,
 		    extname, &pszformat, 0, &vdh) == -1) {
 			goto fail;
 		}
 
-		/* Can't change description on active files */
-		if ((strcmp(property, "description") == 0) &&
-		    (check_vdisk_in_use(vdh, argv[0])))
-			goto fail;
-
 		/* allocate disk handle */
 		rc = VDCreate(NULL, &pdisk);
 		if (!VBOX_SUCCESS(rc)) {
@@ -3876,19 +7335,8 @@ vdi_propset_cmd(int argc, char *argv[])
 		RTStrFree(pszformat);
 		pszformat = NULL;
 
-		if (vdisk_get_prop_str(vdh, property, &tst_value) == -1) {
-			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-			    gettext("ERROR: Property must exist"), property);
-			goto fail;
-		}
-		free(tst_value);
-
-		if (vdisk_set_prop_str(vdh, property, value,
-		    VD_PROP_NORMAL) == -1) {
-			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-			    gettext("ERROR: Unable to set property"), property);
+		if (vdi_propset_apply(vdh, argv[0], property, value) == -1)
 			goto fail;
-		}
 
 		if (vdisk_write_tree(vdh, vdname) == -1) {
 			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
@@ -3900,7 +7348,7 @@ vdi_propset_cmd(int argc, char *argv[])
 		VDDestroy(vdh->hdd);
 		vdisk_free_tree(vdh);
 
-		return (0);
+		return (vdisk_unlock(lockfd, vdname));
 	}
 
 	/* Handle owner property */
@@ -3908,10 +7356,9 @@ vdi_propset_cmd(int argc, char *argv[])
 	if (pw == NULL) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 		    gettext("ERROR: owner invalid"), value);
-		return (-1);
+		goto fail;
 	}
 
-	vdisk_get_vdname(vdname, argv[0], MAXPATHLEN);
 	vdisk_get_xmlfile(xmlname, vdname, MAXPATHLEN);
 
 	/* Check owner of store file and chown if necessary */
@@ -4040,7 +7487,7 @@ vdi_propset_cmd(int argc, char *argv[])
 	/* Close all and free hdd */
 	VDDestroy(vdh->hdd);
 	vdisk_free_tree(vdh);
-	return (0);
+	return (vdisk_unlock(lockfd, vdname));
 
 fail:
 	if ((vdh != NULL) && (vdh->hdd != NULL))
@@ -4048,13 +7495,14 @@ fail:
 	vdisk_free_tree(vdh);
 	if (pszformat)
 		RTStrFree(pszformat);
-	if (tst_value)
-		free(tst_value);
+	(void) vdisk_unlock(lockfd, vdname);
 	return (-1);
 }
 
 /*
  * Move a virtual disk to a different directory.
+ * -v option: report progress when the files have to be copied
+ * -p option: reports progress in parsable format
  *
  * Returns:
  *	0: success
@@ -4067,20 +7515,49 @@ vdi_move_cmd(int argc, char *argv[])
 	char extname[MAXPATHLEN];	/* extension type of virtual disk */
 	char checkname[MAXPATHLEN];	/* path to check for existing vdisk */
 	char *pszformat = NULL;		/* VBox's extension type of disk */
+	char real_vdname[MAXPATHLEN];	/* full path to virtual disk */
+	char real_newname[MAXPATHLEN];	/* full path to moved virtual disk */
 	vd_handle_t *vdh = NULL;
 	int rc;
 	PVBOXHDD pdisk;
 	char *at;
+	char *slash;
 	struct stat64 stat64buf;
+	int c;
+	vdi_copy_opts_t copy_opts;
 
-	if (argc < 3) {
+	bzero(&copy_opts, sizeof (copy_opts));
+
+	while ((c = getopt(argc, argv, "pv")) != -1) {
+		switch (c) {
+		case 'p':
+			copy_opts.co_parsable = B_TRUE;
+			break;
+
+		case 'v':
+			copy_opts.co_progress = B_TRUE;
+			break;
+
+		case '?':
+			(void) fprintf(stderr, "\n%s: %c\n\n",
+			    gettext("ERROR: Invalid option"),
+			    optopt);
+			(void) vdi_cmd_print_help(stderr, "move");
+			exit(-1);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 2) {
 		(void) fprintf(stderr, "\n%s\n\n",
 		    gettext("ERROR: Missing name or path argument"));
 		(void) vdi_cmd_print_help(stderr, "move");
 		exit(-1);
 	}
 
-	at = strrchr(argv[1], '@');
+	at = strrchr(argv[0], '@');
 	if (at) {
 		(void) fprintf(stderr, "\n%s\n\n",
 		    gettext("ERROR: Must use vdname not snapshot"));
@@ -4089,22 +7566,22 @@ vdi_move_cmd(int argc, char *argv[])
 	}
 
 	/* Fail if dest dir is already a vdisk */
-	(void) strlcpy(checkname, argv[2], MAXPATHLEN);
+	(void) strlcpy(checkname, argv[1], MAXPATHLEN);
 	(void) strlcat(checkname, "/vdisk.xml", MAXPATHLEN);
 	rc = stat64(checkname, &stat64buf);
 	if (rc != -1) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 		    gettext("ERROR: Directory cannot be a virtual disk"),
-		    argv[2]);
+		    argv[1]);
 		exit(-1);
 	}
 
-	if (vdisk_find_create_storepath(argv[1], vdname, NULL,
+	if (vdisk_find_create_storepath(argv[0], vdname, NULL,
 	    extname, &pszformat, 0, &vdh) == -1) {
 		goto fail;
 	}
 
-	if (check_vdisk_in_use(vdh, argv[1]))
+	if (check_vdisk_in_use(vdh, argv[0]))
 		goto fail;
 
 
@@ -4121,8 +7598,33 @@ vdi_move_cmd(int argc, char *argv[])
 		goto fail;
 	}
 
-	if ((vdisk_move_snapshots(vdh, pszformat, vdname, argv[2]))
-	    == -1) {
+	/* Linked clones refer to their parent by path */
+	if (vdisk_find_cow_clone_image(vdh) != -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Cannot move virtual disk; linked clones "
+		    "depend on it"), argv[0]);
+		goto fail;
+	}
+	if (realpath(vdname, real_vdname) == NULL) {
+		(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+		    gettext("ERROR: Unable to resolve path of virtual disk"),
+		    argv[0], strerror(errno));
+		goto fail;
+	}
+
+	if ((vdi_copy_move_vdisk(vdh, pszformat, vdname, argv[1],
+	    &copy_opts)) == -1) {
+		goto fail;
+	}
+
+	/* Tell the parent of a linked clone where the clone went */
+	slash = strrchr(real_vdname, '/');
+	(void) snprintf(checkname, MAXPATHLEN, "%s%s", argv[1], slash);
+	if ((realpath(checkname, real_newname) == NULL) ||
+	    (vdisk_update_cow_clone(vdh, real_vdname, real_newname) == -1)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to update parent of linked clone"),
+		    checkname);
 		goto fail;
 	}
 
@@ -4174,8 +7676,12 @@ vdi_rename_cmd(int argc, char *argv[])
 	char *snap_loc;
 	char extname[MAXPATHLEN];	/* extension type of virtual disk */
 	char *pszformat = NULL;		/* VBox's extension type of disk */
+	char real_oldname[MAXPATHLEN];	/* full path to virtual disk */
+	char real_newname[MAXPATHLEN];	/* full path to renamed disk */
 	unsigned int open_flags, open_flags_child;
 	unsigned int uimageflags;
+	char vdname_lock[MAXPATHLEN];	/* virtual disk whose store is locked */
+	int lockfd;
 
 	if (argc < 3) {
 		(void) fprintf(stderr, "\n%s\n\n",
@@ -4184,6 +7690,11 @@ vdi_rename_cmd(int argc, char *argv[])
 		return (-1);
 	}
 
+	/* The store is read, changed and written under its lock */
+	vdisk_get_vdname(vdname_lock, argv[1], MAXPATHLEN);
+	if ((lockfd = vdi_lock(vdname_lock, VD_LOCK_TIMEOUT)) == -1)
+		return (-1);
+
 	/* verify that old path and new path have same ancestry */
 	(void) strlcpy(vdname_old, argv[1], MAXPATHLEN);
 	(void) strlcpy(vdname_new, argv[2], MAXPATHLEN);
@@ -4322,6 +7833,15 @@ vdi_rename_cmd(int argc, char *argv[])
 			goto fail;
 		}
 
+		/* Linked clones refer to their snapshot by name */
+		if (mv_image_number <= vdisk_find_cow_clone_image(vdh)) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Cannot rename snapshot; linked "
+			    "clones depend on it"), argv[1]);
+			ret = -1;
+			goto fail;
+		}
+
 		/* Switch snapshot being renamed to read/write mode */
 		rc = VDGetOpenFlags(vdh->hdd, mv_image_number, &open_flags);
 		if (!(VBOX_SUCCESS(rc))) {
@@ -4435,13 +7955,25 @@ vdi_rename_cmd(int argc, char *argv[])
 			goto fail;
 		}
 
+		/* The index doesn't follow the image to its new name */
+		(void) strlcat(oldsnapname_ext, VDI_INDEX_SUFFIX, MAXPATHLEN);
+		(void) unlink(oldsnapname_ext);
 
+		/* Changes since the snapshot are found by its new name */
+		if (vdisk_cbt_rename(vdname_old, old_snapname + 1,
+		    new_snapname + 1) == -1) {
+			(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+			    gettext("ERROR: Unable to update changed block "
+			    "bitmap"), argv[2], strerror(errno));
+			ret = -1;
+			goto fail;
+		}
 
 		RTStrFree(pszformat);
 		VDDestroy(vdh->hdd);
 		vdisk_free_tree(vdh);
 
-		return (0);
+		return (vdisk_unlock(lockfd, vdname_lock));
 	}
 
 	if (vdisk_read_tree(&vdh, argv[1]) == -1) {
@@ -4454,6 +7986,22 @@ vdi_rename_cmd(int argc, char *argv[])
 		goto fail;
 	}
 
+	/* Linked clones refer to their parent by path */
+	if (vdisk_find_cow_clone_image(vdh) != -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Cannot rename virtual disk; linked clones "
+		    "depend on it"), argv[1]);
+		ret = -1;
+		goto fail;
+	}
+	if (realpath(argv[1], real_oldname) == NULL) {
+		(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+		    gettext("ERROR: Unable to resolve path of virtual disk"),
+		    argv[1], strerror(errno));
+		ret = -1;
+		goto fail;
+	}
+
 	/* just dealing with virtual disk */
 	rc = stat64(argv[2], &stat64buf);
 	if (rc != -1) {
@@ -4517,12 +8065,24 @@ vdi_rename_cmd(int argc, char *argv[])
 		goto fail;
 	}
 
+	/* Tell the parent of a linked clone where the clone went */
+	if ((realpath(argv[2], real_newname) == NULL) ||
+	    (vdisk_update_cow_clone(vdh, real_oldname, real_newname) == -1)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to update parent of linked clone"),
+		    argv[2]);
+		ret = -1;
+		goto fail;
+	}
+
 fail:
 	if (pszformat)
 		RTStrFree(pszformat);
 	if ((vdh != NULL) && (vdh->hdd != NULL))
 		VDDestroy(vdh->hdd);
 	vdisk_free_tree(vdh);
+	if (vdisk_unlock(lockfd, vdname_lock) == -1)
+		ret = -1;
 	return (ret);
 }
 
@@ -4650,14 +8210,38 @@ zfs_nicestrtonum(const char *value, uint64_t *num)
 int
 main(int argc, char *argv[])
 {
-	struct passwd *pw;
-	vdi_cmd_t *cmd;
+	char *path;
 	int e;
 
 
 	(void) setlocale(LC_ALL, "");
 	(void) textdomain(TEXT_DOMAIN);
 
+	/* Have the vdiskadm serve on the socket given run the command */
+	if ((argc >= 3) && (strcmp(argv[1], "-S") == 0)) {
+		path = argv[2];
+		argv[2] = argv[0];
+		argc -= 2;
+		argv += 2;
+		if (vdi_serve_client(path, argc, argv, &e) == 0)
+			return (e);
+	}
+
+	return (vdi_run(argc, argv));
+}
+
+/*
+ * Run the command given by the arguments of vdiskadm, after the -S option.
+ * Also used by vdiskadm serve to run the commands sent to it.
+ */
+static int
+vdi_run(int argc, char *argv[])
+{
+	struct passwd *pw;
+	vdi_cmd_t *cmd;
+	int e;
+
+
 	if (argc < 2) {
 		goto mainfail_usage;
 	}
@@ -4746,6 +8330,37 @@ copy_add_ext(char *name_ext, char *name, char *ext)
 	(void) strlcat(name_ext, ext, MAXPATHLEN);
 }
 
+/*
+ * Can an image of the given format be copied as a plain file?
+ * VMDK descriptors name their extent files, so the copy would still
+ * refer to the files of the original.
+ */
+static boolean_t
+vdi_file_copy_format(const char *pszformat)
+{
+	if ((strcasecmp(pszformat, "VDI") == 0) ||
+	    (strcasecmp(pszformat, "VHD") == 0) ||
+	    (strcasecmp(pszformat, "raw") == 0))
+		return (B_TRUE);
+	return (B_FALSE);
+}
+
+/*
+ * Is an image of the given format and flags laid out as a fixed header,
+ * the linear disk data and a fixed trailer?
+ */
+static boolean_t
+vdi_fixed_format(const char *pszformat, uint_t flags)
+{
+	if (strcasecmp(pszformat, "raw") == 0)
+		return (B_TRUE);
+	if (((strcasecmp(pszformat, "VDI") == 0) ||
+	    (strcasecmp(pszformat, "VHD") == 0)) &&
+	    (flags & VD_IMAGE_FLAGS_FIXED))
+		return (B_TRUE);
+	return (B_FALSE);
+}
+
 
 /*
  * Get type of virtual disk to create given args.
@@ -4794,40 +8409,30 @@ vdi_get_type_flags(VDBACKENDINFO *backend, char *optarg, uint_t *uimageflags)
 int
 check_vdisk_in_use(vd_handle_t *vdh, char *print_name)
 {
-	char *rwcnt_str = NULL;
-	int rwcnt;
-	char *rocnt_str = NULL;
-	int rocnt;
+	const char *rwcnt_str;
+	const char *rocnt_str;
 
 	/* Check to see if virtual disk is open for reading or writing */
-	(void) vdisk_get_prop_str(vdh, "rwcnt", &rwcnt_str);
-	if (strcmp(rwcnt_str, "<unknown>") == 0) {
+	rwcnt_str = vdisk_peek_prop_str(vdh, "rwcnt");
+	if (rwcnt_str == NULL) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 		    gettext("ERROR: Invalid rwcnt for file"), print_name);
-		if (rwcnt_str)
-			free(rwcnt_str);
 		goto fail;
 	}
-	rwcnt = atoi((char *)rwcnt_str);
-	free(rwcnt_str);
-	if (rwcnt > 0) {
+	if (atoi(rwcnt_str) > 0) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 		    gettext("ERROR: Cannot modify in-use virtual disk"),
 		    print_name);
 		goto fail;
 	}
 
-	(void) vdisk_get_prop_str(vdh, "rocnt", &rocnt_str);
-	if (strcmp(rocnt_str, "<unknown>") == 0) {
+	rocnt_str = vdisk_peek_prop_str(vdh, "rocnt");
+	if (rocnt_str == NULL) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 		    gettext("ERROR: Invalid rocnt for file"), print_name);
-		if (rocnt_str)
-			free(rocnt_str);
 		goto fail;
 	}
-	rocnt = atoi((char *)rocnt_str);
-	free(rocnt_str);
-	if (rocnt > 0) {
+	if (atoi(rocnt_str) > 0) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 		    gettext("ERROR: Cannot modify in-use virtual disk"),
 		    print_name);
@@ -0,0 +1,569 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+
+/*
+ * vdiskadm batch: run a list of vdiskadm commands in one process.
+ *
+ * The batch has a command per line, without the leading "vdiskadm" (which
+ * may be given though).  Words are split at blanks; quotes and backslashes
+ * work as in the shell and a word starting with '#' starts a comment.
+ *
+ * Each command is taken to work on the virtual disk named by its last
+ * argument, on the virtual disks named by its other arguments that have a
+ * store, and on those named by an earlier command of the batch.  Commands
+ * run in the order of the batch, except that runs of consecutive commands
+ * for the same virtual disks, groups, run alongside the groups for other
+ * virtual disks, up to a number of groups at a time.  Each group runs in a
+ * process of its own, forked once the formats are loaded, and the runner
+ * given does the commands of a group with as few loads and writes of the
+ * store as it can.  Only the next VDI_BATCH_WINDOW groups waiting are looked
+ * at for one that can start, so a batch of many groups for the same virtual
+ * disk doesn't take quadratic time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <libintl.h>
+
+#include "vdisk.h"
+#include "vdiskadm_batch.h"
+
+
+/* groups waiting looked at for one that can start */
+#define	VDI_BATCH_WINDOW	256
+
+typedef enum {
+	VDI_BATCH_WAIT,
+	VDI_BATCH_RUN,
+	VDI_BATCH_DONE
+} vdi_batch_state_t;
+
+typedef struct vdi_batch_group_s {
+	int			bg_first;	/* first command of the group */
+	int			bg_count;
+	pid_t			bg_pid;
+	vdi_batch_state_t	bg_state;
+} vdi_batch_group_t;
+
+typedef struct vdi_batch_s {
+	vdi_batch_cmd_t		*vb_cmds;
+	int			vb_ncmds;
+	int			vb_maxcmds;
+	vdi_batch_group_t	*vb_groups;
+	int			vb_ngroups;
+} vdi_batch_t;
+
+
+/*
+ * Read a line of any length.
+ *
+ * Returns:
+ *	0: success
+ *	-1: end of file or failure
+ */
+static int
+vdi_batch_getline(FILE *fp, char **bufp, size_t *sizep)
+{
+	size_t len = 0;
+	char *buf;
+
+	if (*bufp == NULL) {
+		if ((*bufp = malloc(BUFSIZ)) == NULL)
+			return (-1);
+		*sizep = BUFSIZ;
+	}
+
+	while (fgets(*bufp + len, *sizep - len, fp) != NULL) {
+		len += strlen(*bufp + len);
+		if ((len > 0) && ((*bufp)[len - 1] == '\n')) {
+			(*bufp)[len - 1] = '\0';
+			return (0);
+		}
+		if (len < *sizep - 1)
+			return (0);
+		if ((buf = realloc(*bufp, *sizep * 2)) == NULL)
+			return (-1);
+		*bufp = buf;
+		*sizep *= 2;
+	}
+	return ((len > 0) ? 0 : -1);
+}
+
+/*
+ * Split a line of the batch into the arguments of a command, in place.
+ * The arguments start with the name of vdiskadm, as main() is given them.
+ *
+ * Returns:
+ *	0: success; bc_argc is 1 for a line without a command
+ *	-1: failure
+ */
+static int
+vdi_batch_split(char *line, vdi_batch_cmd_t *cmd)
+{
+	char **argv;
+	char *in = line;
+	char *out;
+	char *word;
+	char quote;
+	char c;
+	int max = 8;
+
+	if ((cmd->bc_argv = malloc(max * sizeof (char *))) == NULL)
+		return (-1);
+	cmd->bc_argv[0] = "vdiskadm";
+	cmd->bc_argc = 1;
+
+	for (;;) {
+		while (isspace(*in))
+			in++;
+		if ((*in == '\0') || (*in == '#'))
+			break;
+
+		word = out = in;
+		quote = '\0';
+		for (; *in != '\0'; in++) {
+			if (quote == '\'') {
+				if (*in == '\'')
+					quote = '\0';
+				else
+					*out++ = *in;
+			} else if ((*in == '\\') && (in[1] != '\0')) {
+				*out++ = *++in;
+			} else if (quote == '"') {
+				if (*in == '"')
+					quote = '\0';
+				else
+					*out++ = *in;
+			} else if ((*in == '\'') || (*in == '"')) {
+				quote = *in;
+			} else if (isspace(*in)) {
+				break;
+			} else {
+				*out++ = *in;
+			}
+		}
+		if (quote != '\0') {
+			(void) fprintf(stderr, "\n%s %d\n\n",
+			    gettext("ERROR: Unterminated quote at line"),
+			    cmd->bc_line);
+			return (-1);
+		}
+		c = *in;
+		*out = '\0';
+		if (c != '\0')
+			in++;
+
+		/* Leave room for the NULL ending the arguments */
+		if (cmd->bc_argc + 1 == max) {
+			argv = realloc(cmd->bc_argv, max * 2 * sizeof (char *));
+			if (argv == NULL)
+				return (-1);
+			cmd->bc_argv = argv;
+			max *= 2;
+		}
+		cmd->bc_argv[cmd->bc_argc++] = word;
+	}
+
+	/* Drop the name of vdiskadm if the line starts with it */
+	if ((cmd->bc_argc > 1) && (strcmp(cmd->bc_argv[1], "vdiskadm") == 0)) {
+		(void) memmove(&cmd->bc_argv[1], &cmd->bc_argv[2],
+		    (cmd->bc_argc - 2) * sizeof (char *));
+		cmd->bc_argc--;
+	}
+	cmd->bc_argv[cmd->bc_argc] = NULL;
+	return (0);
+}
+
+/*
+ * Name a virtual disk given by an argument the same way whichever path it
+ * is given by: absolute, without a snapshot name and with the directory
+ * it is in resolved if it exists.
+ */
+static void
+vdi_batch_key(const char *arg, char *key)
+{
+	char path[MAXPATHLEN];
+	char vdname[MAXPATHLEN];
+	char dir[MAXPATHLEN];
+	char real[MAXPATHLEN];
+	char *base;
+	size_t len;
+
+	if (arg[0] == '/') {
+		(void) strlcpy(path, arg, MAXPATHLEN);
+	} else if (getcwd(path, MAXPATHLEN) != NULL) {
+		(void) strlcat(path, "/", MAXPATHLEN);
+		(void) strlcat(path, arg, MAXPATHLEN);
+	} else {
+		(void) strlcpy(path, arg, MAXPATHLEN);
+	}
+	vdisk_get_vdname(vdname, path, MAXPATHLEN);
+	while (((len = strlen(vdname)) > 1) && (vdname[len - 1] == '/'))
+		vdname[len - 1] = '\0';
+
+	(void) strlcpy(dir, vdname, MAXPATHLEN);
+	base = strrchr(vdname, '/') + 1;
+	if (realpath(dirname(dir), real) == NULL) {
+		(void) strlcpy(key, vdname, MAXPATHLEN);
+		return;
+	}
+	(void) snprintf(key, MAXPATHLEN, "%s/%s",
+	    (strcmp(real, "/") == 0) ? "" : real, base);
+}
+
+static int
+vdi_batch_add_key(vdi_batch_cmd_t *cmd, const char *key)
+{
+	int i;
+
+	for (i = 0; i < cmd->bc_nkeys; i++) {
+		if (strcmp(cmd->bc_keys[i], key) == 0)
+			return (0);
+	}
+	if ((cmd->bc_keys[cmd->bc_nkeys] = strdup(key)) == NULL)
+		return (-1);
+	cmd->bc_nkeys++;
+	return (0);
+}
+
+/*
+ * Find the virtual disks a command works on, see above.
+ *	vb - the batch, with the commands before this one
+ *	cmd - the command
+ */
+static int
+vdi_batch_keys(vdi_batch_t *vb, vdi_batch_cmd_t *cmd)
+{
+	char key[MAXPATHLEN];
+	char xmlname[MAXPATHLEN];
+	struct stat64 st;
+	char *arg;
+	int i;
+	int j;
+	int k;
+
+	cmd->bc_keys = calloc(cmd->bc_argc, sizeof (char *));
+	if (cmd->bc_keys == NULL)
+		return (-1);
+	if (cmd->bc_argc < 3)
+		return (0);
+
+	for (i = 2; i < cmd->bc_argc; i++) {
+		arg = cmd->bc_argv[i];
+		if ((arg[0] == '-') || (arg[0] == '\0'))
+			continue;
+		vdi_batch_key(arg, key);
+
+		if (i == cmd->bc_argc - 1) {
+			if (vdi_batch_add_key(cmd, key) == -1)
+				return (-1);
+			continue;
+		}
+
+		vdisk_get_xmlfile(xmlname, key, MAXPATHLEN);
+		if (stat64(xmlname, &st) == 0) {
+			if (vdi_batch_add_key(cmd, key) == -1)
+				return (-1);
+			continue;
+		}
+		for (j = (cmd - vb->vb_cmds) - 1; j >= 0; j--) {
+			for (k = 0; k < vb->vb_cmds[j].bc_nkeys; k++) {
+				if (strcmp(vb->vb_cmds[j].bc_keys[k],
+				    key) == 0)
+					break;
+			}
+			if (k < vb->vb_cmds[j].bc_nkeys)
+				break;
+		}
+		if ((j >= 0) && (vdi_batch_add_key(cmd, key) == -1))
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Do two commands work on the same virtual disks?  If all is set, on
+ * exactly the same ones, else on any one of them.
+ */
+static boolean_t
+vdi_batch_same(vdi_batch_cmd_t *a, vdi_batch_cmd_t *b, boolean_t all)
+{
+	int found = 0;
+	int i;
+	int j;
+
+	if (all && (a->bc_nkeys != b->bc_nkeys))
+		return (B_FALSE);
+	for (i = 0; i < a->bc_nkeys; i++) {
+		for (j = 0; j < b->bc_nkeys; j++) {
+			if (strcmp(a->bc_keys[i], b->bc_keys[j]) == 0)
+				break;
+		}
+		if (j < b->bc_nkeys)
+			found++;
+		else if (all)
+			return (B_FALSE);
+	}
+	return (all ? (found == a->bc_nkeys) && (found > 0) : (found > 0));
+}
+
+static void
+vdi_batch_free(vdi_batch_t *vb)
+{
+	vdi_batch_cmd_t *cmd;
+	int i;
+	int j;
+
+	for (i = 0; i < vb->vb_ncmds; i++) {
+		cmd = &vb->vb_cmds[i];
+		for (j = 0; j < cmd->bc_nkeys; j++)
+			free(cmd->bc_keys[j]);
+		free(cmd->bc_keys);
+		free(cmd->bc_argv);
+		free(cmd->bc_buf);
+	}
+	free(vb->vb_cmds);
+	free(vb->vb_groups);
+}
+
+/*
+ * Read the commands of a batch and put them in groups.
+ */
+static int
+vdi_batch_read(vdi_batch_t *vb, FILE *fp)
+{
+	vdi_batch_cmd_t *cmd;
+	vdi_batch_cmd_t *cmds;
+	vdi_batch_group_t *group;
+	char *buf = NULL;
+	size_t size;
+	int line = 0;
+	int i;
+
+	while (vdi_batch_getline(fp, &buf, &size) == 0) {
+		line++;
+		if (vb->vb_ncmds == vb->vb_maxcmds) {
+			cmds = realloc(vb->vb_cmds, (vb->vb_maxcmds + 64) *
+			    2 * sizeof (vdi_batch_cmd_t));
+			if (cmds == NULL)
+				goto fail;
+			vb->vb_cmds = cmds;
+			vb->vb_maxcmds = (vb->vb_maxcmds + 64) * 2;
+		}
+		cmd = &vb->vb_cmds[vb->vb_ncmds];
+		bzero(cmd, sizeof (vdi_batch_cmd_t));
+		cmd->bc_line = line;
+		if ((cmd->bc_buf = strdup(buf)) == NULL)
+			goto fail;
+		vb->vb_ncmds++;
+		if ((vdi_batch_split(cmd->bc_buf, cmd) == -1) ||
+		    (vdi_batch_keys(vb, cmd) == -1))
+			goto fail;
+		if (cmd->bc_argc == 1) {
+			/* Nothing but blanks or a comment */
+			vb->vb_ncmds--;
+			free(cmd->bc_keys);
+			free(cmd->bc_argv);
+			free(cmd->bc_buf);
+		}
+	}
+	if (ferror(fp))
+		goto fail;
+	free(buf);
+	buf = NULL;
+
+	vb->vb_groups = calloc(vb->vb_ncmds, sizeof (vdi_batch_group_t));
+	if ((vb->vb_ncmds > 0) && (vb->vb_groups == NULL))
+		goto fail;
+	for (i = 0; i < vb->vb_ncmds; i++) {
+		if ((i > 0) && vdi_batch_same(&vb->vb_cmds[i],
+		    &vb->vb_cmds[i - 1], B_TRUE)) {
+			vb->vb_groups[vb->vb_ngroups - 1].bg_count++;
+			continue;
+		}
+		group = &vb->vb_groups[vb->vb_ngroups++];
+		group->bg_first = i;
+		group->bg_count = 1;
+		group->bg_state = VDI_BATCH_WAIT;
+	}
+	return (0);
+
+fail:
+	free(buf);
+	return (-1);
+}
+
+/*
+ * Can a group start: does no group before it that hasn't finished work on
+ * any of its virtual disks?
+ */
+static boolean_t
+vdi_batch_ready(vdi_batch_t *vb, int first, int g)
+{
+	vdi_batch_cmd_t *cmd = &vb->vb_cmds[vb->vb_groups[g].bg_first];
+	int i;
+
+	for (i = first; i < g; i++) {
+		if ((vb->vb_groups[i].bg_state != VDI_BATCH_DONE) &&
+		    vdi_batch_same(cmd,
+		    &vb->vb_cmds[vb->vb_groups[i].bg_first], B_FALSE))
+			return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+/*
+ * Start the process running the commands of a group.
+ */
+static int
+vdi_batch_start(vdi_batch_t *vb, int g, const char *name,
+    vdi_batch_run_t *run)
+{
+	vdi_batch_group_t *group = &vb->vb_groups[g];
+	vdi_batch_cmd_t *cmd;
+	pid_t pid;
+	int done = 0;
+
+	(void) fflush(stdout);
+	(void) fflush(stderr);
+	if ((pid = fork()) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Cannot start the commands of batch"),
+		    name);
+		return (-1);
+	}
+	if (pid == 0) {
+		if (run(&vb->vb_cmds[group->bg_first], group->bg_count,
+		    &done) == 0) {
+			(void) fflush(stdout);
+			(void) fflush(stderr);
+			_exit(0);
+		}
+		cmd = &vb->vb_cmds[group->bg_first + done];
+		(void) fprintf(stderr, "\n%s %s:%d: \"%s\"\n\n",
+		    gettext("ERROR: Command failed at"), name, cmd->bc_line,
+		    cmd->bc_argv[1]);
+		(void) fflush(stdout);
+		(void) fflush(stderr);
+		_exit(1);
+	}
+
+	group->bg_pid = pid;
+	group->bg_state = VDI_BATCH_RUN;
+	return (0);
+}
+
+/*
+ * Run the commands of a batch.
+ *	fp - the batch
+ *	name - name of the batch, for messages
+ *	jobs - largest number of groups run at a time
+ *	keep_going - don't stop at the first command that fails
+ *	run - runs the commands of a group
+ *
+ * Returns:
+ *	0: success, all commands succeeded
+ *	-1: failure
+ */
+int
+vdi_batch(FILE *fp, const char *name, int jobs, boolean_t keep_going,
+    vdi_batch_run_t *run)
+{
+	vdi_batch_t vb;
+	int failed = 0;
+	int nrun = 0;
+	int first = 0;
+	int status;
+	int seen;
+	pid_t pid;
+	int g;
+
+	bzero(&vb, sizeof (vb));
+	if (vdi_batch_read(&vb, fp) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to read batch"), name);
+		vdi_batch_free(&vb);
+		return (-1);
+	}
+
+	for (;;) {
+		/* Start what can be, unless stopping after a failure */
+		while ((first < vb.vb_ngroups) &&
+		    (vb.vb_groups[first].bg_state == VDI_BATCH_DONE))
+			first++;
+		for (g = first, seen = 0; (g < vb.vb_ngroups) &&
+		    (nrun < jobs) && (seen < VDI_BATCH_WINDOW) &&
+		    (keep_going || (failed == 0)); g++) {
+			if (vb.vb_groups[g].bg_state != VDI_BATCH_WAIT)
+				continue;
+			seen++;
+			if (!vdi_batch_ready(&vb, first, g))
+				continue;
+			if (vdi_batch_start(&vb, g, name, run) == -1) {
+				vb.vb_groups[g].bg_state = VDI_BATCH_DONE;
+				failed++;
+				continue;
+			}
+			nrun++;
+		}
+		if (nrun == 0)
+			break;
+
+		if ((pid = wait(&status)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (g = first; g < vb.vb_ngroups; g++) {
+			if ((vb.vb_groups[g].bg_state == VDI_BATCH_RUN) &&
+			    (vb.vb_groups[g].bg_pid == pid))
+				break;
+		}
+		if (g == vb.vb_ngroups)
+			continue;
+		vb.vb_groups[g].bg_state = VDI_BATCH_DONE;
+		nrun--;
+		if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+			failed++;
+	}
+
+	/* Anything left waiting wasn't run */
+	for (g = first; g < vb.vb_ngroups; g++) {
+		if (vb.vb_groups[g].bg_state == VDI_BATCH_WAIT)
+			failed++;
+	}
+
+	vdi_batch_free(&vb);
+	return ((failed == 0) ? 0 : -1);
+}
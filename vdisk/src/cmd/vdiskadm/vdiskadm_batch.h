@@ -0,0 +1,63 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+
+
+#ifndef _VDISKADM_BATCH_H
+#define	_VDISKADM_BATCH_H
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+
+
+/* groups of commands run at the same time by default */
+#define	VDI_BATCH_JOBS		8
+
+/* command of a batch */
+typedef struct vdi_batch_cmd_s {
+	int	bc_line;	/* line of the command in the batch */
+	int	bc_argc;
+	char	**bc_argv;	/* arguments, as vdiskadm would be given them */
+	char	*bc_buf;	/* the line the arguments point into */
+	int	bc_nkeys;	/* virtual disks the command names */
+	char	**bc_keys;
+} vdi_batch_cmd_t;
+
+/*
+ * Runs commands of a batch for the same virtual disks, in order, up to the
+ * first one that fails.  Sets *donep to the number of commands that were
+ * run successfully.
+ */
+typedef int vdi_batch_run_t(vdi_batch_cmd_t *cmds, int ncmds, int *donep);
+
+int vdi_batch(FILE *fp, const char *name, int jobs, boolean_t keep_going,
+    vdi_batch_run_t *run);
+
+
+#ifdef	__cplusplus
+}
+#endif
+#endif /* _VDISKADM_BATCH_H */
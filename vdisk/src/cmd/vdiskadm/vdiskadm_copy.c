@@ -0,0 +1,808 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+/*
+ * Pipelined copy of a virtual disk image chain into a new image.
+ *
+ * The virtual disk is split into VDI_COPY_CHUNK sized chunks.  Reader
+ * threads pull the next chunk number, read it from their own read-only
+ * handle on the source chain and queue the filled buffer.  Writer threads
+ * drain the queue into the new image, so reads and writes overlap and
+ * only a bounded number of buffers are ever in flight.
+ *
+ * The VBox handles are not thread safe, so every thread has a handle of
+ * its own.  Sparse images update their block maps on every allocating
+ * write, so they get a single writer which also retires chunks in
+ * ascending order to keep the new image laid out sequentially.  Fixed
+ * and raw images keep their data as one linear run in the file and get
+ * one writer per thread: the first writes through the new image's own
+ * handle and the others pwrite() the data region of the file directly,
+ * so only that handle ever touches the header, footer or descriptor.
+ * A fixed format without a known linear layout gets a single writer.
+ *
+ * Chunks which read back as all zeroes are not written to a newly created
+ * image file, which already reads as zeroes, so sparse images stay
+ * sparse.  A pre-existing target such as a block device gets every chunk.
+ *
+ * If asked to, progress is reported at most once per
+ * VDI_COPY_PROGRESS_INTERVAL, with a summary of the throughput and the
+ * time spent reading and writing once the copy is done.  A serial copy
+ * gets its progress from the VDCopy() progress callback, which only
+ * knows percentages and not where the time went.
+ *
+ * Where the format allows a file to be copied as is, the vdi_copy_file()
+ * and vdi_copy_move_*() wrappers hand the work to the libvdisk file copy
+ * routines (reflinks, in-kernel copies, hole skipping) with the same
+ * progress reporting.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <libintl.h>
+
+#include "VBox/VBoxHDD.h"
+
+#include "vdisk.h"
+#include "vdiskadm_copy.h"
+
+
+typedef struct vdi_copy_buf_s {
+	struct vdi_copy_buf_s	*cb_next;
+	uint64_t		cb_chunk;	/* chunk number */
+	size_t			cb_len;		/* valid bytes in cb_data */
+	boolean_t		cb_zero;	/* chunk is all zeroes */
+	char			*cb_data;
+} vdi_copy_buf_t;
+
+typedef struct vdi_copy_state_s {
+	pthread_mutex_t	cs_mutex;
+	pthread_cond_t	cs_cv;
+	vdi_copy_progress_t	cs_progress;
+
+	uint64_t	cs_size;	/* bytes to copy */
+	uint64_t	cs_nchunks;
+	uint64_t	cs_next_read;	/* next chunk handed to a reader */
+	uint64_t	cs_next_write;	/* next chunk for an ordered writer */
+	uint64_t	cs_retired;	/* chunks finished by the writers */
+	boolean_t	cs_ordered;	/* retire chunks in ascending order */
+	boolean_t	cs_skip_zero;	/* target already reads as zeroes */
+	uint64_t	cs_data_off;	/* where a fixed image's data starts */
+	int		cs_error;	/* first VBox error seen, or 0 */
+
+	vdi_copy_buf_t	*cs_free;	/* buffers available to readers */
+	vdi_copy_buf_t	*cs_ready;	/* filled buffers for the writers */
+} vdi_copy_state_t;
+
+typedef struct vdi_copy_thr_s {
+	vdi_copy_state_t	*ct_state;
+	PVBOXHDD		ct_hdd;
+	int			ct_fd;		/* writer without a handle */
+	pthread_t		ct_tid;
+	boolean_t		ct_started;
+} vdi_copy_thr_t;
+
+
+/*
+ * Parse the argument to -j.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdi_copy_parse_threads(const char *arg, int *nthreads)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(arg, &end, 10);
+	if ((errno != 0) || (end == arg) || (*end != '\0') ||
+	    (n < 1) || (n > VDI_COPY_MAX_THREADS))
+		return (-1);
+
+	*nthreads = (int)n;
+	return (0);
+}
+
+void
+vdi_copy_progress_init(vdi_copy_progress_t *cp, vdi_copy_opts_t *opts,
+    uint64_t total, boolean_t timed)
+{
+	bzero(cp, sizeof (*cp));
+	cp->cp_opts = opts;
+	cp->cp_total = total;
+	cp->cp_timed = timed;
+	cp->cp_start = cp->cp_last = gethrtime();
+}
+
+/*
+ * Report bytes done out of total, the rate since the last report and
+ * the time left at the average rate so far.
+ */
+void
+vdi_copy_progress_update(vdi_copy_progress_t *cp, uint64_t done)
+{
+	hrtime_t now;
+	double secs, rate, avg;
+	long long eta;
+
+	if ((cp->cp_opts == NULL) || !cp->cp_opts->co_progress)
+		return;
+
+	cp->cp_done = done;
+	now = gethrtime();
+	if ((now - cp->cp_last < VDI_COPY_PROGRESS_INTERVAL) &&
+	    (done < cp->cp_total))
+		return;
+
+	secs = (double)(now - cp->cp_last) / NANOSEC;
+	rate = (secs > 0) ? (double)(done - cp->cp_last_done) / secs : 0;
+	secs = (double)(now - cp->cp_start) / NANOSEC;
+	avg = (secs > 0) ? (double)done / secs : 0;
+	eta = (avg > 0) ? (long long)((cp->cp_total - done) / avg) : -1;
+	cp->cp_last = now;
+	cp->cp_last_done = done;
+
+	if (cp->cp_opts->co_parsable) {
+		(void) printf("progress:%llu:%llu:%llu:%lld\n",
+		    (unsigned long long)done, (unsigned long long)cp->cp_total,
+		    (unsigned long long)rate, eta);
+		(void) fflush(stdout);
+	} else {
+		(void) fprintf(stderr, "\r%3d%% %10.1f/%.1f MB %8.1f MB/s",
+		    (cp->cp_total > 0) ? (int)(done * 100 / cp->cp_total) : 100,
+		    (double)done / (1024 * 1024),
+		    (double)cp->cp_total / (1024 * 1024),
+		    rate / (1024 * 1024));
+		if (eta >= 0)
+			(void) fprintf(stderr, "  %s %lld:%02lld:%02lld ",
+			    gettext("ETA"), eta / 3600, (eta / 60) % 60,
+			    eta % 60);
+	}
+}
+
+/*
+ * Print the throughput achieved and, when known, the time the threads
+ * spent reading and writing.
+ */
+void
+vdi_copy_progress_done(vdi_copy_progress_t *cp)
+{
+	double secs, rate;
+	double rsecs, wsecs;
+
+	if ((cp->cp_opts == NULL) || !cp->cp_opts->co_progress)
+		return;
+
+	secs = (double)(gethrtime() - cp->cp_start) / NANOSEC;
+	rate = (secs > 0) ? (double)cp->cp_done / secs : 0;
+	rsecs = (double)cp->cp_read_time / NANOSEC;
+	wsecs = (double)cp->cp_write_time / NANOSEC;
+
+	if (cp->cp_opts->co_parsable) {
+		(void) printf("summary:%llu:%.3f:%llu",
+		    (unsigned long long)cp->cp_done, secs,
+		    (unsigned long long)rate);
+		if (cp->cp_timed)
+			(void) printf(":%.3f:%.3f\n", rsecs, wsecs);
+		else
+			(void) printf("::\n");
+		(void) fflush(stdout);
+	} else {
+		(void) fprintf(stderr, "\n%s %.1f MB %s %.1f s (%.1f MB/s)",
+		    gettext("Copied"), (double)cp->cp_done / (1024 * 1024),
+		    gettext("in"), secs, rate / (1024 * 1024));
+		if (cp->cp_timed)
+			(void) fprintf(stderr, ", %s %.1f s, %s %.1f s",
+			    gettext("reading"), rsecs,
+			    gettext("writing"), wsecs);
+		(void) fprintf(stderr, "\n");
+	}
+}
+
+/*
+ * VDCopy() progress callback.
+ */
+/* ARGSUSED */
+static int
+vdi_copy_progress_cb(PVM pVM, unsigned percent, void *arg)
+{
+	vdi_copy_progress_t *cp = arg;
+
+	vdi_copy_progress_update(cp, cp->cp_total * percent / 100);
+	return (VINF_SUCCESS);
+}
+
+/*
+ * Plain VDCopy(), with a progress interface if progress was asked for.
+ */
+static int
+vdi_copy_serial(PVBOXHDD from, uint_t nimage, PVBOXHDD to,
+    const char *to_format, const char *to_file, uint64_t size,
+    uint_t uimageflags, vdi_copy_opts_t *opts)
+{
+	vdi_copy_progress_t cp;
+	VDINTERFACE vdi_progress;
+	VDINTERFACEPROGRESS vdi_progress_cb;
+	PVDINTERFACE pvdifs = NULL;
+	int rc;
+
+	if ((opts != NULL) && opts->co_progress) {
+		if (nimage >= VDGetCount(from))
+			return (VERR_INVALID_PARAMETER);
+		vdi_copy_progress_init(&cp, opts,
+		    (size != 0) ? size : VDGetSize(from, nimage), B_FALSE);
+
+		vdi_progress_cb.cbSize = sizeof (VDINTERFACEPROGRESS);
+		vdi_progress_cb.enmInterface = VDINTERFACETYPE_PROGRESS;
+		vdi_progress_cb.pfnProgress = vdi_copy_progress_cb;
+		rc = VDInterfaceAdd(&vdi_progress, "vdiskadm_progress",
+		    VDINTERFACETYPE_PROGRESS, &vdi_progress_cb, &cp, &pvdifs);
+		if (!VBOX_SUCCESS(rc))
+			return (rc);
+	}
+
+	rc = VDCopy(from, nimage, to, to_format, to_file, false, size,
+	    uimageflags, NULL, pvdifs, NULL, NULL);
+
+	if ((pvdifs != NULL) && VBOX_SUCCESS(rc)) {
+		vdi_copy_progress_update(&cp, cp.cp_total);
+		vdi_copy_progress_done(&cp);
+	}
+	return (rc);
+}
+
+boolean_t
+vdi_copy_is_zero(const char *data, size_t len)
+{
+	const uint64_t *p = (const uint64_t *)data;
+	size_t i;
+
+	for (i = 0; i < len / sizeof (uint64_t); i++) {
+		if (p[i] != 0)
+			return (B_FALSE);
+	}
+	for (i *= sizeof (uint64_t); i < len; i++) {
+		if (data[i] != 0)
+			return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+/*
+ * Record the first failure and wake everybody up so they can quit.
+ * Called with cs_mutex held.
+ */
+static void
+vdi_copy_set_error(vdi_copy_state_t *cs, int rc)
+{
+	if (cs->cs_error == 0)
+		cs->cs_error = rc;
+	(void) pthread_cond_broadcast(&cs->cs_cv);
+}
+
+/*
+ * Take the next buffer a writer may retire, or NULL if there is none yet.
+ * Called with cs_mutex held.
+ */
+static vdi_copy_buf_t *
+vdi_copy_take_ready(vdi_copy_state_t *cs)
+{
+	vdi_copy_buf_t **cbp;
+	vdi_copy_buf_t *cb;
+
+	for (cbp = &cs->cs_ready; (cb = *cbp) != NULL; cbp = &cb->cb_next) {
+		if (!cs->cs_ordered || (cb->cb_chunk == cs->cs_next_write)) {
+			*cbp = cb->cb_next;
+			return (cb);
+		}
+	}
+	return (NULL);
+}
+
+static void *
+vdi_copy_reader(void *arg)
+{
+	vdi_copy_thr_t *ct = arg;
+	vdi_copy_state_t *cs = ct->ct_state;
+	vdi_copy_buf_t *cb;
+	uint64_t off;
+	hrtime_t start;
+	int rc;
+
+	for (;;) {
+		(void) pthread_mutex_lock(&cs->cs_mutex);
+		while ((cs->cs_error == 0) &&
+		    (cs->cs_next_read < cs->cs_nchunks) &&
+		    (cs->cs_free == NULL))
+			(void) pthread_cond_wait(&cs->cs_cv, &cs->cs_mutex);
+		if ((cs->cs_error != 0) ||
+		    (cs->cs_next_read >= cs->cs_nchunks)) {
+			(void) pthread_mutex_unlock(&cs->cs_mutex);
+			break;
+		}
+		cb = cs->cs_free;
+		cs->cs_free = cb->cb_next;
+		cb->cb_chunk = cs->cs_next_read++;
+		(void) pthread_mutex_unlock(&cs->cs_mutex);
+
+		off = cb->cb_chunk * VDI_COPY_CHUNK;
+		cb->cb_len = VDI_COPY_CHUNK;
+		if (cs->cs_size - off < VDI_COPY_CHUNK)
+			cb->cb_len = cs->cs_size - off;
+
+		start = gethrtime();
+		rc = VDRead(ct->ct_hdd, off, cb->cb_data, cb->cb_len);
+		cb->cb_zero = B_FALSE;
+		if (VBOX_SUCCESS(rc) && cs->cs_skip_zero)
+			cb->cb_zero = vdi_copy_is_zero(cb->cb_data, cb->cb_len);
+
+		(void) pthread_mutex_lock(&cs->cs_mutex);
+		cs->cs_progress.cp_read_time += gethrtime() - start;
+		if (!VBOX_SUCCESS(rc)) {
+			cb->cb_next = cs->cs_free;
+			cs->cs_free = cb;
+			vdi_copy_set_error(cs, rc);
+			(void) pthread_mutex_unlock(&cs->cs_mutex);
+			break;
+		}
+		cb->cb_next = cs->cs_ready;
+		cs->cs_ready = cb;
+		(void) pthread_cond_broadcast(&cs->cs_cv);
+		(void) pthread_mutex_unlock(&cs->cs_mutex);
+	}
+
+	return (NULL);
+}
+
+static void *
+vdi_copy_writer(void *arg)
+{
+	vdi_copy_thr_t *ct = arg;
+	vdi_copy_state_t *cs = ct->ct_state;
+	vdi_copy_buf_t *cb;
+	hrtime_t start;
+	int rc;
+
+	for (;;) {
+		(void) pthread_mutex_lock(&cs->cs_mutex);
+		cb = NULL;
+		while ((cs->cs_error == 0) &&
+		    (cs->cs_retired < cs->cs_nchunks) &&
+		    ((cb = vdi_copy_take_ready(cs)) == NULL))
+			(void) pthread_cond_wait(&cs->cs_cv, &cs->cs_mutex);
+		if (cb == NULL) {
+			(void) pthread_mutex_unlock(&cs->cs_mutex);
+			break;
+		}
+		(void) pthread_mutex_unlock(&cs->cs_mutex);
+
+		start = gethrtime();
+		rc = VINF_SUCCESS;
+		if (cb->cb_zero) {
+			/* nothing to write */
+		} else if (ct->ct_hdd != NULL) {
+			rc = VDWrite(ct->ct_hdd, cb->cb_chunk * VDI_COPY_CHUNK,
+			    cb->cb_data, cb->cb_len);
+		} else if (pwrite(ct->ct_fd, cb->cb_data, cb->cb_len,
+		    cs->cs_data_off + cb->cb_chunk * VDI_COPY_CHUNK) !=
+		    (ssize_t)cb->cb_len) {
+			rc = VERR_GENERAL_FAILURE;
+		}
+
+		(void) pthread_mutex_lock(&cs->cs_mutex);
+		cs->cs_progress.cp_write_time += gethrtime() - start;
+		cb->cb_next = cs->cs_free;
+		cs->cs_free = cb;
+		if (!VBOX_SUCCESS(rc)) {
+			vdi_copy_set_error(cs, rc);
+			(void) pthread_mutex_unlock(&cs->cs_mutex);
+			break;
+		}
+		cs->cs_retired++;
+		if (cs->cs_ordered)
+			cs->cs_next_write++;
+		vdi_copy_progress_update(&cs->cs_progress,
+		    cs->cs_progress.cp_done + cb->cb_len);
+		(void) pthread_cond_broadcast(&cs->cs_cv);
+		(void) pthread_mutex_unlock(&cs->cs_mutex);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Open images 0 through nimage of the source chain read-only in a
+ * handle of the caller's own.
+ */
+int
+vdi_copy_open_from(PVBOXHDD from, uint_t nimage, const char *from_format,
+    PVBOXHDD *hddp)
+{
+	char filename[MAXPATHLEN];
+	PVBOXHDD hdd;
+	uint_t i;
+	int rc;
+
+	rc = VDCreate(NULL, &hdd);
+	if (!VBOX_SUCCESS(rc))
+		return (rc);
+
+	for (i = 0; i <= nimage; i++) {
+		rc = VDGetFilename(from, i, filename, sizeof (filename));
+		if (VBOX_SUCCESS(rc))
+			rc = VDOpen(hdd, from_format, filename,
+			    VD_OPEN_FLAGS_READONLY, NULL);
+		if (!VBOX_SUCCESS(rc)) {
+			VDDestroy(hdd);
+			return (rc);
+		}
+	}
+
+	*hddp = hdd;
+	return (VINF_SUCCESS);
+}
+
+/*
+ * Copy the contents of image nimage of "from" (including everything
+ * it inherits from its parents) into a new image "to_file" of format
+ * "to_format" opened in the "to" handle.  Arguments follow VDCopy()
+ * without the rename, uuid and interface arguments.  A size of 0 means
+ * the size of the source.
+ *
+ * With one thread (or no opts) this is VDCopy().  On failure a
+ * partially written image file is removed; a pre-existing target such
+ * as a block device is only closed.
+ *
+ * Returns:
+ *	VBox status code
+ */
+int
+vdi_copy(PVBOXHDD from, uint_t nimage, const char *from_format,
+    PVBOXHDD to, const char *to_format, const char *to_file,
+    uint64_t size, uint_t uimageflags, vdi_copy_opts_t *opts)
+{
+	vdi_copy_state_t cs;
+	vdi_copy_thr_t *readers = NULL;
+	vdi_copy_thr_t *writers = NULL;
+	vdi_copy_buf_t *bufs = NULL;
+	PDMMEDIAGEOMETRY PCHSGeometry;
+	PDMMEDIAGEOMETRY LCHSGeometry;
+	char comment[MAXPATHLEN];
+	struct stat64 stat64buf;
+	boolean_t existed;
+	int nreaders, nwriters, nbufs;
+	boolean_t created = B_FALSE;
+	int i;
+	int rc;
+
+	if ((opts == NULL) || (opts->co_nthreads <= 1)) {
+		return (vdi_copy_serial(from, nimage, to, to_format, to_file,
+		    size, uimageflags, opts));
+	}
+
+	if (nimage >= VDGetCount(from))
+		return (VERR_INVALID_PARAMETER);
+	if (size == 0)
+		size = VDGetSize(from, nimage);
+
+	/* Sparse images serialize their block map updates */
+	nreaders = opts->co_nthreads;
+	if ((uimageflags & VD_IMAGE_FLAGS_FIXED) ||
+	    (strcasecmp(to_format, "raw") == 0))
+		nwriters = opts->co_nthreads;
+	else
+		nwriters = 1;
+	nbufs = (nreaders + nwriters) * VDI_COPY_BUFS_PER_THREAD;
+
+	bzero(&cs, sizeof (cs));
+	(void) pthread_mutex_init(&cs.cs_mutex, NULL);
+	(void) pthread_cond_init(&cs.cs_cv, NULL);
+	cs.cs_size = size;
+	cs.cs_nchunks = (size + VDI_COPY_CHUNK - 1) / VDI_COPY_CHUNK;
+	vdi_copy_progress_init(&cs.cs_progress, opts, size, B_TRUE);
+
+	readers = calloc(nreaders, sizeof (vdi_copy_thr_t));
+	writers = calloc(nwriters, sizeof (vdi_copy_thr_t));
+	bufs = calloc(nbufs, sizeof (vdi_copy_buf_t));
+	if ((readers == NULL) || (writers == NULL) || (bufs == NULL)) {
+		rc = VERR_NO_MEMORY;
+		goto out;
+	}
+	for (i = 0; i < nwriters; i++)
+		writers[i].ct_fd = -1;
+	for (i = 0; i < nbufs; i++) {
+		bufs[i].cb_data = malloc(VDI_COPY_CHUNK);
+		if (bufs[i].cb_data == NULL) {
+			rc = VERR_NO_MEMORY;
+			goto out;
+		}
+		bufs[i].cb_next = cs.cs_free;
+		cs.cs_free = &bufs[i];
+	}
+
+	/* Create the new image the same way VDCopy() would */
+	existed = (stat64(to_file, &stat64buf) == 0) ? B_TRUE : B_FALSE;
+	cs.cs_skip_zero = existed ? B_FALSE : B_TRUE;
+	comment[0] = '\0';
+	(void) VDGetComment(from, nimage, comment, sizeof (comment));
+	if (!VBOX_SUCCESS(VDGetPCHSGeometry(from, nimage, &PCHSGeometry)))
+		bzero(&PCHSGeometry, sizeof (PCHSGeometry));
+	if (!VBOX_SUCCESS(VDGetLCHSGeometry(from, nimage, &LCHSGeometry)))
+		bzero(&LCHSGeometry, sizeof (LCHSGeometry));
+
+	rc = VDCreateBase(to, to_format, to_file, size, uimageflags, comment,
+	    &PCHSGeometry, &LCHSGeometry, NULL, VD_OPEN_FLAGS_NORMAL,
+	    NULL, NULL);
+	if (!VBOX_SUCCESS(rc))
+		goto out;
+	created = B_TRUE;
+
+	/*
+	 * The extra writers of a fixed image write the data region of the
+	 * file themselves, which needs to know where the data starts.  The
+	 * metadata is flushed first so it can be read back from the file.
+	 */
+	if (strcasecmp(to_format, "raw") == 0)
+		cs.cs_data_off = 0;
+	else if ((nwriters > 1) && (!VBOX_SUCCESS(VDFlush(to)) ||
+	    (vdisk_fixed_layout(to_file, to_format, &cs.cs_data_off) != 0)))
+		nwriters = 1;
+	cs.cs_ordered = (nwriters == 1) ? B_TRUE : B_FALSE;
+
+	/* Give every thread a handle of its own */
+	for (i = 0; i < nreaders; i++) {
+		readers[i].ct_state = &cs;
+		rc = vdi_copy_open_from(from, nimage, from_format,
+		    &readers[i].ct_hdd);
+		if (!VBOX_SUCCESS(rc))
+			goto out;
+	}
+	writers[0].ct_state = &cs;
+	writers[0].ct_hdd = to;
+	for (i = 1; i < nwriters; i++) {
+		writers[i].ct_state = &cs;
+		writers[i].ct_fd = open(to_file, O_RDWR);
+		if (writers[i].ct_fd == -1) {
+			rc = VERR_GENERAL_FAILURE;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nwriters; i++) {
+		if (pthread_create(&writers[i].ct_tid, NULL, vdi_copy_writer,
+		    &writers[i]) != 0) {
+			rc = VERR_NO_MEMORY;
+			goto stop;
+		}
+		writers[i].ct_started = B_TRUE;
+	}
+	for (i = 0; i < nreaders; i++) {
+		if (pthread_create(&readers[i].ct_tid, NULL, vdi_copy_reader,
+		    &readers[i]) != 0) {
+			rc = VERR_NO_MEMORY;
+			goto stop;
+		}
+		readers[i].ct_started = B_TRUE;
+	}
+	rc = VINF_SUCCESS;
+
+stop:
+	if (!VBOX_SUCCESS(rc)) {
+		(void) pthread_mutex_lock(&cs.cs_mutex);
+		vdi_copy_set_error(&cs, rc);
+		(void) pthread_mutex_unlock(&cs.cs_mutex);
+	}
+	for (i = 0; i < nreaders; i++) {
+		if (readers[i].ct_started)
+			(void) pthread_join(readers[i].ct_tid, NULL);
+	}
+	for (i = 0; i < nwriters; i++) {
+		if (writers[i].ct_started)
+			(void) pthread_join(writers[i].ct_tid, NULL);
+	}
+	rc = cs.cs_error;
+
+	for (i = 1; (i < nwriters) && VBOX_SUCCESS(rc); i++) {
+		if (fsync(writers[i].ct_fd) == -1)
+			rc = VERR_GENERAL_FAILURE;
+	}
+	if (VBOX_SUCCESS(rc))
+		rc = VDFlush(to);
+	if (VBOX_SUCCESS(rc))
+		vdi_copy_progress_done(&cs.cs_progress);
+
+out:
+	if (readers != NULL) {
+		for (i = 0; i < nreaders; i++) {
+			if (readers[i].ct_hdd != NULL)
+				VDDestroy(readers[i].ct_hdd);
+		}
+		free(readers);
+	}
+	if (writers != NULL) {
+		for (i = 1; i < nwriters; i++) {
+			if (writers[i].ct_fd != -1)
+				(void) close(writers[i].ct_fd);
+		}
+		free(writers);
+	}
+	if (bufs != NULL) {
+		for (i = 0; i < nbufs; i++)
+			free(bufs[i].cb_data);
+		free(bufs);
+	}
+	(void) pthread_cond_destroy(&cs.cs_cv);
+	(void) pthread_mutex_destroy(&cs.cs_mutex);
+
+	/* Don't leave a partial image behind */
+	if (!VBOX_SUCCESS(rc) && created)
+		(void) VDClose(to, existed ? false : true);
+
+	return (rc);
+}
+
+/*
+ * Progress callback of the libvdisk file copy routines.
+ */
+static void
+vdi_copy_file_progress(uint64_t done, uint64_t total, void *arg)
+{
+	vdi_copy_progress_t *cp = arg;
+
+	cp->cp_total = total;
+	vdi_copy_progress_update(cp, done);
+}
+
+static vd_copy_progress_t *
+vdi_copy_file_progress_init(vdi_copy_progress_t *cp, vdi_copy_opts_t *opts)
+{
+	vdi_copy_progress_init(cp, opts, 0, B_FALSE);
+	if ((opts == NULL) || !opts->co_progress)
+		return (NULL);
+	return (vdi_copy_file_progress);
+}
+
+static void
+vdi_copy_file_progress_done(vdi_copy_progress_t *cp, int rc)
+{
+	/* nothing was copied if a rename did it */
+	if ((rc == 0) && (cp->cp_total > 0))
+		vdi_copy_progress_done(cp);
+}
+
+/*
+ * Copy a file as is, see vdisk_copy_file().
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdi_copy_file(const char *from, const char *to, vdi_copy_opts_t *opts)
+{
+	vdi_copy_progress_t cp;
+	vd_copy_progress_t *progress;
+	int rc;
+
+	progress = vdi_copy_file_progress_init(&cp, opts);
+	rc = vdisk_copy_file(from, to, progress, &cp);
+	vdi_copy_file_progress_done(&cp, rc);
+	return (rc);
+}
+
+/*
+ * Move the files of a directory starting with prefix, see
+ * vdisk_move_files().
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdi_copy_move_files(const char *from_dir, const char *prefix,
+    const char *to_dir, vdi_copy_opts_t *opts)
+{
+	vdi_copy_progress_t cp;
+	vd_copy_progress_t *progress;
+	int rc;
+
+	progress = vdi_copy_file_progress_init(&cp, opts);
+	rc = vdisk_move_files(from_dir, prefix, to_dir, progress, &cp);
+	vdi_copy_file_progress_done(&cp, rc);
+	return (rc);
+}
+
+/*
+ * Move a virtual disk to another directory, see vdisk_move_snapshots().
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdi_copy_move_vdisk(vd_handle_t *vdh, char *pszformat, char *vdname,
+    char *new_dir, vdi_copy_opts_t *opts)
+{
+	vdi_copy_progress_t cp;
+	vd_copy_progress_t *progress;
+	int rc;
+
+	progress = vdi_copy_file_progress_init(&cp, opts);
+	rc = vdisk_move_snapshots(vdh, pszformat, vdname, new_dir, progress,
+	    &cp);
+	vdi_copy_file_progress_done(&cp, rc);
+	return (rc);
+}
+
+/*
+ * Compact a sparse image in place, see vdisk_compact().
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdi_copy_compact(const char *file, uint64_t *freedp, vdi_copy_opts_t *opts)
+{
+	vdi_copy_progress_t cp;
+	vd_copy_progress_t *progress;
+	int rc;
+
+	progress = vdi_copy_file_progress_init(&cp, opts);
+	rc = vdisk_compact(file, freedp, progress, &cp);
+	vdi_copy_file_progress_done(&cp, rc);
+	return (rc);
+}
+
+/*
+ * Convert the single fixed image of a virtual disk to another fixed
+ * format, keeping its data.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdi_copy_convert_fixed(vd_handle_t *vdh, char *vdname, char *pszformat,
+    char *pszformat_conv, vdi_copy_opts_t *opts)
+{
+	vdi_copy_progress_t cp;
+	vd_copy_progress_t *progress;
+	int rc;
+
+	progress = vdi_copy_file_progress_init(&cp, opts);
+	rc = vdisk_convert_fixed(vdh, vdname, pszformat, pszformat_conv,
+	    progress, &cp);
+	vdi_copy_file_progress_done(&cp, rc);
+	return (rc);
+}
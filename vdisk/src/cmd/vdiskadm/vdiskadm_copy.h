@@ -0,0 +1,88 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+#ifndef _VDISKADM_COPY_H
+#define	_VDISKADM_COPY_H
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+#include "VBox/VBoxHDD.h"
+#include "vdisk.h"
+
+
+/* size of each chunk handed between reader and writer threads */
+#define	VDI_COPY_CHUNK		(1024 * 1024)
+/* in-flight buffers per thread */
+#define	VDI_COPY_BUFS_PER_THREAD	2
+#define	VDI_COPY_MAX_THREADS	64
+
+/* minimum time between two progress reports */
+#define	VDI_COPY_PROGRESS_INTERVAL	1000000000LL	/* ns */
+
+typedef struct vdi_copy_opts_s {
+	int		co_nthreads;	/* reader (and fixed writer) threads */
+	boolean_t	co_progress;	/* report progress and a summary */
+	boolean_t	co_parsable;	/* ... in parsable format */
+} vdi_copy_opts_t;
+
+typedef struct vdi_copy_progress_s {
+	vdi_copy_opts_t	*cp_opts;
+	uint64_t	cp_total;	/* bytes to copy */
+	uint64_t	cp_done;	/* bytes copied so far */
+	hrtime_t	cp_start;
+	hrtime_t	cp_last;	/* time of the last report */
+	uint64_t	cp_last_done;	/* cp_done at the last report */
+	boolean_t	cp_timed;	/* read and write times are known */
+	hrtime_t	cp_read_time;	/* summed over all reader threads */
+	hrtime_t	cp_write_time;	/* summed over all writer threads */
+} vdi_copy_progress_t;
+
+int vdi_copy_parse_threads(const char *arg, int *nthreads);
+void vdi_copy_progress_init(vdi_copy_progress_t *cp, vdi_copy_opts_t *opts,
+    uint64_t total, boolean_t timed);
+void vdi_copy_progress_update(vdi_copy_progress_t *cp, uint64_t done);
+void vdi_copy_progress_done(vdi_copy_progress_t *cp);
+boolean_t vdi_copy_is_zero(const char *data, size_t len);
+int vdi_copy_open_from(PVBOXHDD from, uint_t nimage, const char *from_format,
+    PVBOXHDD *hddp);
+int vdi_copy(PVBOXHDD from, uint_t nimage, const char *from_format,
+    PVBOXHDD to, const char *to_format, const char *to_file,
+    uint64_t size, uint_t uimageflags, vdi_copy_opts_t *opts);
+int vdi_copy_file(const char *from, const char *to, vdi_copy_opts_t *opts);
+int vdi_copy_move_files(const char *from_dir, const char *prefix,
+    const char *to_dir, vdi_copy_opts_t *opts);
+int vdi_copy_move_vdisk(vd_handle_t *vdh, char *pszformat, char *vdname,
+    char *new_dir, vdi_copy_opts_t *opts);
+int vdi_copy_compact(const char *file, uint64_t *freedp,
+    vdi_copy_opts_t *opts);
+int vdi_copy_convert_fixed(vd_handle_t *vdh, char *vdname, char *pszformat,
+    char *pszformat_conv, vdi_copy_opts_t *opts);
+
+
+#ifdef	__cplusplus
+}
+#endif
+#endif /* _VDISKADM_COPY_H */
@@ -0,0 +1,788 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+/*
+ * Content indexes of images, for vdiskadm index and compare.
+ *
+ * The index of an image is a hash tree over VDI_INDEX_BLOCK blocks of
+ * the disk as read through the chain ending at that image, so two
+ * indexes of the same geometry can be compared node by node: equal
+ * nodes cover equal data, and only differing nodes need to be looked
+ * into, down to the blocks that differ.  The layout of the file is in
+ * vdiskadm_index.h.
+ *
+ * Building the index of an image starts from the index of the nearest
+ * image below it that has a valid one; only the blocks the images in
+ * between write are read and hashed again.  Without one, the blocks
+ * any image up to this one allocates are read, and the others get the
+ * hash of a zero block.  Blocks are hashed on a pool of threads, each
+ * with handles of its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <libintl.h>
+#include <sha2.h>
+
+#include "VBox/VBoxHDD.h"
+
+#include "vdisk.h"
+#include "vdiskadm_copy.h"
+#include "vdiskadm_index.h"
+
+
+typedef struct vdi_index_job_s {
+	pthread_mutex_t	xj_mutex;
+	vdi_copy_progress_t	*xj_progress;
+	vd_handle_t	*xj_vdh;
+	const char	*xj_format;
+	int		xj_image;
+	vdi_index_t	*xj_index;
+	uchar_t		xj_zero[VDI_INDEX_HASH_SIZE];	/* of a full block */
+	uint64_t	*xj_leaves;	/* leaves to hash again */
+	uint64_t	xj_nleaves;
+	uint64_t	xj_next;	/* next leaf handed to a thread */
+	uint64_t	xj_bytes;	/* bytes hashed, for the progress */
+	int		xj_errors;
+} vdi_index_job_t;
+
+typedef struct vdi_index_thr_s {
+	vdi_index_job_t	*xt_job;
+	PVBOXHDD	xt_hdd;
+	char		*xt_buf;
+	pthread_t	xt_tid;
+	boolean_t	xt_started;
+} vdi_index_thr_t;
+
+/* Merges the ranges vdi_index_compare() finds before reporting them */
+typedef struct vdi_index_run_s {
+	void		(*xr_func)(uint64_t off, uint64_t len, int state,
+			    void *arg);
+	void		*xr_arg;
+	uint64_t	xr_off;
+	uint64_t	xr_len;
+	int		xr_state;
+} vdi_index_run_t;
+
+
+static void
+vdi_index_put64(uchar_t *p, uint64_t val)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		p[i] = val & 0xff;
+		val >>= 8;
+	}
+}
+
+static uint64_t
+vdi_index_get64(const uchar_t *p)
+{
+	uint64_t val = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		val = (val << 8) | p[i];
+	return (val);
+}
+
+static void
+vdi_index_hash(const void *data, size_t len, uchar_t *hash)
+{
+	SHA2_CTX ctx;
+
+	SHA2Init(SHA256, &ctx);
+	SHA2Update(&ctx, data, len);
+	SHA2Final(hash, &ctx);
+}
+
+/*
+ * Hash of a block of zeros, as read from unallocated parts of a disk.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+static int
+vdi_index_zero_hash(size_t len, uchar_t *hash)
+{
+	char *zero;
+
+	if ((zero = calloc(1, len)) == NULL)
+		return (-1);
+	vdi_index_hash(zero, len, hash);
+	free(zero);
+	return (0);
+}
+
+/*
+ * Index file of the image, the image file name with VDI_INDEX_SUFFIX.
+ */
+static int
+vdi_index_path(vd_handle_t *vdh, int image, char *image_file, char *path)
+{
+	if (!VBOX_SUCCESS(VDGetFilename(vdh->hdd, image, image_file,
+	    MAXPATHLEN))) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (snprintf(path, MAXPATHLEN, "%s%s", image_file,
+	    VDI_INDEX_SUFFIX) >= MAXPATHLEN) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Allocate an index and lay out the levels of its tree.
+ */
+static vdi_index_t *
+vdi_index_alloc(uint64_t size, uint32_t block)
+{
+	vdi_index_t *xi;
+	uint64_t count, nodes = 0;
+	int l;
+
+	if ((size == 0) || (block == 0) || (block % 512 != 0)) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if ((xi = calloc(1, sizeof (vdi_index_t))) == NULL) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	xi->xi_block = block;
+	xi->xi_size = size;
+
+	count = (size + block - 1) / block;
+	for (l = 0; l < VDI_INDEX_MAX_LEVELS; l++) {
+		xi->xi_count[l] = count;
+		nodes += count;
+		if (count == 1)
+			break;
+		count = (count + 1) / 2;
+	}
+	xi->xi_levels = l + 1;
+
+	xi->xi_nodes_size = nodes * VDI_INDEX_HASH_SIZE;
+	if ((xi->xi_nodes = malloc(xi->xi_nodes_size)) == NULL) {
+		free(xi);
+		errno = ENOMEM;
+		return (NULL);
+	}
+	xi->xi_level[0] = xi->xi_nodes;
+	for (l = 1; l < xi->xi_levels; l++)
+		xi->xi_level[l] = xi->xi_level[l - 1] +
+		    xi->xi_count[l - 1] * VDI_INDEX_HASH_SIZE;
+	return (xi);
+}
+
+void
+vdi_index_free(vdi_index_t *xi)
+{
+	if (xi == NULL)
+		return;
+	free(xi->xi_nodes);
+	free(xi);
+}
+
+/*
+ * Hash the levels above the leaves.
+ */
+static void
+vdi_index_hash_tree(vdi_index_t *xi)
+{
+	uchar_t *child, *node;
+	uint64_t k;
+	int l;
+
+	for (l = 1; l < xi->xi_levels; l++) {
+		for (k = 0; k < xi->xi_count[l]; k++) {
+			child = xi->xi_level[l - 1] + 2 * k *
+			    VDI_INDEX_HASH_SIZE;
+			node = xi->xi_level[l] + k * VDI_INDEX_HASH_SIZE;
+			if (2 * k + 1 < xi->xi_count[l - 1])
+				vdi_index_hash(child, 2 * VDI_INDEX_HASH_SIZE,
+				    node);
+			else
+				bcopy(child, node, VDI_INDEX_HASH_SIZE);
+		}
+	}
+}
+
+/*
+ * Read the index of an image of the chain.
+ *	vdh - handle with the image chain opened
+ *	image - image number in the chain
+ *	xip - returns the index, to be freed with vdi_index_free()
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno ENOENT if there is no index, ESTALE if the
+ *	    image changed since it was indexed
+ */
+int
+vdi_index_load(vd_handle_t *vdh, int image, vdi_index_t **xip)
+{
+	char image_file[MAXPATHLEN];
+	char path[MAXPATHLEN];
+	uchar_t hdr[VDI_INDEX_HDR_SIZE];
+	uchar_t *root;
+	struct stat64 st;
+	vdi_index_t *xi = NULL;
+	uint32_t block;
+	FILE *fp;
+
+	if (vdi_index_path(vdh, image, image_file, path) == -1)
+		return (-1);
+	if ((fp = fopen(path, "r")) == NULL)
+		return (-1);
+
+	if (fread(hdr, VDI_INDEX_HDR_SIZE, 1, fp) != 1)
+		goto corrupt;
+	if ((bcmp(hdr, VDI_INDEX_MAGIC, 8) != 0) ||
+	    (vdi_index_get64(hdr + 8) >> 32 != VDI_INDEX_VERSION))
+		goto corrupt;
+	block = vdi_index_get64(hdr + 8) & 0xffffffff;
+	if ((xi = vdi_index_alloc(vdi_index_get64(hdr + 16), block)) == NULL)
+		goto fail;
+	xi->xi_fsize = vdi_index_get64(hdr + 24);
+	xi->xi_mtime_sec = vdi_index_get64(hdr + 32);
+	xi->xi_mtime_nsec = vdi_index_get64(hdr + 40);
+	if ((vdi_index_get64(hdr + 48) != xi->xi_count[0]) ||
+	    (fread(xi->xi_nodes, xi->xi_nodes_size, 1, fp) != 1))
+		goto corrupt;
+	root = xi->xi_level[xi->xi_levels - 1];
+	if (bcmp(hdr + 64, root, VDI_INDEX_HASH_SIZE) != 0)
+		goto corrupt;
+	(void) fclose(fp);
+	fp = NULL;
+
+	/* Whatever changed the image made the index stale */
+	if ((stat64(image_file, &st) == -1) ||
+	    (xi->xi_size != VDGetSize(vdh->hdd, image)) ||
+	    (xi->xi_fsize != (uint64_t)st.st_size) ||
+	    (xi->xi_mtime_sec != (uint64_t)st.st_mtim.tv_sec) ||
+	    (xi->xi_mtime_nsec != (uint64_t)st.st_mtim.tv_nsec)) {
+		errno = ESTALE;
+		goto fail;
+	}
+
+	*xip = xi;
+	return (0);
+
+corrupt:
+	errno = EINVAL;
+fail:
+	if (fp != NULL)
+		(void) fclose(fp);
+	vdi_index_free(xi);
+	return (-1);
+}
+
+/*
+ * Write an index next to its image, replacing any old one at once.
+ */
+static int
+vdi_index_write(const char *path, vdi_index_t *xi)
+{
+	char tmp[MAXPATHLEN];
+	uchar_t hdr[VDI_INDEX_HDR_SIZE];
+	FILE *fp;
+
+	bzero(hdr, sizeof (hdr));
+	bcopy(VDI_INDEX_MAGIC, hdr, 8);
+	vdi_index_put64(hdr + 8, ((uint64_t)VDI_INDEX_VERSION << 32) |
+	    xi->xi_block);
+	vdi_index_put64(hdr + 16, xi->xi_size);
+	vdi_index_put64(hdr + 24, xi->xi_fsize);
+	vdi_index_put64(hdr + 32, xi->xi_mtime_sec);
+	vdi_index_put64(hdr + 40, xi->xi_mtime_nsec);
+	vdi_index_put64(hdr + 48, xi->xi_count[0]);
+	bcopy(xi->xi_level[xi->xi_levels - 1], hdr + 64, VDI_INDEX_HASH_SIZE);
+
+	if (snprintf(tmp, sizeof (tmp), "%s.tmp", path) >= sizeof (tmp)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	if ((fp = fopen(tmp, "w")) == NULL)
+		return (-1);
+	if ((fwrite(hdr, sizeof (hdr), 1, fp) != 1) ||
+	    (fwrite(xi->xi_nodes, xi->xi_nodes_size, 1, fp) != 1) ||
+	    (fflush(fp) != 0) || (fsync(fileno(fp)) == -1)) {
+		(void) fclose(fp);
+		(void) unlink(tmp);
+		return (-1);
+	}
+	if ((fclose(fp) != 0) || (rename(tmp, path) == -1)) {
+		(void) unlink(tmp);
+		return (-1);
+	}
+	return (0);
+}
+
+static void *
+vdi_index_hasher(void *arg)
+{
+	vdi_index_thr_t *xt = arg;
+	vdi_index_job_t *xj = xt->xt_job;
+	vdi_index_t *xi = xj->xj_index;
+	uchar_t *leaf;
+	uint64_t k, off, len;
+	int rc;
+
+	for (;;) {
+		(void) pthread_mutex_lock(&xj->xj_mutex);
+		if ((xj->xj_next >= xj->xj_nleaves) || (xj->xj_errors != 0)) {
+			(void) pthread_mutex_unlock(&xj->xj_mutex);
+			break;
+		}
+		k = xj->xj_leaves[xj->xj_next++];
+		(void) pthread_mutex_unlock(&xj->xj_mutex);
+
+		off = k * xi->xi_block;
+		len = MIN(xi->xi_block, xi->xi_size - off);
+		leaf = xi->xi_level[0] + k * VDI_INDEX_HASH_SIZE;
+		rc = VDRead(xt->xt_hdd, off, xt->xt_buf, len);
+		if (VBOX_SUCCESS(rc)) {
+			if ((len == xi->xi_block) &&
+			    vdi_copy_is_zero(xt->xt_buf, len))
+				bcopy(xj->xj_zero, leaf, VDI_INDEX_HASH_SIZE);
+			else
+				vdi_index_hash(xt->xt_buf, len, leaf);
+		}
+
+		(void) pthread_mutex_lock(&xj->xj_mutex);
+		if (!VBOX_SUCCESS(rc)) {
+			(void) fprintf(stderr, "\n%s %llu\n",
+			    gettext("ERROR: Unable to read image at offset"),
+			    (unsigned long long)off);
+			xj->xj_errors++;
+		}
+		xj->xj_bytes += len;
+		vdi_copy_progress_update(xj->xj_progress, xj->xj_bytes);
+		(void) pthread_mutex_unlock(&xj->xj_mutex);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Hash the leaves of the job on a pool of threads.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+static int
+vdi_index_run(vdi_index_job_t *xj, int nthreads)
+{
+	vdi_index_thr_t *xt;
+	int i, started = 0;
+	int rc = -1;
+
+	if (xj->xj_nleaves == 0)
+		return (0);
+	if (nthreads > xj->xj_nleaves)
+		nthreads = xj->xj_nleaves;
+
+	xt = calloc(nthreads, sizeof (vdi_index_thr_t));
+	if (xt == NULL)
+		return (-1);
+	for (i = 0; i < nthreads; i++) {
+		xt[i].xt_job = xj;
+		xt[i].xt_buf = malloc(xj->xj_index->xi_block);
+		if (xt[i].xt_buf == NULL)
+			goto out;
+		if (!VBOX_SUCCESS(vdi_copy_open_from(xj->xj_vdh->hdd,
+		    xj->xj_image, xj->xj_format, &xt[i].xt_hdd))) {
+			xt[i].xt_hdd = NULL;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&xt[i].xt_tid, NULL, vdi_index_hasher,
+		    &xt[i]) != 0)
+			break;
+		xt[i].xt_started = B_TRUE;
+		started++;
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (xt[i].xt_started)
+			(void) pthread_join(xt[i].xt_tid, NULL);
+	}
+	/* Fewer threads just take longer */
+	if ((started > 0) && (xj->xj_errors == 0))
+		rc = 0;
+out:
+	for (i = 0; i < nthreads; i++) {
+		if (xt[i].xt_hdd != NULL)
+			VDDestroy(xt[i].xt_hdd);
+		free(xt[i].xt_buf);
+	}
+	free(xt);
+	return (rc);
+}
+
+/*
+ * List the leaves an array of extents touches, in order.
+ */
+static int
+vdi_index_leaves(vdi_index_t *xi, vd_extent_t *extents, int nextents,
+    uint64_t **leavesp, uint64_t *nleavesp)
+{
+	uint64_t *leaves;
+	uint64_t n = 0, max = 0, k, last;
+	int i;
+
+	*leavesp = NULL;
+	for (i = 0; i < nextents; i++) {
+		if ((extents[i].ve_length == 0) ||
+		    (extents[i].ve_offset >= xi->xi_size))
+			continue;
+		k = extents[i].ve_offset / xi->xi_block;
+		last = (MIN(extents[i].ve_offset + extents[i].ve_length,
+		    xi->xi_size) - 1) / xi->xi_block;
+		/* Extents don't overlap, but may share a block */
+		if ((n > 0) && ((*leavesp)[n - 1] >= k))
+			k = (*leavesp)[n - 1] + 1;
+		for (; k <= last; k++) {
+			if (n == max) {
+				leaves = realloc(*leavesp,
+				    (max + 1024) * 2 * sizeof (uint64_t));
+				if (leaves == NULL) {
+					free(*leavesp);
+					*leavesp = NULL;
+					return (-1);
+				}
+				*leavesp = leaves;
+				max = (max + 1024) * 2;
+			}
+			(*leavesp)[n++] = k;
+		}
+	}
+	*nleavesp = n;
+	return (0);
+}
+
+/*
+ * Build the index of one image, starting from the index of an image
+ * below it when there is one.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+static int
+vdi_index_build_image(vdi_index_job_t *xj, vdi_index_t *from,
+    int from_image, int nthreads)
+{
+	vd_handle_t *vdh = xj->xj_vdh;
+	char image_file[MAXPATHLEN];
+	char path[MAXPATHLEN];
+	uchar_t tail[VDI_INDEX_HASH_SIZE];
+	vd_extent_t *extents = NULL;
+	struct stat64 st;
+	vdi_index_t *xi;
+	uint64_t size, k, len;
+	int nextents;
+	int rc = -1;
+
+	size = VDGetSize(vdh->hdd, xj->xj_image);
+	if ((xi = vdi_index_alloc(size, VDI_INDEX_BLOCK)) == NULL)
+		return (-1);
+	xj->xj_index = xi;
+
+	if ((from != NULL) && (from->xi_size == size) &&
+	    (from->xi_block == xi->xi_block)) {
+		bcopy(from->xi_level[0], xi->xi_level[0],
+		    xi->xi_count[0] * VDI_INDEX_HASH_SIZE);
+	} else {
+		from_image = -1;
+		len = size % xi->xi_block;
+		if ((len != 0) && (vdi_index_zero_hash(len, tail) == -1))
+			goto out;
+		for (k = 0; k < xi->xi_count[0]; k++)
+			bcopy(((len != 0) && (k == xi->xi_count[0] - 1)) ?
+			    tail : xj->xj_zero, xi->xi_level[0] +
+			    k * VDI_INDEX_HASH_SIZE, VDI_INDEX_HASH_SIZE);
+	}
+
+	if ((vdi_index_path(vdh, xj->xj_image, image_file, path) == -1) ||
+	    (stat64(image_file, &st) == -1) ||
+	    (vdisk_get_delta(vdh, from_image, xj->xj_image, &extents,
+	    &nextents) == -1))
+		goto out;
+	/* Taken before reading, so a write meanwhile makes it stale */
+	xi->xi_fsize = st.st_size;
+	xi->xi_mtime_sec = st.st_mtim.tv_sec;
+	xi->xi_mtime_nsec = st.st_mtim.tv_nsec;
+
+	if (vdi_index_leaves(xi, extents, nextents, &xj->xj_leaves,
+	    &xj->xj_nleaves) == -1)
+		goto out;
+	xj->xj_next = 0;
+	xj->xj_errors = 0;
+	xj->xj_progress->cp_total += xj->xj_nleaves * xi->xi_block;
+
+	if (vdi_index_run(xj, nthreads) == -1)
+		goto out;
+	vdi_index_hash_tree(xi);
+	if (vdi_index_write(path, xi) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+		    gettext("ERROR: Unable to write index"), path,
+		    strerror(errno));
+		goto out;
+	}
+	rc = 0;
+out:
+	if (rc == -1)
+		vdi_index_free(xi);
+	else if (from != NULL)
+		vdi_index_free(from);
+	vdisk_free_allocation(extents);
+	free(xj->xj_leaves);
+	xj->xj_leaves = NULL;
+	return (rc);
+}
+
+/*
+ * Build the missing or stale indexes of the images of a virtual disk,
+ * base first.  The images of a linked clone's parent are used when
+ * they have an index but never indexed.
+ *	vdh - handle with the image chain opened read-only
+ *	pszformat - VBox format of the images
+ *	skip_top - the top image is in use, leave it
+ *	opts - threads and progress options
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdi_index_build(vd_handle_t *vdh, const char *pszformat, boolean_t skip_top,
+    vdi_copy_opts_t *opts)
+{
+	vdi_copy_progress_t cp;
+	vdi_index_job_t xj;
+	vdi_index_t *from = NULL, *xi;
+	int from_image = -1;
+	int nimages, i;
+	int rc = -1;
+
+	bzero(&xj, sizeof (xj));
+	(void) pthread_mutex_init(&xj.xj_mutex, NULL);
+	vdi_copy_progress_init(&cp, opts, 0, B_FALSE);
+	xj.xj_progress = &cp;
+	xj.xj_vdh = vdh;
+	xj.xj_format = pszformat;
+	if (vdi_index_zero_hash(VDI_INDEX_BLOCK, xj.xj_zero) == -1)
+		goto nomem;
+
+	nimages = VDGetCount(vdh->hdd);
+	if (skip_top)
+		nimages--;
+	for (i = 0; i < nimages; i++) {
+		if (vdi_index_load(vdh, i, &xi) == 0) {
+			vdi_index_free(from);
+			from = xi;
+			from_image = i;
+			continue;
+		}
+		if (i < vdh->parent_images)
+			continue;
+
+		xj.xj_image = i;
+		if (vdi_index_build_image(&xj, from, from_image,
+		    (opts->co_nthreads > 0) ? opts->co_nthreads : 1) == -1) {
+			(void) fprintf(stderr, "\n%s: \"%d\"\n\n",
+			    gettext("ERROR: Unable to index image number"), i);
+			goto out;
+		}
+		/* The build took over from */
+		from = xj.xj_index;
+		from_image = i;
+	}
+	vdi_copy_progress_done(&cp);
+	rc = 0;
+	goto out;
+
+nomem:
+	(void) fprintf(stderr, "%s\n", gettext(
+	    "ERROR: Unable to allocate memory."));
+out:
+	vdi_index_free(from);
+	(void) pthread_mutex_destroy(&xj.xj_mutex);
+	return (rc);
+}
+
+static void
+vdi_index_emit(vdi_index_run_t *xr, uint64_t off, uint64_t len, int state)
+{
+	if (len == 0)
+		return;
+	if ((xr->xr_len > 0) && (xr->xr_state == state) &&
+	    (xr->xr_off + xr->xr_len == off)) {
+		xr->xr_len += len;
+		return;
+	}
+	if (xr->xr_len > 0)
+		xr->xr_func(xr->xr_off, xr->xr_len, xr->xr_state, xr->xr_arg);
+	xr->xr_off = off;
+	xr->xr_len = len;
+	xr->xr_state = state;
+}
+
+/*
+ * Descend into the nodes that differ, reporting what each node covers.
+ */
+static void
+vdi_index_diff(vdi_index_t *a, vdi_index_t *b, int l, uint64_t k,
+    vdi_index_run_t *xr)
+{
+	uint64_t off, end;
+	boolean_t same;
+
+	same = (bcmp(a->xi_level[l] + k * VDI_INDEX_HASH_SIZE,
+	    b->xi_level[l] + k * VDI_INDEX_HASH_SIZE,
+	    VDI_INDEX_HASH_SIZE) == 0);
+	if (same || (l == 0)) {
+		off = (k << l) * a->xi_block;
+		end = MIN(((k + 1) << l) * a->xi_block, a->xi_size);
+		vdi_index_emit(xr, off, end - off, same ? VDI_INDEX_EQUAL :
+		    VDI_INDEX_DIFFER);
+		return;
+	}
+	vdi_index_diff(a, b, l - 1, 2 * k, xr);
+	if (2 * k + 1 < a->xi_count[l - 1])
+		vdi_index_diff(a, b, l - 1, 2 * k + 1, xr);
+}
+
+/*
+ * Compare two indexes and report the ranges that are equal, differ or
+ * can't be told apart by the indexes, in order and merged.  Trees of
+ * the same geometry are descended only where they differ; disks of
+ * different sizes are compared block by block up to the smaller size
+ * and differ beyond it.
+ *	a, b - indexes to compare, NULL for one that is missing
+ *	func - called with each range and its VDI_INDEX_* state
+ *	arg - passed to func
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdi_index_compare(vdi_index_t *a, vdi_index_t *b,
+    void (*func)(uint64_t off, uint64_t len, int state, void *arg),
+    void *arg)
+{
+	vdi_index_run_t xr;
+	uint64_t common, size, k;
+
+	bzero(&xr, sizeof (xr));
+	xr.xr_func = func;
+	xr.xr_arg = arg;
+
+	if ((a == NULL) || (b == NULL)) {
+		size = (a != NULL) ? a->xi_size : ((b != NULL) ?
+		    b->xi_size : 0);
+		vdi_index_emit(&xr, 0, size, VDI_INDEX_UNKNOWN);
+	} else if (a->xi_block != b->xi_block) {
+		vdi_index_emit(&xr, 0, MAX(a->xi_size, b->xi_size),
+		    VDI_INDEX_UNKNOWN);
+	} else if (a->xi_size == b->xi_size) {
+		vdi_index_diff(a, b, a->xi_levels - 1, 0, &xr);
+	} else {
+		/* Only whole blocks hash the same on both */
+		size = MIN(a->xi_size, b->xi_size);
+		common = size / a->xi_block;
+		for (k = 0; k < common; k++)
+			vdi_index_emit(&xr, k * a->xi_block, a->xi_block,
+			    (bcmp(a->xi_level[0] + k * VDI_INDEX_HASH_SIZE,
+			    b->xi_level[0] + k * VDI_INDEX_HASH_SIZE,
+			    VDI_INDEX_HASH_SIZE) == 0) ? VDI_INDEX_EQUAL :
+			    VDI_INDEX_DIFFER);
+		vdi_index_emit(&xr, common * a->xi_block,
+		    MAX(a->xi_size, b->xi_size) - common * a->xi_block,
+		    VDI_INDEX_DIFFER);
+	}
+	if (xr.xr_len > 0)
+		func(xr.xr_off, xr.xr_len, xr.xr_state, arg);
+	return (0);
+}
+
+/*
+ * Remove the indexes in a virtual disk directory whose image is no
+ * longer one of the disk's own images, or every index if vdh is NULL.
+ */
+void
+vdi_index_prune(vd_handle_t *vdh, const char *vdname)
+{
+	char image_file[MAXPATHLEN];
+	char path[MAXPATHLEN];
+	struct dirent *dp;
+	char *slash;
+	size_t len, slen = strlen(VDI_INDEX_SUFFIX);
+	int i, nimages = 0;
+	DIR *dirp;
+
+	if ((dirp = opendir(vdname)) == NULL)
+		return;
+	if (vdh != NULL)
+		nimages = VDGetCount(vdh->hdd);
+	while ((dp = readdir(dirp)) != NULL) {
+		len = strlen(dp->d_name);
+		if ((len <= slen) ||
+		    (strcmp(dp->d_name + len - slen, VDI_INDEX_SUFFIX) != 0))
+			continue;
+		for (i = (vdh != NULL) ? vdh->parent_images : 0;
+		    i < nimages; i++) {
+			if (!VBOX_SUCCESS(VDGetFilename(vdh->hdd, i,
+			    image_file, sizeof (image_file))))
+				continue;
+			slash = strrchr(image_file, '/');
+			slash = (slash != NULL) ? slash + 1 : image_file;
+			if ((strlen(slash) == len - slen) &&
+			    (strncmp(slash, dp->d_name, len - slen) == 0))
+				break;
+		}
+		if (i < nimages)
+			continue;
+		(void) snprintf(path, sizeof (path), "%s/%s", vdname,
+		    dp->d_name);
+		(void) unlink(path);
+	}
+	(void) closedir(dirp);
+}
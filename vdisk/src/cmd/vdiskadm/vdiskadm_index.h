@@ -0,0 +1,96 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+
+#ifndef _VDISKADM_INDEX_H
+#define	_VDISKADM_INDEX_H
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+#include "VBox/VBoxHDD.h"
+#include "vdisk.h"
+#include "vdiskadm_copy.h"
+
+
+/*
+ * Content index of an image, kept beside it as <image file>.idx: a hash
+ * tree over fixed-size blocks of what a read through the chain ending
+ * at the image returns.  All integers are big endian.
+ *
+ *	header (VDI_INDEX_HDR_SIZE bytes):
+ *	    magic (8), version (4), block size (4), disk size (8),
+ *	    image file size (8), image mtime seconds (8) and
+ *	    nanoseconds (8), number of leaves (8), reserved (8),
+ *	    root hash (VDI_INDEX_HASH_SIZE)
+ *	nodes:
+ *	    the hashes of every level of the tree, the leaves first and
+ *	    the root last
+ *
+ * A leaf is the SHA-256 of its block, an inner node the SHA-256 of its
+ * two children; the last node of a level without a sibling moves up
+ * unchanged.  An index whose image file no longer has the size and
+ * mtime recorded is stale.
+ */
+#define	VDI_INDEX_SUFFIX	".idx"
+#define	VDI_INDEX_MAGIC		"VDMERKLE"
+#define	VDI_INDEX_VERSION	1
+#define	VDI_INDEX_HDR_SIZE	96
+#define	VDI_INDEX_HASH_SIZE	32
+#define	VDI_INDEX_BLOCK		VDI_COPY_CHUNK
+#define	VDI_INDEX_MAX_LEVELS	64
+
+/* states of a range reported by vdi_index_compare() */
+#define	VDI_INDEX_EQUAL		0
+#define	VDI_INDEX_DIFFER	1
+#define	VDI_INDEX_UNKNOWN	2
+
+typedef struct vdi_index_s {
+	uint32_t	xi_block;
+	uint64_t	xi_size;	/* bytes of the disk covered */
+	uint64_t	xi_fsize;	/* image file when indexed */
+	uint64_t	xi_mtime_sec;
+	uint64_t	xi_mtime_nsec;
+	int		xi_levels;
+	uint64_t	xi_count[VDI_INDEX_MAX_LEVELS];	/* nodes per level */
+	uchar_t		*xi_level[VDI_INDEX_MAX_LEVELS]; /* into xi_nodes */
+	uchar_t		*xi_nodes;
+	size_t		xi_nodes_size;
+} vdi_index_t;
+
+int vdi_index_build(vd_handle_t *vdh, const char *pszformat,
+    boolean_t skip_top, vdi_copy_opts_t *opts);
+int vdi_index_load(vd_handle_t *vdh, int image, vdi_index_t **xip);
+void vdi_index_free(vdi_index_t *xi);
+int vdi_index_compare(vdi_index_t *a, vdi_index_t *b,
+    void (*func)(uint64_t off, uint64_t len, int state, void *arg),
+    void *arg);
+void vdi_index_prune(vd_handle_t *vdh, const char *vdname);
+
+
+#ifdef	__cplusplus
+}
+#endif
+#endif /* _VDISKADM_INDEX_H */
@@ -0,0 +1,506 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+
+/*
+ * Inventory of the virtual disks in a tree, for vdiskadm list -R.
+ *
+ * The tree is walked by a pool of threads taking directories off a
+ * shared list: a directory with a store is a virtual disk and isn't looked
+ * into any further, the directories of any other are put on the list.
+ * Only the stores are read, through their compiled caches, and the files
+ * of a virtual disk are only looked at with stat, so a rescan of a tree
+ * whose stores haven't changed parses none of them and no image is ever
+ * opened.  Each virtual disk gets its lines printed together:
+ *
+ *	disk:<vtype>:<max-size>:<allocated>:<depth>:<rwcnt>:<rocnt>:<vdname>
+ *	snapshot:<allocated>:<depth>:<clones>:<vdname>@<snapname>
+ *
+ * where allocated is the bytes the files of the virtual disk, or those of
+ * the image of the snapshot, take on disk, depth is the number of images
+ * in the chain up to and including the virtual disk or snapshot, counting
+ * those of the snapshots a linked clone was created from, and clones is
+ * the number of linked clones of the snapshot.  The name is last so that
+ * colons in it don't get in the way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <libintl.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#include "vdisk.h"
+#include "vdiskadm_scan.h"
+
+
+typedef struct vdi_scan_dir_s {
+	struct vdi_scan_dir_s	*sd_next;
+	char			*sd_path;
+} vdi_scan_dir_t;
+
+typedef struct vdi_scan_s {
+	pthread_mutex_t	vs_mutex;
+	pthread_cond_t	vs_cv;
+	vdi_scan_dir_t	*vs_dirs;	/* directories left to look at */
+	int		vs_busy;	/* threads looking at one */
+	int		vs_errors;
+	pthread_mutex_t	vs_out_mutex;	/* keeps the lines of a disk together */
+} vdi_scan_t;
+
+/* file in the directory of a virtual disk */
+typedef struct vdi_scan_file_s {
+	char		*sf_name;
+	uint64_t	sf_alloc;	/* bytes allocated to it */
+} vdi_scan_file_t;
+
+/* snapshot of a virtual disk */
+typedef struct vdi_scan_snap_s {
+	xmlChar		*ss_name;
+	uint64_t	ss_alloc;
+	int		ss_clones;
+} vdi_scan_snap_t;
+
+
+static void
+vdi_scan_error(vdi_scan_t *vs)
+{
+	(void) pthread_mutex_lock(&vs->vs_mutex);
+	vs->vs_errors++;
+	(void) pthread_mutex_unlock(&vs->vs_mutex);
+}
+
+/*
+ * Put a directory on the list of those to look at.
+ */
+static int
+vdi_scan_push(vdi_scan_t *vs, const char *path)
+{
+	vdi_scan_dir_t *sd;
+
+	if ((sd = malloc(sizeof (vdi_scan_dir_t))) == NULL)
+		return (-1);
+	if ((sd->sd_path = strdup(path)) == NULL) {
+		free(sd);
+		return (-1);
+	}
+	(void) pthread_mutex_lock(&vs->vs_mutex);
+	sd->sd_next = vs->vs_dirs;
+	vs->vs_dirs = sd;
+	(void) pthread_cond_signal(&vs->vs_cv);
+	(void) pthread_mutex_unlock(&vs->vs_mutex);
+	return (0);
+}
+
+/*
+ * Count the images a linked clone is created on: those of the snapshots
+ * of its parent up to the one it was cloned from, and those the parent is
+ * created on in turn.
+ *	vdh - handle of the store of the linked clone
+ *	level - number of parents already looked at
+ *	depthp - set to the number of images
+ */
+static int
+vdi_scan_parent_depth(vd_handle_t *vdh, int level, int *depthp)
+{
+	char pvdname[MAXPATHLEN];
+	vd_handle_t *pvdh = NULL;
+	const char *parent;
+	const char *at;
+	xmlNodePtr node;
+	xmlNodePtr snap_node;
+	xmlChar *name;
+	int found = 0;
+	int depth;
+
+	*depthp = 0;
+	parent = vdisk_peek_prop_str(vdh, "parent");
+	if ((parent == NULL) || (strcmp(parent, "none") == 0))
+		return (0);
+
+	at = strrchr(parent, '@');
+	if ((at == NULL) || (at == parent) ||
+	    (strlen(parent) >= MAXPATHLEN) || (level >= VD_MAX_CLONE_DEPTH))
+		return (-1);
+	(void) strlcpy(pvdname, parent, MAXPATHLEN);
+	pvdname[at - parent] = '\0';
+
+	if (vdisk_read_tree(&pvdh, pvdname) == -1)
+		return (-1);
+	if (vdi_scan_parent_depth(pvdh, level + 1, &depth) == -1) {
+		vdisk_free_tree(pvdh);
+		return (-1);
+	}
+
+	for (node = pvdh->snap_root; (node != NULL) && !found;
+	    node = node->next) {
+		if (xmlStrcmp(node->name, (xmlChar *)"snapshot") != 0)
+			continue;
+		depth++;
+		for (snap_node = node->xmlChildrenNode; snap_node != NULL;
+		    snap_node = snap_node->next) {
+			if (xmlStrcmp(snap_node->name, (xmlChar *)"name") != 0)
+				continue;
+			name = xmlNodeListGetString(pvdh->doc,
+			    snap_node->xmlChildrenNode, 1);
+			found = ((name != NULL) &&
+			    (strcmp((char *)name, at) == 0));
+			xmlFree(name);
+			break;
+		}
+	}
+
+	vdisk_free_tree(pvdh);
+	if (!found)
+		return (-1);
+	*depthp = depth;
+	return (0);
+}
+
+/*
+ * Bytes allocated to the image in a file of the virtual disk, along with
+ * the extent files named after it, as in <base>-s001.vmdk.
+ */
+static uint64_t
+vdi_scan_image_alloc(vdi_scan_file_t *files, int nfiles, const char *vdfile)
+{
+	const char *dot;
+	const char *end;
+	size_t baselen;
+	size_t len;
+	uint64_t alloc = 0;
+	int i;
+
+	if ((dot = strrchr(vdfile, '.')) == NULL)
+		dot = vdfile + strlen(vdfile);
+	baselen = dot - vdfile;
+
+	for (i = 0; i < nfiles; i++) {
+		if (strcmp(files[i].sf_name, vdfile) == 0) {
+			alloc += files[i].sf_alloc;
+			continue;
+		}
+		len = strlen(files[i].sf_name);
+		if (len <= baselen + strlen(dot) + 1)
+			continue;
+		end = files[i].sf_name + len - strlen(dot);
+		if ((strncmp(files[i].sf_name, vdfile, baselen) == 0) &&
+		    (files[i].sf_name[baselen] == '-') &&
+		    (strcmp(end, dot) == 0))
+			alloc += files[i].sf_alloc;
+	}
+	return (alloc);
+}
+
+/*
+ * Read the names and allocation of the files of a virtual disk.
+ */
+static int
+vdi_scan_files(const char *vdname, vdi_scan_file_t **filesp, int *nfilesp)
+{
+	char path[MAXPATHLEN];
+	vdi_scan_file_t *files = NULL;
+	vdi_scan_file_t *nfiles;
+	struct dirent *de;
+	struct stat64 st;
+	int cnt = 0;
+	int max = 0;
+	DIR *dir;
+
+	*filesp = NULL;
+	*nfilesp = 0;
+	if ((dir = opendir(vdname)) == NULL)
+		return (-1);
+	while ((de = readdir(dir)) != NULL) {
+		(void) snprintf(path, MAXPATHLEN, "%s/%s", vdname, de->d_name);
+		if ((lstat64(path, &st) == -1) || !S_ISREG(st.st_mode))
+			continue;
+		if (cnt == max) {
+			nfiles = realloc(files,
+			    (max + 16) * 2 * sizeof (vdi_scan_file_t));
+			if (nfiles == NULL)
+				goto fail;
+			files = nfiles;
+			max = (max + 16) * 2;
+		}
+		if ((files[cnt].sf_name = strdup(de->d_name)) == NULL)
+			goto fail;
+		files[cnt].sf_alloc = (uint64_t)st.st_blocks * DEV_BSIZE;
+		cnt++;
+	}
+	(void) closedir(dir);
+	*filesp = files;
+	*nfilesp = cnt;
+	return (0);
+
+fail:
+	(void) closedir(dir);
+	while (cnt > 0)
+		free(files[--cnt].sf_name);
+	free(files);
+	return (-1);
+}
+
+/*
+ * Print the lines of a virtual disk and its snapshots.
+ */
+static int
+vdi_scan_disk(vdi_scan_t *vs, const char *path)
+{
+	char vdname[MAXPATHLEN];
+	vdi_scan_file_t *files = NULL;
+	vdi_scan_snap_t *snaps = NULL;
+	vdi_scan_snap_t *ss;
+	vd_handle_t *vdh = NULL;
+	xmlNodePtr node;
+	xmlNodePtr snap_node;
+	xmlChar *vdfile;
+	const char *vtype;
+	const char *size;
+	const char *rwcnt;
+	const char *rocnt;
+	uint64_t total = 0;
+	int nfiles = 0;
+	int nsnaps = 0;
+	int depth;
+	int ret = -1;
+	int i;
+
+	(void) strlcpy(vdname, path, MAXPATHLEN);
+	if (vdisk_read_tree(&vdh, vdname) == -1)
+		return (-1);
+
+	vtype = vdisk_peek_prop_str(vdh, "vtype");
+	size = vdisk_peek_prop_str(vdh, "max-size");
+	rwcnt = vdisk_peek_prop_str(vdh, "rwcnt");
+	rocnt = vdisk_peek_prop_str(vdh, "rocnt");
+	if ((vtype == NULL) || (size == NULL) || (rwcnt == NULL) ||
+	    (rocnt == NULL)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to retrieve properties from store"),
+		    vdname);
+		goto fail;
+	}
+	if (vdi_scan_parent_depth(vdh, 0, &depth) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to find parent snapshot"), vdname);
+		goto fail;
+	}
+	if (vdi_scan_files(vdname, &files, &nfiles) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to read directory"), vdname);
+		goto fail;
+	}
+	for (i = 0; i < nfiles; i++)
+		total += files[i].sf_alloc;
+
+	for (node = vdh->snap_root; node != NULL; node = node->next) {
+		if (xmlStrcmp(node->name, (xmlChar *)"snapshot") == 0)
+			nsnaps++;
+	}
+	if ((nsnaps > 0) &&
+	    ((snaps = calloc(nsnaps, sizeof (vdi_scan_snap_t))) == NULL))
+		goto fail;
+	ss = snaps;
+	for (node = vdh->snap_root; node != NULL; node = node->next) {
+		if (xmlStrcmp(node->name, (xmlChar *)"snapshot") != 0)
+			continue;
+		for (snap_node = node->xmlChildrenNode; snap_node != NULL;
+		    snap_node = snap_node->next) {
+			if (xmlStrcmp(snap_node->name,
+			    (xmlChar *)"name") == 0) {
+				xmlFree(ss->ss_name);
+				ss->ss_name = xmlNodeListGetString(vdh->doc,
+				    snap_node->xmlChildrenNode, 1);
+			} else if (xmlStrcmp(snap_node->name,
+			    (xmlChar *)"vdfile") == 0) {
+				vdfile = xmlNodeListGetString(vdh->doc,
+				    snap_node->xmlChildrenNode, 1);
+				if (vdfile != NULL) {
+					ss->ss_alloc = vdi_scan_image_alloc(
+					    files, nfiles, (char *)vdfile);
+					xmlFree(vdfile);
+				}
+			} else if (xmlStrcmp(snap_node->name,
+			    (xmlChar *)"cow_clone") == 0) {
+				ss->ss_clones++;
+			}
+		}
+		if (ss->ss_name == NULL) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to retrieve "
+			    "snapshot name from store"), vdname);
+			goto fail;
+		}
+		ss++;
+	}
+
+	(void) pthread_mutex_lock(&vs->vs_out_mutex);
+	(void) printf("disk:%s:%s:%llu:%d:%s:%s:%s\n", vtype, size,
+	    (unsigned long long)total, depth + nsnaps + 1, rwcnt, rocnt,
+	    vdname);
+	for (i = 0; i < nsnaps; i++) {
+		/* Snapshot names are kept with their leading '@' */
+		(void) printf("snapshot:%llu:%d:%d:%s%s\n",
+		    (unsigned long long)snaps[i].ss_alloc, depth + i + 1,
+		    snaps[i].ss_clones, vdname, (char *)snaps[i].ss_name);
+	}
+	(void) pthread_mutex_unlock(&vs->vs_out_mutex);
+	ret = 0;
+
+fail:
+	for (i = 0; i < nsnaps && snaps != NULL; i++)
+		xmlFree(snaps[i].ss_name);
+	free(snaps);
+	for (i = 0; i < nfiles; i++)
+		free(files[i].sf_name);
+	free(files);
+	vdisk_free_tree(vdh);
+	return (ret);
+}
+
+/*
+ * Look at a directory: print it if it is a virtual disk, else put the
+ * directories in it on the list.  Links aren't followed, so a tree linking
+ * back to itself is only scanned once.
+ */
+static int
+vdi_scan_dir(vdi_scan_t *vs, const char *path)
+{
+	char xmlname[MAXPATHLEN];
+	char child[MAXPATHLEN];
+	struct dirent *de;
+	struct stat64 st;
+	DIR *dir;
+	int ret = 0;
+
+	(void) snprintf(xmlname, MAXPATHLEN, "%s/%s.xml", path, VD_BASE);
+	if (stat64(xmlname, &st) == 0)
+		return (vdi_scan_disk(vs, path));
+
+	if ((dir = opendir(path)) == NULL) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to read directory"), path);
+		return (-1);
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if ((strcmp(de->d_name, ".") == 0) ||
+		    (strcmp(de->d_name, "..") == 0))
+			continue;
+		(void) snprintf(child, MAXPATHLEN, "%s%s%s", path,
+		    (path[strlen(path) - 1] == '/') ? "" : "/", de->d_name);
+		if ((lstat64(child, &st) == 0) && S_ISDIR(st.st_mode) &&
+		    (vdi_scan_push(vs, child) == -1))
+			ret = -1;
+	}
+	(void) closedir(dir);
+	return (ret);
+}
+
+static void *
+vdi_scan_thread(void *arg)
+{
+	vdi_scan_t *vs = arg;
+	vdi_scan_dir_t *sd;
+
+	(void) pthread_mutex_lock(&vs->vs_mutex);
+	for (;;) {
+		while ((vs->vs_dirs == NULL) && (vs->vs_busy > 0))
+			(void) pthread_cond_wait(&vs->vs_cv, &vs->vs_mutex);
+		if (vs->vs_dirs == NULL)
+			break;
+		sd = vs->vs_dirs;
+		vs->vs_dirs = sd->sd_next;
+		vs->vs_busy++;
+		(void) pthread_mutex_unlock(&vs->vs_mutex);
+
+		if (vdi_scan_dir(vs, sd->sd_path) == -1)
+			vdi_scan_error(vs);
+		free(sd->sd_path);
+		free(sd);
+
+		(void) pthread_mutex_lock(&vs->vs_mutex);
+		vs->vs_busy--;
+	}
+	/* Nothing left to look at and no one to add to it: wake the rest */
+	(void) pthread_cond_broadcast(&vs->vs_cv);
+	(void) pthread_mutex_unlock(&vs->vs_mutex);
+	return (NULL);
+}
+
+/*
+ * Print the virtual disks in a tree, see above.
+ *	dir - top of the tree
+ *	nthreads - number of threads scanning it
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, for some of the tree at least
+ */
+int
+vdi_scan(const char *dir, int nthreads)
+{
+	pthread_t *tids;
+	vdi_scan_t vs;
+	int started;
+	int i;
+
+	bzero(&vs, sizeof (vs));
+	(void) pthread_mutex_init(&vs.vs_mutex, NULL);
+	(void) pthread_mutex_init(&vs.vs_out_mutex, NULL);
+	(void) pthread_cond_init(&vs.vs_cv, NULL);
+
+	/* libxml has to be set up before threads use it */
+	xmlInitParser();
+
+	if (((tids = calloc(nthreads, sizeof (pthread_t))) == NULL) ||
+	    (vdi_scan_push(&vs, dir) == -1)) {
+		free(tids);
+		return (-1);
+	}
+	for (started = 0; started < nthreads; started++) {
+		if (pthread_create(&tids[started], NULL, vdi_scan_thread,
+		    &vs) != 0)
+			break;
+	}
+	if (started == 0) {
+		/* Scan it ourselves */
+		(void) vdi_scan_thread(&vs);
+	}
+	for (i = 0; i < started; i++)
+		(void) pthread_join(tids[i], NULL);
+	free(tids);
+
+	(void) fflush(stdout);
+	(void) pthread_mutex_destroy(&vs.vs_mutex);
+	(void) pthread_mutex_destroy(&vs.vs_out_mutex);
+	(void) pthread_cond_destroy(&vs.vs_cv);
+	return ((vs.vs_errors == 0) ? 0 : -1);
+}
@@ -0,0 +1,780 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+
+/*
+ * vdiskadm serve, and the client side of it for vdiskadm -S.
+ *
+ * Management software asking many small questions pays the start up of
+ * vdiskadm, loading the backends and parsing the stores, on each one.
+ * vdiskadm serve does that once and then runs the commands it is sent
+ * over a UNIX domain socket.  Each request is run in a process of its own
+ * forked from the server, so it finds the backends loaded and the stores
+ * it names already parsed (see vdisk_set_store_keep()), and a command
+ * that exits or fails can't take the server down with it.  Open images
+ * aren't kept across requests: the handles of the VD layer hold file
+ * offsets and state that processes running at the same time can't share,
+ * so each request still opens the images it uses.
+ *
+ * A request names the virtual disks it works on by their paths.  Requests
+ * for the same virtual disk are run one at a time in the order received;
+ * requests for other virtual disks run alongside them, up to a number of
+ * requests at a time.
+ *
+ * A request is a sequence of strings, each ending in a NUL: the number of
+ * the strings that follow, the working directory of the client and the
+ * arguments vdiskadm was called with, starting with its own name.  The
+ * server answers with records, each a type letter, a space, a decimal
+ * number and a newline:
+ *
+ *	o <length>\n<bytes>	bytes the command wrote to its stdout
+ *	e <length>\n<bytes>	bytes the command wrote to its stderr
+ *	x <status>\n		the exit status of the command; the last record
+ *
+ * Only clients running as the user the server runs as are served.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <ucred.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <libintl.h>
+
+#include "vdisk.h"
+#include "vdiskadm_serve.h"
+
+
+/* longest request taken, in bytes */
+#define	VDI_SERVE_REQ_MAX	(64 * 1024)
+
+/* milliseconds a client is given to send its request */
+#define	VDI_SERVE_TIMEOUT	10000
+
+/* bytes of output relayed as one record */
+#define	VDI_SERVE_CHUNK		8192
+
+typedef struct vdi_serve_req_s {
+	struct vdi_serve_req_s	*sr_next;
+	int		sr_fd;		/* connection to the client */
+	char		*sr_buf;	/* the strings of the request */
+	char		*sr_cwd;	/* working directory of the client */
+	int		sr_argc;
+	char		**sr_argv;
+	int		sr_ndisks;	/* virtual disks the request names */
+	char		**sr_disks;
+	pid_t		sr_pid;		/* process running the request */
+} vdi_serve_req_t;
+
+static int vdi_serve_sigfd = -1;	/* written to on SIGCHLD */
+static volatile sig_atomic_t vdi_serve_done = 0;
+
+
+/*
+ * Write all of a buffer to a descriptor.
+ */
+static int
+vdi_serve_write(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		buf += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/*
+ * Send the exit status of a command, the last record of the answer.
+ */
+static void
+vdi_serve_send_status(int fd, int status)
+{
+	char hdr[32];
+	int n;
+
+	n = snprintf(hdr, sizeof (hdr), "x %d\n", status);
+	(void) vdi_serve_write(fd, hdr, n);
+}
+
+/*
+ * Send a record of output in the answer to a request.
+ */
+static int
+vdi_serve_send(int fd, char type, const char *buf, size_t len)
+{
+	char hdr[32];
+	int n;
+
+	n = snprintf(hdr, sizeof (hdr), "%c %lu\n", type, (ulong_t)len);
+	if ((vdi_serve_write(fd, hdr, n) == -1) ||
+	    (vdi_serve_write(fd, buf, len) == -1))
+		return (-1);
+	return (0);
+}
+
+static void
+vdi_serve_req_free(vdi_serve_req_t *req)
+{
+	int i;
+
+	if (req->sr_fd != -1)
+		(void) close(req->sr_fd);
+	for (i = 0; i < req->sr_ndisks; i++)
+		free(req->sr_disks[i]);
+	free(req->sr_disks);
+	free(req->sr_argv);
+	free(req->sr_buf);
+	free(req);
+}
+
+/*
+ * Find the virtual disks the arguments of a request name: arguments that
+ * are the path of a virtual disk, or of a snapshot of one, relative to the
+ * working directory of the client.  Each is named by its real path so that
+ * different paths to the same virtual disk match.
+ */
+static int
+vdi_serve_req_disks(vdi_serve_req_t *req)
+{
+	char path[MAXPATHLEN];
+	char vdname[MAXPATHLEN];
+	char xmlname[MAXPATHLEN];
+	char real[MAXPATHLEN];
+	struct stat64 st;
+	int i;
+	int j;
+
+	req->sr_disks = calloc(req->sr_argc, sizeof (char *));
+	if (req->sr_disks == NULL)
+		return (-1);
+
+	for (i = 1; i < req->sr_argc; i++) {
+		if (req->sr_argv[i][0] == '/') {
+			(void) strlcpy(path, req->sr_argv[i], MAXPATHLEN);
+		} else {
+			(void) snprintf(path, MAXPATHLEN, "%s/%s",
+			    req->sr_cwd, req->sr_argv[i]);
+		}
+		vdisk_get_vdname(vdname, path, MAXPATHLEN);
+		vdisk_get_xmlfile(xmlname, vdname, MAXPATHLEN);
+		if ((stat64(xmlname, &st) == -1) || !S_ISREG(st.st_mode) ||
+		    (realpath(vdname, real) == NULL))
+			continue;
+
+		for (j = 0; j < req->sr_ndisks; j++) {
+			if (strcmp(req->sr_disks[j], real) == 0)
+				break;
+		}
+		if (j < req->sr_ndisks)
+			continue;
+		if ((req->sr_disks[j] = strdup(real)) == NULL)
+			return (-1);
+		req->sr_ndisks++;
+	}
+
+	return (0);
+}
+
+/*
+ * Read the request of a client that connected.
+ *	fd - connection to the client
+ *
+ * Returns:
+ *	the request
+ *	NULL: failure, the connection is left to the caller
+ */
+static vdi_serve_req_t *
+vdi_serve_req_read(int fd)
+{
+	vdi_serve_req_t *req;
+	struct pollfd pfd;
+	ucred_t *uc = NULL;
+	size_t len = 0;
+	ssize_t n;
+	char *str;
+	char *end;
+	long cnt = -1;
+	int found = 0;
+	int i;
+
+	/* Only serve the user we run as */
+	if ((getpeerucred(fd, &uc) == -1) ||
+	    (ucred_geteuid(uc) != geteuid())) {
+		if (uc != NULL)
+			ucred_free(uc);
+		return (NULL);
+	}
+	ucred_free(uc);
+
+	if ((req = calloc(1, sizeof (vdi_serve_req_t))) == NULL)
+		return (NULL);
+	req->sr_fd = -1;
+	if ((req->sr_buf = malloc(VDI_SERVE_REQ_MAX)) == NULL)
+		goto fail;
+
+	/* Read until the count given by the first string has come in */
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while ((cnt == -1) || (found < cnt + 1)) {
+		if (len == VDI_SERVE_REQ_MAX)
+			goto fail;
+		n = poll(&pfd, 1, VDI_SERVE_TIMEOUT);
+		if ((n == -1) && (errno == EINTR))
+			continue;
+		if (n <= 0)
+			goto fail;
+		n = read(fd, req->sr_buf + len, VDI_SERVE_REQ_MAX - len);
+		if ((n == -1) && (errno == EINTR))
+			continue;
+		if (n <= 0)
+			goto fail;
+		for (i = len; i < len + n; i++) {
+			if (req->sr_buf[i] == '\0')
+				found++;
+		}
+		len += n;
+		if ((cnt == -1) && (found > 0)) {
+			errno = 0;
+			cnt = strtol(req->sr_buf, &end, 10);
+			if ((errno != 0) || (*end != '\0') || (cnt < 2) ||
+			    (cnt > VDI_SERVE_REQ_MAX / 2))
+				goto fail;
+		}
+	}
+	if (found != cnt + 1)
+		goto fail;
+
+	req->sr_argc = cnt - 1;
+	req->sr_argv = calloc(req->sr_argc + 1, sizeof (char *));
+	if (req->sr_argv == NULL)
+		goto fail;
+	str = req->sr_buf + strlen(req->sr_buf) + 1;
+	req->sr_cwd = str;
+	for (i = 0; i < req->sr_argc; i++) {
+		str += strlen(str) + 1;
+		req->sr_argv[i] = str;
+	}
+	req->sr_argv[i] = NULL;
+
+	if (vdi_serve_req_disks(req) == -1)
+		goto fail;
+
+	req->sr_fd = fd;
+	return (req);
+
+fail:
+	vdi_serve_req_free(req);
+	return (NULL);
+}
+
+/*
+ * Does a request name a virtual disk another one names?
+ */
+static boolean_t
+vdi_serve_req_conflict(vdi_serve_req_t *a, vdi_serve_req_t *b)
+{
+	int i;
+	int j;
+
+	for (i = 0; i < a->sr_ndisks; i++) {
+		for (j = 0; j < b->sr_ndisks; j++) {
+			if (strcmp(a->sr_disks[i], b->sr_disks[j]) == 0)
+				return (B_TRUE);
+		}
+	}
+	return (B_FALSE);
+}
+
+/*
+ * Run the command of a request with its output going to pipes, and relay
+ * that output and its exit status to the client.  Runs in the process
+ * forked for the request and doesn't return.  If the client goes away, the
+ * command is still run to its end, its output thrown away.
+ */
+static void
+vdi_serve_job(vdi_serve_req_t *req, vdi_serve_run_t *run)
+{
+	struct pollfd pfd[2];
+	char buf[VDI_SERVE_CHUNK];
+	int outp[2];
+	int errp[2];
+	int client = 0;
+	int status;
+	int nopen;
+	pid_t pid;
+	ssize_t n;
+	int fd;
+	int i;
+
+	if (chdir(req->sr_cwd) == -1) {
+		n = snprintf(buf, sizeof (buf), "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Cannot change directory to"),
+		    req->sr_cwd);
+		(void) vdi_serve_send(req->sr_fd, 'e', buf, n);
+		vdi_serve_send_status(req->sr_fd, 255);
+		_exit(1);
+	}
+	if ((pipe(outp) == -1) || (pipe(errp) == -1) ||
+	    ((pid = fork()) == -1)) {
+		n = snprintf(buf, sizeof (buf), "\n%s\n\n",
+		    gettext("ERROR: Cannot start the command"));
+		(void) vdi_serve_send(req->sr_fd, 'e', buf, n);
+		vdi_serve_send_status(req->sr_fd, 255);
+		_exit(1);
+	}
+
+	if (pid == 0) {
+		(void) close(req->sr_fd);
+		if ((fd = open("/dev/null", O_RDONLY)) != -1) {
+			(void) dup2(fd, STDIN_FILENO);
+			(void) close(fd);
+		}
+		(void) dup2(outp[1], STDOUT_FILENO);
+		(void) dup2(errp[1], STDERR_FILENO);
+		(void) close(outp[0]);
+		(void) close(outp[1]);
+		(void) close(errp[0]);
+		(void) close(errp[1]);
+		optind = 1;
+		exit(run(req->sr_argc, req->sr_argv));
+	}
+
+	(void) close(outp[1]);
+	(void) close(errp[1]);
+	pfd[0].fd = outp[0];
+	pfd[1].fd = errp[0];
+	pfd[0].events = pfd[1].events = POLLIN;
+	for (nopen = 2; nopen > 0; ) {
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < 2; i++) {
+			if (pfd[i].revents == 0)
+				continue;
+			n = read(pfd[i].fd, buf, sizeof (buf));
+			if ((n == -1) && (errno == EINTR))
+				continue;
+			if (n <= 0) {
+				(void) close(pfd[i].fd);
+				pfd[i].fd = -1;
+				nopen--;
+				continue;
+			}
+			if ((client == 0) && (vdi_serve_send(req->sr_fd,
+			    (i == 0) ? 'o' : 'e', buf, n) == -1))
+				client = -1;
+		}
+	}
+
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			status = 0xff00;
+			break;
+		}
+	}
+	if (WIFEXITED(status))
+		status = WEXITSTATUS(status);
+	else if (WIFSIGNALED(status))
+		status = 128 + WTERMSIG(status);
+	else
+		status = 255;
+	if (client == 0)
+		vdi_serve_send_status(req->sr_fd, status);
+	_exit(0);
+}
+
+/*
+ * Start the process running a request.
+ */
+static int
+vdi_serve_start(vdi_serve_req_t *req, int lfd, vdi_serve_run_t *run)
+{
+	vd_handle_t *vdh;
+	pid_t pid;
+	int i;
+
+	/*
+	 * Parse the stores named in this process, so they are kept for the
+	 * requests to come and not just the one process.
+	 */
+	for (i = 0; i < req->sr_ndisks; i++) {
+		if (vdisk_read_tree(&vdh, req->sr_disks[i]) == 0)
+			vdisk_free_tree(vdh);
+	}
+
+	(void) fflush(stdout);
+	(void) fflush(stderr);
+	if ((pid = fork()) == -1)
+		return (-1);
+	if (pid == 0) {
+		(void) close(lfd);
+		(void) close(vdi_serve_sigfd);
+		(void) signal(SIGCHLD, SIG_DFL);
+		(void) signal(SIGTERM, SIG_DFL);
+		(void) signal(SIGINT, SIG_DFL);
+		vdi_serve_job(req, run);
+	}
+
+	req->sr_pid = pid;
+	(void) close(req->sr_fd);
+	req->sr_fd = -1;
+	return (0);
+}
+
+/*
+ * Start the requests waiting whose virtual disks aren't in use by a request
+ * running or an earlier one still waiting, while fewer than jobs run.
+ */
+static void
+vdi_serve_sched(vdi_serve_req_t **waitp, vdi_serve_req_t **runp,
+    int *nrunp, int jobs, int lfd, vdi_serve_run_t *run)
+{
+	vdi_serve_req_t **rp;
+	vdi_serve_req_t *req;
+	vdi_serve_req_t *r;
+	boolean_t busy;
+
+	for (rp = waitp; ((req = *rp) != NULL) && (*nrunp < jobs); ) {
+		busy = B_FALSE;
+		for (r = *runp; (r != NULL) && !busy; r = r->sr_next)
+			busy = vdi_serve_req_conflict(req, r);
+		for (r = *waitp; (r != req) && !busy; r = r->sr_next)
+			busy = vdi_serve_req_conflict(req, r);
+		if (busy) {
+			rp = &req->sr_next;
+			continue;
+		}
+
+		*rp = req->sr_next;
+		if (vdi_serve_start(req, lfd, run) == -1) {
+			vdi_serve_req_free(req);
+			continue;
+		}
+		req->sr_next = *runp;
+		*runp = req;
+		(*nrunp)++;
+	}
+}
+
+/* ARGSUSED */
+static void
+vdi_serve_sigchld(int sig)
+{
+	int err = errno;
+
+	(void) write(vdi_serve_sigfd, "", 1);
+	errno = err;
+}
+
+/* ARGSUSED */
+static void
+vdi_serve_sigterm(int sig)
+{
+	vdi_serve_done = 1;
+	(void) write(vdi_serve_sigfd, "", 1);
+}
+
+/*
+ * Open the socket to listen on, replacing one left behind by a server that
+ * is gone.
+ */
+static int
+vdi_serve_listen(const char *path)
+{
+	struct sockaddr_un sun;
+	mode_t mask;
+	int fd;
+
+	if (strlen(path) >= sizeof (sun.sun_path)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Socket path too long"), path);
+		return (-1);
+	}
+	bzero(&sun, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	(void) strlcpy(sun.sun_path, path, sizeof (sun.sun_path));
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		goto fail;
+	if (connect(fd, (struct sockaddr *)&sun, sizeof (sun)) == 0) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Socket already served"), path);
+		(void) close(fd);
+		return (-1);
+	}
+	(void) close(fd);
+	(void) unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		goto fail;
+	mask = umask(077);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof (sun)) == -1) {
+		(void) umask(mask);
+		(void) close(fd);
+		goto fail;
+	}
+	(void) umask(mask);
+	if ((listen(fd, SOMAXCONN) == -1) ||
+	    (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)) {
+		(void) close(fd);
+		(void) unlink(path);
+		goto fail;
+	}
+	return (fd);
+
+fail:
+	(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+	    gettext("ERROR: Cannot listen on socket"), path, strerror(errno));
+	return (-1);
+}
+
+/*
+ * Serve requests on a socket until SIGTERM or SIGINT.
+ *	path - path of the socket
+ *	jobs - largest number of requests run at a time
+ *	run - runs the command of a request
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdi_serve(const char *path, int jobs, vdi_serve_run_t *run)
+{
+	vdi_serve_req_t *waiting = NULL;
+	vdi_serve_req_t *running = NULL;
+	vdi_serve_req_t **rp;
+	vdi_serve_req_t *req;
+	struct pollfd pfd[2];
+	char buf[64];
+	int nrun = 0;
+	int sigp[2];
+	int status;
+	pid_t pid;
+	int lfd;
+	int fd;
+
+	if ((lfd = vdi_serve_listen(path)) == -1)
+		return (-1);
+	if (pipe(sigp) == -1) {
+		(void) close(lfd);
+		(void) unlink(path);
+		return (-1);
+	}
+	(void) fcntl(sigp[0], F_SETFL, O_NONBLOCK);
+	(void) fcntl(sigp[1], F_SETFL, O_NONBLOCK);
+	(void) fcntl(sigp[0], F_SETFD, FD_CLOEXEC);
+	(void) fcntl(sigp[1], F_SETFD, FD_CLOEXEC);
+	vdi_serve_sigfd = sigp[1];
+
+	(void) signal(SIGPIPE, SIG_IGN);
+	(void) signal(SIGCHLD, vdi_serve_sigchld);
+	(void) signal(SIGTERM, vdi_serve_sigterm);
+	(void) signal(SIGINT, vdi_serve_sigterm);
+
+	pfd[0].fd = sigp[0];
+	pfd[1].fd = lfd;
+	pfd[0].events = pfd[1].events = POLLIN;
+	while (!vdi_serve_done || (running != NULL)) {
+		if (poll(pfd, vdi_serve_done ? 1 : 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[0].revents != 0) {
+			while (read(sigp[0], buf, sizeof (buf)) > 0)
+				;
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+				for (rp = &running; (req = *rp) != NULL;
+				    rp = &req->sr_next) {
+					if (req->sr_pid == pid)
+						break;
+				}
+				if (req == NULL)
+					continue;
+				*rp = req->sr_next;
+				vdi_serve_req_free(req);
+				nrun--;
+			}
+		}
+
+		if (!vdi_serve_done && (pfd[1].revents != 0) &&
+		    ((fd = accept(lfd, NULL, NULL)) != -1)) {
+			if ((req = vdi_serve_req_read(fd)) == NULL) {
+				(void) close(fd);
+			} else {
+				for (rp = &waiting; *rp != NULL;
+				    rp = &(*rp)->sr_next)
+					;
+				*rp = req;
+			}
+		}
+
+		if (!vdi_serve_done) {
+			vdi_serve_sched(&waiting, &running, &nrun, jobs,
+			    lfd, run);
+		}
+	}
+
+	/* Requests still waiting are dropped; their clients see an error */
+	while ((req = waiting) != NULL) {
+		waiting = req->sr_next;
+		vdi_serve_req_free(req);
+	}
+	(void) close(lfd);
+	(void) unlink(path);
+	(void) close(sigp[0]);
+	(void) close(sigp[1]);
+	return (0);
+}
+
+/*
+ * Read a line of the answer of the server, one byte at a time so no more
+ * than the line is taken.
+ */
+static int
+vdi_serve_read_line(int fd, char *buf, size_t len)
+{
+	size_t i;
+	ssize_t n;
+
+	for (i = 0; i < len - 1; ) {
+		n = read(fd, &buf[i], 1);
+		if ((n == -1) && (errno == EINTR))
+			continue;
+		if (n <= 0)
+			return (-1);
+		if (buf[i] == '\n') {
+			buf[i] = '\0';
+			return (0);
+		}
+		i++;
+	}
+	return (-1);
+}
+
+/*
+ * Have vdiskadm serve run a command.
+ *	path - path of the socket the server listens on
+ *	argc, argv - the arguments of vdiskadm, starting with its name
+ *	statusp - set to the exit status of the command
+ *
+ * Returns:
+ *	0: success, the command was run by the server
+ *	-1: no server could be reached; nothing was run
+ */
+int
+vdi_serve_client(const char *path, int argc, char *argv[], int *statusp)
+{
+	struct sockaddr_un sun;
+	char cwd[MAXPATHLEN];
+	char buf[VDI_SERVE_CHUNK];
+	char line[64];
+	unsigned long len;
+	char *end;
+	ssize_t n;
+	int out;
+	int fd;
+	int i;
+
+	if ((strlen(path) >= sizeof (sun.sun_path)) ||
+	    (getcwd(cwd, sizeof (cwd)) == NULL))
+		return (-1);
+	bzero(&sun, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	(void) strlcpy(sun.sun_path, path, sizeof (sun.sun_path));
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return (-1);
+	if (connect(fd, (struct sockaddr *)&sun, sizeof (sun)) == -1) {
+		(void) close(fd);
+		return (-1);
+	}
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	n = snprintf(line, sizeof (line), "%d", argc + 1);
+	if ((vdi_serve_write(fd, line, n + 1) == -1) ||
+	    (vdi_serve_write(fd, cwd, strlen(cwd) + 1) == -1))
+		goto lost;
+	for (i = 0; i < argc; i++) {
+		if (vdi_serve_write(fd, argv[i], strlen(argv[i]) + 1) == -1)
+			goto lost;
+	}
+
+	for (;;) {
+		if ((vdi_serve_read_line(fd, line, sizeof (line)) == -1) ||
+		    (line[0] == '\0') || (line[1] != ' '))
+			goto lost;
+		errno = 0;
+		len = strtoul(&line[2], &end, 10);
+		if ((errno != 0) || (*end != '\0'))
+			goto lost;
+		if (line[0] == 'x')
+			break;
+		if ((line[0] != 'o') && (line[0] != 'e'))
+			goto lost;
+
+		out = (line[0] == 'o') ? STDOUT_FILENO : STDERR_FILENO;
+		while (len > 0) {
+			n = read(fd, buf, MIN(len, sizeof (buf)));
+			if ((n == -1) && (errno == EINTR))
+				continue;
+			if (n <= 0)
+				goto lost;
+			(void) vdi_serve_write(out, buf, n);
+			len -= n;
+		}
+	}
+
+	(void) close(fd);
+	*statusp = (int)len;
+	return (0);
+
+lost:
+	(void) close(fd);
+	(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+	    gettext("ERROR: Lost the connection to vdiskadm serve"), path);
+	*statusp = -1;
+	return (0);
+}
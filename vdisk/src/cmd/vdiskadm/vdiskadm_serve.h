@@ -0,0 +1,54 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+
+
+#ifndef _VDISKADM_SERVE_H
+#define	_VDISKADM_SERVE_H
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+
+/* socket vdiskadm serve listens on by default */
+#define	VDI_SERVE_SOCKET	"/var/run/vdiskadm.sock"
+
+/* requests run at the same time by default */
+#define	VDI_SERVE_JOBS		8
+
+/* stores kept in memory by default */
+#define	VDI_SERVE_KEEP		256
+
+/* runs the command of a request, as main() would */
+typedef int vdi_serve_run_t(int argc, char *argv[]);
+
+int vdi_serve(const char *path, int jobs, vdi_serve_run_t *run);
+int vdi_serve_client(const char *path, int argc, char *argv[], int *statusp);
+
+
+#ifdef	__cplusplus
+}
+#endif
+#endif /* _VDISKADM_SERVE_H */
@@ -0,0 +1,1655 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+/*
+ * Sequential export and import of a virtual disk through a pipe.
+ *
+ * Neither end of a stream needs to seek, so an export can be piped
+ * straight into compression or transfer tools and an import can read
+ * what they produce, without a temporary copy of the disk.  Two
+ * representations are supported:
+ *	raw	every byte of the disk in order
+ *	stream	a header giving the disk size, then DATA records for the
+ *		chunks holding data and ZERO records for the runs between
+ *		them, then an END record; see vdiskadm_stream.h
+ * The export asks vdisk_get_allocation() which ranges of the chain hold
+ * data, so unallocated ranges aren't read and, in a stream, cost no bytes
+ * on the wire; chunks of allocated data reading as zeroes become ZERO
+ * records too.  The import creates a sparse image (or whatever was
+ * asked for) up front and writes the DATA records as they arrive; the
+ * ZERO records need no writes on a new image.  The END record tells a
+ * complete stream from one cut short.
+ *
+ * A raw stream doesn't give the disk size up front, so it can only be
+ * imported into a raw image, which grows as data arrives.
+ *
+ * A third representation, zstream, compresses the chunks holding data
+ * on several threads; see "Compressed streams" below.  Imports tell it
+ * from a stream by its magic.
+ *
+ * A delta stream carries only the ranges the differencing images above
+ * one snapshot wrote, up to a later snapshot or the current contents,
+ * so a replica holding the older snapshot can be brought up to date by
+ * applying it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <libintl.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "VBox/VBoxHDD.h"
+
+#include "vdisk.h"
+#include "vdiskadm_copy.h"
+#include "vdiskadm_stream.h"
+
+
+typedef struct vdi_stream_s {
+	int		vs_fd;
+	uint64_t	vs_zero_start;	/* start of the pending zero run */
+	uint64_t	vs_data;	/* DATA bytes sent or received */
+	char		*vs_buf;
+} vdi_stream_t;
+
+
+static void
+vdi_stream_put32(uchar_t *p, uint32_t val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+static void
+vdi_stream_put64(uchar_t *p, uint64_t val)
+{
+	vdi_stream_put32(p, val >> 32);
+	vdi_stream_put32(p + 4, (uint32_t)val);
+}
+
+static uint32_t
+vdi_stream_get32(const uchar_t *p)
+{
+	return (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	    ((uint32_t)p[2] << 8) | p[3]);
+}
+
+static uint64_t
+vdi_stream_get64(const uchar_t *p)
+{
+	return (((uint64_t)vdi_stream_get32(p) << 32) |
+	    vdi_stream_get32(p + 4));
+}
+
+/*
+ * Write all of buf.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set
+ */
+static int
+vdi_stream_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		p += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/*
+ * Read up to len bytes, stopping early only at the end of the input.
+ *
+ * Returns:
+ *	number of bytes read
+ *	-1: failure, errno set
+ */
+static ssize_t
+vdi_stream_read(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(fd, p + done, len - done);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return ((ssize_t)done);
+}
+
+static int
+vdi_stream_put_rec(vdi_stream_t *vs, uint32_t type, uint64_t off,
+    uint64_t len)
+{
+	uchar_t rec[VDI_STREAM_REC_SIZE];
+
+	bzero(rec, sizeof (rec));
+	vdi_stream_put32(rec, type);
+	vdi_stream_put64(rec + 8, off);
+	vdi_stream_put64(rec + 16, len);
+	return (vdi_stream_write(vs->vs_fd, rec, sizeof (rec)));
+}
+
+/*
+ * Send the zero run pending up to off.
+ */
+static int
+vdi_stream_put_zero(vdi_stream_t *vs, uint64_t off)
+{
+	int rc = 0;
+
+	if (off > vs->vs_zero_start)
+		rc = vdi_stream_put_rec(vs, VDI_STREAM_REC_ZERO,
+		    vs->vs_zero_start, off - vs->vs_zero_start);
+	vs->vs_zero_start = off;
+	return (rc);
+}
+
+/*
+ * Send len bytes of the disk at off, read from the chain.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set unless the read failed
+ */
+static int
+vdi_stream_put_data(vdi_stream_t *vs, PVBOXHDD hdd, boolean_t raw,
+    uint64_t off, size_t len)
+{
+	int rc;
+
+	rc = VDRead(hdd, off, vs->vs_buf, len);
+	if (!VBOX_SUCCESS(rc)) {
+		(void) fprintf(stderr, "\n%s: %d\n\n",
+		    gettext("ERROR: Unable to read virtual disk"), rc);
+		errno = 0;
+		return (-1);
+	}
+
+	if (raw)
+		return (vdi_stream_write(vs->vs_fd, vs->vs_buf, len));
+
+	/* Zeroes just extend the pending zero run */
+	if (vdi_copy_is_zero(vs->vs_buf, len))
+		return (0);
+
+	if ((vdi_stream_put_zero(vs, off) == -1) ||
+	    (vdi_stream_put_rec(vs, VDI_STREAM_REC_DATA, off, len) == -1) ||
+	    (vdi_stream_write(vs->vs_fd, vs->vs_buf, len) == -1))
+		return (-1);
+	vs->vs_zero_start = off + len;
+	vs->vs_data += len;
+	return (0);
+}
+
+/*
+ * Write a virtual disk's contents, as seen through its whole image
+ * chain, to a pipe or file.
+ *	vdh - handle with the image chain opened
+ *	fd - descriptor to write to
+ *	raw - B_TRUE for every byte of the disk, B_FALSE for a stream
+ *	opts - progress options
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdi_stream_export(vd_handle_t *vdh, int fd, boolean_t raw,
+    vdi_copy_opts_t *opts)
+{
+	uchar_t hdr[VDI_STREAM_HDR_SIZE];
+	vdi_copy_progress_t cp;
+	vdi_stream_t vs;
+	vd_extent_t whole;
+	vd_extent_t *extents = NULL;
+	uint64_t size, off, end, len;
+	int nextents, i;
+	int rc = -1;
+
+	bzero(&vs, sizeof (vs));
+	vs.vs_fd = fd;
+	size = VDGetSize(vdh->hdd, VDGetCount(vdh->hdd) - 1);
+	vs.vs_buf = malloc(VDI_STREAM_MAX_DATA);
+	if (vs.vs_buf == NULL) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate memory."));
+		return (-1);
+	}
+
+	/*
+	 * Unallocated ranges aren't read.  Without an allocation map
+	 * every range is read; zero chunks are still left out of a stream.
+	 */
+	whole.ve_offset = 0;
+	whole.ve_length = size;
+	if (vdisk_get_allocation(vdh, VD_ALLOC_CHAIN, 0, 0, &extents,
+	    &nextents) == -1) {
+		extents = NULL;
+		nextents = 1;
+	}
+
+	vdi_copy_progress_init(&cp, opts, size, B_FALSE);
+	if (!raw) {
+		bzero(hdr, sizeof (hdr));
+		bcopy(VDI_STREAM_MAGIC, hdr, 8);
+		vdi_stream_put32(hdr + 8, VDI_STREAM_VERSION);
+		vdi_stream_put64(hdr + 16, size);
+		if (vdi_stream_write(fd, hdr, sizeof (hdr)) == -1)
+			goto write_fail;
+	}
+
+	off = 0;
+	for (i = 0; i < nextents; i++) {
+		vd_extent_t *ve = (extents != NULL) ? &extents[i] : &whole;
+
+		/* A raw stream spells out the unallocated range */
+		if (raw && (ve->ve_offset > off)) {
+			bzero(vs.vs_buf, VDI_STREAM_MAX_DATA);
+			while (off < ve->ve_offset) {
+				len = MIN(ve->ve_offset - off,
+				    VDI_STREAM_MAX_DATA);
+				if (vdi_stream_write(fd, vs.vs_buf, len) == -1)
+					goto write_fail;
+				off += len;
+			}
+		}
+
+		end = MIN(ve->ve_offset + ve->ve_length, size);
+		for (off = ve->ve_offset; off < end; off += len) {
+			len = MIN(end - off, VDI_STREAM_MAX_DATA);
+			if (vdi_stream_put_data(&vs, vdh->hdd, raw, off,
+			    len) == -1) {
+				if (errno != 0)
+					goto write_fail;
+				goto out;
+			}
+			vdi_copy_progress_update(&cp, off + len);
+		}
+	}
+
+	if (raw && (off < size)) {
+		bzero(vs.vs_buf, VDI_STREAM_MAX_DATA);
+		for (; off < size; off += len) {
+			len = MIN(size - off, VDI_STREAM_MAX_DATA);
+			if (vdi_stream_write(fd, vs.vs_buf, len) == -1)
+				goto write_fail;
+		}
+	}
+	if (!raw && ((vdi_stream_put_zero(&vs, size) == -1) ||
+	    (vdi_stream_put_rec(&vs, VDI_STREAM_REC_END, size,
+	    vs.vs_data) == -1)))
+		goto write_fail;
+
+	vdi_copy_progress_update(&cp, size);
+	vdi_copy_progress_done(&cp);
+	rc = 0;
+	goto out;
+
+write_fail:
+	(void) fprintf(stderr, "\n%s: %s\n\n",
+	    gettext("ERROR: Unable to write export stream"), strerror(errno));
+out:
+	if (extents != NULL)
+		vdisk_free_allocation(extents);
+	free(vs.vs_buf);
+	return (rc);
+}
+
+/*
+ * Write the changes between two points of a virtual disk's image chain
+ * as a delta stream.
+ *	vdh - handle with the image chain opened
+ *	pszformat - VBox format of the images
+ *	from - image number of the snapshot the delta starts at
+ *	to - image number of the snapshot or top image it runs up to
+ *	from_name - name of the snapshot at from
+ *	to_name - name of the snapshot at to, NULL for the top image
+ *	fd - descriptor to write to
+ *	opts - progress options
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdi_stream_export_delta(vd_handle_t *vdh, const char *pszformat,
+    int from, int to, const char *from_name, const char *to_name, int fd,
+    vdi_copy_opts_t *opts)
+{
+	uchar_t hdr[VDI_STREAM_HDR_SIZE];
+	vdi_copy_progress_t cp;
+	vdi_stream_t vs;
+	PVBOXHDD hdd = vdh->hdd;
+	vd_extent_t *extents = NULL;
+	uint64_t size, off, end, len, total = 0, done = 0;
+	int nextents, i;
+	int rc = -1;
+
+	if (to_name == NULL)
+		to_name = "";
+	if (vdisk_get_delta(vdh, from, to, &extents, &nextents) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+		    gettext("ERROR: Unable to find changes since snapshot"),
+		    from_name, strerror(errno));
+		return (-1);
+	}
+
+	bzero(&vs, sizeof (vs));
+	vs.vs_fd = fd;
+	vs.vs_buf = malloc(VDI_STREAM_MAX_DATA);
+	if (vs.vs_buf == NULL) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate memory."));
+		goto out;
+	}
+
+	/* Read a snapshot through a chain that ends at it */
+	if ((to != VDGetCount(vdh->hdd) - 1) &&
+	    !VBOX_SUCCESS(vdi_copy_open_from(vdh->hdd, to, pszformat,
+	    &hdd))) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to open snapshot"), to_name);
+		hdd = vdh->hdd;
+		goto out;
+	}
+	size = VDGetSize(hdd, to);
+
+	for (i = 0; i < nextents; i++)
+		total += extents[i].ve_length;
+	vdi_copy_progress_init(&cp, opts, total, B_FALSE);
+
+	bzero(hdr, sizeof (hdr));
+	bcopy(VDI_STREAM_MAGIC, hdr, 8);
+	vdi_stream_put32(hdr + 8, VDI_STREAM_VERSION);
+	vdi_stream_put32(hdr + 12, VDI_STREAM_DELTA);
+	vdi_stream_put64(hdr + 16, size);
+	if ((vdi_stream_write(fd, hdr, sizeof (hdr)) == -1) ||
+	    (vdi_stream_put_rec(&vs, VDI_STREAM_REC_FROM, 0,
+	    strlen(from_name)) == -1) ||
+	    (vdi_stream_write(fd, from_name, strlen(from_name)) == -1) ||
+	    (vdi_stream_put_rec(&vs, VDI_STREAM_REC_TO, 0,
+	    strlen(to_name)) == -1) ||
+	    (vdi_stream_write(fd, to_name, strlen(to_name)) == -1))
+		goto write_fail;
+
+	/*
+	 * Zero chunks of a changed range become ZERO records, which the
+	 * replica has to write too; ranges between extents are left out.
+	 */
+	for (i = 0; i < nextents; i++) {
+		end = MIN(extents[i].ve_offset + extents[i].ve_length, size);
+		vs.vs_zero_start = extents[i].ve_offset;
+		for (off = extents[i].ve_offset; off < end; off += len) {
+			len = MIN(end - off, VDI_STREAM_MAX_DATA);
+			if (vdi_stream_put_data(&vs, hdd, B_FALSE, off,
+			    len) == -1) {
+				if (errno != 0)
+					goto write_fail;
+				goto out;
+			}
+			done += len;
+			vdi_copy_progress_update(&cp, done);
+		}
+		if (vdi_stream_put_zero(&vs, end) == -1)
+			goto write_fail;
+	}
+	if (vdi_stream_put_rec(&vs, VDI_STREAM_REC_END, size,
+	    vs.vs_data) == -1)
+		goto write_fail;
+
+	vdi_copy_progress_update(&cp, total);
+	vdi_copy_progress_done(&cp);
+	rc = 0;
+	goto out;
+
+write_fail:
+	(void) fprintf(stderr, "\n%s: %s\n\n",
+	    gettext("ERROR: Unable to write export stream"), strerror(errno));
+out:
+	if (hdd != vdh->hdd)
+		VDDestroy(hdd);
+	vdisk_free_allocation(extents);
+	free(vs.vs_buf);
+	return (rc);
+}
+
+/*
+ * Write a raw stream into a new raw image, leaving holes for zeroes.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+static int
+vdi_stream_import_raw(vdi_stream_t *vs, const char *to_file,
+    vdi_copy_opts_t *opts)
+{
+	vdi_copy_progress_t cp;
+	uint64_t off = 0;
+	ssize_t len;
+	int out;
+
+	out = open(to_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (out == -1) {
+		(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+		    gettext("ERROR: Unable to create file"), to_file,
+		    strerror(errno));
+		return (-1);
+	}
+
+	vdi_copy_progress_init(&cp, opts, 0, B_FALSE);
+	for (;;) {
+		len = vdi_stream_read(vs->vs_fd, vs->vs_buf,
+		    VDI_STREAM_MAX_DATA);
+		if (len == -1)
+			goto read_fail;
+		if (len == 0)
+			break;
+		if (!vdi_copy_is_zero(vs->vs_buf, len) &&
+		    (pwrite(out, vs->vs_buf, len, (off_t)off) != len))
+			goto write_fail;
+		off += len;
+		cp.cp_total = off;
+		vdi_copy_progress_update(&cp, off);
+	}
+
+	if ((off == 0) || (off % 512) != 0) {
+		(void) fprintf(stderr, "\n%s\n\n", gettext(
+		    "ERROR: Raw stream isn't a whole number of sectors"));
+		goto fail;
+	}
+	if ((ftruncate(out, (off_t)off) == -1) || (fsync(out) == -1))
+		goto write_fail;
+	(void) close(out);
+	vdi_copy_progress_done(&cp);
+	return (0);
+
+read_fail:
+	(void) fprintf(stderr, "\n%s: %s\n\n",
+	    gettext("ERROR: Unable to read import stream"), strerror(errno));
+	goto fail;
+write_fail:
+	(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+	    gettext("ERROR: Unable to write file"), to_file, strerror(errno));
+fail:
+	(void) close(out);
+	(void) unlink(to_file);
+	return (-1);
+}
+
+/*
+ * Compressed streams.
+ *
+ * Each chunk of the disk holding data is deflated on its own and written
+ * as a frame naming the chunk, so chunks can be compressed by a pool of
+ * threads and, on import, inflated by one.  Chunks reading as zeroes
+ * aren't written at all.  An index of the frames written follows them
+ * and a trailer at the very end locates the index: an import from a
+ * file reads the index first and lets every thread fetch the frames it
+ * needs with pread(), while an import from a pipe reads the frames in
+ * order and checks the index against them when it arrives.
+ *
+ * The threads of an export each read and compress a chunk of their own,
+ * then take turns in chunk order to write the frames, so the stream is
+ * the same whatever the number of threads.  The threads of an import
+ * likewise take turns in stream order to write the chunks they inflated
+ * into the new image, which, if sparse, allocates its blocks in order.
+ */
+
+typedef struct vdi_zstream_s {
+	pthread_mutex_t	zs_mutex;
+	pthread_cond_t	zs_cv;
+	vdi_copy_progress_t	zs_progress;
+
+	int		zs_fd;
+	int		zs_level;	/* compression level */
+	uint64_t	zs_size;	/* disk size */
+	uint32_t	zs_chunk_size;
+	uint64_t	zs_nchunks;
+	uint64_t	*zs_chunks;	/* export: chunks to visit */
+	uint64_t	zs_nwork;	/* chunks or frames to do */
+	uint64_t	zs_next;	/* next unit of work handed out */
+	uint64_t	zs_turn;	/* unit whose turn it is */
+	uint64_t	zs_off;		/* export: offset of next frame */
+	uchar_t		*zs_index;	/* index entries */
+	uint64_t	zs_nindex;	/* export: entries written so far */
+	boolean_t	zs_seekable;	/* import: index gives frames */
+	boolean_t	zs_eof;		/* import: index frame reached */
+	uint64_t	zs_index_len;	/* import: length of the index frame */
+	PVBOXHDD	zs_to;		/* import: new image */
+	const char	*zs_to_file;
+	boolean_t	zs_error;	/* a thread failed, stop */
+} vdi_zstream_t;
+
+typedef struct vdi_zstream_thr_s {
+	vdi_zstream_t	*zt_zs;
+	PVBOXHDD	zt_hdd;		/* export: read handle of its own */
+	char		*zt_buf;	/* chunk data */
+	uchar_t		*zt_zbuf;	/* chunk compressed */
+	uLong		zt_zmax;	/* size of zt_zbuf */
+	pthread_t	zt_tid;
+	boolean_t	zt_started;
+} vdi_zstream_thr_t;
+
+
+/*
+ * Report the first failure of a thread and tell the others to stop.
+ * Called with zs_mutex held.
+ */
+static void
+vdi_zstream_fail(vdi_zstream_t *zs, const char *msg, const char *detail)
+{
+	if (!zs->zs_error) {
+		if (detail != NULL)
+			(void) fprintf(stderr, "\n%s: %s\n\n", msg, detail);
+		else
+			(void) fprintf(stderr, "\n%s\n\n", msg);
+	}
+	zs->zs_error = B_TRUE;
+	(void) pthread_cond_broadcast(&zs->zs_cv);
+}
+
+/*
+ * Wait for the turn of unit to write.
+ *
+ * Returns:
+ *	0: it's unit's turn, zs_mutex held
+ *	-1: another thread failed, zs_mutex held
+ */
+static int
+vdi_zstream_wait_turn(vdi_zstream_t *zs, uint64_t unit)
+{
+	(void) pthread_mutex_lock(&zs->zs_mutex);
+	while (!zs->zs_error && (zs->zs_turn != unit))
+		(void) pthread_cond_wait(&zs->zs_cv, &zs->zs_mutex);
+	return (zs->zs_error ? -1 : 0);
+}
+
+static void
+vdi_zstream_end_turn(vdi_zstream_t *zs, uint64_t done)
+{
+	zs->zs_turn++;
+	vdi_copy_progress_update(&zs->zs_progress, done);
+	(void) pthread_cond_broadcast(&zs->zs_cv);
+	(void) pthread_mutex_unlock(&zs->zs_mutex);
+}
+
+static void
+vdi_zstream_put_frame(uchar_t *frame, uint64_t chunk, uint32_t len,
+    uint32_t flags)
+{
+	vdi_stream_put64(frame, chunk);
+	vdi_stream_put32(frame + 8, len);
+	vdi_stream_put32(frame + 12, flags);
+}
+
+static void *
+vdi_zstream_compressor(void *arg)
+{
+	vdi_zstream_thr_t *zt = arg;
+	vdi_zstream_t *zs = zt->zt_zs;
+	uchar_t frame[VDI_ZSTREAM_FRAME_SIZE];
+	uint64_t unit, chunk, off;
+	size_t len;
+	uLongf zlen;
+	const void *payload;
+	uint32_t plen, flags;
+	boolean_t zero;
+	int rc;
+
+	for (;;) {
+		(void) pthread_mutex_lock(&zs->zs_mutex);
+		if (zs->zs_error || (zs->zs_next == zs->zs_nwork)) {
+			(void) pthread_mutex_unlock(&zs->zs_mutex);
+			break;
+		}
+		unit = zs->zs_next++;
+		(void) pthread_mutex_unlock(&zs->zs_mutex);
+
+		chunk = zs->zs_chunks[unit];
+		off = chunk * zs->zs_chunk_size;
+		len = MIN(zs->zs_size - off, zs->zs_chunk_size);
+		rc = VDRead(zt->zt_hdd, off, zt->zt_buf, len);
+
+		/* Keep the chunk as it is if deflating doesn't shrink it */
+		zero = B_FALSE;
+		payload = zt->zt_buf;
+		plen = len;
+		flags = VDI_ZSTREAM_STORED;
+		if (VBOX_SUCCESS(rc)) {
+			zero = vdi_copy_is_zero(zt->zt_buf, len);
+			zlen = zt->zt_zmax;
+			if (!zero && (compress2(zt->zt_zbuf, &zlen,
+			    (const Bytef *)zt->zt_buf, len,
+			    zs->zs_level) == Z_OK) && (zlen < len)) {
+				payload = zt->zt_zbuf;
+				plen = zlen;
+				flags = 0;
+			}
+		}
+
+		if (vdi_zstream_wait_turn(zs, unit) == -1) {
+			(void) pthread_mutex_unlock(&zs->zs_mutex);
+			break;
+		}
+		if (!VBOX_SUCCESS(rc)) {
+			char err[16];
+
+			(void) snprintf(err, sizeof (err), "%d", rc);
+			vdi_zstream_fail(zs,
+			    gettext("ERROR: Unable to read virtual disk"), err);
+			(void) pthread_mutex_unlock(&zs->zs_mutex);
+			break;
+		}
+		if (!zero) {
+			vdi_zstream_put_frame(frame, chunk, plen, flags);
+			if ((vdi_stream_write(zs->zs_fd, frame,
+			    sizeof (frame)) == -1) ||
+			    (vdi_stream_write(zs->zs_fd, payload,
+			    plen) == -1)) {
+				vdi_zstream_fail(zs, gettext(
+				    "ERROR: Unable to write export stream"),
+				    strerror(errno));
+				(void) pthread_mutex_unlock(&zs->zs_mutex);
+				break;
+			}
+			vdi_stream_put64(zs->zs_index +
+			    zs->zs_nindex * VDI_ZSTREAM_ENTRY_SIZE, chunk);
+			vdi_stream_put64(zs->zs_index +
+			    zs->zs_nindex * VDI_ZSTREAM_ENTRY_SIZE + 8,
+			    zs->zs_off);
+			zs->zs_nindex++;
+			zs->zs_off += sizeof (frame) + plen;
+		}
+		vdi_zstream_end_turn(zs, off + len);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Start nthreads threads running func on the threads in zt, and wait for
+ * them all to finish.
+ */
+static void
+vdi_zstream_run(vdi_zstream_t *zs, vdi_zstream_thr_t *zt, int nthreads,
+    void *(*func)(void *))
+{
+	int i;
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&zt[i].zt_tid, NULL, func, &zt[i]) != 0) {
+			(void) pthread_mutex_lock(&zs->zs_mutex);
+			vdi_zstream_fail(zs, gettext(
+			    "ERROR: Unable to create thread"), NULL);
+			(void) pthread_mutex_unlock(&zs->zs_mutex);
+			break;
+		}
+		zt[i].zt_started = B_TRUE;
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (zt[i].zt_started)
+			(void) pthread_join(zt[i].zt_tid, NULL);
+	}
+}
+
+/*
+ * Allocate the threads of a compressed export or import and their
+ * buffers.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+static int
+vdi_zstream_alloc_thr(vdi_zstream_t *zs, int nthreads,
+    vdi_zstream_thr_t **ztp)
+{
+	vdi_zstream_thr_t *zt;
+	int i;
+
+	zt = calloc(nthreads, sizeof (vdi_zstream_thr_t));
+	if (zt == NULL)
+		goto nomem;
+	*ztp = zt;
+	for (i = 0; i < nthreads; i++) {
+		zt[i].zt_zs = zs;
+		zt[i].zt_zmax = compressBound(zs->zs_chunk_size);
+		zt[i].zt_buf = malloc(zs->zs_chunk_size);
+		zt[i].zt_zbuf = malloc(zt[i].zt_zmax);
+		if ((zt[i].zt_buf == NULL) || (zt[i].zt_zbuf == NULL))
+			goto nomem;
+	}
+	return (0);
+
+nomem:
+	(void) fprintf(stderr, "%s\n", gettext(
+	    "ERROR: Unable to allocate memory."));
+	return (-1);
+}
+
+static void
+vdi_zstream_free_thr(vdi_zstream_thr_t *zt, int nthreads)
+{
+	int i;
+
+	if (zt == NULL)
+		return;
+	for (i = 0; i < nthreads; i++) {
+		if (zt[i].zt_hdd != NULL)
+			VDDestroy(zt[i].zt_hdd);
+		free(zt[i].zt_buf);
+		free(zt[i].zt_zbuf);
+	}
+	free(zt);
+}
+
+static void
+vdi_zstream_init(vdi_zstream_t *zs, int fd, uint64_t size,
+    uint32_t chunk_size)
+{
+	bzero(zs, sizeof (*zs));
+	zs->zs_fd = fd;
+	zs->zs_size = size;
+	zs->zs_chunk_size = chunk_size;
+	zs->zs_nchunks = (size + chunk_size - 1) / chunk_size;
+	(void) pthread_mutex_init(&zs->zs_mutex, NULL);
+	(void) pthread_cond_init(&zs->zs_cv, NULL);
+}
+
+static void
+vdi_zstream_fini(vdi_zstream_t *zs)
+{
+	free(zs->zs_chunks);
+	free(zs->zs_index);
+	(void) pthread_cond_destroy(&zs->zs_cv);
+	(void) pthread_mutex_destroy(&zs->zs_mutex);
+}
+
+/*
+ * Write a compressed stream of a virtual disk's contents, as seen
+ * through its whole image chain, to a pipe or file.
+ *	vdh - handle with the image chain opened
+ *	pszformat - VBox format of the images
+ *	fd - descriptor to write to
+ *	level - zlib compression level, 1 through 9
+ *	opts - threads and progress options
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdi_zstream_export(vd_handle_t *vdh, const char *pszformat, int fd,
+    int level, vdi_copy_opts_t *opts)
+{
+	uchar_t hdr[VDI_ZSTREAM_HDR_SIZE];
+	uchar_t frame[VDI_ZSTREAM_FRAME_SIZE];
+	uchar_t trailer[VDI_ZSTREAM_TRAILER_SIZE];
+	uchar_t count[8];
+	vdi_zstream_t zs;
+	vdi_zstream_thr_t *zt = NULL;
+	vd_extent_t *extents = NULL;
+	uint64_t size, chunk, last, end;
+	uint_t nimage;
+	int nextents, nthreads, i;
+	int rc = -1;
+
+	nimage = VDGetCount(vdh->hdd) - 1;
+	size = VDGetSize(vdh->hdd, nimage);
+	vdi_zstream_init(&zs, fd, size, VDI_ZSTREAM_CHUNK);
+	zs.zs_level = level;
+	nthreads = ((opts != NULL) && (opts->co_nthreads > 1)) ?
+	    opts->co_nthreads : 1;
+
+	/*
+	 * Only the chunks overlapping allocated ranges are read; without
+	 * an allocation map every chunk is.
+	 */
+	zs.zs_chunks = malloc(MAX(zs.zs_nchunks, 1) * sizeof (uint64_t));
+	zs.zs_index = malloc(MAX(zs.zs_nchunks, 1) * VDI_ZSTREAM_ENTRY_SIZE);
+	if ((zs.zs_chunks == NULL) || (zs.zs_index == NULL)) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate memory."));
+		goto out;
+	}
+	if (vdisk_get_allocation(vdh, VD_ALLOC_CHAIN, 0, 0, &extents,
+	    &nextents) == -1) {
+		for (chunk = 0; chunk < zs.zs_nchunks; chunk++)
+			zs.zs_chunks[chunk] = chunk;
+		zs.zs_nwork = zs.zs_nchunks;
+	} else {
+		for (i = 0; i < nextents; i++) {
+			if (extents[i].ve_offset >= size)
+				break;
+			end = MIN(extents[i].ve_offset +
+			    extents[i].ve_length, size);
+			chunk = extents[i].ve_offset / zs.zs_chunk_size;
+			last = (end - 1) / zs.zs_chunk_size;
+			/* Adjacent extents may share a chunk */
+			if ((zs.zs_nwork > 0) &&
+			    (zs.zs_chunks[zs.zs_nwork - 1] >= chunk))
+				chunk = zs.zs_chunks[zs.zs_nwork - 1] + 1;
+			for (; chunk <= last; chunk++)
+				zs.zs_chunks[zs.zs_nwork++] = chunk;
+		}
+		vdisk_free_allocation(extents);
+	}
+
+	if (vdi_zstream_alloc_thr(&zs, nthreads, &zt) == -1)
+		goto out;
+	for (i = 0; i < nthreads; i++) {
+		if (!VBOX_SUCCESS(vdi_copy_open_from(vdh->hdd, nimage,
+		    pszformat, &zt[i].zt_hdd))) {
+			zt[i].zt_hdd = NULL;
+			(void) fprintf(stderr, "\n%s\n\n", gettext(
+			    "ERROR: Unable to open virtual disk"));
+			goto out;
+		}
+	}
+
+	bzero(hdr, sizeof (hdr));
+	bcopy(VDI_ZSTREAM_MAGIC, hdr, 8);
+	vdi_stream_put32(hdr + 8, VDI_ZSTREAM_VERSION);
+	vdi_stream_put32(hdr + 12, zs.zs_chunk_size);
+	vdi_stream_put64(hdr + 16, size);
+	if (vdi_stream_write(fd, hdr, sizeof (hdr)) == -1)
+		goto write_fail;
+	zs.zs_off = sizeof (hdr);
+
+	vdi_copy_progress_init(&zs.zs_progress, opts, size, B_FALSE);
+	vdi_zstream_run(&zs, zt, nthreads, vdi_zstream_compressor);
+	if (zs.zs_error)
+		goto out;
+
+	/* The index frame, then the trailer locating it */
+	vdi_zstream_put_frame(frame, VDI_ZSTREAM_INDEX_CHUNK,
+	    sizeof (count) + zs.zs_nindex * VDI_ZSTREAM_ENTRY_SIZE, 0);
+	vdi_stream_put64(count, zs.zs_nindex);
+	vdi_stream_put64(trailer, zs.zs_off);
+	bcopy(VDI_ZSTREAM_INDEX_MAGIC, trailer + 8, 8);
+	if ((vdi_stream_write(fd, frame, sizeof (frame)) == -1) ||
+	    (vdi_stream_write(fd, count, sizeof (count)) == -1) ||
+	    (vdi_stream_write(fd, zs.zs_index,
+	    zs.zs_nindex * VDI_ZSTREAM_ENTRY_SIZE) == -1) ||
+	    (vdi_stream_write(fd, trailer, sizeof (trailer)) == -1))
+		goto write_fail;
+
+	vdi_copy_progress_update(&zs.zs_progress, size);
+	vdi_copy_progress_done(&zs.zs_progress);
+	rc = 0;
+	goto out;
+
+write_fail:
+	(void) fprintf(stderr, "\n%s: %s\n\n",
+	    gettext("ERROR: Unable to write export stream"), strerror(errno));
+out:
+	vdi_zstream_free_thr(zt, nthreads);
+	vdi_zstream_fini(&zs);
+	return (rc);
+}
+
+/*
+ * Read the frame of the next unit of work of an import into zt_zbuf.
+ * Called with zs_mutex held, which is dropped while reading a frame
+ * located through the index.
+ *
+ * Returns:
+ *	1: a frame was read, unit, chunk, len and flags set
+ *	0: no more frames
+ *	-1: failure
+ */
+static int
+vdi_zstream_get_frame(vdi_zstream_thr_t *zt, uint64_t *unitp,
+    uint64_t *chunkp, uint32_t *lenp, uint32_t *flagsp)
+{
+	vdi_zstream_t *zs = zt->zt_zs;
+	uchar_t frame[VDI_ZSTREAM_FRAME_SIZE];
+	uint64_t unit, chunk = 0, off = 0;
+	uint32_t len, flags;
+	ssize_t n;
+
+	if (zs->zs_error || zs->zs_eof ||
+	    (zs->zs_seekable && (zs->zs_next == zs->zs_nwork)))
+		return (0);
+	unit = zs->zs_next++;
+
+	if (zs->zs_seekable) {
+		(void) pthread_mutex_unlock(&zs->zs_mutex);
+		chunk = vdi_stream_get64(zs->zs_index +
+		    unit * VDI_ZSTREAM_ENTRY_SIZE);
+		off = vdi_stream_get64(zs->zs_index +
+		    unit * VDI_ZSTREAM_ENTRY_SIZE + 8);
+		n = pread(zs->zs_fd, frame, sizeof (frame), (off_t)off);
+	} else {
+		n = vdi_stream_read(zs->zs_fd, frame, sizeof (frame));
+	}
+	if (n != sizeof (frame))
+		goto read_fail;
+
+	len = vdi_stream_get32(frame + 8);
+	flags = vdi_stream_get32(frame + 12);
+	if (!zs->zs_seekable &&
+	    (vdi_stream_get64(frame) == VDI_ZSTREAM_INDEX_CHUNK)) {
+		/* The rest is left to the main thread */
+		zs->zs_eof = B_TRUE;
+		zs->zs_nwork = unit;
+		zs->zs_index_len = len;
+		(void) pthread_cond_broadcast(&zs->zs_cv);
+		return (0);
+	}
+	if ((zs->zs_seekable && (vdi_stream_get64(frame) != chunk)) ||
+	    (vdi_stream_get64(frame) >= zs->zs_nchunks) ||
+	    (len > zt->zt_zmax) || ((flags & ~VDI_ZSTREAM_STORED) != 0)) {
+		if (zs->zs_seekable)
+			(void) pthread_mutex_lock(&zs->zs_mutex);
+		vdi_zstream_fail(zs, gettext(
+		    "ERROR: Invalid frame in stream"), NULL);
+		return (-1);
+	}
+	chunk = vdi_stream_get64(frame);
+
+	if (zs->zs_seekable)
+		n = pread(zs->zs_fd, zt->zt_zbuf, len,
+		    (off_t)(off + sizeof (frame)));
+	else
+		n = vdi_stream_read(zs->zs_fd, zt->zt_zbuf, len);
+	if (n != len)
+		goto read_fail;
+
+	*unitp = unit;
+	*chunkp = chunk;
+	*lenp = len;
+	*flagsp = flags;
+	return (1);
+
+read_fail:
+	if (zs->zs_seekable)
+		(void) pthread_mutex_lock(&zs->zs_mutex);
+	vdi_zstream_fail(zs, gettext("ERROR: Unable to read import stream"),
+	    (n == -1) ? strerror(errno) : gettext("stream ended early"));
+	return (-1);
+}
+
+static void *
+vdi_zstream_decompressor(void *arg)
+{
+	vdi_zstream_thr_t *zt = arg;
+	vdi_zstream_t *zs = zt->zt_zs;
+	uint64_t unit, chunk, off;
+	uint32_t zlen, flags;
+	size_t len;
+	uLongf dlen;
+	boolean_t ok;
+	int rc;
+
+	for (;;) {
+		(void) pthread_mutex_lock(&zs->zs_mutex);
+		rc = vdi_zstream_get_frame(zt, &unit, &chunk, &zlen, &flags);
+		if (!zs->zs_seekable || (rc != 1))
+			(void) pthread_mutex_unlock(&zs->zs_mutex);
+		if (rc != 1)
+			break;
+
+		off = chunk * zs->zs_chunk_size;
+		len = MIN(zs->zs_size - off, zs->zs_chunk_size);
+		if (flags & VDI_ZSTREAM_STORED) {
+			ok = (zlen == len) ? B_TRUE : B_FALSE;
+			if (ok)
+				bcopy(zt->zt_zbuf, zt->zt_buf, len);
+		} else {
+			dlen = len;
+			ok = ((uncompress((Bytef *)zt->zt_buf, &dlen,
+			    zt->zt_zbuf, zlen) == Z_OK) && (dlen == len)) ?
+			    B_TRUE : B_FALSE;
+		}
+
+		if (vdi_zstream_wait_turn(zs, unit) == -1) {
+			(void) pthread_mutex_unlock(&zs->zs_mutex);
+			break;
+		}
+		if (!ok) {
+			vdi_zstream_fail(zs, gettext(
+			    "ERROR: Corrupt chunk in stream"), NULL);
+			(void) pthread_mutex_unlock(&zs->zs_mutex);
+			break;
+		}
+		if (!VBOX_SUCCESS(VDWrite(zs->zs_to, off, zt->zt_buf, len))) {
+			vdi_zstream_fail(zs, gettext(
+			    "ERROR: Unable to write file"), zs->zs_to_file);
+			(void) pthread_mutex_unlock(&zs->zs_mutex);
+			break;
+		}
+		vdi_zstream_end_turn(zs, off + len);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Read the index of a compressed stream held in a file, through the
+ * trailer at its end.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+static int
+vdi_zstream_read_index(vdi_zstream_t *zs)
+{
+	uchar_t frame[VDI_ZSTREAM_FRAME_SIZE];
+	uchar_t trailer[VDI_ZSTREAM_TRAILER_SIZE];
+	uchar_t count[8];
+	uint64_t off, n;
+	off_t end;
+	size_t len;
+
+	end = lseek(zs->zs_fd, 0, SEEK_END);
+	if ((end < VDI_ZSTREAM_HDR_SIZE + sizeof (frame) + sizeof (count) +
+	    sizeof (trailer)) ||
+	    (pread(zs->zs_fd, trailer, sizeof (trailer),
+	    end - sizeof (trailer)) != sizeof (trailer)) ||
+	    (bcmp(trailer + 8, VDI_ZSTREAM_INDEX_MAGIC, 8) != 0))
+		goto bad;
+
+	off = vdi_stream_get64(trailer);
+	if ((off > end) ||
+	    (pread(zs->zs_fd, frame, sizeof (frame), (off_t)off) !=
+	    sizeof (frame)) ||
+	    (pread(zs->zs_fd, count, sizeof (count),
+	    (off_t)(off + sizeof (frame))) != sizeof (count)))
+		goto bad;
+	n = vdi_stream_get64(count);
+	if ((vdi_stream_get64(frame) != VDI_ZSTREAM_INDEX_CHUNK) ||
+	    (n > zs->zs_nchunks) ||
+	    (vdi_stream_get32(frame + 8) !=
+	    sizeof (count) + n * VDI_ZSTREAM_ENTRY_SIZE))
+		goto bad;
+
+	len = n * VDI_ZSTREAM_ENTRY_SIZE;
+	zs->zs_index = malloc(MAX(len, 1));
+	if (zs->zs_index == NULL) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate memory."));
+		return (-1);
+	}
+	if (pread(zs->zs_fd, zs->zs_index, len,
+	    (off_t)(off + sizeof (frame) + sizeof (count))) != len)
+		goto bad;
+	zs->zs_nwork = n;
+	return (0);
+
+bad:
+	(void) fprintf(stderr, "\n%s\n\n", gettext(
+	    "ERROR: Stream index is missing or invalid"));
+	return (-1);
+}
+
+/*
+ * Check the index at the end of a compressed stream read from a pipe
+ * against the frames imported.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+static int
+vdi_zstream_check_index(vdi_zstream_t *zs)
+{
+	uchar_t trailer[VDI_ZSTREAM_TRAILER_SIZE];
+	uchar_t count[8];
+	char *buf;
+	uint64_t left;
+	ssize_t n;
+
+	if ((zs->zs_index_len < sizeof (count)) ||
+	    (vdi_stream_read(zs->zs_fd, count, sizeof (count)) !=
+	    sizeof (count)) ||
+	    (vdi_stream_get64(count) != zs->zs_nwork) ||
+	    (zs->zs_index_len - sizeof (count) !=
+	    zs->zs_nwork * VDI_ZSTREAM_ENTRY_SIZE))
+		goto bad;
+
+	/* The entries themselves are of no use without seeking */
+	buf = malloc(VDI_STREAM_MAX_DATA);
+	if (buf == NULL) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate memory."));
+		return (-1);
+	}
+	for (left = zs->zs_index_len - sizeof (count); left > 0; left -= n) {
+		n = vdi_stream_read(zs->zs_fd, buf,
+		    MIN(left, VDI_STREAM_MAX_DATA));
+		if (n <= 0)
+			break;
+	}
+	free(buf);
+	if ((left > 0) || (vdi_stream_read(zs->zs_fd, trailer,
+	    sizeof (trailer)) != sizeof (trailer)) ||
+	    (bcmp(trailer + 8, VDI_ZSTREAM_INDEX_MAGIC, 8) != 0))
+		goto bad;
+	return (0);
+
+bad:
+	(void) fprintf(stderr, "\n%s\n\n", gettext(
+	    "ERROR: Stream index is missing or invalid"));
+	return (-1);
+}
+
+/*
+ * Create a new image from a compressed stream whose magic has been
+ * read already.  See vdi_stream_import() for the arguments.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+static int
+vdi_zstream_import(int fd, PVBOXHDD to, const char *to_format,
+    const char *to_file, uint_t uimageflags, vdi_copy_opts_t *opts)
+{
+	uchar_t hdr[VDI_ZSTREAM_HDR_SIZE];
+	PDMMEDIAGEOMETRY PCHSGeometry;
+	PDMMEDIAGEOMETRY LCHSGeometry;
+	struct stat64 stat64buf;
+	vdi_zstream_t zs;
+	vdi_zstream_thr_t *zt = NULL;
+	uint64_t size;
+	uint32_t chunk_size;
+	boolean_t created = B_FALSE;
+	int nthreads;
+	ssize_t n;
+	int rc = -1;
+
+	n = vdi_stream_read(fd, hdr + 8, sizeof (hdr) - 8);
+	if (n == -1) {
+		(void) fprintf(stderr, "\n%s: %s\n\n", gettext(
+		    "ERROR: Unable to read import stream"), strerror(errno));
+		return (-1);
+	}
+	if (n != sizeof (hdr) - 8) {
+		(void) fprintf(stderr, "\n%s\n\n",
+		    gettext("ERROR: Stream ended early"));
+		return (-1);
+	}
+	if (vdi_stream_get32(hdr + 8) != VDI_ZSTREAM_VERSION) {
+		(void) fprintf(stderr, "\n%s: %u\n\n",
+		    gettext("ERROR: Unsupported stream version"),
+		    vdi_stream_get32(hdr + 8));
+		return (-1);
+	}
+	chunk_size = vdi_stream_get32(hdr + 12);
+	size = vdi_stream_get64(hdr + 16);
+	if ((chunk_size == 0) || (chunk_size > VDI_ZSTREAM_MAX_CHUNK) ||
+	    (chunk_size % 512) != 0) {
+		(void) fprintf(stderr, "\n%s\n\n", gettext(
+		    "ERROR: Invalid chunk size in stream"));
+		return (-1);
+	}
+
+	vdi_zstream_init(&zs, fd, size, chunk_size);
+	zs.zs_to = to;
+	zs.zs_to_file = to_file;
+	nthreads = ((opts != NULL) && (opts->co_nthreads > 1)) ?
+	    opts->co_nthreads : 1;
+
+	/* A file can be read out of order, guided by the index */
+	if ((fstat64(fd, &stat64buf) == 0) && S_ISREG(stat64buf.st_mode)) {
+		zs.zs_seekable = B_TRUE;
+		if (vdi_zstream_read_index(&zs) == -1)
+			goto out;
+	}
+	if (vdi_zstream_alloc_thr(&zs, nthreads, &zt) == -1)
+		goto out;
+
+	bzero(&PCHSGeometry, sizeof (PCHSGeometry));
+	bzero(&LCHSGeometry, sizeof (LCHSGeometry));
+	if (!VBOX_SUCCESS(VDCreateBase(to, to_format, to_file, size,
+	    uimageflags, "", &PCHSGeometry, &LCHSGeometry, NULL,
+	    VD_OPEN_FLAGS_NORMAL, NULL, NULL))) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to create file"), to_file);
+		goto out;
+	}
+	created = B_TRUE;
+
+	vdi_copy_progress_init(&zs.zs_progress, opts, size, B_FALSE);
+	vdi_zstream_run(&zs, zt, nthreads, vdi_zstream_decompressor);
+	if (zs.zs_error)
+		goto out;
+	if (!zs.zs_seekable && (!zs.zs_eof ||
+	    (vdi_zstream_check_index(&zs) == -1))) {
+		if (!zs.zs_eof)
+			(void) fprintf(stderr, "\n%s\n\n",
+			    gettext("ERROR: Stream ended early"));
+		goto out;
+	}
+
+	if (!VBOX_SUCCESS(VDFlush(to))) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to write file"), to_file);
+		goto out;
+	}
+	vdi_copy_progress_update(&zs.zs_progress, size);
+	vdi_copy_progress_done(&zs.zs_progress);
+	rc = 0;
+
+out:
+	/* Don't leave a partial image behind */
+	if ((rc == -1) && created)
+		(void) VDClose(to, true);
+	vdi_zstream_free_thr(zt, nthreads);
+	vdi_zstream_fini(&zs);
+	return (rc);
+}
+
+/*
+ * Create a new image from a raw stream or a stream written by
+ * vdi_stream_export().  The image is opened in "to" on success.
+ *	fd - descriptor to read the stream from
+ *	raw - B_TRUE for a raw stream, B_FALSE for a stream
+ *	to - handle to create the image in
+ *	to_format - VBox format of the new image; raw for a raw stream
+ *	to_file - path of the new image, which must not exist
+ *	uimageflags - image flags of the new image
+ *	opts - progress options
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdi_stream_import(int fd, boolean_t raw, PVBOXHDD to,
+    const char *to_format, const char *to_file, uint_t uimageflags,
+    vdi_copy_opts_t *opts)
+{
+	uchar_t hdr[VDI_STREAM_HDR_SIZE];
+	uchar_t rec[VDI_STREAM_REC_SIZE];
+	PDMMEDIAGEOMETRY PCHSGeometry;
+	PDMMEDIAGEOMETRY LCHSGeometry;
+	vdi_copy_progress_t cp;
+	vdi_stream_t vs;
+	uint64_t size, off, len;
+	uint32_t type;
+	boolean_t created = B_FALSE;
+	ssize_t n;
+	int rc = -1;
+
+	bzero(&vs, sizeof (vs));
+	vs.vs_fd = fd;
+	vs.vs_buf = malloc(VDI_STREAM_MAX_DATA);
+	if (vs.vs_buf == NULL) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate memory."));
+		return (-1);
+	}
+
+	if (raw) {
+		if (strcasecmp(to_format, "raw") != 0) {
+			(void) fprintf(stderr, "\n%s\n\n", gettext(
+			    "ERROR: A raw stream can only be imported as raw"));
+			goto out;
+		}
+		if (vdi_stream_import_raw(&vs, to_file, opts) == -1)
+			goto out;
+		if (!VBOX_SUCCESS(VDOpen(to, to_format, to_file,
+		    VD_OPEN_FLAGS_NORMAL, NULL))) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to open file"), to_file);
+			(void) unlink(to_file);
+			goto out;
+		}
+		rc = 0;
+		goto out;
+	}
+
+	/* The magic tells a stream from a compressed stream */
+	n = vdi_stream_read(fd, hdr, 8);
+	if (n == -1)
+		goto read_fail;
+	if ((n == 8) && (bcmp(hdr, VDI_ZSTREAM_MAGIC, 8) == 0)) {
+		rc = vdi_zstream_import(fd, to, to_format, to_file,
+		    uimageflags, opts);
+		goto out;
+	}
+	if ((n != 8) || (bcmp(hdr, VDI_STREAM_MAGIC, 8) != 0)) {
+		(void) fprintf(stderr, "\n%s\n\n", gettext(
+		    "ERROR: Input isn't a virtual disk stream"));
+		goto out;
+	}
+	n = vdi_stream_read(fd, hdr + 8, sizeof (hdr) - 8);
+	if (n == -1)
+		goto read_fail;
+	if (n != sizeof (hdr) - 8)
+		goto truncated;
+	if (vdi_stream_get32(hdr + 8) != VDI_STREAM_VERSION) {
+		(void) fprintf(stderr, "\n%s: %u\n\n",
+		    gettext("ERROR: Unsupported stream version"),
+		    vdi_stream_get32(hdr + 8));
+		goto out;
+	}
+	if (vdi_stream_get32(hdr + 12) & VDI_STREAM_DELTA) {
+		(void) fprintf(stderr, "\n%s\n\n", gettext(
+		    "ERROR: Stream holds changes since a snapshot; use "
+		    "import -i to apply it"));
+		goto out;
+	}
+	size = vdi_stream_get64(hdr + 16);
+
+	bzero(&PCHSGeometry, sizeof (PCHSGeometry));
+	bzero(&LCHSGeometry, sizeof (LCHSGeometry));
+	if (!VBOX_SUCCESS(VDCreateBase(to, to_format, to_file, size,
+	    uimageflags, "", &PCHSGeometry, &LCHSGeometry, NULL,
+	    VD_OPEN_FLAGS_NORMAL, NULL, NULL))) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to create file"), to_file);
+		goto out;
+	}
+	created = B_TRUE;
+
+	vdi_copy_progress_init(&cp, opts, size, B_FALSE);
+	for (;;) {
+		n = vdi_stream_read(fd, rec, sizeof (rec));
+		if (n == -1)
+			goto read_fail;
+		if (n != sizeof (rec))
+			goto truncated;
+		type = vdi_stream_get32(rec);
+		off = vdi_stream_get64(rec + 8);
+		len = vdi_stream_get64(rec + 16);
+
+		if (type == VDI_STREAM_REC_END) {
+			if ((off != size) || (len != vs.vs_data))
+				goto truncated;
+			break;
+		}
+		if ((off > size) || (len > size - off) ||
+		    ((type == VDI_STREAM_REC_DATA) &&
+		    (len > VDI_STREAM_MAX_DATA)) ||
+		    ((type != VDI_STREAM_REC_DATA) &&
+		    (type != VDI_STREAM_REC_ZERO))) {
+			(void) fprintf(stderr, "\n%s\n\n", gettext(
+			    "ERROR: Invalid record in stream"));
+			goto out;
+		}
+
+		/* A new image already reads as zeroes */
+		if (type == VDI_STREAM_REC_DATA) {
+			n = vdi_stream_read(fd, vs.vs_buf, len);
+			if (n == -1)
+				goto read_fail;
+			if (n != len)
+				goto truncated;
+			if (!VBOX_SUCCESS(VDWrite(to, off, vs.vs_buf, len))) {
+				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+				    gettext("ERROR: Unable to write file"),
+				    to_file);
+				goto out;
+			}
+			vs.vs_data += len;
+		}
+		vdi_copy_progress_update(&cp, off + len);
+	}
+
+	if (!VBOX_SUCCESS(VDFlush(to))) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to write file"), to_file);
+		goto out;
+	}
+	vdi_copy_progress_update(&cp, size);
+	vdi_copy_progress_done(&cp);
+	rc = 0;
+	goto out;
+
+truncated:
+	(void) fprintf(stderr, "\n%s\n\n",
+	    gettext("ERROR: Stream ended early"));
+	goto out;
+read_fail:
+	(void) fprintf(stderr, "\n%s: %s\n\n",
+	    gettext("ERROR: Unable to read import stream"), strerror(errno));
+out:
+	/* Don't leave a partial image behind */
+	if ((rc == -1) && created)
+		(void) VDClose(to, true);
+	free(vs.vs_buf);
+	return (rc);
+}
+
+/*
+ * Read the snapshot name following a FROM or TO record.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, reported
+ */
+static int
+vdi_stream_get_name(int fd, uint32_t type, char *name, size_t namelen)
+{
+	uchar_t rec[VDI_STREAM_REC_SIZE];
+	uint64_t len;
+	ssize_t n;
+
+	n = vdi_stream_read(fd, rec, sizeof (rec));
+	if (n == -1)
+		goto read_fail;
+	if (n != sizeof (rec))
+		goto truncated;
+	len = vdi_stream_get64(rec + 16);
+	if ((vdi_stream_get32(rec) != type) || (len > VDI_STREAM_MAX_NAME) ||
+	    (len >= namelen)) {
+		(void) fprintf(stderr, "\n%s\n\n", gettext(
+		    "ERROR: Invalid record in stream"));
+		return (-1);
+	}
+	n = vdi_stream_read(fd, name, len);
+	if (n == -1)
+		goto read_fail;
+	if (n != len)
+		goto truncated;
+	name[len] = '\0';
+	return (0);
+
+truncated:
+	(void) fprintf(stderr, "\n%s\n\n",
+	    gettext("ERROR: Stream ended early"));
+	return (-1);
+read_fail:
+	(void) fprintf(stderr, "\n%s: %s\n\n",
+	    gettext("ERROR: Unable to read import stream"), strerror(errno));
+	return (-1);
+}
+
+/*
+ * Apply a delta stream written by vdi_stream_export_delta() to the top
+ * image of a replica.
+ *	fd - descriptor to read the stream from
+ *	to - handle with the replica's image chain opened read-write
+ *	base - name of the replica's latest snapshot, which the delta
+ *	    must start at
+ *	to_name - returns the name of the snapshot the delta brings the
+ *	    replica to, empty if it ran up to the current contents
+ *	to_namelen - size of to_name
+ *	opts - progress options
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure; the top image may hold part of the delta
+ */
+int
+vdi_stream_apply(int fd, PVBOXHDD to, const char *base, char *to_name,
+    size_t to_namelen, vdi_copy_opts_t *opts)
+{
+	uchar_t hdr[VDI_STREAM_HDR_SIZE];
+	uchar_t rec[VDI_STREAM_REC_SIZE];
+	char from_name[VDI_STREAM_MAX_NAME + 1];
+	vdi_copy_progress_t cp;
+	vdi_stream_t vs;
+	uint64_t size, off, len, zoff, zlen;
+	uint32_t type;
+	ssize_t n;
+	int rc = -1;
+
+	bzero(&vs, sizeof (vs));
+	vs.vs_fd = fd;
+	vs.vs_buf = malloc(VDI_STREAM_MAX_DATA);
+	if (vs.vs_buf == NULL) {
+		(void) fprintf(stderr, "%s\n", gettext(
+		    "ERROR: Unable to allocate memory."));
+		return (-1);
+	}
+
+	n = vdi_stream_read(fd, hdr, sizeof (hdr));
+	if (n == -1)
+		goto read_fail;
+	if ((n != sizeof (hdr)) || (bcmp(hdr, VDI_STREAM_MAGIC, 8) != 0) ||
+	    !(vdi_stream_get32(hdr + 12) & VDI_STREAM_DELTA)) {
+		(void) fprintf(stderr, "\n%s\n\n", gettext(
+		    "ERROR: Input isn't a delta stream"));
+		goto out;
+	}
+	if (vdi_stream_get32(hdr + 8) != VDI_STREAM_VERSION) {
+		(void) fprintf(stderr, "\n%s: %u\n\n",
+		    gettext("ERROR: Unsupported stream version"),
+		    vdi_stream_get32(hdr + 8));
+		goto out;
+	}
+	size = vdi_stream_get64(hdr + 16);
+	if (size != VDGetSize(to, VDGetCount(to) - 1)) {
+		(void) fprintf(stderr, "\n%s\n\n", gettext(
+		    "ERROR: Stream is of a virtual disk of another size"));
+		goto out;
+	}
+
+	if ((vdi_stream_get_name(fd, VDI_STREAM_REC_FROM, from_name,
+	    sizeof (from_name)) == -1) ||
+	    (vdi_stream_get_name(fd, VDI_STREAM_REC_TO, to_name,
+	    to_namelen) == -1))
+		goto out;
+	if (strcmp(from_name, base) != 0) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n", gettext(
+		    "ERROR: Stream holds the changes since snapshot"),
+		    from_name);
+		goto out;
+	}
+
+	vdi_copy_progress_init(&cp, opts, size, B_FALSE);
+	for (;;) {
+		n = vdi_stream_read(fd, rec, sizeof (rec));
+		if (n == -1)
+			goto read_fail;
+		if (n != sizeof (rec))
+			goto truncated;
+		type = vdi_stream_get32(rec);
+		off = vdi_stream_get64(rec + 8);
+		len = vdi_stream_get64(rec + 16);
+
+		if (type == VDI_STREAM_REC_END) {
+			if ((off != size) || (len != vs.vs_data))
+				goto truncated;
+			break;
+		}
+		if ((off > size) || (len > size - off) ||
+		    ((type == VDI_STREAM_REC_DATA) &&
+		    (len > VDI_STREAM_MAX_DATA)) ||
+		    ((type != VDI_STREAM_REC_DATA) &&
+		    (type != VDI_STREAM_REC_ZERO))) {
+			(void) fprintf(stderr, "\n%s\n\n", gettext(
+			    "ERROR: Invalid record in stream"));
+			goto out;
+		}
+
+		if (type == VDI_STREAM_REC_DATA) {
+			n = vdi_stream_read(fd, vs.vs_buf, len);
+			if (n == -1)
+				goto read_fail;
+			if (n != len)
+				goto truncated;
+			if (!VBOX_SUCCESS(VDWrite(to, off, vs.vs_buf, len)))
+				goto write_fail;
+			vs.vs_data += len;
+		} else {
+			/* Unlike a new image the replica may hold data here */
+			bzero(vs.vs_buf, VDI_STREAM_MAX_DATA);
+			for (zoff = off; zoff < off + len; zoff += zlen) {
+				zlen = MIN(off + len - zoff,
+				    VDI_STREAM_MAX_DATA);
+				if (!VBOX_SUCCESS(VDWrite(to, zoff, vs.vs_buf,
+				    zlen)))
+					goto write_fail;
+			}
+		}
+		vdi_copy_progress_update(&cp, off + len);
+	}
+
+	if (!VBOX_SUCCESS(VDFlush(to)))
+		goto write_fail;
+	vdi_copy_progress_update(&cp, size);
+	vdi_copy_progress_done(&cp);
+	rc = 0;
+	goto out;
+
+truncated:
+	(void) fprintf(stderr, "\n%s\n\n",
+	    gettext("ERROR: Stream ended early"));
+	goto out;
+read_fail:
+	(void) fprintf(stderr, "\n%s: %s\n\n",
+	    gettext("ERROR: Unable to read import stream"), strerror(errno));
+	goto out;
+write_fail:
+	(void) fprintf(stderr, "\n%s\n\n",
+	    gettext("ERROR: Unable to write virtual disk"));
+out:
+	free(vs.vs_buf);
+	return (rc);
+}
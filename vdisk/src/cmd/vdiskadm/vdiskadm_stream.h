@@ -0,0 +1,117 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+#ifndef _VDISKADM_STREAM_H
+#define	_VDISKADM_STREAM_H
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+#include "VBox/VBoxHDD.h"
+#include "vdisk.h"
+#include "vdiskadm_copy.h"
+
+
+/* Name of the stream format given to export -x and import -x */
+#define	VDI_STREAM_FORMAT	"stream"
+
+/*
+ * Stream layout, all numbers big endian:
+ *	header	magic, version, flags, disk size
+ *	records	type, offset, length, followed by length bytes for DATA
+ *	END	offset is the disk size, length the DATA bytes sent
+ *
+ * A delta stream has VDI_STREAM_DELTA set and starts with a FROM and a
+ * TO record, each followed by length bytes of snapshot name; TO has no
+ * name when the delta runs up to the disk's current contents.  Its
+ * records only cover the ranges that changed, and a ZERO record there
+ * means the range must be zeroed.
+ */
+#define	VDI_STREAM_MAGIC	"VDSTREAM"
+#define	VDI_STREAM_VERSION	1
+#define	VDI_STREAM_HDR_SIZE	24
+#define	VDI_STREAM_REC_SIZE	24
+
+#define	VDI_STREAM_REC_DATA	1	/* data of the range follows */
+#define	VDI_STREAM_REC_ZERO	2	/* range reads as zeroes */
+#define	VDI_STREAM_REC_END	3	/* end of the stream */
+#define	VDI_STREAM_REC_FROM	4	/* snapshot a delta applies to */
+#define	VDI_STREAM_REC_TO	5	/* snapshot a delta brings about */
+
+#define	VDI_STREAM_DELTA	0x1	/* header flag of a delta stream */
+
+/* largest DATA record written and accepted */
+#define	VDI_STREAM_MAX_DATA	VDI_COPY_CHUNK
+/* longest snapshot name of a FROM or TO record */
+#define	VDI_STREAM_MAX_NAME	(MAXNAMELEN - 1)
+
+/* Name of the compressed stream format, optionally followed by :level */
+#define	VDI_ZSTREAM_FORMAT	"zstream"
+
+/*
+ * Compressed stream layout, all numbers big endian:
+ *	header	magic, version, chunk size, disk size, reserved
+ *	frames	chunk number, payload length, flags, followed by the
+ *		chunk deflated (or stored) for each chunk holding data
+ *	index	a frame for chunk VDI_ZSTREAM_INDEX_CHUNK holding the
+ *		number of entries, then chunk number and stream offset of
+ *		every frame in chunk order
+ *	trailer	stream offset of the index frame, index magic
+ */
+#define	VDI_ZSTREAM_MAGIC	"VDZCHUNK"
+#define	VDI_ZSTREAM_INDEX_MAGIC	"VDZINDEX"
+#define	VDI_ZSTREAM_VERSION	1
+#define	VDI_ZSTREAM_HDR_SIZE	32
+#define	VDI_ZSTREAM_FRAME_SIZE	16
+#define	VDI_ZSTREAM_ENTRY_SIZE	16
+#define	VDI_ZSTREAM_TRAILER_SIZE	16
+#define	VDI_ZSTREAM_INDEX_CHUNK	0xffffffffffffffffULL
+
+#define	VDI_ZSTREAM_STORED	0x1	/* payload isn't deflated */
+
+/* chunk size written, and the largest accepted */
+#define	VDI_ZSTREAM_CHUNK	VDI_COPY_CHUNK
+#define	VDI_ZSTREAM_MAX_CHUNK	(64 * 1024 * 1024)
+
+#define	VDI_ZSTREAM_DEF_LEVEL	6
+
+int vdi_stream_export(vd_handle_t *vdh, int fd, boolean_t raw,
+    vdi_copy_opts_t *opts);
+int vdi_stream_import(int fd, boolean_t raw, PVBOXHDD to,
+    const char *to_format, const char *to_file, uint_t uimageflags,
+    vdi_copy_opts_t *opts);
+int vdi_stream_export_delta(vd_handle_t *vdh, const char *pszformat,
+    int from, int to, const char *from_name, const char *to_name, int fd,
+    vdi_copy_opts_t *opts);
+int vdi_stream_apply(int fd, PVBOXHDD to, const char *base, char *to_name,
+    size_t to_namelen, vdi_copy_opts_t *opts);
+int vdi_zstream_export(vd_handle_t *vdh, const char *pszformat, int fd,
+    int level, vdi_copy_opts_t *opts);
+
+
+#ifdef	__cplusplus
+}
+#endif
+#endif /* _VDISKADM_STREAM_H */
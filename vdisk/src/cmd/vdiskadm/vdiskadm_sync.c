@@ -0,0 +1,463 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+/*
+ * Block level sync of one virtual disk into another, for vdiskadm sync.
+ *
+ * The destination is made to read the same as the source by writing
+ * only the blocks that differ, through its own top image, so it keeps
+ * its format, snapshots and changed block bitmap.  What needs to be
+ * looked at is narrowed down, best first, by:
+ *
+ *	- the content indexes of both sides, when they are up to date:
+ *	  only the ranges they don't show as equal are read;
+ *	- shared ancestry, when the bottom images of both chains are the
+ *	  same files, as with a linked clone: only the ranges the images
+ *	  above the shared ones write are read;
+ *	- else the whole disk is read.
+ *
+ * Those ranges are split into VDI_SYNC_CHUNK blocks and compared on a
+ * pool of threads, each reading both sides through handles of its own.
+ * Writes are serialized through the destination's handle.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <libintl.h>
+
+#include "VBox/VBoxHDD.h"
+
+#include "vdisk.h"
+#include "vdiskadm_copy.h"
+#include "vdiskadm_index.h"
+#include "vdiskadm_sync.h"
+
+
+typedef struct vdi_sync_state_s {
+	pthread_mutex_t	vs_mutex;	/* hands out blocks */
+	pthread_mutex_t	vs_write_mutex;	/* serializes writes */
+	vdi_copy_progress_t	vs_progress;
+	vd_handle_t	*vs_from;
+	int		vs_from_image;
+	const char	*vs_from_format;
+	vd_handle_t	*vs_to;
+	int		vs_to_image;
+	const char	*vs_to_format;
+	vd_cbt_t	*vs_cbt;	/* destination's bitmap, or NULL */
+
+	vd_extent_t	*vs_extents;	/* ranges to compare */
+	int		vs_nextents;
+	int		vs_cur;		/* extent and offset handed out next */
+	uint64_t	vs_off;
+
+	uint64_t	vs_compared;
+	uint64_t	vs_written;
+	int		vs_errors;
+} vdi_sync_state_t;
+
+typedef struct vdi_sync_thr_s {
+	vdi_sync_state_t	*st_state;
+	PVBOXHDD		st_from;
+	PVBOXHDD		st_to;
+	char			*st_from_buf;
+	char			*st_to_buf;
+	pthread_t		st_tid;
+	boolean_t		st_started;
+} vdi_sync_thr_t;
+
+typedef struct vdi_sync_list_s {
+	vd_extent_t	*sl_extents;
+	int		sl_cnt;
+	int		sl_max;
+	int		sl_error;
+} vdi_sync_list_t;
+
+
+static void
+vdi_sync_list_add(vdi_sync_list_t *sl, uint64_t off, uint64_t len)
+{
+	vd_extent_t *extents;
+	vd_extent_t *last;
+
+	if ((len == 0) || sl->sl_error)
+		return;
+	if (sl->sl_cnt > 0) {
+		last = &sl->sl_extents[sl->sl_cnt - 1];
+		if (last->ve_offset + last->ve_length >= off) {
+			last->ve_length = MAX(last->ve_offset +
+			    last->ve_length, off + len) - last->ve_offset;
+			return;
+		}
+	}
+	if (sl->sl_cnt == sl->sl_max) {
+		extents = realloc(sl->sl_extents,
+		    (sl->sl_max + 64) * 2 * sizeof (vd_extent_t));
+		if (extents == NULL) {
+			sl->sl_error = 1;
+			return;
+		}
+		sl->sl_extents = extents;
+		sl->sl_max = (sl->sl_max + 64) * 2;
+	}
+	sl->sl_extents[sl->sl_cnt].ve_offset = off;
+	sl->sl_extents[sl->sl_cnt].ve_length = len;
+	sl->sl_cnt++;
+}
+
+static void
+vdi_sync_index_range(uint64_t off, uint64_t len, int state, void *arg)
+{
+	if (state != VDI_INDEX_EQUAL)
+		vdi_sync_list_add(arg, off, len);
+}
+
+/*
+ * Use the content indexes of both sides, if they are up to date.
+ *
+ * Returns:
+ *	0: success
+ *	-1: no usable indexes
+ */
+static int
+vdi_sync_by_index(vdi_sync_state_t *vs, vdi_sync_list_t *sl)
+{
+	vdi_index_t *a = NULL, *b = NULL;
+	int rc = -1;
+
+	if ((vdi_index_load(vs->vs_from, vs->vs_from_image, &a) == 0) &&
+	    (vdi_index_load(vs->vs_to, vs->vs_to_image, &b) == 0) &&
+	    (a->xi_block == b->xi_block) && (a->xi_size == b->xi_size)) {
+		(void) vdi_index_compare(a, b, vdi_sync_index_range, sl);
+		rc = 0;
+	}
+	vdi_index_free(a);
+	vdi_index_free(b);
+	return (rc);
+}
+
+/*
+ * Number of images at the bottom of both chains that are the same
+ * files.
+ */
+static int
+vdi_sync_shared(vdi_sync_state_t *vs)
+{
+	char name[MAXPATHLEN];
+	char from_path[MAXPATHLEN];
+	char to_path[MAXPATHLEN];
+	int i;
+
+	for (i = 0; (i <= vs->vs_from_image) && (i < vs->vs_to_image); i++) {
+		if (!VBOX_SUCCESS(VDGetFilename(vs->vs_from->hdd, i, name,
+		    sizeof (name))) || (realpath(name, from_path) == NULL))
+			break;
+		if (!VBOX_SUCCESS(VDGetFilename(vs->vs_to->hdd, i, name,
+		    sizeof (name))) || (realpath(name, to_path) == NULL))
+			break;
+		if (strcmp(from_path, to_path) != 0)
+			break;
+	}
+	return (i);
+}
+
+/*
+ * Use the allocation of the images above the ones both chains share.
+ *
+ * Returns:
+ *	0: success
+ *	-1: the chains share no image
+ */
+static int
+vdi_sync_by_ancestry(vdi_sync_state_t *vs, vdi_sync_list_t *sl)
+{
+	vd_extent_t *from_ext = NULL, *to_ext = NULL;
+	int from_n = 0, to_n = 0;
+	int shared, i, j;
+	int rc = -1;
+
+	if ((shared = vdi_sync_shared(vs)) == 0)
+		return (-1);
+	if (((shared - 1 < vs->vs_from_image) &&
+	    (vdisk_get_delta(vs->vs_from, shared - 1, vs->vs_from_image,
+	    &from_ext, &from_n) == -1)) ||
+	    (vdisk_get_delta(vs->vs_to, shared - 1, vs->vs_to_image,
+	    &to_ext, &to_n) == -1))
+		goto out;
+
+	/* Both lists are sorted; add them in order of offset */
+	for (i = 0, j = 0; (i < from_n) || (j < to_n); ) {
+		if ((j == to_n) || ((i < from_n) &&
+		    (from_ext[i].ve_offset < to_ext[j].ve_offset))) {
+			vdi_sync_list_add(sl, from_ext[i].ve_offset,
+			    from_ext[i].ve_length);
+			i++;
+		} else {
+			vdi_sync_list_add(sl, to_ext[j].ve_offset,
+			    to_ext[j].ve_length);
+			j++;
+		}
+	}
+	rc = 0;
+out:
+	vdisk_free_allocation(from_ext);
+	vdisk_free_allocation(to_ext);
+	return (rc);
+}
+
+static void *
+vdi_sync_worker(void *arg)
+{
+	vdi_sync_thr_t *st = arg;
+	vdi_sync_state_t *vs = st->st_state;
+	vd_extent_t *ve;
+	uint64_t off, len;
+	int rc;
+
+	for (;;) {
+		(void) pthread_mutex_lock(&vs->vs_mutex);
+		if ((vs->vs_cur >= vs->vs_nextents) || (vs->vs_errors != 0)) {
+			(void) pthread_mutex_unlock(&vs->vs_mutex);
+			break;
+		}
+		ve = &vs->vs_extents[vs->vs_cur];
+		off = ve->ve_offset + vs->vs_off;
+		len = MIN((off / VDI_SYNC_CHUNK + 1) * VDI_SYNC_CHUNK,
+		    ve->ve_offset + ve->ve_length) - off;
+		vs->vs_off += len;
+		if (vs->vs_off >= ve->ve_length) {
+			vs->vs_cur++;
+			vs->vs_off = 0;
+		}
+		(void) pthread_mutex_unlock(&vs->vs_mutex);
+
+		rc = VDRead(st->st_from, off, st->st_from_buf, len);
+		if (VBOX_SUCCESS(rc))
+			rc = VDRead(st->st_to, off, st->st_to_buf, len);
+		if (VBOX_SUCCESS(rc) &&
+		    (bcmp(st->st_from_buf, st->st_to_buf, len) != 0)) {
+			(void) pthread_mutex_lock(&vs->vs_write_mutex);
+			rc = VDWrite(vs->vs_to->hdd, off, st->st_from_buf,
+			    len);
+			if (VBOX_SUCCESS(rc) && (vs->vs_cbt != NULL))
+				vdisk_cbt_mark(vs->vs_cbt, off, len);
+			(void) pthread_mutex_unlock(&vs->vs_write_mutex);
+			if (VBOX_SUCCESS(rc)) {
+				(void) pthread_mutex_lock(&vs->vs_mutex);
+				vs->vs_written += len;
+				(void) pthread_mutex_unlock(&vs->vs_mutex);
+			}
+		}
+
+		(void) pthread_mutex_lock(&vs->vs_mutex);
+		if (!VBOX_SUCCESS(rc)) {
+			(void) fprintf(stderr, "\n%s %llu\n",
+			    gettext("ERROR: Unable to sync block at offset"),
+			    (unsigned long long)off);
+			vs->vs_errors++;
+		}
+		vs->vs_compared += len;
+		vdi_copy_progress_update(&vs->vs_progress, vs->vs_compared);
+		(void) pthread_mutex_unlock(&vs->vs_mutex);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Compare and write the ranges on a pool of threads.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+static int
+vdi_sync_run(vdi_sync_state_t *vs, int nthreads)
+{
+	vdi_sync_thr_t *st;
+	int i, started = 0;
+	int rc = -1;
+
+	st = calloc(nthreads, sizeof (vdi_sync_thr_t));
+	if (st == NULL)
+		return (-1);
+	for (i = 0; i < nthreads; i++) {
+		st[i].st_state = vs;
+		st[i].st_from_buf = malloc(VDI_SYNC_CHUNK);
+		st[i].st_to_buf = malloc(VDI_SYNC_CHUNK);
+		if ((st[i].st_from_buf == NULL) || (st[i].st_to_buf == NULL))
+			goto out;
+		if (!VBOX_SUCCESS(vdi_copy_open_from(vs->vs_from->hdd,
+		    vs->vs_from_image, vs->vs_from_format, &st[i].st_from))) {
+			st[i].st_from = NULL;
+			goto out;
+		}
+		/* Each block is read before it is written, by one thread */
+		if (!VBOX_SUCCESS(vdi_copy_open_from(vs->vs_to->hdd,
+		    vs->vs_to_image, vs->vs_to_format, &st[i].st_to))) {
+			st[i].st_to = NULL;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&st[i].st_tid, NULL, vdi_sync_worker,
+		    &st[i]) != 0)
+			break;
+		st[i].st_started = B_TRUE;
+		started++;
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (st[i].st_started)
+			(void) pthread_join(st[i].st_tid, NULL);
+	}
+	/* Fewer threads just take longer */
+	if ((started > 0) && (vs->vs_errors == 0))
+		rc = 0;
+out:
+	for (i = 0; i < nthreads; i++) {
+		if (st[i].st_from != NULL)
+			VDDestroy(st[i].st_from);
+		if (st[i].st_to != NULL)
+			VDDestroy(st[i].st_to);
+		free(st[i].st_from_buf);
+		free(st[i].st_to_buf);
+	}
+	free(st);
+	return (rc);
+}
+
+/*
+ * Make a virtual disk read the same as another, or a snapshot of it;
+ * see the top of this file.
+ *	from - handle with the source chain opened read-only
+ *	from_image - image number of the source to read through
+ *	from_format - VBox format of the source images
+ *	to - handle with the destination chain opened, top read-write
+ *	to_format - VBox format of the destination images
+ *	to_vdname - path to the destination virtual disk
+ *	opts - threads and progress options
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdi_sync(vd_handle_t *from, int from_image, const char *from_format,
+    vd_handle_t *to, const char *to_format, char *to_vdname,
+    vdi_copy_opts_t *opts)
+{
+	vdi_sync_state_t vs;
+	vdi_sync_list_t sl;
+	const char *how;
+	int i;
+	int rc = -1;
+
+	bzero(&vs, sizeof (vs));
+	bzero(&sl, sizeof (sl));
+	(void) pthread_mutex_init(&vs.vs_mutex, NULL);
+	(void) pthread_mutex_init(&vs.vs_write_mutex, NULL);
+	vs.vs_from = from;
+	vs.vs_from_image = from_image;
+	vs.vs_from_format = from_format;
+	vs.vs_to = to;
+	vs.vs_to_image = VDGetCount(to->hdd) - 1;
+	vs.vs_to_format = to_format;
+
+	if (vdi_sync_by_index(&vs, &sl) == 0) {
+		how = gettext("content indexes");
+	} else if (vdi_sync_by_ancestry(&vs, &sl) == 0) {
+		how = gettext("shared images");
+	} else {
+		vdi_sync_list_add(&sl, 0, VDGetSize(to->hdd, vs.vs_to_image));
+		how = NULL;
+	}
+	if (sl.sl_error)
+		goto nomem;
+	vs.vs_extents = sl.sl_extents;
+	vs.vs_nextents = sl.sl_cnt;
+
+	vdi_copy_progress_init(&vs.vs_progress, opts, 0, B_FALSE);
+	for (i = 0; i < vs.vs_nextents; i++)
+		vs.vs_progress.cp_total += vs.vs_extents[i].ve_length;
+	if (opts->co_progress && !opts->co_parsable && (how != NULL))
+		(void) fprintf(stderr, "%s %s: %.1f MB\n",
+		    gettext("Blocks to compare found by"), how,
+		    (double)vs.vs_progress.cp_total / (1024 * 1024));
+
+	/* Writes are tracked like a guest's */
+	vs.vs_cbt = vdisk_cbt_open(to_vdname);
+	if ((vs.vs_cbt == NULL) && (errno != ENOENT)) {
+		(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+		    gettext("ERROR: Unable to open changed block bitmap"),
+		    to_vdname, strerror(errno));
+		goto out;
+	}
+
+	if (vdi_sync_run(&vs, (opts->co_nthreads > 0) ?
+	    opts->co_nthreads : 1) == -1) {
+		if (vs.vs_errors == 0)
+			goto nomem;
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to sync virtual disk"), to_vdname);
+	} else {
+		rc = 0;
+	}
+	if (!VBOX_SUCCESS(VDFlush(to->hdd)) ||
+	    ((vs.vs_cbt != NULL) && (vdisk_cbt_sync(vs.vs_cbt) == -1))) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to flush virtual disk"),
+		    to_vdname);
+		rc = -1;
+	}
+	vdi_copy_progress_done(&vs.vs_progress);
+
+	if ((rc == 0) && opts->co_progress) {
+		if (opts->co_parsable)
+			(void) printf("synced:%llu:%llu\n",
+			    (unsigned long long)vs.vs_compared,
+			    (unsigned long long)vs.vs_written);
+		else
+			(void) fprintf(stderr, "%s %.1f MB, %s %.1f MB\n",
+			    gettext("Compared"),
+			    (double)vs.vs_compared / (1024 * 1024),
+			    gettext("wrote"),
+			    (double)vs.vs_written / (1024 * 1024));
+	}
+	goto out;
+
+nomem:
+	(void) fprintf(stderr, "%s\n", gettext(
+	    "ERROR: Unable to allocate memory."));
+out:
+	if ((vs.vs_cbt != NULL) && (vdisk_cbt_close(vs.vs_cbt) == -1))
+		rc = -1;
+	free(sl.sl_extents);
+	(void) pthread_mutex_destroy(&vs.vs_mutex);
+	(void) pthread_mutex_destroy(&vs.vs_write_mutex);
+	return (rc);
+}
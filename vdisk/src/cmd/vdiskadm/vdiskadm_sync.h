@@ -0,0 +1,49 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+
+#ifndef _VDISKADM_SYNC_H
+#define	_VDISKADM_SYNC_H
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+#include "VBox/VBoxHDD.h"
+#include "vdisk.h"
+#include "vdiskadm_copy.h"
+
+
+/* bytes compared, and written if they differ, as one block */
+#define	VDI_SYNC_CHUNK		VDI_COPY_CHUNK
+
+int vdi_sync(vd_handle_t *from, int from_image, const char *from_format,
+    vd_handle_t *to, const char *to_format, char *to_vdname,
+    vdi_copy_opts_t *opts);
+
+
+#ifdef	__cplusplus
+}
+#endif
+#endif /* _VDISKADM_SYNC_H */
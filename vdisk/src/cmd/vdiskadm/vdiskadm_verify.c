@@ -0,0 +1,678 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+/*
+ * Deep verification of a virtual disk, for verify -f.
+ *
+ * First the image metadata is checked: every image of the chain must
+ * have the size the store gives the disk, name the image below it as
+ * its parent, and have a block map that can be read.  Then every block
+ * each image allocates is read through VBox, which also checks that the
+ * block map entries lead somewhere sensible.  Images are read from the
+ * base up, each through a chain ending at it, so a read returns the
+ * image's own data.
+ *
+ * The reads are split into units of at most VDI_VERIFY_CHUNK, aligned
+ * to VDI_VERIFY_CHUNK, and handed out to a pool of threads, each with
+ * handles of its own.  A rate limit spreads the reads out so guests
+ * using the same storage keep most of its bandwidth.
+ *
+ * Snapshot images never change, so the CRC-32 of each of their units
+ * can be recorded in VDI_VERIFY_SUMS and compared by later scans, which
+ * turns silent corruption into a mismatch.  The top image is only read.
+ *
+ * Every VDI_VERIFY_SAVE_INTERVAL the position below which every unit is
+ * done goes to VDI_VERIFY_STATE, along with a signature of the chain
+ * and its allocation.  A scan of the same chain resumes from there; a
+ * complete scan removes the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <libintl.h>
+#include <zlib.h>
+
+#include "VBox/VBoxHDD.h"
+#include "iprt/uuid.h"
+
+#include "vdisk.h"
+#include "vdiskadm_copy.h"
+#include "vdiskadm_verify.h"
+
+
+typedef struct vdi_verify_unit_s {
+	int		vu_image;
+	uint64_t	vu_off;
+	uint64_t	vu_len;
+} vdi_verify_unit_t;
+
+/* A recorded checksum */
+typedef struct vdi_verify_crc_s {
+	int		vc_image;
+	uint64_t	vc_off;
+	uint64_t	vc_len;
+	uint32_t	vc_crc;
+} vdi_verify_crc_t;
+
+typedef struct vdi_verify_state_s {
+	pthread_mutex_t	vv_mutex;
+	vdi_copy_progress_t	vv_progress;
+	vd_handle_t	*vv_vdh;
+	const char	*vv_format;
+	vdi_verify_opts_t	*vv_opts;
+
+	int		vv_nimages;
+	char		(*vv_names)[MAXPATHLEN];	/* image basenames */
+	int		vv_first_sum;	/* images with checksums */
+	int		vv_last_sum;
+
+	vdi_verify_unit_t	*vv_units;
+	uint64_t	vv_nunits;
+	uchar_t		*vv_done;	/* units finished */
+	uint64_t	vv_next;	/* next unit handed to a thread */
+	uint64_t	vv_low;		/* every unit below is finished */
+	uint64_t	vv_bytes;	/* bytes of the finished units */
+	uint64_t	vv_errors;
+	hrtime_t	vv_slot;	/* when the rate lets a read start */
+	hrtime_t	vv_saved;	/* time the position was last saved */
+	uint32_t	vv_sig;		/* signature of chain and units */
+
+	char		vv_statefile[MAXPATHLEN];
+	char		vv_sumfile[MAXPATHLEN];
+	char		vv_newsumfile[MAXPATHLEN];
+	FILE		*vv_record;	/* checksums being recorded */
+	vdi_verify_crc_t	*vv_crcs;	/* checksums being compared */
+	int		vv_ncrcs;
+} vdi_verify_state_t;
+
+typedef struct vdi_verify_thr_s {
+	vdi_verify_state_t	*vt_state;
+	PVBOXHDD		vt_hdd;
+	int			vt_image;	/* image vt_hdd ends at */
+	char			*vt_buf;
+	pthread_t		vt_tid;
+	boolean_t		vt_started;
+} vdi_verify_thr_t;
+
+
+/*
+ * Report a failing image and count it.
+ */
+static void
+vdi_verify_error(vdi_verify_state_t *vv, int image, const char *msg,
+    uint64_t off)
+{
+	vv->vv_errors++;
+	if (off == UINT64_MAX)
+		(void) fprintf(stderr, "\n%s: \"%s\"\n", msg,
+		    vv->vv_names[image]);
+	else
+		(void) fprintf(stderr, "\n%s: \"%s\" %s %llu\n", msg,
+		    vv->vv_names[image], gettext("offset"),
+		    (unsigned long long)off);
+}
+
+/*
+ * Check what the images say about themselves and each other.
+ */
+static void
+vdi_verify_meta(vdi_verify_state_t *vv, uint64_t size)
+{
+	PVBOXHDD hdd = vv->vv_vdh->hdd;
+	RTUUID uuid, parent;
+	int i;
+
+	for (i = 0; i < vv->vv_nimages; i++) {
+		if (VDGetSize(hdd, i) != size)
+			vdi_verify_error(vv, i, gettext("ERROR: Image size "
+			    "doesn't match the virtual disk"), UINT64_MAX);
+
+		/* Formats without uuids (raw) can't be checked */
+		if ((i > 0) &&
+		    VBOX_SUCCESS(VDGetParentUuid(hdd, i, &parent)) &&
+		    VBOX_SUCCESS(VDGetUuid(hdd, i - 1, &uuid)) &&
+		    (RTUuidCompare(&parent, &uuid) != 0))
+			vdi_verify_error(vv, i, gettext("ERROR: Image's "
+			    "parent isn't the image below it"), UINT64_MAX);
+	}
+}
+
+/*
+ * Split an extent of an image into units, at VDI_VERIFY_CHUNK
+ * boundaries so a block of a snapshot always gets the same units.
+ */
+static int
+vdi_verify_add_units(vdi_verify_state_t *vv, uint64_t *maxp, int image,
+    uint64_t off, uint64_t end)
+{
+	vdi_verify_unit_t *units;
+	uint64_t next;
+
+	for (; off < end; off = next) {
+		next = MIN((off / VDI_VERIFY_CHUNK + 1) * VDI_VERIFY_CHUNK,
+		    end);
+		if (vv->vv_nunits == *maxp) {
+			units = realloc(vv->vv_units,
+			    (*maxp + 1024) * 2 * sizeof (vdi_verify_unit_t));
+			if (units == NULL)
+				return (-1);
+			vv->vv_units = units;
+			*maxp = (*maxp + 1024) * 2;
+		}
+		vv->vv_units[vv->vv_nunits].vu_image = image;
+		vv->vv_units[vv->vv_nunits].vu_off = off;
+		vv->vv_units[vv->vv_nunits].vu_len = next - off;
+		vv->vv_nunits++;
+		vv->vv_progress.cp_total += next - off;
+		vv->vv_sig = crc32(vv->vv_sig, (const Bytef *)
+		    &vv->vv_units[vv->vv_nunits - 1],
+		    sizeof (vdi_verify_unit_t));
+	}
+	return (0);
+}
+
+/*
+ * Build the units of every image, base first.  An image whose block
+ * map can't be read is failed and read throughout.
+ */
+static int
+vdi_verify_build(vdi_verify_state_t *vv, uint64_t size)
+{
+	vd_extent_t *extents;
+	uint64_t max = 0;
+	int nimages = vv->vv_nimages;
+	int nextents, i, j;
+
+	if (vv->vv_opts->vo_skip_top)
+		nimages--;
+	for (i = 0; i < nimages; i++) {
+		vv->vv_sig = crc32(vv->vv_sig, (const Bytef *)vv->vv_names[i],
+		    strlen(vv->vv_names[i]));
+		if (vdisk_get_allocation(vv->vv_vdh, i, 0, 0, &extents,
+		    &nextents) == -1) {
+			vdi_verify_error(vv, i, gettext("ERROR: Unable to "
+			    "read block map of image"), UINT64_MAX);
+			if (vdi_verify_add_units(vv, &max, i, 0, size) == -1)
+				return (-1);
+			continue;
+		}
+		for (j = 0; j < nextents; j++) {
+			if (vdi_verify_add_units(vv, &max, i,
+			    extents[j].ve_offset, extents[j].ve_offset +
+			    extents[j].ve_length) == -1) {
+				vdisk_free_allocation(extents);
+				return (-1);
+			}
+		}
+		vdisk_free_allocation(extents);
+	}
+	return (0);
+}
+
+static int
+vdi_verify_crc_cmp(const void *a, const void *b)
+{
+	const vdi_verify_crc_t *ca = a;
+	const vdi_verify_crc_t *cb = b;
+
+	if (ca->vc_image != cb->vc_image)
+		return ((ca->vc_image < cb->vc_image) ? -1 : 1);
+	if (ca->vc_off != cb->vc_off)
+		return ((ca->vc_off < cb->vc_off) ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Read the recorded checksums of the images still in the chain.  Each
+ * line is offset, length and CRC, then the image name.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set
+ */
+static int
+vdi_verify_load_sums(vdi_verify_state_t *vv)
+{
+	char line[MAXPATHLEN + 64];
+	unsigned long long off, len;
+	vdi_verify_crc_t *crcs;
+	char *name, *nl;
+	uint_t crc;
+	int max = 0;
+	int n, i;
+	FILE *fp;
+
+	if ((fp = fopen(vv->vv_sumfile, "r")) == NULL)
+		return ((errno == ENOENT) ? 0 : -1);
+
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		if ((sscanf(line, "%llu\t%llu\t%x\t%n", &off, &len, &crc,
+		    &n) != 3) || ((nl = strchr(line, '\n')) == NULL))
+			continue;
+		*nl = '\0';
+		name = line + n;
+		for (i = vv->vv_first_sum; i <= vv->vv_last_sum; i++) {
+			if (strcmp(name, vv->vv_names[i]) == 0)
+				break;
+		}
+		if (i > vv->vv_last_sum)
+			continue;
+
+		if (vv->vv_ncrcs == max) {
+			crcs = realloc(vv->vv_crcs,
+			    (max + 1024) * 2 * sizeof (vdi_verify_crc_t));
+			if (crcs == NULL) {
+				(void) fclose(fp);
+				errno = ENOMEM;
+				return (-1);
+			}
+			vv->vv_crcs = crcs;
+			max = (max + 1024) * 2;
+		}
+		vv->vv_crcs[vv->vv_ncrcs].vc_image = i;
+		vv->vv_crcs[vv->vv_ncrcs].vc_off = off;
+		vv->vv_crcs[vv->vv_ncrcs].vc_len = len;
+		vv->vv_crcs[vv->vv_ncrcs].vc_crc = crc;
+		vv->vv_ncrcs++;
+	}
+	(void) fclose(fp);
+
+	if (vv->vv_ncrcs > 1)
+		qsort(vv->vv_crcs, vv->vv_ncrcs, sizeof (vdi_verify_crc_t),
+		    vdi_verify_crc_cmp);
+	return (0);
+}
+
+/*
+ * Pick up where an earlier scan of the same chain stopped.
+ */
+static void
+vdi_verify_resume(vdi_verify_state_t *vv)
+{
+	unsigned long long low, nunits;
+	uint_t sig;
+	uint64_t i;
+	FILE *fp;
+
+	if ((fp = fopen(vv->vv_statefile, "r")) == NULL)
+		return;
+	if ((fscanf(fp, "%llu %llu %x", &low, &nunits, &sig) == 3) &&
+	    (nunits == vv->vv_nunits) && (sig == vv->vv_sig) &&
+	    (low <= nunits)) {
+		for (i = 0; i < low; i++) {
+			vv->vv_done[i] = 1;
+			vv->vv_bytes += vv->vv_units[i].vu_len;
+		}
+		vv->vv_low = vv->vv_next = low;
+		if (vv->vv_progress.cp_opts->co_progress)
+			(void) fprintf(stderr, "%s %llu%%\n",
+			    gettext("Resuming verification at"),
+			    (unsigned long long)((vv->vv_progress.cp_total >
+			    0) ? vv->vv_bytes * 100 / vv->vv_progress.cp_total :
+			    100));
+	}
+	(void) fclose(fp);
+}
+
+/*
+ * Save the position reached, once every unit below it has its checksum
+ * recorded.  Called with vv_mutex held.
+ */
+static void
+vdi_verify_save(vdi_verify_state_t *vv)
+{
+	FILE *fp;
+
+	vv->vv_saved = gethrtime();
+	if ((vv->vv_record != NULL) && (fflush(vv->vv_record) != 0))
+		return;
+	if ((fp = fopen(vv->vv_statefile, "w")) == NULL)
+		return;
+	(void) fprintf(fp, "%llu %llu %08x\n",
+	    (unsigned long long)vv->vv_low,
+	    (unsigned long long)vv->vv_nunits, vv->vv_sig);
+	(void) fclose(fp);
+}
+
+/*
+ * Record or compare the checksum of a unit read.
+ * Called with vv_mutex held.
+ */
+static void
+vdi_verify_sum(vdi_verify_state_t *vv, vdi_verify_unit_t *vu, uint32_t crc)
+{
+	vdi_verify_crc_t key, *vc;
+
+	if ((vu->vu_image < vv->vv_first_sum) ||
+	    (vu->vu_image > vv->vv_last_sum))
+		return;
+
+	if (vv->vv_record != NULL) {
+		(void) fprintf(vv->vv_record, "%llu\t%llu\t%08x\t%s\n",
+		    (unsigned long long)vu->vu_off,
+		    (unsigned long long)vu->vu_len, crc,
+		    vv->vv_names[vu->vu_image]);
+		return;
+	}
+
+	key.vc_image = vu->vu_image;
+	key.vc_off = vu->vu_off;
+	vc = bsearch(&key, vv->vv_crcs, vv->vv_ncrcs,
+	    sizeof (vdi_verify_crc_t), vdi_verify_crc_cmp);
+	if ((vc != NULL) && (vc->vc_len == vu->vu_len) && (vc->vc_crc != crc))
+		vdi_verify_error(vv, vu->vu_image,
+		    gettext("ERROR: Checksum mismatch in image"), vu->vu_off);
+}
+
+/*
+ * Wait for the rate limit to allow len more bytes to be read.
+ * Called with vv_mutex held, drops it while sleeping.
+ */
+static void
+vdi_verify_throttle(vdi_verify_state_t *vv, uint64_t len)
+{
+	struct timespec ts;
+	hrtime_t now, start;
+
+	if (vv->vv_opts->vo_rate == 0)
+		return;
+
+	now = gethrtime();
+	start = MAX(now, vv->vv_slot);
+	vv->vv_slot = start + (hrtime_t)(len * NANOSEC / vv->vv_opts->vo_rate);
+	if (start <= now)
+		return;
+
+	(void) pthread_mutex_unlock(&vv->vv_mutex);
+	ts.tv_sec = (start - now) / NANOSEC;
+	ts.tv_nsec = (start - now) % NANOSEC;
+	while ((nanosleep(&ts, &ts) == -1) && (errno == EINTR))
+		;
+	(void) pthread_mutex_lock(&vv->vv_mutex);
+}
+
+static void *
+vdi_verify_reader(void *arg)
+{
+	vdi_verify_thr_t *vt = arg;
+	vdi_verify_state_t *vv = vt->vt_state;
+	vdi_verify_unit_t *vu;
+	uint64_t u;
+	uint32_t crc = 0;
+	int rc;
+
+	for (;;) {
+		(void) pthread_mutex_lock(&vv->vv_mutex);
+		if (vv->vv_next >= vv->vv_nunits) {
+			(void) pthread_mutex_unlock(&vv->vv_mutex);
+			break;
+		}
+		u = vv->vv_next++;
+		vu = &vv->vv_units[u];
+		vdi_verify_throttle(vv, vu->vu_len);
+		(void) pthread_mutex_unlock(&vv->vv_mutex);
+
+		/* Units come base image first, so handles rarely change */
+		rc = VINF_SUCCESS;
+		if (vt->vt_image != vu->vu_image) {
+			if (vt->vt_hdd != NULL)
+				VDDestroy(vt->vt_hdd);
+			vt->vt_hdd = NULL;
+			vt->vt_image = vu->vu_image;
+			rc = vdi_copy_open_from(vv->vv_vdh->hdd, vu->vu_image,
+			    vv->vv_format, &vt->vt_hdd);
+			if (!VBOX_SUCCESS(rc))
+				vt->vt_hdd = NULL;
+		}
+		if (VBOX_SUCCESS(rc))
+			rc = VDRead(vt->vt_hdd, vu->vu_off, vt->vt_buf,
+			    vu->vu_len);
+		if (VBOX_SUCCESS(rc))
+			crc = crc32(crc32(0L, Z_NULL, 0),
+			    (const Bytef *)vt->vt_buf, (uInt)vu->vu_len);
+
+		(void) pthread_mutex_lock(&vv->vv_mutex);
+		if (!VBOX_SUCCESS(rc))
+			vdi_verify_error(vv, vu->vu_image,
+			    gettext("ERROR: Unable to read image"), vu->vu_off);
+		else
+			vdi_verify_sum(vv, vu, crc);
+		vv->vv_done[u] = 1;
+		while ((vv->vv_low < vv->vv_nunits) &&
+		    vv->vv_done[vv->vv_low])
+			vv->vv_low++;
+		vv->vv_bytes += vu->vu_len;
+		vdi_copy_progress_update(&vv->vv_progress, vv->vv_bytes);
+		if (gethrtime() - vv->vv_saved >= VDI_VERIFY_SAVE_INTERVAL)
+			vdi_verify_save(vv);
+		(void) pthread_mutex_unlock(&vv->vv_mutex);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Read the units on a pool of threads.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+static int
+vdi_verify_run(vdi_verify_state_t *vv, int nthreads)
+{
+	vdi_verify_thr_t *vt;
+	int i;
+	int rc = -1;
+
+	vt = calloc(nthreads, sizeof (vdi_verify_thr_t));
+	if (vt == NULL)
+		return (-1);
+	for (i = 0; i < nthreads; i++) {
+		vt[i].vt_state = vv;
+		vt[i].vt_image = -1;
+		vt[i].vt_buf = malloc(VDI_VERIFY_CHUNK);
+		if (vt[i].vt_buf == NULL)
+			goto out;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&vt[i].vt_tid, NULL, vdi_verify_reader,
+		    &vt[i]) != 0)
+			break;
+		vt[i].vt_started = B_TRUE;
+	}
+	/* Fewer threads just take longer */
+	if (i > 0)
+		rc = 0;
+
+	for (i = 0; i < nthreads; i++) {
+		if (vt[i].vt_started)
+			(void) pthread_join(vt[i].vt_tid, NULL);
+	}
+out:
+	for (i = 0; i < nthreads; i++) {
+		if (vt[i].vt_hdd != NULL)
+			VDDestroy(vt[i].vt_hdd);
+		free(vt[i].vt_buf);
+	}
+	free(vt);
+	return (rc);
+}
+
+/*
+ * Deep verification of a virtual disk; see the top of this file.
+ *	vdh - handle with the image chain opened read-only
+ *	vdname - path to the virtual disk
+ *	pszformat - VBox format of the images
+ *	vopts - rate limit, checksum and resume options
+ *	opts - threads and progress options
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, or the disk failed verification
+ */
+int
+vdi_verify(vd_handle_t *vdh, char *vdname, const char *pszformat,
+    vdi_verify_opts_t *vopts, vdi_copy_opts_t *opts)
+{
+	vdi_verify_state_t vv;
+	char filename[MAXPATHLEN];
+	char *sectors = NULL;
+	char *slash;
+	uint64_t size;
+	int i;
+	int rc = -1;
+
+	bzero(&vv, sizeof (vv));
+	(void) pthread_mutex_init(&vv.vv_mutex, NULL);
+	vv.vv_vdh = vdh;
+	vv.vv_format = pszformat;
+	vv.vv_opts = vopts;
+	vv.vv_nimages = VDGetCount(vdh->hdd);
+	vdi_copy_progress_init(&vv.vv_progress, opts, 0, B_FALSE);
+	vv.vv_saved = vv.vv_progress.cp_start;
+	vv.vv_sig = crc32(0L, Z_NULL, 0);
+
+	(void) snprintf(vv.vv_statefile, MAXPATHLEN, "%s/%s", vdname,
+	    VDI_VERIFY_STATE);
+	(void) snprintf(vv.vv_sumfile, MAXPATHLEN, "%s/%s", vdname,
+	    VDI_VERIFY_SUMS);
+	(void) snprintf(vv.vv_newsumfile, MAXPATHLEN, "%s/%s.new", vdname,
+	    VDI_VERIFY_SUMS);
+
+	if (vdisk_get_prop_str(vdh, "sectors", &sectors) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to get size of file"), vdname);
+		goto out;
+	}
+	size = strtoull(sectors, NULL, 10) * 512;
+	if (size == 0) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to get size of file"), vdname);
+		goto out;
+	}
+
+	vv.vv_names = calloc(vv.vv_nimages, MAXPATHLEN);
+	if (vv.vv_names == NULL)
+		goto nomem;
+	for (i = 0; i < vv.vv_nimages; i++) {
+		if (!VBOX_SUCCESS(VDGetFilename(vdh->hdd, i, filename,
+		    sizeof (filename))))
+			continue;
+		slash = strrchr(filename, '/');
+		(void) strlcpy(vv.vv_names[i], (slash != NULL) ? slash + 1 :
+		    filename, MAXPATHLEN);
+	}
+	/* The vdisk's own snapshots, not a linked clone's parent's */
+	vv.vv_first_sum = vdh->parent_images;
+	vv.vv_last_sum = vv.vv_nimages - 2;
+
+	vdi_verify_meta(&vv, size);
+	if (vdi_verify_build(&vv, size) == -1)
+		goto nomem;
+	vv.vv_done = calloc(vv.vv_nunits + 1, 1);
+	if (vv.vv_done == NULL)
+		goto nomem;
+
+	if ((vopts->vo_sums == VDI_VERIFY_SUMS_CHECK) &&
+	    (vdi_verify_load_sums(&vv) == -1)) {
+		(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+		    gettext("ERROR: Unable to read checksums"),
+		    vv.vv_sumfile, strerror(errno));
+		goto out;
+	}
+	if (!vopts->vo_restart)
+		vdi_verify_resume(&vv);
+	if (vopts->vo_sums == VDI_VERIFY_SUMS_RECORD) {
+		vv.vv_record = fopen(vv.vv_newsumfile,
+		    (vv.vv_low > 0) ? "a" : "w");
+		if (vv.vv_record == NULL) {
+			(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+			    gettext("ERROR: Unable to write checksums"),
+			    vv.vv_newsumfile, strerror(errno));
+			goto out;
+		}
+	}
+
+	if (vdi_verify_run(&vv, (opts->co_nthreads > 0) ?
+	    opts->co_nthreads : 1) == -1)
+		goto nomem;
+
+	/* A complete scan starts over next time */
+	if (vv.vv_record != NULL) {
+		if ((fclose(vv.vv_record) != 0) ||
+		    (rename(vv.vv_newsumfile, vv.vv_sumfile) == -1)) {
+			vv.vv_record = NULL;
+			(void) fprintf(stderr, "\n%s: \"%s\": %s\n\n",
+			    gettext("ERROR: Unable to write checksums"),
+			    vv.vv_sumfile, strerror(errno));
+			goto out;
+		}
+		vv.vv_record = NULL;
+	}
+	(void) unlink(vv.vv_statefile);
+
+	if (opts->co_progress) {
+		if (opts->co_parsable)
+			(void) printf("verified:%llu:%llu\n",
+			    (unsigned long long)vv.vv_bytes,
+			    (unsigned long long)vv.vv_errors);
+		else
+			(void) fprintf(stderr, "\n%s %.1f MB, %llu %s\n",
+			    gettext("Verified"),
+			    (double)vv.vv_bytes / (1024 * 1024),
+			    (unsigned long long)vv.vv_errors,
+			    gettext("errors"));
+	}
+	if (vv.vv_errors != 0) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Virtual disk failed verification"),
+		    vdname);
+		goto out;
+	}
+	rc = 0;
+	goto out;
+
+nomem:
+	(void) fprintf(stderr, "%s\n", gettext(
+	    "ERROR: Unable to allocate memory."));
+out:
+	if (vv.vv_record != NULL)
+		(void) fclose(vv.vv_record);
+	free(sectors);
+	free(vv.vv_names);
+	free(vv.vv_units);
+	free(vv.vv_done);
+	free(vv.vv_crcs);
+	(void) pthread_mutex_destroy(&vv.vv_mutex);
+	return (rc);
+}
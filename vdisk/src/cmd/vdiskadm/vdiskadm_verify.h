@@ -0,0 +1,66 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+#ifndef _VDISKADM_VERIFY_H
+#define	_VDISKADM_VERIFY_H
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+#include "VBox/VBoxHDD.h"
+#include "vdisk.h"
+#include "vdiskadm_copy.h"
+
+
+/* bytes read, and checksummed, as one block */
+#define	VDI_VERIFY_CHUNK	VDI_COPY_CHUNK
+
+/* files in the virtual disk directory */
+#define	VDI_VERIFY_SUMS		"vdisk.crc"	/* checksums of snapshots */
+#define	VDI_VERIFY_STATE	"vdisk.scrub"	/* where a scan resumes */
+
+/* minimum time between two saves of the position reached */
+#define	VDI_VERIFY_SAVE_INTERVAL	10000000000LL	/* ns */
+
+/* what to do with the checksums of snapshot images */
+#define	VDI_VERIFY_SUMS_NONE	0
+#define	VDI_VERIFY_SUMS_RECORD	1	/* write them to VDI_VERIFY_SUMS */
+#define	VDI_VERIFY_SUMS_CHECK	2	/* compare them to VDI_VERIFY_SUMS */
+
+typedef struct vdi_verify_opts_s {
+	uint64_t	vo_rate;	/* bytes read per second, 0 for any */
+	int		vo_sums;	/* VDI_VERIFY_SUMS_* */
+	boolean_t	vo_restart;	/* don't resume a saved position */
+	boolean_t	vo_skip_top;	/* top image is in use, leave it */
+} vdi_verify_opts_t;
+
+int vdi_verify(vd_handle_t *vdh, char *vdname, const char *pszformat,
+    vdi_verify_opts_t *vopts, vdi_copy_opts_t *opts);
+
+
+#ifdef	__cplusplus
+}
+#endif
+#endif /* _VDISKADM_VERIFY_H */
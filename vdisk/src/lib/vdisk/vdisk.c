@@ -27,9 +27,11 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include <locale.h>
 #include <libintl.h>
@@ -54,6 +56,7 @@ int errno;
  *	vdisk_flush
  *	vdisk_get_size
  *	vdisk_setflags
+ *	vdisk_get_allocation (vdisk_alloc.c)
  * Virtual disk configuration is kept in a store file: vdisk.xml.
  * Virtual disks are created using vbox code and can be created of types
  * that are supported by the vbox code (vmdk, vdi, etc).
@@ -136,6 +139,54 @@ static prop_info_t prop_attr_info[] = {
 	{"rocnt", "rw"},		/* VD_A_ROCNT */
 };
 
+/* Kind of node holding the value of an indexed property */
+typedef enum prop_kind {
+	VD_PK_ATTR,		/* attribute of the vdisk element */
+	VD_PK_ELEM,		/* child element of vdisk or diskprop */
+	VD_PK_USER		/* value element of a userprop */
+} prop_kind_t;
+
+/* Property index entry, names and nodes are owned by the xml tree */
+typedef struct vd_propent {
+	struct vd_propent *pe_next;	/* next entry in hash chain */
+	const char *pe_name;		/* property name */
+	prop_kind_t pe_kind;		/* kind of node holding the value */
+	xmlNodePtr pe_node;		/* attribute or element with value */
+	xmlNodePtr pe_userprop;		/* userprop element of VD_PK_USER */
+	xmlChar *pe_joined;		/* value split over several nodes */
+} vd_propent_t;
+
+/* Initial number of hash chains, always a power of two */
+#define	VD_PROPIDX_MIN	32
+
+struct vd_propidx {
+	vd_propent_t **pi_hash;		/* hash chains */
+	uint_t pi_size;			/* number of hash chains */
+	uint_t pi_count;		/* number of entries */
+};
+
+/* Image file of a chain being loaded by vdisk_load_snapshots() */
+typedef struct vd_chain_image {
+	char ci_file[MAXPATHLEN];	/* path of the image */
+	int ci_error;			/* errno of stat64(), 0 if present */
+} vd_chain_image_t;
+
+typedef struct vd_chain {
+	vd_chain_image_t *vc_images;	/* images, base image first */
+	int vc_count;			/* number of images */
+	int vc_next;			/* next image to prefetch */
+	pthread_mutex_t vc_lock;	/* protects vc_next */
+} vd_chain_t;
+
+/* Threads prefetching the images of a chain */
+#define	VD_PREFETCH_THREADS	8
+
+/* Bytes read from the head of an image, where formats keep metadata */
+#define	VD_PREFETCH_HEAD	(64 * 1024)
+
+/* Bytes read from the tail of an image, where a VHD keeps its footer */
+#define	VD_PREFETCH_TAIL	512
+
 struct VDIMAGE_small
 {
 	/*  Link to parent image descriptor, if any. */
@@ -167,6 +218,17 @@ static int vdisk_is_unmanaged(const char *vdisk_path);
 static vd_handle_t *vdisk_open_unmanaged(const char *vdisk_path);
 static int vdisk_is_structured_file(const char *vdisk_name,
     const char **filetype);
+static int vdisk_load_parent(vd_chain_t *vc, vd_handle_t *child, int depth);
+static xmlNodePtr vdisk_find_snap_node(vd_handle_t *vdh, const char *name);
+static int vdisk_index_props(vd_handle_t *vdh);
+static void vdisk_free_props(vd_handle_t *vdh);
+
+/* Bounds of the interval vdisk_lock_wait() retries at, microseconds */
+#define	VD_LOCK_MIN_DELAY	1000
+#define	VD_LOCK_MAX_DELAY	64000
+
+/* See vdisk_set_store_flags() */
+static int vdisk_store_flags = 0;
 
 
 char *vdisk_structured_files[] = {"vdi", "vmdk", "vhd"};
@@ -192,12 +254,20 @@ vdisk_open(const char *vdisk_path)
 	int rc;
 	vd_handle_t *vdh = NULL;
 	PVBOXHDD pdisk;
+	int lockfd;
 
 
 	if (vdisk_is_unmanaged(vdisk_path)) {
 		return (vdisk_open_unmanaged(vdisk_path));
 	}
 
+	/* Images can't be replaced while they are being opened */
+	vdisk_get_vdname(vdname, vdisk_path, MAXPATHLEN);
+	lockfd = vdisk_lock_wait(vdname, VD_LOCK_SHARED, VD_LOCK_TIMEOUT,
+	    NULL);
+	if (lockfd == -1)
+		return (NULL);
+
 	if (vdisk_find_create_storepath(vdisk_path, vdname, NULL, extname,
 	    &pszformat, 0, &vdh) == -1) {
 		errno = ENOENT;
@@ -224,6 +294,7 @@ vdisk_open(const char *vdisk_path)
 	RTStrFree(pszformat);
 	pszformat = NULL;
 
+	(void) vdisk_unlock(lockfd, vdname);
 	return ((void *)vdh);
 
 fail:
@@ -232,6 +303,9 @@ fail:
 	if ((vdh != NULL) && (vdh->hdd))
 		VDDestroy(vdh->hdd);
 	vdisk_free_tree(vdh);
+	rc = errno;
+	(void) vdisk_unlock(lockfd, vdname);
+	errno = rc;
 	return (NULL);
 }
 
@@ -579,8 +653,113 @@ vdisk_print_files(vd_handle_t *vdh, char *vdname, int parsable_output,
 	return (0);
 }
 
+/*
+ * Add an image file to the end of a chain.
+ *	vc - chain the file is added to
+ *	file - path of the image file
+ *
+ * Returns:
+ * 	0: success
+ *	-1: failure
+ */
+static int
+vdisk_chain_add(vd_chain_t *vc, const char *file)
+{
+	vd_chain_image_t *images;
+
+	images = realloc(vc->vc_images,
+	    (vc->vc_count + 1) * sizeof (vd_chain_image_t));
+	if (images == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	vc->vc_images = images;
+	(void) strlcpy(images[vc->vc_count].ci_file, file, MAXPATHLEN);
+	images[vc->vc_count].ci_error = 0;
+	vc->vc_count++;
+	return (0);
+}
+
+/*
+ * Prefetch the images of a chain until none is left.  Each image is
+ * stat'ed and the head and tail of it read, so the attributes and the
+ * metadata the image formats keep there are cached when VDOpen() reads
+ * them.  Errors other than those of stat64() are ignored; VDOpen()
+ * reports them.
+ *	arg - chain being prefetched
+ */
+static void *
+vdisk_prefetch_thread(void *arg)
+{
+	vd_chain_t *vc = arg;
+	vd_chain_image_t *ci;
+	struct stat64 st;
+	char *buf;
+	int fd;
+
+	buf = malloc(VD_PREFETCH_HEAD);
+	for (;;) {
+		(void) pthread_mutex_lock(&vc->vc_lock);
+		if (vc->vc_next == vc->vc_count) {
+			(void) pthread_mutex_unlock(&vc->vc_lock);
+			break;
+		}
+		ci = &vc->vc_images[vc->vc_next++];
+		(void) pthread_mutex_unlock(&vc->vc_lock);
+
+		if (stat64(ci->ci_file, &st) == -1) {
+			ci->ci_error = errno;
+			continue;
+		}
+		if ((buf == NULL) || ((fd = open(ci->ci_file, O_RDONLY)) == -1))
+			continue;
+		(void) pread(fd, buf, VD_PREFETCH_HEAD, 0);
+		if (st.st_size > VD_PREFETCH_HEAD) {
+			(void) pread(fd, buf, VD_PREFETCH_TAIL,
+			    st.st_size - VD_PREFETCH_TAIL);
+		}
+		(void) close(fd);
+	}
+	free(buf);
+	return (NULL);
+}
+
+/*
+ * Prefetch the images of a chain in parallel.  VDOpen() opens images one
+ * at a time and each open waits for several reads of the image; on a
+ * remote file system doing these reads for all images at once first
+ * keeps the time to load a chain from growing with its depth.  The
+ * calling thread prefetches too, alone if no thread can be created.
+ *	vc - chain to prefetch
+ */
+static void
+vdisk_prefetch_chain(vd_chain_t *vc)
+{
+	pthread_t tids[VD_PREFETCH_THREADS - 1];
+	int nthreads = 0;
+	int i;
+
+	vc->vc_next = 0;
+	(void) pthread_mutex_init(&vc->vc_lock, NULL);
+	while ((nthreads < VD_PREFETCH_THREADS - 1) &&
+	    (nthreads < vc->vc_count - 1)) {
+		if (pthread_create(&tids[nthreads], NULL,
+		    vdisk_prefetch_thread, vc) != 0)
+			break;
+		nthreads++;
+	}
+	(void) vdisk_prefetch_thread(vc);
+	for (i = 0; i < nthreads; i++)
+		(void) pthread_join(tids[i], NULL);
+	(void) pthread_mutex_destroy(&vc->vc_lock);
+}
+
 /*
  * Load the virtual disk images from store file into hdd area.
+ * A linked clone first gets the read-only images of the snapshot
+ * it was cloned from; vdh->parent_images is set to their count.
+ * The paths of all images are gathered and the images prefetched in
+ * parallel before they are opened, see vdisk_prefetch_chain().
  *	vdh - pointer to handle for virtual disk
  *	pszformat - string containing type of virtual disk
  *	vdname - string containing path to virtual disk
@@ -594,18 +773,28 @@ int
 vdisk_load_snapshots(vd_handle_t *vdh, char *pszformat, char *vdname,
 	int open_flag)
 {
-	struct stat64 statbuf;
+	vd_chain_t chain;
+	vd_chain_image_t *ci;
 	int rc;
 	xmlChar *name = NULL;
 	char vdpath[MAXPATHLEN];
 	char fullname[MAXPATHLEN];
 	xmlNodePtr  node, snap_node;
 	char *val_string;
+	int parents;
+	int i;
 
 	(void) strlcpy(vdpath, vdname, MAXPATHLEN);
 	(void) strlcat(vdpath, "/", MAXPATHLEN);
+	bzero(&chain, sizeof (chain));
+
+	/* gather the chain a linked clone was created from */
+	vdh->parent_images = 0;
+	if (vdisk_load_parent(&chain, vdh, 0) == -1)
+		goto fail;
+	parents = chain.vc_count;
 
-	/* verify snapshots exist and load them */
+	/* then the snapshots */
 	for (node = vdh->snap_root; node != NULL; node = node->next) {
 		for (snap_node = node->xmlChildrenNode;
 		    snap_node != NULL; snap_node = snap_node->next) {
@@ -618,60 +807,70 @@ vdisk_load_snapshots(vd_handle_t *vdh, char *pszformat, char *vdname,
 				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 				    gettext("ERROR: Unable to retrieve "
 				    "snapshot filename from store"), vdname);
-				return (-1);
+				goto fail;
 			}
-			/* verify disk is present first */
 			(void) strlcpy(fullname, vdpath, MAXPATHLEN);
 			(void) strlcat(fullname, (char *)name, MAXPATHLEN);
-			rc = stat64(fullname, &statbuf);
-			if (rc == -1) {
-				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-				    gettext("ERROR: File does not exist"),
-				    vdname);
-				xmlFree(name);
-				return (-1);
-			}
 			xmlFree(name);
-			rc = VDOpen((PVBOXHDD)vdh->hdd, pszformat, fullname,
-			    (VD_OPEN_FLAGS_NORMAL | open_flag), NULL);
-			if (!(VBOX_SUCCESS(rc))) {
-				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-				    gettext("ERROR: Unable to open file"),
-				    fullname);
-				return (-1);
-			}
+			if (vdisk_chain_add(&chain, fullname) == -1)
+				goto fail;
 		}
 	}
 
-	/* now verify and load vdname */
+	/* and vdname itself */
 	if (vdisk_get_prop_str(vdh, "vdfile", &val_string) == -1) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 		    gettext("ERROR: Unable to retrieve "
 		    "filename from store"), vdname);
-		return (-1);
+		goto fail;
 	}
-
 	(void) strlcpy(fullname, vdpath, MAXPATHLEN);
 	(void) strlcat(fullname, (char *)val_string, MAXPATHLEN);
-	rc = stat64(fullname, &statbuf);
-	if (rc == -1) {
-		fprintf(stderr, "\n%s: \"%s\"\n\n",
-		    gettext("ERROR: File does not exist"), vdname);
-		return (-1);
-	}
+	free(val_string);
+	if (vdisk_chain_add(&chain, fullname) == -1)
+		goto fail;
 
-	rc = VDOpen((PVBOXHDD)vdh->hdd, pszformat, (char *)fullname,
-	    (VD_OPEN_FLAGS_NORMAL | open_flag), NULL);
-	if (!(VBOX_SUCCESS(rc))) {
-		fprintf(stderr, "\n%s: \"%s\"\n\n",
-		    gettext("ERROR: Unable to open file"), vdname);
-		return (-1);
+	/* A conversion cut short can have left a footer on a raw image */
+	if ((strcasecmp(pszformat, "RAW") == 0) &&
+	    (vdisk_fixed_recover(vdh, vdname) == -1))
+		goto fail;
+
+	vdisk_prefetch_chain(&chain);
+
+	/* verify the disk's own images exist and load the chain */
+	for (i = 0; i < chain.vc_count; i++) {
+		ci = &chain.vc_images[i];
+		if ((i >= parents) && (ci->ci_error != 0)) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: File does not exist"), vdname);
+			goto fail;
+		}
+		rc = VDOpen((PVBOXHDD)vdh->hdd, pszformat, ci->ci_file,
+		    VD_OPEN_FLAGS_NORMAL | ((i < parents) ?
+		    VD_OPEN_FLAGS_READONLY : open_flag), NULL);
+		if (!(VBOX_SUCCESS(rc))) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to open file"),
+			    (i == chain.vc_count - 1) ? vdname : ci->ci_file);
+			goto fail;
+		}
+		if (i < parents)
+			vdh->parent_images++;
 	}
+	free(chain.vc_images);
 	return (0);
+
+fail:
+	free(chain.vc_images);
+	return (-1);
 }
 
 /*
- * Write xml tree to store file.
+ * Write xml tree to store file.  The tree is written to a temporary file
+ * that is synced and renamed over the store, so a crash leaves either the
+ * old or the new store and never a partly written one.  The temporary
+ * file takes the mode and ownership of the store; where it can't be
+ * created or given them the store is rewritten in place as before.
  *	vdh - pointer to virtual disk handle
  *	vdname - string containing path to virtual disk store file
  *
@@ -683,6 +882,15 @@ int
 vdisk_write_tree(vd_handle_t *vdh, char *vdname)
 {
 	char xmlname[MAXPATHLEN];
+	char tmpname[MAXPATHLEN];
+	char dirname[MAXPATHLEN];
+	struct stat64 st;
+	xmlChar *buf = NULL;
+	char *slash;
+	ssize_t n;
+	int len;
+	int off;
+	int fd = -1;
 
 	if (vdh->doc == NULL) {
 		fprintf(stderr, "\n%s: \"%s\"\n\n",
@@ -691,14 +899,86 @@ vdisk_write_tree(vd_handle_t *vdh, char *vdname)
 	}
 
 	vdisk_get_xmlfile(xmlname, vdname, MAXPATHLEN);
+	(void) snprintf(tmpname, MAXPATHLEN, "%s.tmp", xmlname);
+
+	xmlDocDumpFormatMemory(vdh->doc, &buf, &len, 1);
+	if (buf == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		goto inplace;
+	if (stat64(xmlname, &st) == 0) {
+		if ((fchmod(fd, st.st_mode & 07777) == -1) ||
+		    (((st.st_uid != geteuid()) || (st.st_gid != getegid())) &&
+		    (fchown(fd, st.st_uid, st.st_gid) == -1)))
+			goto inplace;
+	}
+
+	for (off = 0; off < len; off += n) {
+		n = write(fd, buf + off, len - off);
+		if (n == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			goto fail;
+		}
+	}
+	/* The identity of what was written, for the caches of the store */
+	if ((fsync(fd) == -1) || (fstat64(fd, &st) == -1))
+		goto fail;
+	if (close(fd) == -1) {
+		fd = -1;
+		goto fail;
+	}
+	fd = -1;
+	if (rename(tmpname, xmlname) == -1)
+		goto fail;
+	xmlFree(buf);
+
+	/* Make the rename itself stable */
+	(void) strlcpy(dirname, xmlname, MAXPATHLEN);
+	if ((slash = strrchr(dirname, '/')) != NULL)
+		*slash = '\0';
+	else
+		(void) strlcpy(dirname, ".", MAXPATHLEN);
+	if ((fd = open(dirname, O_RDONLY)) != -1) {
+		(void) fsync(fd);
+		(void) close(fd);
+	}
 
-	(void) xmlSaveFormatFileEnc(xmlname, vdh->doc, NULL, 1);
+	vdisk_cache_write(vdh, xmlname, &st);
+	vdisk_cache_keep(vdh, xmlname, &st);
 	return (0);
+
+inplace:
+	/* Not allowed to replace the store, overwrite it */
+	if (fd != -1) {
+		(void) close(fd);
+		(void) unlink(tmpname);
+	}
+	xmlFree(buf);
+	if (xmlSaveFormatFileEnc(xmlname, vdh->doc, NULL, 1) == -1)
+		return (-1);
+	/* What was written can't be told from a later writer's store */
+	vdisk_cache_remove(vdname);
+	return (0);
+
+fail:
+	if (fd != -1)
+		(void) close(fd);
+	(void) unlink(tmpname);
+	xmlFree(buf);
+	return (-1);
 }
 
 /*
  * Find an image's associated image number given a file name.
- * Image numbers start at 0.
+ * Image numbers start at 0.  Images of a linked clone's parent
+ * are counted but never matched.
  *	vdh - pointer to handle for virtual disk
  *	pszrmfilename - string containing path of image to find
  *	image_number - contains image number on successful return
@@ -732,7 +1012,7 @@ vdisk_find_snapshots(vd_handle_t *vdh, char *pszrmfilename,
 
 	for (pimage = (struct VDIMAGE_small *)pdisk_sm->pBase; pimage;
 	    pimage = (struct VDIMAGE_small *)pimage->pNext) {
-		if (found_flag == 0) {
+		if ((found_flag == 0) && (image_cnt >= vdh->parent_images)) {
 			imagefile = strrchr(pimage->pszFilename, '/');
 			if (imagefile)
 				imagefile++;
@@ -789,6 +1069,9 @@ list_image_name_callback(const char *image_name)
  *	pszformat - format extension of file being moved
  *	vdname - name of virtual disk being moved
  *	new_dir - string containing new directory of virtual disk
+ *	progress - if non-null called with bytes copied so far when the
+ *		files have to be copied to another file system
+ *	arg - passed to progress
  *
  * Returns:
  *	0: success
@@ -796,10 +1079,9 @@ list_image_name_callback(const char *image_name)
  */
 int
 vdisk_move_snapshots(vd_handle_t *vdh, char *pszformat, char *vdname,
-	char *new_dir)
+	char *new_dir, vd_copy_progress_t *progress, void *arg)
 {
 	char vdname_newdir[MAXPATHLEN];
-	char system_command[MAXPATHLEN];
 	int rc;
 	char *slash;
 	struct stat64 statbuf;
@@ -833,16 +1115,23 @@ vdisk_move_snapshots(vd_handle_t *vdh, char *pszformat, char *vdname,
 		return (-1);
 	}
 
-	/* If rename can't be used, do a system mv instead. */
-	snprintf(system_command, MAXPATHLEN, "mv %s %s\n",
-	    vdname, vdname_newdir);
-	rc = system(system_command);
-	if (rc != 0) {
+	/* If rename can't be used, copy the files over instead. */
+	rc = stat64(vdname, &statbuf);
+	if ((rc == -1) || (mkdir(vdname_newdir, statbuf.st_mode & 07777)
+	    == -1)) {
 		(void) fprintf(stderr, "\n%s: %s: %s\n\n",
 		    gettext("ERROR: Unable to move virtual disk"),
 		    vdname, strerror(errno));
 		return (-1);
 	}
+	if (vdisk_move_files(vdname, NULL, vdname_newdir, progress,
+	    arg) == -1) {
+		(void) rmdir(vdname_newdir);
+		(void) fprintf(stderr, "\n%s: %s\n\n",
+		    gettext("ERROR: Unable to move virtual disk"), vdname);
+		return (-1);
+	}
+	(void) rmdir(vdname);
 
 	return (0);
 }
@@ -1238,7 +1527,8 @@ vd_xlate_element(const unsigned char *tag, const char **element_array, int size)
  *	vdname - used to print error messages for virtual disk
  *	vtype - virtual disk extension type
  *	fixed - boolean for fixed/flat (1) or sparse (0)
- *	parent - currently null since COW clones not yet supported
+ *	parent - <vdname>@<snapname> a linked clone was created from or
+ *		null if the virtual disk isn't a linked clone
  * 	create_epoch - strings containing file creation in epoch form
  *	size_bytes - ascii string of the number of bytes in virtual disk
  *	sector_str - ascii string of the number of sectors in virtual disk
@@ -1314,7 +1604,7 @@ vdisk_create_tree(char *vdname, char *vtype, int fixed, char *parent,
 	(void) xmlNewChild(disk_root, NULL, (xmlChar *)"version",
 	    (xmlChar *)"1.0");
 	(void) xmlNewChild(disk_root, NULL, (xmlChar *)"parent",
-	    (xmlChar *)"none");
+	    (xmlChar *)(parent ? parent : "none"));
 	diskprop_root = vdh->diskprop_root = xmlNewChild(disk_root, NULL,
 	    (xmlChar *)"diskprop", (xmlChar *)NULL);
 
@@ -1335,11 +1625,12 @@ vdisk_create_tree(char *vdname, char *vtype, int fixed, char *parent,
 	(void) xmlNewChild(diskprop_root, NULL, (xmlChar *)"description",
 	    (xmlChar *)desc);
 
-	return (0);
+	return (vdisk_index_props(vdh));
 }
 
 /*
- * Free xml tree given virtual disk handle.
+ * Free xml tree given virtual disk handle.  The parser's global state is
+ * left alone, as other threads of the process may be reading stores.
  *	vdh: virtual disk handle
  */
 void
@@ -1348,14 +1639,25 @@ vdisk_free_tree(vd_handle_t *vdh)
 	if (vdh == NULL)
 		return;
 
-	if (vdh->doc) {
+	vdisk_free_props(vdh);
+	if (vdh->doc)
 		xmlFreeDoc(vdh->doc);
-		xmlCleanupParser();
-	}
 
 	free(vdh);
 }
 
+/*
+ * Set how the stores of virtual disks are read by this process.
+ *	flags - VD_STORE_CACHED: stores are taken from their cache, see
+ *		vdisk_cache.c, when it is current.  Only for processes that
+ *		never write a store, as the store isn't validated then.
+ */
+void
+vdisk_set_store_flags(int flags)
+{
+	vdisk_store_flags = flags;
+}
+
 /*
  * Reads in the store file and returns handle to information.
  *	vdhp: virtual disk handle returned in pointer
@@ -1369,7 +1671,9 @@ int
 vdisk_read_tree(vd_handle_t **vdhp, char *vdname)
 {
 	char xmlname[MAXPATHLEN];
+	struct stat64 st;
 	xmlNodePtr node;
+	int fd;
 	int i;
 	vd_handle_t *vdh;
 
@@ -1391,17 +1695,35 @@ vdisk_read_tree(vd_handle_t **vdhp, char *vdname)
 	vdh = *vdhp;
 	bzero(vdh, sizeof (vd_handle_t));
 
-	/* parse the file */
-	vdh->doc = xmlReadFile(xmlname, NULL,
-	    (XML_PARSE_NOBLANKS | XML_PARSE_DTDLOAD |
-	    XML_PARSE_DTDATTR | XML_PARSE_DTDVALID));
-	if (vdh->doc == NULL) {
-		fprintf(stderr, "\n%s: \"%s\"\n\n",
-		    gettext("ERROR: Open of virtual disk store file failed"),
-		    xmlname);
-		free(vdh);
-		*vdhp = NULL;
-		return (-1);
+	/* Take the tree from memory if the store is kept there */
+	if (vdisk_cache_get(vdh, xmlname) == -1) {
+		/* Readers take the tree from the cache of the store */
+		if (!(vdisk_store_flags & VD_STORE_CACHED) ||
+		    (vdisk_cache_read(vdh, xmlname, &st) == -1)) {
+			/*
+			 * parse the file, the caches get the identity of
+			 * the file parsed, not of whatever replaced it since
+			 */
+			if (((fd = open(xmlname, O_RDONLY)) != -1) &&
+			    (fstat64(fd, &st) == 0)) {
+				vdh->doc = xmlReadFd(fd, xmlname, NULL,
+				    (XML_PARSE_NOBLANKS | XML_PARSE_DTDLOAD |
+				    XML_PARSE_DTDATTR | XML_PARSE_DTDVALID));
+			}
+			if (fd != -1)
+				(void) close(fd);
+			if (vdh->doc == NULL) {
+				fprintf(stderr, "\n%s: \"%s\"\n\n",
+				    gettext("ERROR: Open of virtual disk store "
+				    "file failed"), xmlname);
+				free(vdh);
+				*vdhp = NULL;
+				return (-1);
+			}
+			if (vdisk_store_flags & VD_STORE_CACHED)
+				vdisk_cache_write(vdh, xmlname, &st);
+		}
+		vdisk_cache_keep(vdh, xmlname, &st);
 	}
 
 	/* Get root element node and set diskprop_root and snap_root globals */
@@ -1445,6 +1767,13 @@ vdisk_read_tree(vd_handle_t **vdhp, char *vdname)
 			break;
 		}
 	}
+
+	/* Index the properties once, they're looked up many times */
+	if (vdisk_index_props(vdh) == -1) {
+		vdisk_free_tree(vdh);
+		*vdhp = NULL;
+		return (-1);
+	}
 	return (0);
 }
 
@@ -1611,166 +1940,619 @@ vdisk_rename_snap(vd_handle_t *vdh, char *property, char *old_string,
 }
 
 /*
- * Look into array of prop_info_t elements to find entry with
- * given property name.  Return corresponding r/w status string.
- *	property - property name
- *	array - array of elements to check
- *	size - size of array
- *	str - returns r/w status string.
+ * Record a linked clone of a snapshot in the xml tree.
+ *	vdh: virtual disk handle
+ *	name: string containing name of snapshot cloned
+ *	clone: string containing full path of linked clone
  *
  * Returns:
- *	0 - success
- *	-1 - failure
+ * 	0: success
+ *	-1: failure
  */
 int
-vdisk_get_rw(const char *property, prop_info_t *array, int size, char **str)
+vdisk_add_cow_clone(vd_handle_t *vdh, char *name, char *clone)
 {
-	int i;
-	for (i = 0; i < size / sizeof (prop_info_t); i++) {
-		if (xmlStrcmp((xmlChar *)property,
-		    (xmlChar *)array[i].prop_name) == 0) {
-			*str = array[i].prop_rw;
-			return (0);
-		}
+	xmlNodePtr node;
+	char *at;
+
+	at = strrchr(name, '@');
+	if (at == NULL) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Malformed snapshot "), name);
+		return (-1);
 	}
-	return (-1);
+
+	node = vdisk_find_snap_node(vdh, at);
+	if (node == NULL) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to find snapshot"), name);
+		return (-1);
+	}
+	(void) xmlNewChild(node, NULL, (xmlChar *)"cow_clone",
+	    (xmlChar *)clone);
+
+	return (0);
 }
 
 /*
- * Find the r/w status of a given property.
- * On success rw_string will point to a constant string 'rw' or 'ro'.
- *	property - property name
- *	rw_string - returns r/w status string.
+ * Update the record the parent of a linked clone keeps of the clone
+ * and write out the parent's store, holding the parent's lock.  Nothing
+ * is done if the virtual disk isn't a linked clone.
+ *	vdh: virtual disk handle of linked clone
+ *	clone: string containing full path of linked clone
+ *	new_clone: string containing new full path of linked clone or
+ *		NULL to remove the record when the clone is destroyed
  *
  * Returns:
- *	0 - success
- *	-1 - failure
+ * 	0: success
+ *	-1: failure
  */
 int
-vdisk_get_prop_rw(char *property, char **rw_string)
+vdisk_update_cow_clone(vd_handle_t *vdh, char *clone, char *new_clone)
 {
-	/* User defined properties are all 'rw' */
-	if (strrchr(property, ':') != NULL) {
-		/* point to userprop 'rw' string */
-		*rw_string = prop_element_info[VD_E_USERPROP].prop_rw;
+	vd_handle_t *pvdh = NULL;
+	char pvdname[MAXPATHLEN];
+	xmlNodePtr node, snap_node;
+	xmlChar *fname;
+	char *parent;
+	char *at;
+	int lockfd = -1;
+
+	if ((vdisk_get_prop_str(vdh, "parent", &parent) == -1) ||
+	    (strcmp(parent, "none") == 0)) {
+		free(parent);
 		return (0);
 	}
 
-	/* Try attributes */
-	if (vdisk_get_rw(property, prop_attr_info,
-	    sizeof (prop_attr_info), rw_string) == 0) {
-		return (0);
+	at = strrchr(parent, '@');
+	if ((at == NULL) || (at == parent) ||
+	    (strlen(parent) >= MAXPATHLEN)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Malformed parent in store"), parent);
+		goto fail;
 	}
+	(void) strlcpy(pvdname, parent, MAXPATHLEN);
+	pvdname[at - parent] = '\0';
 
-	/* Try elements */
-	if (vdisk_get_rw(property, prop_element_info,
-	    sizeof (prop_element_info), rw_string) == 0) {
-		return (0);
+	/* Others update the parent's store too, such as its ref counts */
+	if ((lockfd = vdisk_lock(pvdname)) == -1)
+		goto fail;
+	if (vdisk_read_tree(&pvdh, pvdname) == -1)
+		goto fail;
+
+	node = vdisk_find_snap_node(pvdh, at);
+	if (node == NULL) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to find snapshot"), parent);
+		goto fail;
 	}
 
-	(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-	    gettext("ERROR: Unable to get property write status"),
-	    property);
+	for (snap_node = node->xmlChildrenNode; snap_node != NULL;
+	    snap_node = snap_node->next) {
+		if (xmlStrcmp(snap_node->name, (xmlChar *)"cow_clone") != 0)
+			continue;
+		fname = xmlNodeListGetString(pvdh->doc,
+		    snap_node->xmlChildrenNode, 1);
+		if (fname == NULL)
+			continue;
+		if (strcmp(clone, (char *)fname) == 0) {
+			xmlFree(fname);
+			break;
+		}
+		xmlFree(fname);
+	}
+	if (snap_node == NULL) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Linked clone not recorded by parent"),
+		    parent);
+		goto fail;
+	}
+
+	if (new_clone != NULL) {
+		xmlNodeSetContent(snap_node, (xmlChar *)new_clone);
+	} else {
+		xmlUnlinkNode(snap_node);
+		xmlFreeNode(snap_node);
+	}
+
+	if (vdisk_write_tree(pvdh, pvdname) == -1) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to update store file"), pvdname);
+		goto fail;
+	}
+
+	(void) vdisk_unlock(lockfd, pvdname);
+	vdisk_free_tree(pvdh);
+	free(parent);
+	return (0);
+
+fail:
+	if (lockfd != -1)
+		(void) vdisk_unlock(lockfd, pvdname);
+	vdisk_free_tree(pvdh);
+	free(parent);
 	return (-1);
 }
 
 /*
- * Find and return a boolean property element value that matches the given
- * property by first looking at disk_root attributes and then checking
- * the disk_prop nodes.
- *	vdh - virtual disk handle
- *	property - string containing property
- *	bool - pointer to boolean value to be returned
+ * Find the most recent snapshot that linked clones were created from.
+ * Images up to and including it are shared with the clones and must
+ * not be removed or rewritten.
+ *	vdh: virtual disk handle
  *
  * Returns:
- * -1 - failure
- *  0 - success
+ *	image number of the snapshot once images are loaded
+ *	-1: no snapshot has linked clones
  */
 int
-vdisk_get_prop_bool(vd_handle_t *vdh, const char *property, int *bool)
+vdisk_find_cow_clone_image(vd_handle_t *vdh)
 {
-	xmlNodePtr node;
-	char *rname = NULL;
-
-	/* Check in disk node attributes first */
-	rname = (char *)xmlGetProp(vdh->disk_root, (xmlChar *)property);
-	if (rname != NULL)
-		goto found;
+	xmlNodePtr node, snap_node;
+	int cnt = 0;
+	int image_number = -1;
 
-	/* If not found, check in diskprop nodes */
-	for (node = vdh->diskprop_root->xmlChildrenNode; node != NULL;
-	    node = node->next) {
-		if ((xmlStrcmp(node->name, (xmlChar *)property) == 0)) {
-			rname = (char *)xmlNodeListGetString(vdh->doc,
-			    node->xmlChildrenNode, 1);
+	for (node = vdh->snap_root; node != NULL; node = node->next, cnt++) {
+		for (snap_node = node->xmlChildrenNode;
+		    snap_node != NULL; snap_node = snap_node->next) {
+			if (xmlStrcmp(snap_node->name,
+			    (xmlChar *)"cow_clone") == 0) {
+				image_number = vdh->parent_images + cnt;
+				break;
+			}
 		}
-		if (rname)
-			goto found;
 	}
 
-	/* property not found */
-	return (-1);
+	return (image_number);
+}
 
-found:
-	if (strcmp(rname, "true") == 0)
-		*bool = 1;
-	else
-		*bool = 0;
+/*
+ * Look into array of prop_info_t elements to find entry with
+ * given property name.  Return corresponding r/w status string.
+ *	property - property name
+ *	array - array of elements to check
+ *	size - size of array
+ *	str - returns r/w status string.
+ *
+ * Returns:
+ *	0 - success
+ *	-1 - failure
+ */
+int
+vdisk_get_rw(const char *property, prop_info_t *array, int size, char **str)
+{
+	int i;
+	for (i = 0; i < size / sizeof (prop_info_t); i++) {
+		if (xmlStrcmp((xmlChar *)property,
+		    (xmlChar *)array[i].prop_name) == 0) {
+			*str = array[i].prop_rw;
+			return (0);
+		}
+	}
+	return (-1);
+}
+
+/*
+ * Hash a property name (FNV-1a) into one of size chains.
+ */
+static uint_t
+vd_prop_hash(const char *name, uint_t size)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name != '\0') {
+		h ^= (uchar_t)*name++;
+		h *= 16777619U;
+	}
+	return (h & (size - 1));
+}
+
+/*
+ * Find the index entry of a property.
+ *	vdh - virtual disk handle
+ *	name - property name
+ *
+ * Returns:
+ *	entry of the property, or NULL if there's no such property
+ */
+static vd_propent_t *
+vd_prop_lookup(vd_handle_t *vdh, const char *name)
+{
+	vd_propidx_t *pi = vdh->propidx;
+	vd_propent_t *pe;
+
+	if (pi == NULL)
+		return (NULL);
+
+	for (pe = pi->pi_hash[vd_prop_hash(name, pi->pi_size)]; pe != NULL;
+	    pe = pe->pe_next) {
+		if (strcmp(pe->pe_name, name) == 0)
+			return (pe);
+	}
+	return (NULL);
+}
+
+/*
+ * Add a property to the index unless one of that name is already in it,
+ * the first node found for a name is the one the property is taken from.
+ *	pi - property index
+ *	name - property name, must live as long as the node
+ *	kind - kind of node holding the value
+ *	node - attribute or element holding the value
+ *	userprop - userprop element for user defined properties
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+static int
+vd_prop_insert(vd_propidx_t *pi, const char *name, prop_kind_t kind,
+    xmlNodePtr node, xmlNodePtr userprop)
+{
+	vd_propent_t **hash;
+	vd_propent_t *pe;
+	vd_propent_t *next;
+	uint_t size;
+	uint_t i;
+	uint_t h;
+
+	h = vd_prop_hash(name, pi->pi_size);
+	for (pe = pi->pi_hash[h]; pe != NULL; pe = pe->pe_next) {
+		if (strcmp(pe->pe_name, name) == 0)
+			return (0);
+	}
+
+	/* Keep the chains short for disks with many user properties */
+	if (pi->pi_count >= pi->pi_size * 2) {
+		size = pi->pi_size * 2;
+		hash = calloc(size, sizeof (vd_propent_t *));
+		if (hash == NULL)
+			return (-1);
+		for (i = 0; i < pi->pi_size; i++) {
+			for (pe = pi->pi_hash[i]; pe != NULL; pe = next) {
+				next = pe->pe_next;
+				h = vd_prop_hash(pe->pe_name, size);
+				pe->pe_next = hash[h];
+				hash[h] = pe;
+			}
+		}
+		free(pi->pi_hash);
+		pi->pi_hash = hash;
+		pi->pi_size = size;
+		h = vd_prop_hash(name, size);
+	}
 
-	xmlFree(rname);
+	pe = malloc(sizeof (vd_propent_t));
+	if (pe == NULL)
+		return (-1);
+	pe->pe_name = name;
+	pe->pe_kind = kind;
+	pe->pe_node = node;
+	pe->pe_userprop = userprop;
+	pe->pe_joined = NULL;
+	pe->pe_next = pi->pi_hash[h];
+	pi->pi_hash[h] = pe;
+	pi->pi_count++;
 	return (0);
 }
 
 /*
- * Return a value for a given property.  If property doesn't exist
- * or contains no data then return failure.
+ * Remove an entry from the property index and free it.
+ */
+static void
+vd_prop_remove(vd_propidx_t *pi, vd_propent_t *pe)
+{
+	vd_propent_t **pep;
+
+	for (pep = &pi->pi_hash[vd_prop_hash(pe->pe_name, pi->pi_size)];
+	    *pep != NULL; pep = &(*pep)->pe_next) {
+		if (*pep == pe) {
+			*pep = pe->pe_next;
+			pi->pi_count--;
+			break;
+		}
+	}
+	if (pe->pe_joined != NULL)
+		xmlFree(pe->pe_joined);
+	free(pe);
+}
+
+/*
+ * Return the name of a user defined property given its userprop element,
+ * pointing into the tree.  NULL if the element has no usable name.
+ */
+static const char *
+vd_userprop_name(xmlNodePtr userprop, xmlNodePtr *valuep)
+{
+	xmlNodePtr name = userprop->xmlChildrenNode;
+	xmlNodePtr text;
+
+	if ((name == NULL) || (xmlStrcmp(name->name, (xmlChar *)"name") != 0))
+		return (NULL);
+	text = name->xmlChildrenNode;
+	if ((text == NULL) || (text->next != NULL) ||
+	    (text->type != XML_TEXT_NODE))
+		return (NULL);
+	if (valuep != NULL)
+		*valuep = name->next;
+	return ((const char *)text->content);
+}
+
+/*
+ * Return the value of an indexed property, pointing into the tree.
+ * An element without text has no value, as with xmlNodeListGetString().
+ */
+static const char *
+vd_prop_value(vd_handle_t *vdh, vd_propent_t *pe)
+{
+	xmlNodePtr text;
+
+	if (pe->pe_node == NULL)
+		return (NULL);
+	text = pe->pe_node->xmlChildrenNode;
+	if (text == NULL)
+		return ((pe->pe_kind == VD_PK_ATTR) ? "" : NULL);
+	if ((text->next == NULL) && (text->type == XML_TEXT_NODE))
+		return ((const char *)text->content);
+
+	/* Entity references or CDATA, join them once */
+	if (pe->pe_joined == NULL)
+		pe->pe_joined = xmlNodeListGetString(vdh->doc, text, 1);
+	return ((const char *)pe->pe_joined);
+}
+
+/*
+ * Build the property index of a virtual disk handle from its tree.
+ * Attributes of the vdisk element come first, then the child elements of
+ * vdisk and of diskprop and then the user defined properties, matching the
+ * order properties have always been looked up in.
  *	vdh - virtual disk handle
- *	property - string containing property
- *	val - pointer to integer value to be returned
  *
  * Returns:
- * -1 - failure
- *  0 - success
+ *	0: success
+ *	-1: failure
  */
-int
-vdisk_get_prop_val(vd_handle_t *vdh, const char *property, int *val)
+static int
+vdisk_index_props(vd_handle_t *vdh)
 {
+	vd_propidx_t *pi;
+	xmlAttrPtr attr;
 	xmlNodePtr node;
-	char *rname = NULL;
-	int ret = 0;
+	xmlNodePtr value;
+	const char *name;
 
-	rname = (char *)xmlGetProp(vdh->disk_root, (xmlChar *)property);
-	if (rname != NULL)
-		goto found;
+	vdisk_free_props(vdh);
+
+	pi = malloc(sizeof (vd_propidx_t));
+	if (pi == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	pi->pi_size = VD_PROPIDX_MIN;
+	pi->pi_count = 0;
+	pi->pi_hash = calloc(pi->pi_size, sizeof (vd_propent_t *));
+	if (pi->pi_hash == NULL) {
+		free(pi);
+		errno = ENOMEM;
+		return (-1);
+	}
+	vdh->propidx = pi;
+
+	for (attr = vdh->disk_root->properties; attr != NULL;
+	    attr = attr->next) {
+		if (vd_prop_insert(pi, (const char *)attr->name, VD_PK_ATTR,
+		    (xmlNodePtr)attr, NULL) == -1)
+			goto fail;
+	}
+
+	for (node = vdh->disk_root->xmlChildrenNode; node != NULL;
+	    node = node->next) {
+		if ((node->type != XML_ELEMENT_NODE) ||
+		    (node == vdh->diskprop_root) ||
+		    (xmlStrcmp(node->name, (xmlChar *)"snapshot") == 0))
+			continue;
+		if (vd_prop_insert(pi, (const char *)node->name, VD_PK_ELEM,
+		    node, NULL) == -1)
+			goto fail;
+	}
+
+	if (vdh->diskprop_root == NULL)
+		return (0);
 
 	for (node = vdh->diskprop_root->xmlChildrenNode; node != NULL;
 	    node = node->next) {
-		if ((xmlStrcmp(node->name, (xmlChar *)property) == 0)) {
-			rname = (char *)xmlNodeListGetString(vdh->doc,
-			    node->xmlChildrenNode, 1);
+		if (node->type != XML_ELEMENT_NODE)
+			continue;
+		if (xmlStrcmp(node->name, (xmlChar *)"userprop") != 0) {
+			if (vd_prop_insert(pi, (const char *)node->name,
+			    VD_PK_ELEM, node, NULL) == -1)
+				goto fail;
+			continue;
 		}
-		if (rname)
-			goto found;
+		name = vd_userprop_name(node, &value);
+		if ((name == NULL) || (value == NULL))
+			continue;
+		if (vd_prop_insert(pi, name, VD_PK_USER, value, node) == -1)
+			goto fail;
+	}
+	return (0);
+
+fail:
+	vdisk_free_props(vdh);
+	errno = ENOMEM;
+	return (-1);
+}
+
+/*
+ * Free the property index of a virtual disk handle.
+ *	vdh - virtual disk handle
+ */
+static void
+vdisk_free_props(vd_handle_t *vdh)
+{
+	vd_propidx_t *pi = vdh->propidx;
+	vd_propent_t *pe;
+	uint_t i;
+
+	if (pi == NULL)
+		return;
+
+	for (i = 0; i < pi->pi_size; i++) {
+		while ((pe = pi->pi_hash[i]) != NULL)
+			vd_prop_remove(pi, pe);
+	}
+	free(pi->pi_hash);
+	free(pi);
+	vdh->propidx = NULL;
+}
+
+/*
+ * Find the r/w status of a given property.
+ * On success rw_string will point to a constant string 'rw' or 'ro'.
+ *	property - property name
+ *	rw_string - returns r/w status string.
+ *
+ * Returns:
+ *	0 - success
+ *	-1 - failure
+ */
+int
+vdisk_get_prop_rw(char *property, char **rw_string)
+{
+	/* User defined properties are all 'rw' */
+	if (strrchr(property, ':') != NULL) {
+		/* point to userprop 'rw' string */
+		*rw_string = prop_element_info[VD_E_USERPROP].prop_rw;
+		return (0);
+	}
+
+	/* Try attributes */
+	if (vdisk_get_rw(property, prop_attr_info,
+	    sizeof (prop_attr_info), rw_string) == 0) {
+		return (0);
 	}
 
+	/* Try elements */
+	if (vdisk_get_rw(property, prop_element_info,
+	    sizeof (prop_element_info), rw_string) == 0) {
+		return (0);
+	}
+
+	(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+	    gettext("ERROR: Unable to get property write status"),
+	    property);
 	return (-1);
+}
+
+/*
+ * Return the value of a property without copying it.  The string points
+ * into the xml tree and stays valid until the property is set or deleted
+ * or the tree is freed.
+ *	vdh - virtual disk handle
+ *	property - string containing property
+ *
+ * Returns:
+ *	value of the property, NULL if it doesn't exist or contains no data
+ */
+const char *
+vdisk_peek_prop_str(vd_handle_t *vdh, const char *property)
+{
+	vd_propent_t *pe;
+
+	if ((pe = vd_prop_lookup(vdh, property)) == NULL)
+		return (NULL);
+	return (vd_prop_value(vdh, pe));
+}
+
+/*
+ * Find and return a boolean property element value that matches the given
+ * property by first looking at disk_root attributes and then checking
+ * the disk_prop nodes.
+ *	vdh - virtual disk handle
+ *	property - string containing property
+ *	bool - pointer to boolean value to be returned
+ *
+ * Returns:
+ * -1 - failure
+ *  0 - success
+ */
+int
+vdisk_get_prop_bool(vd_handle_t *vdh, const char *property, int *bool)
+{
+	const char *rname;
+
+	if ((rname = vdisk_peek_prop_str(vdh, property)) == NULL)
+		return (-1);
+
+	if (strcmp(rname, "true") == 0)
+		*bool = 1;
+	else
+		*bool = 0;
+	return (0);
+}
+
+/*
+ * Return a value for a given property.  If property doesn't exist
+ * or contains no data then return failure.
+ *	vdh - virtual disk handle
+ *	property - string containing property
+ *	val - pointer to integer value to be returned
+ *
+ * Returns:
+ * -1 - failure
+ *  0 - success
+ */
+int
+vdisk_get_prop_val(vd_handle_t *vdh, const char *property, int *val)
+{
+	const char *rname;
+
+	if ((rname = vdisk_peek_prop_str(vdh, property)) == NULL)
+		return (-1);
 
-found:
-	*val = atoi((char *)rname);
+	errno = 0;
+	*val = (int)strtol(rname, NULL, 10);
 	if (errno) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n",
 		    gettext("ERROR: unable to locate integer property "),
 		    property);
-		ret = -1;
+		return (-1);
 	}
-	free(rname);
-	return (ret);
+	return (0);
+}
+
+/*
+ * Return an unsigned 64 bit value for a given property such as sectors
+ * or max-size.  If property doesn't exist or isn't a number then return
+ * failure.
+ *	vdh - virtual disk handle
+ *	property - string containing property
+ *	valp - pointer to value to be returned
+ *
+ * Returns:
+ * -1 - failure
+ *  0 - success
+ */
+int
+vdisk_get_prop_u64(vd_handle_t *vdh, const char *property, uint64_t *valp)
+{
+	const char *rname;
+	char *end;
+
+	if ((rname = vdisk_peek_prop_str(vdh, property)) == NULL)
+		return (-1);
+
+	errno = 0;
+	*valp = strtoull(rname, &end, 10);
+	if ((errno != 0) || (end == rname) || (*end != '\0'))
+		return (-1);
+	return (0);
 }
 
 /*
  * Return a string for a given property.  If property doesn't exist
  * or contains no data then return a string of "<unknown>".
- * Caller needs to free returned string via free().
+ * Caller needs to free returned string via free(), callers that only
+ * look at the string should use vdisk_peek_prop_str().
  *	vdh - virtual disk handle
  *	property - string containing property
  *	val_string - pointer to string value to be returned
@@ -1782,70 +2564,18 @@ found:
 int
 vdisk_get_prop_str(vd_handle_t *vdh, const char *property, char **val_string)
 {
-	char unknown[] = "<unknown>";
-	int len;
-	xmlNodePtr node;
-	xmlChar *rname = NULL;
-	xmlChar *uname = NULL;
-	xmlNodePtr userprop_node;
-
-	/* Check if property is a user defined property */
-	if (strrchr(property, ':') != NULL) {
-		if (vdh->userprop_root == NULL)
-			goto notfound;
-		for (userprop_node = vdh->userprop_root; userprop_node != NULL;
-		    userprop_node = userprop_node->next) {
-			node = userprop_node->xmlChildrenNode;
-			uname = xmlNodeListGetString(vdh->doc,
-			    node->xmlChildrenNode, 1);
-			if ((xmlStrcmp(uname, (xmlChar *)property) == 0)) {
-				node = node->next;
-				rname = xmlNodeListGetString(vdh->doc,
-				    node->xmlChildrenNode, 1);
-				goto found;
-			}
-		}
-		goto notfound;
-	}
+	const char *rname;
 
-	rname = xmlGetProp(vdh->disk_root, (xmlChar *)property);
-	if (rname != NULL)
-		goto found;
-
-	for (node = vdh->disk_root->xmlChildrenNode; node != NULL;
-	    node = node->next) {
-		if ((xmlStrcmp(node->name, (xmlChar *)property) == 0)) {
-			rname = xmlNodeListGetString(vdh->doc,
-			    node->xmlChildrenNode, 1);
-		}
-		if (rname)
-			goto found;
-	}
-
-	for (node = vdh->diskprop_root->xmlChildrenNode; node != NULL;
-	    node = node->next) {
-		if ((xmlStrcmp(node->name, (xmlChar *)property) == 0)) {
-			rname = xmlNodeListGetString(vdh->doc,
-			    node->xmlChildrenNode, 1);
-		}
-		if (rname)
-			goto found;
+	if ((rname = vdisk_peek_prop_str(vdh, property)) == NULL) {
+		/* property not found */
+		*val_string = strdup("<unknown>");
+		return (-1);
 	}
 
-notfound:
-	/* property not found */
-	len = strlen(unknown) + 1;
-	*val_string = malloc(len);
-	(void) strlcpy(*val_string, unknown, len);
-	return (-1);
-
-found:
-	len = strlen((char *)rname) + 1;
-	*val_string = malloc(len);
-	(void) strlcpy(*val_string, (char *)rname, len);
-	xmlFree(rname);
+	*val_string = strdup(rname);
 	return (0);
 }
+
 /*
  * Sets a boolean for a property.
  *	vdh - virtual disk handle
@@ -1920,106 +2650,58 @@ int
 vdisk_set_prop_str(vd_handle_t *vdh, const char *property, char *string,
     int ign_ro)
 {
-	xmlNodePtr node;
-	char *rname = NULL;
+	vd_propent_t *pe;
 	char *rw_string;
-	int rc = 0;
+
+	pe = vd_prop_lookup(vdh, property);
 
 	/* Check if property is a user defined property */
 	if (strrchr(property, ':') != NULL) {
-		for (node = vdh->userprop_root->xmlChildrenNode; node != NULL;
-		    node = node->next) {
-			if ((xmlStrcmp(node->name, (xmlChar *)property) == 0)) {
-				/* All user defined properties are rw */
-				xmlNodeSetContent(node, (xmlChar *)string);
-				return (0);
-			}
+		if ((pe == NULL) || (pe->pe_kind != VD_PK_USER)) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Property must exist"), property);
+			return (-1);
 		}
-		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-		    gettext("ERROR: Property must exist"), property);
-		return (-1);
+		/* All user defined properties are rw */
+		goto set;
 	}
 
+	if (pe == NULL)
+		return (-1);
 
-	/* Try to set property as an attribute */
-	rname = (char *)xmlGetProp(vdh->disk_root, (xmlChar *)property);
 	/* If ign_ro is normal then check if readonly */
-	if ((rname != NULL) && (ign_ro == VD_PROP_NORMAL)) {
-		if (vdisk_get_rw(property, prop_attr_info,
-		    sizeof (prop_attr_info), &rw_string) == -1) {
+	if (ign_ro == VD_PROP_NORMAL) {
+		if (((pe->pe_kind == VD_PK_ATTR) &&
+		    (vdisk_get_rw(property, prop_attr_info,
+		    sizeof (prop_attr_info), &rw_string) == -1)) ||
+		    ((pe->pe_kind == VD_PK_ELEM) &&
+		    (vdisk_get_rw(property, prop_element_info,
+		    sizeof (prop_element_info), &rw_string) == -1))) {
 			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 			    gettext("ERROR: Unable to get write status"),
 			    property);
-			xmlFree(rname);
 			return (-1);
 		}
 		if (strcmp(rw_string, "ro") == 0) {
 			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
 			    gettext("ERROR: Property is readonly"), property);
-			xmlFree(rname);
 			return (-1);
 		}
 	}
-	if (rname != NULL) {
-		/* Given property is an attribute */
-		xmlFree(rname);
-		(void) xmlSetProp(vdh->disk_root, (xmlChar *)property,
-		    (xmlChar *)string);
-		return (0);
-	}
 
-	/* Now try to set property as a child element of diskprop */
-	for (node = vdh->diskprop_root->xmlChildrenNode; node != NULL;
-	    node = node->next) {
-		rc = xmlStrcmp(node->name, (xmlChar *)property);
-		/* If ign_ro is normal then check if readonly */
-		if ((rc == 0) && (ign_ro == VD_PROP_NORMAL)) {
-			if (vdisk_get_rw(property, prop_element_info,
-			    sizeof (prop_element_info), &rw_string) == -1) {
-				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-				    gettext("ERROR: Unable to get write "
-				    "status"), property);
-				return (-1);
-			}
-			if (strcmp(rw_string, "ro") == 0) {
-				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-				    gettext("ERROR: Property is readonly"),
-				    property);
-				return (-1);
-			}
-		}
-		if (rc == 0) {
-			xmlNodeSetContent(node, (xmlChar *)string);
-			return (0);
-		}
+set:
+	if (pe->pe_joined != NULL) {
+		xmlFree(pe->pe_joined);
+		pe->pe_joined = NULL;
 	}
-
-	/* Now try to set property as a child element of root */
-	for (node = vdh->disk_root->xmlChildrenNode; node != NULL;
-	    node = node->next) {
-		rc = xmlStrcmp(node->name, (xmlChar *)property);
-		/* If ign_ro is normal then check if readonly */
-		if ((rc == 0) && (ign_ro == VD_PROP_NORMAL)) {
-			if (vdisk_get_rw(property, prop_element_info,
-			    sizeof (prop_element_info), &rw_string) == -1) {
-				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-				    gettext("ERROR: Unable to get write "
-				    "status"), property);
-				return (-1);
-			}
-			if (strcmp(rw_string, "ro") == 0) {
-				(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-				    gettext("ERROR: Property is readonly"),
-				    property);
-				return (-1);
-			}
-		}
-		if (rc == 0) {
-			xmlNodeSetContent(node, (xmlChar *)string);
-			return (0);
-		}
+	if (pe->pe_kind == VD_PK_ATTR) {
+		/* Given property is an attribute */
+		pe->pe_node = (xmlNodePtr)xmlSetProp(vdh->disk_root,
+		    (xmlChar *)property, (xmlChar *)string);
+	} else {
+		xmlNodeSetContent(pe->pe_node, (xmlChar *)string);
 	}
-	return (-1);
+	return (0);
 }
 
 /*
@@ -2038,6 +2720,8 @@ int
 vdisk_add_prop_str(vd_handle_t *vdh, const char *property, char *string)
 {
 	xmlNodePtr node;
+	xmlNodePtr value;
+	const char *name;
 
 	if (strrchr(property, ':') == NULL) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
@@ -2047,20 +2731,13 @@ vdisk_add_prop_str(vd_handle_t *vdh, const char *property, char *string)
 	}
 
 	/* Check if user property already exists */
-	if (vdh->userprop_root == NULL)
-		goto notfound;
-
-	for (node = vdh->userprop_root->xmlChildrenNode; node != NULL;
-	    node = node->next) {
-		if ((xmlStrcmp(node->name, (xmlChar *)property) == 0)) {
-			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-			    gettext("ERROR: Property already exists"),
-			    property);
-			return (-1);
-		}
+	if (vd_prop_lookup(vdh, property) != NULL) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Property already exists"),
+		    property);
+		return (-1);
 	}
 
-notfound:
 	if (vdh->userprop_root == NULL)
 		node = vdh->userprop_root = xmlNewChild(vdh->diskprop_root,
 		    NULL, (xmlChar *)"userprop", (xmlChar *)NULL);
@@ -2073,6 +2750,20 @@ notfound:
 	(void) xmlNewChild(node, NULL,
 	    (xmlChar *)"value", (xmlChar *)string);
 
+	/* Index the property under the name as stored in the tree */
+	name = vd_userprop_name(node, &value);
+	if ((name != NULL) && (value != NULL) && (vdh->propidx != NULL) &&
+	    (vd_prop_insert(vdh->propidx, name, VD_PK_USER, value,
+	    node) == -1)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to add property"), property);
+		if (vdh->userprop_root == node)
+			vdh->userprop_root = NULL;
+		xmlUnlinkNode(node);
+		xmlFreeNode(node);
+		return (-1);
+	}
+
 	return (0);
 }
 
@@ -2088,9 +2779,9 @@ notfound:
 int
 vdisk_del_prop_str(vd_handle_t *vdh, const char *property)
 {
-	xmlNodePtr node;
+	vd_propent_t *pe;
 	xmlNodePtr userprop_node;
-	xmlChar *fname = NULL;
+	xmlNodePtr node;
 
 	if (strrchr(property, ':') == NULL) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
@@ -2100,30 +2791,29 @@ vdisk_del_prop_str(vd_handle_t *vdh, const char *property)
 	}
 
 	/* Find user property and delete it */
-	for (userprop_node = vdh->userprop_root; userprop_node != NULL;
-	    userprop_node = userprop_node->next) {
-		node = userprop_node->xmlChildrenNode;
-		if ((xmlStrcmp(node->name, (xmlChar *)"name") != 0)) {
-			continue;
-		}
-		fname = xmlNodeListGetString(vdh->doc,
-		    node->xmlChildrenNode, 1);
-		if (fname == NULL)
-			continue;
-		if (strcmp(property, (char *)fname) == 0) {
-			xmlUnlinkNode(userprop_node);
-			xmlFreeNode(userprop_node);
-			xmlFree(fname);
-			return (0);
-		}
-		xmlFree(fname);
+	pe = vd_prop_lookup(vdh, property);
+	if ((pe == NULL) || (pe->pe_kind != VD_PK_USER)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: User defined property must exist"),
+		    property);
+		return (-1);
 	}
+	userprop_node = pe->pe_userprop;
 
-	/* Didn't find property to delete */
-	(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
-	    gettext("ERROR: User defined property must exist"),
-	    property);
-	return (-1);
+	/* The name of the entry is in the node, drop the entry first */
+	vd_prop_remove(vdh->propidx, pe);
+
+	if (userprop_node == vdh->userprop_root) {
+		for (node = userprop_node->next; node != NULL;
+		    node = node->next) {
+			if (xmlStrcmp(node->name, (xmlChar *)"userprop") == 0)
+				break;
+		}
+		vdh->userprop_root = node;
+	}
+	xmlUnlinkNode(userprop_node);
+	xmlFreeNode(userprop_node);
+	return (0);
 }
 
 /*
@@ -2137,21 +2827,20 @@ vdisk_print_prop_all(vd_handle_t *vdh, int longlist)
 {
 	int i;
 	xmlNodePtr node;
-	xmlNodePtr userprop_node;
-	char *rname = NULL;
-	char *uname = NULL;
-	char *uval = NULL;
+	const char *rname;
+	const char *uname;
+	const char *uval;
 
 	/* Print the native attributes */
 	for (i = 0; i < sizeof (prop_attr_info) / sizeof (prop_info_t); i++) {
-		(void) vdisk_get_prop_str(vdh, prop_attr_info[i].prop_name,
-		    &rname);
+		rname = vdisk_peek_prop_str(vdh, prop_attr_info[i].prop_name);
+		if (rname == NULL)
+			rname = "<unknown>";
 		if (longlist)
 			printf("%s: %s\t%s\n", prop_attr_info[i].prop_name,
 			    rname, prop_attr_info[i].prop_rw);
 		else
 			printf("%s: %s\n", prop_attr_info[i].prop_name, rname);
-		free(rname);
 	}
 
 	/* Print the native properties */
@@ -2160,33 +2849,27 @@ vdisk_print_prop_all(vd_handle_t *vdh, int longlist)
 		/* Skip the base user prop node */
 		if (i == VD_E_USERPROP)
 			continue;
-		(void) vdisk_get_prop_str(vdh,
-		    prop_element_info[i].prop_name, &rname);
+		rname = vdisk_peek_prop_str(vdh,
+		    prop_element_info[i].prop_name);
+		if (rname == NULL)
+			rname = "<unknown>";
 		if (longlist)
 			printf("%s: %s\t%s\n", prop_element_info[i].prop_name,
 			    rname, prop_element_info[i].prop_rw);
 		else
 			printf("%s: %s\n", prop_element_info[i].prop_name,
 			    rname);
-		free(rname);
 	}
 
-	/* Print the user properties */
-	if (vdh->userprop_root == 0)
-		return;
-
-	for (userprop_node = vdh->userprop_root; userprop_node != NULL;
-	    userprop_node = userprop_node->next) {
-		node = userprop_node->xmlChildrenNode;
-		uname = (char *)xmlNodeListGetString(vdh->doc,
-		    node->xmlChildrenNode, 1);
-		node = node->next;
-		uval = (char *)xmlNodeListGetString(vdh->doc,
-		    node->xmlChildrenNode, 1);
+	/* Print the user properties in the order they were added */
+	for (node = vdh->userprop_root; node != NULL; node = node->next) {
+		if ((uname = vd_userprop_name(node, NULL)) == NULL)
+			continue;
+		uval = vdisk_peek_prop_str(vdh, uname);
 		if (longlist)
-			printf("%s: %s\trw\n", uname, uval);
+			printf("%s: %s\trw\n", uname, uval ? uval : "");
 		else
-			printf("%s: %s\n", uname, uval);
+			printf("%s: %s\n", uname, uval ? uval : "");
 	}
 }
 
@@ -2218,46 +2901,129 @@ vdisk_find_snapshot_name(vd_handle_t *vdh, int image_number)
 }
 
 /*
- * Create lock file for exclusive access
- * Returns 0 for success, -1 otherwise.
+ * Lock the store of a virtual disk.  The lock is an fcntl() lock on
+ * <vdfile>.lock, so it goes away with the process holding it and the
+ * file itself is left in place for the next user.  A lock held by another
+ * process is waited for, retrying at growing intervals, up to timeout.
+ *	vdname - path to virtual disk
+ *	flags - VD_LOCK_SHARED: take a shared lock, for readers that need
+ *		the store and images not to change under them; a reader
+ *		that can't write the lock file opens it read-only
+ *	timeout - seconds to wait for the lock, 0 not to wait and -1 to
+ *		wait as long as it takes
+ *	waitedp - if non-null, returns the time spent waiting
+ *
+ * Returns:
+ *	file descriptor to pass to vdisk_unlock(): success
+ *	-1: failure
  */
 int
-vdisk_lock(char *vdname)
+vdisk_lock_wait(char *vdname, int flags, int timeout, hrtime_t *waitedp)
 {
 	char lockname[MAXPATHLEN];
+	struct stat64 st, dst;
+	struct flock fl;
+	hrtime_t start;
+	useconds_t delay = VD_LOCK_MIN_DELAY;
 	int lockfd;
 
 	vdisk_get_vdfilebase(NULL, lockname, vdname, MAXPATHLEN);
 	(void) strlcat(lockname, ".lock", MAXPATHLEN);
-	if ((lockfd = open(lockname, (O_WRONLY | O_CREAT | O_EXCL), 0644))
-	    < 0) {
+	lockfd = open(lockname, (O_RDWR | O_CREAT), 0644);
+	if ((lockfd < 0) && (errno == ENOENT)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Virtual disk does not exist"), vdname);
+		return (-1);
+	}
+	/* A reader may only be allowed to read the lock file */
+	if ((lockfd < 0) && (flags & VD_LOCK_SHARED))
+		lockfd = open(lockname, O_RDONLY);
+	if (lockfd < 0) {
 		(void) fprintf(stderr, "\n%s: \"%s\"\n",
 		    gettext("ERROR: unable to create lockfile"), lockname);
 		return (-1);
 	}
 
+	/* Let the owner of the virtual disk lock it too */
+	if ((fstat64(lockfd, &st) == 0) && (stat64(vdname, &dst) == 0) &&
+	    ((st.st_uid != dst.st_uid) || (st.st_gid != dst.st_gid)))
+		(void) fchown(lockfd, dst.st_uid, dst.st_gid);
+
+	bzero(&fl, sizeof (fl));
+	fl.l_type = (flags & VD_LOCK_SHARED) ? F_RDLCK : F_WRLCK;
+	fl.l_whence = SEEK_SET;
+
+	start = gethrtime();
+	while (fcntl(lockfd, (timeout < 0) ? F_SETLKW : F_SETLK, &fl) == -1) {
+		if (errno == EINTR)
+			continue;
+		if ((errno != EAGAIN) && (errno != EACCES)) {
+			(void) fprintf(stderr, "\n%s: \"%s\": %s\n",
+			    gettext("ERROR: unable to lock lockfile"),
+			    lockname, strerror(errno));
+			(void) close(lockfd);
+			return (-1);
+		}
+		if (gethrtime() - start >= (hrtime_t)timeout * NANOSEC) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n",
+			    gettext("ERROR: timed out waiting for lock"),
+			    lockname);
+			(void) close(lockfd);
+			errno = EAGAIN;
+			return (-1);
+		}
+		(void) usleep(delay);
+		if (delay < VD_LOCK_MAX_DELAY)
+			delay *= 2;
+	}
+
+	if (waitedp != NULL)
+		*waitedp = gethrtime() - start;
 	return (lockfd);
 }
 
 /*
- * Delete lock file for exclusive access
+ * Take the lock for exclusive access, waiting VD_LOCK_TIMEOUT seconds
+ * at most.  See vdisk_lock_wait().
+ * Returns lock file descriptor for success, -1 otherwise.
+ */
+int
+vdisk_lock(char *vdname)
+{
+	return (vdisk_lock_wait(vdname, 0, VD_LOCK_TIMEOUT, NULL));
+}
+
+/*
+ * Release the lock taken by vdisk_lock() or vdisk_lock_wait().
  * Returns 0 for success, -1 otherwise.
  */
 int
 vdisk_unlock(int lockfd, char *vdname)
 {
 	char lockname[MAXPATHLEN];
-	int ret = 0;
 
-	vdisk_get_vdfilebase(NULL, lockname, vdname, MAXPATHLEN);
-	(void) strlcat(lockname, ".lock", MAXPATHLEN);
 	if (close(lockfd) < 0) {
+		vdisk_get_vdfilebase(NULL, lockname, vdname, MAXPATHLEN);
+		(void) strlcat(lockname, ".lock", MAXPATHLEN);
 		(void) fprintf(stderr, "\n%s: \"%s\"\n",
 		    gettext("ERROR: unable to close lockfile"), lockname);
-		ret = -1;
+		return (-1);
 	}
-	unlink(lockname);
-	return (ret);
+	return (0);
+}
+
+/*
+ * Remove the lock file of a virtual disk that is being removed.
+ *	vdname - path to virtual disk
+ */
+void
+vdisk_lock_remove(char *vdname)
+{
+	char lockname[MAXPATHLEN];
+
+	vdisk_get_vdfilebase(NULL, lockname, vdname, MAXPATHLEN);
+	(void) strlcat(lockname, ".lock", MAXPATHLEN);
+	(void) unlink(lockname);
 }
 
 /*
@@ -2314,23 +3080,23 @@ void
 vdisk_get_vdfilebase(vd_handle_t *vdh, char *vdfilebase, char *vdname, int len)
 {
 	char vdname_local[MAXPATHLEN];
+	char base[MAXPATHLEN];
+	const char *vdfile;
 	char *slash;
 	char *dot;
-	char *base;
-	char default_base[] = VD_BASE;
-	int alloc_base = 0;
 
 	(void) strlcpy(vdname_local, vdname, MAXPATHLEN);
 	slash = strrchr(vdname_local, '/');
 
 	if (vdh) {
-		(void) vdisk_get_prop_str(vdh, "vdfile", &base);
-		alloc_base = 1;
+		vdfile = vdisk_peek_prop_str(vdh, "vdfile");
+		(void) strlcpy(base, vdfile ? vdfile : "<unknown>",
+		    MAXPATHLEN);
 		dot = strrchr(base, '.');
 		if (dot)
 			*dot = '\0';
 	} else
-		base = default_base;
+		(void) strlcpy(base, VD_BASE, MAXPATHLEN);
 
 	if (slash) {
 		/* If a/x set vdfilebase to a/x/vdisk or a/x/<filename> */
@@ -2347,8 +3113,6 @@ vdisk_get_vdfilebase(vd_handle_t *vdh, char *vdfilebase, char *vdname, int len)
 		(void) strlcat(vdfilebase, "/", len);
 		(void) strlcat(vdfilebase, base, len);
 	}
-	if (alloc_base)
-		free(base);
 }
 
 /*
@@ -2417,6 +3181,7 @@ vdisk_open_unmanaged(const char *vdisk_path)
 	}
 	vdh->unmanaged = B_TRUE;
 	vdh->doc = NULL;
+	vdh->parent_images = 0;
 
 	/* allocate hard disk handle */
 	rc = VDCreate(NULL, (PVBOXHDD *)&vdh->hdd);
@@ -2488,3 +3253,142 @@ vdisk_is_structured_file(const char *vdisk_name, const char **filetype)
 
 	return (0);
 }
+
+/*
+ * Gather the read-only images of the snapshot a linked clone was created
+ * from.  The parent element of a linked clone's store holds the
+ * <vdname>@<snapname> of that snapshot.  Images of the parent's own
+ * parent, if it is a linked clone too, are gathered first.
+ *	vc - chain the images are added to
+ *	child - handle of the store whose parent is loaded
+ *	depth - number of parents already loaded
+ *
+ * Returns:
+ * 	0: success
+ *	-1: failure
+ */
+static int
+vdisk_load_parent(vd_chain_t *vc, vd_handle_t *child, int depth)
+{
+	vd_handle_t *pvdh = NULL;
+	char pvdname[MAXPATHLEN];
+	char fullname[MAXPATHLEN];
+	xmlNodePtr node, snap_node;
+	xmlChar *name, *vdfile;
+	char *parent;
+	char *at;
+	int found = 0;
+
+	if ((vdisk_get_prop_str(child, "parent", &parent) == -1) ||
+	    (strcmp(parent, "none") == 0)) {
+		free(parent);
+		return (0);
+	}
+
+	at = strrchr(parent, '@');
+	if ((at == NULL) || (at == parent) ||
+	    (strlen(parent) >= MAXPATHLEN)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Malformed parent in store"), parent);
+		goto fail;
+	}
+	if (depth >= VD_MAX_CLONE_DEPTH) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Too many levels of linked clones"), parent);
+		goto fail;
+	}
+	(void) strlcpy(pvdname, parent, MAXPATHLEN);
+	pvdname[at - parent] = '\0';
+
+	if (vdisk_read_tree(&pvdh, pvdname) == -1)
+		goto fail;
+
+	if (vdisk_load_parent(vc, pvdh, depth + 1) == -1)
+		goto fail;
+
+	/* gather snapshots of the parent up to the one cloned */
+	for (node = pvdh->snap_root; (node != NULL) && (found == 0);
+	    node = node->next) {
+		name = NULL;
+		vdfile = NULL;
+		for (snap_node = node->xmlChildrenNode;
+		    snap_node != NULL; snap_node = snap_node->next) {
+			if (xmlStrcmp(snap_node->name,
+			    (xmlChar *)"name") == 0) {
+				name = xmlNodeListGetString(pvdh->doc,
+				    snap_node->xmlChildrenNode, 1);
+			} else if (xmlStrcmp(snap_node->name,
+			    (xmlChar *)"vdfile") == 0) {
+				vdfile = xmlNodeListGetString(pvdh->doc,
+				    snap_node->xmlChildrenNode, 1);
+			}
+		}
+		if ((name == NULL) || (vdfile == NULL)) {
+			(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+			    gettext("ERROR: Unable to retrieve "
+			    "snapshot filename from store"), pvdname);
+			xmlFree(name);
+			xmlFree(vdfile);
+			goto fail;
+		}
+		found = (strcmp((char *)name, at) == 0);
+		(void) snprintf(fullname, MAXPATHLEN, "%s/%s", pvdname,
+		    (char *)vdfile);
+		xmlFree(name);
+		xmlFree(vdfile);
+
+		if (vdisk_chain_add(vc, fullname) == -1)
+			goto fail;
+	}
+
+	if (found == 0) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to find parent snapshot"), parent);
+		goto fail;
+	}
+
+	vdisk_free_tree(pvdh);
+	free(parent);
+	return (0);
+
+fail:
+	vdisk_free_tree(pvdh);
+	free(parent);
+	return (-1);
+}
+
+/*
+ * Find the snapshot element with the given name in the xml tree.
+ *	vdh: virtual disk handle
+ *	name: string containing @<snapname> of snapshot
+ *
+ * Returns:
+ *	pointer to snapshot element
+ *	NULL: snapshot not found
+ */
+static xmlNodePtr
+vdisk_find_snap_node(vd_handle_t *vdh, const char *name)
+{
+	xmlNodePtr node, snap_node;
+	xmlChar *fname;
+	int match;
+
+	for (node = vdh->snap_root; node != NULL; node = node->next) {
+		for (snap_node = node->xmlChildrenNode;
+		    snap_node != NULL; snap_node = snap_node->next) {
+			if (xmlStrcmp(snap_node->name,
+			    (xmlChar *)"name") != 0)
+				continue;
+			fname = xmlNodeListGetString(vdh->doc,
+			    snap_node->xmlChildrenNode, 1);
+			if (fname == NULL)
+				continue;
+			match = (strcmp(name, (char *)fname) == 0);
+			xmlFree(fname);
+			if (match)
+				return (node);
+		}
+	}
+
+	return (NULL);
+}
@@ -28,8 +28,12 @@ extern "C" {
 #endif
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <libxml/tree.h>
 
+/* Index from property names to the nodes holding them, see vdisk.c */
+typedef struct vd_propidx vd_propidx_t;
+
 typedef struct vd_handle
 {
 	void *hdd;			/* pointer to hdd */
@@ -40,14 +44,47 @@ typedef struct vd_handle
 	xmlNodePtr snap_root;		/* pointer to snapshot element */
 	xmlDtdPtr dtd;			/* pointer to dtd */
 	xmlNodePtr userprop_root;	/* pointer to userprop element */
+	int parent_images;		/* images loaded from clone parents */
+	vd_propidx_t *propidx;		/* property index of the tree */
 } vd_handle_t;
 
 /* Base name to give to virtual disk files */
 #define	VD_BASE "vdisk"
 
+/* Maximum length of a chain of linked clones */
+#define	VD_MAX_CLONE_DEPTH	16
+
 /* Flags used by vdisk command */
 #define	VD_NOFLUSH_ON_CLOSE	1
 
+/* Flags for vdisk_lock_wait() */
+#define	VD_LOCK_SHARED		0x1	/* shared lock for readers */
+
+/* Seconds vdisk_lock() waits for the lock of a store */
+#define	VD_LOCK_TIMEOUT		60
+
+/* Flags for vdisk_set_store_flags() */
+#define	VD_STORE_CACHED		0x1	/* read stores from their cache */
+
+/* Extent of a virtual disk holding data, see vdisk_get_allocation() */
+typedef struct vd_extent
+{
+	uint64_t ve_offset;		/* byte offset in virtual disk */
+	uint64_t ve_length;		/* length in bytes */
+} vd_extent_t;
+
+/* Image number asking vdisk_get_allocation() for the whole chain */
+#define	VD_ALLOC_CHAIN	(-1)
+
+/* Called with the bytes copied so far by the file copy routines */
+typedef void vd_copy_progress_t(uint64_t done, uint64_t total, void *arg);
+
+/* Bitmap of the blocks a guest wrote, see vdisk_cbt.c */
+typedef struct vd_cbt vd_cbt_t;
+
+/* Default bytes of a virtual disk covered by one bit of the bitmap */
+#define	VD_CBT_DEF_BLOCK	(64 * 1024)
+
 /*
  * Flags used to ignore and not ignore the read-only flag in the
  * property declaration structure.
@@ -66,6 +103,24 @@ int vdisk_flush(void *vdh);
 int64_t vdisk_get_size(void *vdh);
 void vdisk_close(void *vdh);
 int vdisk_setflags(void *vdh, uint_t flags);
+int vdisk_get_allocation(void *vdh, int image, uint64_t offset,
+    uint64_t length, vd_extent_t **extentsp, int *nextentsp);
+int vdisk_get_delta(void *vdh, int from, int to, vd_extent_t **extentsp,
+    int *nextentsp);
+void vdisk_free_allocation(vd_extent_t *extents);
+
+vd_cbt_t *vdisk_cbt_open(const char *vdisk_path);
+void vdisk_cbt_mark(vd_cbt_t *cbt, uint64_t offset, uint64_t length);
+int vdisk_cbt_sync(vd_cbt_t *cbt);
+int vdisk_cbt_close(vd_cbt_t *cbt);
+int vdisk_cbt_enable(char *vdname, uint64_t size, uint32_t block);
+int vdisk_cbt_disable(char *vdname);
+int vdisk_cbt_snapshot(char *vdname, const char *snapname);
+int vdisk_cbt_unsnapshot(char *vdname, const char *snapname);
+int vdisk_cbt_rollback(char *vdname, const char *snapname);
+int vdisk_cbt_rename(char *vdname, const char *oldsnap, const char *newsnap);
+int vdisk_cbt_get_changes(char *vdname, const char *snapname, uint64_t *genp,
+    uint64_t *curp, vd_extent_t **extentsp, int *nextentsp);
 
 int vdisk_check_vdisk(const char *vdisk_path);
 
@@ -77,7 +132,22 @@ int vdisk_load_snapshots(vd_handle_t *vdh, char *pszformat, char *vdname,
 int vdisk_find_snapshots(vd_handle_t *vdh, char *pszrmfilename,
     int *image_number, int *total_image_number);
 int vdisk_move_snapshots(vd_handle_t *vdh, char *pszformat, char *vdname,
-    char *new_dir);
+    char *new_dir, vd_copy_progress_t *progress, void *arg);
+int vdisk_copy_file(const char *from, const char *to,
+    vd_copy_progress_t *progress, void *arg);
+int vdisk_move_files(const char *from_dir, const char *prefix,
+    const char *to_dir, vd_copy_progress_t *progress, void *arg);
+int vdisk_copy_range(int in, uint64_t in_off, int out, uint64_t out_off,
+    uint64_t len, vd_copy_progress_t *progress, void *arg);
+int vdisk_fixed_layout(const char *file, const char *pszformat,
+    uint64_t *offp);
+int vdisk_compact(const char *filename, uint64_t *freedp,
+    vd_copy_progress_t *progress, void *arg);
+int vdisk_convert_fixed(vd_handle_t *vdh, char *vdname, char *pszformat,
+    char *pszformat_conv, vd_copy_progress_t *progress, void *arg);
+int vdisk_fixed_recover(vd_handle_t *vdh, char *vdname);
+int vdisk_create_fixed(const char *file, const char *pszformat, uint64_t size,
+    const char *comment);
 char *vdisk_find_snapshot_name(vd_handle_t *vdh, int image_number);
 int vdisk_find_create_storepath(const char *name, char *vdname, char *snapname,
     char *extname, char **pszformat, int create_flag, vd_handle_t **vdhp);
@@ -93,10 +163,23 @@ int vdisk_create_tree(char *vdname, char *vtype, int sparse, char *parent,
 void vdisk_free_tree(vd_handle_t *vdh);
 int vdisk_read_tree(vd_handle_t **vdh, char *vdname);
 int vdisk_write_tree(vd_handle_t *vdh, char *vdname);
+void vdisk_set_store_flags(int flags);
+int vdisk_cache_read(vd_handle_t *vdh, const char *xmlname,
+    struct stat64 *stp);
+void vdisk_cache_write(vd_handle_t *vdh, const char *xmlname,
+    const struct stat64 *stp);
+void vdisk_cache_remove(char *vdname);
+void vdisk_set_store_keep(int count);
+int vdisk_cache_get(vd_handle_t *vdh, const char *xmlname);
+void vdisk_cache_keep(vd_handle_t *vdh, const char *xmlname,
+    const struct stat64 *stp);
 int vdisk_add_snap(vd_handle_t *vdh, char *snapname, char *filename);
 int vdisk_rename_snap(vd_handle_t *vdh, char *property, char *old_string,
     char *new_string);
 int vdisk_delete_snap(vd_handle_t *vdh, char *snapname);
+int vdisk_add_cow_clone(vd_handle_t *vdh, char *snapname, char *clone);
+int vdisk_update_cow_clone(vd_handle_t *vdh, char *clone, char *new_clone);
+int vdisk_find_cow_clone_image(vd_handle_t *vdh);
 int vdisk_add_prop_str(vd_handle_t *vdh, const char *property, char *string);
 int vdisk_del_prop_str(vd_handle_t *vdh, const char *property);
 int vdisk_get_prop_rw(char *property, char **rw_string);
@@ -107,11 +190,15 @@ int vdisk_get_prop_val(vd_handle_t *vdh, const char *property, int *val);
 int vdisk_set_prop_val(vd_handle_t *vdh, const char *property, int val,
     int override);
 int vdisk_get_prop_str(vd_handle_t *vdh, const char *name, char **str);
+const char *vdisk_peek_prop_str(vd_handle_t *vdh, const char *name);
+int vdisk_get_prop_u64(vd_handle_t *vdh, const char *name, uint64_t *valp);
 int vdisk_set_prop_str(vd_handle_t *vdh, const char *property, char *str,
     int override);
 void vdisk_print_prop_all(vd_handle_t *vdh, int longlist);
 int vdisk_lock(char *vdname);
+int vdisk_lock_wait(char *vdname, int flags, int timeout, hrtime_t *waitedp);
 int vdisk_unlock(int lockfd, char *vdname);
+void vdisk_lock_remove(char *vdname);
 void vdisk_get_xmlfile_suffix(char *xmlname, char *file, int len);
 void vdisk_get_xmlfile(char *xmlname, char *vdname, int len);
 void vdisk_get_vdfilebase(vd_handle_t *, char *vdfilebase, char *vdname,
@@ -0,0 +1,860 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+/*
+ * Allocation map of a virtual disk.
+ *
+ * VBox does not export which blocks of an image hold data, so the block
+ * maps are read straight from the image files:
+ *	VDI	- block map, a free or zero entry is not data
+ *	VHD	- block allocation table of dynamic and differencing disks
+ *	VMDK	- grain directory and grain tables of sparse extents,
+ *		  either a monolithic sparse file or the extents listed in
+ *		  a descriptor file
+ *	raw	- SEEK_DATA/SEEK_HOLE on the file
+ * Anything else (fixed images, stream optimized VMDK, unknown files) is
+ * reported as allocated throughout, so the answer is never smaller than
+ * the data actually present.
+ *
+ * For a chain the layers are walked from the top down.  Whatever a layer
+ * allocates hides the same range in every layer below it; a zero block
+ * hides it too but reads as zeroes, so is not reported as data.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#include "VBox/VBoxHDD.h"
+
+#include "vdisk.h"
+
+
+#define	VDA_SECTOR		512
+
+/* state of a run within one layer; free ranges have no run */
+#define	VDA_RUN_DATA		1
+#define	VDA_RUN_ZERO		2
+
+/* map entries read per pread */
+#define	VDA_MAP_BATCH		16384
+
+#define	VDI_SIGNATURE		0xbeda107fU
+#define	VDI_PRE_HEADER_SIZE	72
+#define	VDI_TYPE_FIXED		2
+#define	VDI_BLOCK_FREE		0xffffffffU
+#define	VDI_BLOCK_ZERO		0xfffffffeU
+
+#define	VHD_COOKIE		"conectix"
+#define	VHD_DYN_COOKIE		"cxsparse"
+#define	VHD_FOOTER_SIZE		512
+#define	VHD_DYN_HEADER_SIZE	1024
+#define	VHD_TYPE_DYNAMIC	3
+#define	VHD_TYPE_DIFF		4
+#define	VHD_BLOCK_FREE		0xffffffffU
+
+#define	VMDK_SPARSE_MAGIC	0x564d444bU	/* "KDMV" */
+#define	VMDK_DESC_MAGIC		"# Disk DescriptorFile"
+#define	VMDK_GD_AT_END		0xffffffffffffffffULL
+#define	VMDK_GRAIN_FREE		0
+#define	VMDK_GRAIN_ZERO		1
+#define	VMDK_MAX_DESC		(64 * 1024)
+
+typedef struct vda_run {
+	uint64_t	vr_off;
+	uint64_t	vr_len;
+	int		vr_state;
+} vda_run_t;
+
+typedef struct vda_list {
+	vda_run_t	*vl_runs;
+	int		vl_cnt;
+	int		vl_max;
+} vda_list_t;
+
+
+static uint32_t
+vda_le32(const uchar_t *p)
+{
+	return ((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static uint64_t
+vda_le64(const uchar_t *p)
+{
+	return ((uint64_t)vda_le32(p) | ((uint64_t)vda_le32(p + 4) << 32));
+}
+
+static uint32_t
+vda_be32(const uchar_t *p)
+{
+	return (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	    ((uint32_t)p[2] << 8) | (uint32_t)p[3]);
+}
+
+static uint64_t
+vda_be64(const uchar_t *p)
+{
+	return (((uint64_t)vda_be32(p) << 32) | (uint64_t)vda_be32(p + 4));
+}
+
+static int
+vda_pread(int fd, void *buf, size_t len, uint64_t off)
+{
+	ssize_t n;
+	size_t done = 0;
+
+	while (done < len) {
+		n = pread(fd, (char *)buf + done, len - done,
+		    (off_t)(off + done));
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		if (n == 0) {
+			errno = EIO;
+			return (-1);
+		}
+		done += n;
+	}
+	return (0);
+}
+
+/*
+ * Append a run, clipped to [start, end), merging it with the previous
+ * run when they touch and have the same state.  Runs must be appended
+ * in ascending order.
+ */
+static int
+vda_add(vda_list_t *vl, uint64_t off, uint64_t len, int state,
+    uint64_t start, uint64_t end)
+{
+	vda_run_t *last;
+	vda_run_t *runs;
+
+	if (off < start) {
+		if (off + len <= start)
+			return (0);
+		len -= start - off;
+		off = start;
+	}
+	if (off >= end)
+		return (0);
+	if (off + len > end)
+		len = end - off;
+	if (len == 0)
+		return (0);
+
+	if (vl->vl_cnt > 0) {
+		last = &vl->vl_runs[vl->vl_cnt - 1];
+		if ((last->vr_state == state) &&
+		    (last->vr_off + last->vr_len == off)) {
+			last->vr_len += len;
+			return (0);
+		}
+	}
+
+	if (vl->vl_cnt == vl->vl_max) {
+		runs = realloc(vl->vl_runs,
+		    (vl->vl_max + 64) * 2 * sizeof (vda_run_t));
+		if (runs == NULL) {
+			errno = ENOMEM;
+			return (-1);
+		}
+		vl->vl_runs = runs;
+		vl->vl_max = (vl->vl_max + 64) * 2;
+	}
+	vl->vl_runs[vl->vl_cnt].vr_off = off;
+	vl->vl_runs[vl->vl_cnt].vr_len = len;
+	vl->vl_runs[vl->vl_cnt].vr_state = state;
+	vl->vl_cnt++;
+	return (0);
+}
+
+static void
+vda_free(vda_list_t *vl)
+{
+	free(vl->vl_runs);
+	bzero(vl, sizeof (*vl));
+}
+
+/*
+ * Walk a map of 32 bit entries, one per "unit" bytes of virtual disk,
+ * covering [start, end).  classify() turns an entry into a run state
+ * or 0 for free.
+ */
+static int
+vda_map(int fd, uint64_t map_off, boolean_t big_endian, uint64_t unit,
+    uint64_t nentries, uint64_t start, uint64_t end,
+    int (*classify)(uint32_t), vda_list_t *vl)
+{
+	uchar_t *buf;
+	uint64_t first, last, i, n, j;
+	int state;
+
+	if ((start >= end) || (unit == 0) || (nentries == 0))
+		return (0);
+	first = start / unit;
+	last = (end - 1) / unit;
+	if (last >= nentries)
+		last = nentries - 1;
+	if (first > last)
+		return (0);
+
+	buf = malloc(VDA_MAP_BATCH * sizeof (uint32_t));
+	if (buf == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	for (i = first; i <= last; i += n) {
+		n = last - i + 1;
+		if (n > VDA_MAP_BATCH)
+			n = VDA_MAP_BATCH;
+		if (vda_pread(fd, buf, n * sizeof (uint32_t),
+		    map_off + i * sizeof (uint32_t)) == -1) {
+			free(buf);
+			return (-1);
+		}
+		for (j = 0; j < n; j++) {
+			state = classify(big_endian ? vda_be32(buf + j * 4) :
+			    vda_le32(buf + j * 4));
+			if ((state != 0) && (vda_add(vl, (i + j) * unit, unit,
+			    state, start, end) == -1)) {
+				free(buf);
+				return (-1);
+			}
+		}
+	}
+
+	free(buf);
+	return (0);
+}
+
+static int
+vda_vdi_classify(uint32_t entry)
+{
+	if (entry == VDI_BLOCK_FREE)
+		return (0);
+	if (entry == VDI_BLOCK_ZERO)
+		return (VDA_RUN_ZERO);
+	return (VDA_RUN_DATA);
+}
+
+static int
+vda_vhd_classify(uint32_t entry)
+{
+	return ((entry == VHD_BLOCK_FREE) ? 0 : VDA_RUN_DATA);
+}
+
+/*
+ * VDI 1.x: the header follows a 72 byte pre-header.
+ */
+static int
+vda_vdi(int fd, uint64_t start, uint64_t end, vda_list_t *vl)
+{
+	uchar_t hdr[VDI_PRE_HEADER_SIZE + 320];
+	const uchar_t *h = hdr + VDI_PRE_HEADER_SIZE;
+	uint64_t cbdisk;
+
+	if (vda_pread(fd, hdr, sizeof (hdr), 0) == -1)
+		return (-1);
+
+	/* Only know the 1.x layout; fixed images are all data */
+	if (((vda_le32(hdr + 68) >> 16) != 1) ||
+	    (vda_le32(h + 4) == VDI_TYPE_FIXED))
+		return (vda_add(vl, start, end - start, VDA_RUN_DATA,
+		    start, end));
+
+	cbdisk = vda_le64(h + 296);
+	if (end > cbdisk)
+		end = cbdisk;
+	return (vda_map(fd, vda_le32(h + 268), B_FALSE, vda_le32(h + 304),
+	    vda_le32(h + 312), start, end, vda_vdi_classify, vl));
+}
+
+/*
+ * VHD: a dynamic or differencing disk has a block allocation table.
+ * Block granularity over-reports the sectors of a differencing block
+ * that still come from its parent, which is harmless.
+ */
+static int
+vda_vhd(int fd, const uchar_t *footer, uint64_t start, uint64_t end,
+    vda_list_t *vl)
+{
+	uchar_t dyn[VHD_DYN_HEADER_SIZE];
+	uint32_t type;
+
+	type = vda_be32(footer + 60);
+	if ((type != VHD_TYPE_DYNAMIC) && (type != VHD_TYPE_DIFF))
+		return (vda_add(vl, start, end - start, VDA_RUN_DATA,
+		    start, end));
+
+	if (vda_pread(fd, dyn, sizeof (dyn), vda_be64(footer + 16)) == -1)
+		return (-1);
+	if (bcmp(dyn, VHD_DYN_COOKIE, strlen(VHD_DYN_COOKIE)) != 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	return (vda_map(fd, vda_be64(dyn + 16), B_TRUE, vda_be32(dyn + 32),
+	    vda_be32(dyn + 28), start, end, vda_vhd_classify, vl));
+}
+
+/*
+ * A hosted sparse VMDK extent mapped at byte "base" of the virtual
+ * disk.  [start, end) is in virtual disk bytes.
+ */
+static int
+vda_vmdk_sparse(int fd, uint64_t base, uint64_t start, uint64_t end,
+    vda_list_t *vl)
+{
+	uchar_t hdr[VDA_SECTOR];
+	uchar_t *gt = NULL;
+	uint64_t capacity, grain, gtcover, gdoff, ngd;
+	uint64_t gdi, gdfirst, gdlast, gi, off;
+	uint32_t ngte, gde, gte;
+	int rc = -1;
+
+	if (vda_pread(fd, hdr, sizeof (hdr), 0) == -1)
+		return (-1);
+	capacity = vda_le64(hdr + 12) * VDA_SECTOR;
+	grain = vda_le64(hdr + 20) * VDA_SECTOR;
+	ngte = vda_le32(hdr + 44);
+	gdoff = vda_le64(hdr + 56);
+
+	if (start < base)
+		start = base;
+	if (end > base + capacity)
+		end = base + capacity;
+	if (start >= end)
+		return (0);
+
+	/* Stream optimized extents keep their directory at the end */
+	if ((gdoff == VMDK_GD_AT_END) || (grain == 0) || (ngte == 0))
+		return (vda_add(vl, start, end - start, VDA_RUN_DATA,
+		    start, end));
+
+	gtcover = grain * ngte;
+	ngd = (capacity + gtcover - 1) / gtcover;
+	gdfirst = (start - base) / gtcover;
+	gdlast = (end - 1 - base) / gtcover;
+
+	gt = malloc(ngte * sizeof (uint32_t));
+	if (gt == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	for (gdi = gdfirst; (gdi <= gdlast) && (gdi < ngd); gdi++) {
+		uchar_t ent[sizeof (uint32_t)];
+
+		if (vda_pread(fd, ent, sizeof (ent),
+		    gdoff * VDA_SECTOR + gdi * sizeof (uint32_t)) == -1)
+			goto out;
+		gde = vda_le32(ent);
+		if (gde == 0)
+			continue;
+		if (vda_pread(fd, gt, ngte * sizeof (uint32_t),
+		    (uint64_t)gde * VDA_SECTOR) == -1)
+			goto out;
+		for (gi = 0; gi < ngte; gi++) {
+			gte = vda_le32(gt + gi * sizeof (uint32_t));
+			if (gte == VMDK_GRAIN_FREE)
+				continue;
+			off = base + gdi * gtcover + gi * grain;
+			if (vda_add(vl, off, grain, (gte == VMDK_GRAIN_ZERO) ?
+			    VDA_RUN_ZERO : VDA_RUN_DATA, start, end) == -1)
+				goto out;
+		}
+	}
+	rc = 0;
+out:
+	free(gt);
+	return (rc);
+}
+
+/*
+ * A VMDK descriptor file: walk its extent lines in order, e.g.
+ *	RW 4192256 SPARSE "disk-s001.vmdk"
+ *	RW 8388608 FLAT "disk-flat.vmdk" 0
+ *	RW 2048 ZERO
+ */
+static int
+vda_vmdk_desc(int fd, const char *filename, uint64_t start, uint64_t end,
+    vda_list_t *vl)
+{
+	char *desc, *line, *next, *q1, *q2;
+	char access[16], type[16];
+	char path[MAXPATHLEN];
+	const char *slash;
+	unsigned long long sectors;
+	uint64_t base = 0, len;
+	ssize_t n;
+	int efd, erc;
+	int rc = -1;
+
+	desc = malloc(VMDK_MAX_DESC + 1);
+	if (desc == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	n = pread(fd, desc, VMDK_MAX_DESC, 0);
+	if (n == -1)
+		goto out;
+	desc[n] = '\0';
+
+	for (line = desc; (line != NULL) && (*line != '\0'); line = next) {
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+		if (sscanf(line, "%15s %llu %15s", access, &sectors,
+		    type) != 3)
+			continue;
+		if ((strcmp(access, "RW") != 0) &&
+		    (strcmp(access, "RDONLY") != 0) &&
+		    (strcmp(access, "NOACCESS") != 0))
+			continue;
+		len = (uint64_t)sectors * VDA_SECTOR;
+
+		if (strcmp(type, "ZERO") == 0) {
+			if (vda_add(vl, base, len, VDA_RUN_ZERO,
+			    start, end) == -1)
+				goto out;
+		} else if ((strcmp(type, "SPARSE") == 0) &&
+		    ((q1 = strchr(line, '"')) != NULL) &&
+		    ((q2 = strchr(q1 + 1, '"')) != NULL)) {
+			/* Extent names are relative to the descriptor */
+			*q2 = '\0';
+			slash = strrchr(filename, '/');
+			if ((q1[1] == '/') || (slash == NULL))
+				(void) strlcpy(path, q1 + 1, sizeof (path));
+			else
+				(void) snprintf(path, sizeof (path), "%.*s/%s",
+				    (int)(slash - filename), filename, q1 + 1);
+			efd = open(path, O_RDONLY);
+			if (efd == -1)
+				goto out;
+			erc = vda_vmdk_sparse(efd, base, start, end, vl);
+			(void) close(efd);
+			if (erc == -1)
+				goto out;
+		} else if (vda_add(vl, base, len, VDA_RUN_DATA,
+		    start, end) == -1) {
+			goto out;
+		}
+		base += len;
+	}
+	rc = 0;
+out:
+	free(desc);
+	return (rc);
+}
+
+static int
+vda_raw(int fd, uint64_t start, uint64_t end, vda_list_t *vl)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	off_t data, hole;
+	uint64_t off = start;
+
+	while (off < end) {
+		data = lseek(fd, (off_t)off, SEEK_DATA);
+		if (data == -1) {
+			if (errno == ENXIO)
+				return (0);
+			/* Not supported here, so assume data */
+			break;
+		}
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole == -1)
+			hole = (off_t)end;
+		if (vda_add(vl, data, hole - data, VDA_RUN_DATA,
+		    start, end) == -1)
+			return (-1);
+		off = hole;
+	}
+	if (off >= end)
+		return (0);
+	start = off;
+#endif
+	return (vda_add(vl, start, end - start, VDA_RUN_DATA, start, end));
+}
+
+/*
+ * Append the runs of one image file, found by its magic numbers.
+ */
+static int
+vda_image(const char *filename, uint64_t start, uint64_t end,
+    vda_list_t *vl)
+{
+	uchar_t hdr[VDA_SECTOR];
+	uchar_t footer[VHD_FOOTER_SIZE];
+	struct stat64 st;
+	ssize_t n;
+	int fd;
+	int rc;
+
+	fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return (-1);
+	if (fstat64(fd, &st) == -1) {
+		(void) close(fd);
+		return (-1);
+	}
+
+	bzero(hdr, sizeof (hdr));
+	n = pread(fd, hdr, sizeof (hdr), 0);
+	if (n == -1) {
+		(void) close(fd);
+		return (-1);
+	}
+
+	if ((n >= VDI_PRE_HEADER_SIZE) &&
+	    (vda_le32(hdr + 64) == VDI_SIGNATURE)) {
+		rc = vda_vdi(fd, start, end, vl);
+	} else if (vda_le32(hdr) == VMDK_SPARSE_MAGIC) {
+		rc = vda_vmdk_sparse(fd, 0, start, end, vl);
+	} else if (bcmp(hdr, VMDK_DESC_MAGIC, strlen(VMDK_DESC_MAGIC)) == 0) {
+		rc = vda_vmdk_desc(fd, filename, start, end, vl);
+	} else if (S_ISREG(st.st_mode) && (st.st_size >= VHD_FOOTER_SIZE) &&
+	    (vda_pread(fd, footer, sizeof (footer),
+	    st.st_size - VHD_FOOTER_SIZE) == 0) &&
+	    (bcmp(footer, VHD_COOKIE, strlen(VHD_COOKIE)) == 0)) {
+		rc = vda_vhd(fd, footer, start, end, vl);
+	} else {
+		rc = vda_raw(fd, start, end, vl);
+	}
+
+	(void) close(fd);
+	return (rc);
+}
+
+/*
+ * Append to "out" the parts of the runs in "layer" not already in
+ * "covered".  Both lists are sorted and their runs don't overlap.
+ */
+static int
+vda_subtract(vda_list_t *layer, vda_list_t *covered, vda_list_t *out)
+{
+	vda_run_t *r, *c;
+	uint64_t cur, rend;
+	int i, j = 0, k;
+
+	for (i = 0; i < layer->vl_cnt; i++) {
+		r = &layer->vl_runs[i];
+		rend = r->vr_off + r->vr_len;
+		while ((j < covered->vl_cnt) &&
+		    (covered->vl_runs[j].vr_off + covered->vl_runs[j].vr_len <=
+		    r->vr_off))
+			j++;
+		cur = r->vr_off;
+		for (k = j; (k < covered->vl_cnt) &&
+		    (covered->vl_runs[k].vr_off < rend); k++) {
+			c = &covered->vl_runs[k];
+			if (c->vr_off > cur) {
+				if (vda_add(out, cur, c->vr_off - cur,
+				    r->vr_state, 0, UINT64_MAX) == -1)
+					return (-1);
+			}
+			if (c->vr_off + c->vr_len > cur)
+				cur = c->vr_off + c->vr_len;
+		}
+		if ((cur < rend) && (vda_add(out, cur, rend - cur, r->vr_state,
+		    0, UINT64_MAX) == -1))
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Replace "covered" by its union with "layer".
+ */
+static int
+vda_union(vda_list_t *covered, vda_list_t *layer)
+{
+	vda_list_t merged;
+	vda_run_t *r, *last;
+	int i = 0, j = 0;
+
+	bzero(&merged, sizeof (merged));
+	while ((i < covered->vl_cnt) || (j < layer->vl_cnt)) {
+		if ((j >= layer->vl_cnt) || ((i < covered->vl_cnt) &&
+		    (covered->vl_runs[i].vr_off <= layer->vl_runs[j].vr_off)))
+			r = &covered->vl_runs[i++];
+		else
+			r = &layer->vl_runs[j++];
+
+		last = (merged.vl_cnt > 0) ?
+		    &merged.vl_runs[merged.vl_cnt - 1] : NULL;
+		if ((last != NULL) &&
+		    (r->vr_off <= last->vr_off + last->vr_len)) {
+			if (r->vr_off + r->vr_len > last->vr_off + last->vr_len)
+				last->vr_len = r->vr_off + r->vr_len -
+				    last->vr_off;
+			continue;
+		}
+		if (vda_add(&merged, r->vr_off, r->vr_len, VDA_RUN_DATA,
+		    0, UINT64_MAX) == -1) {
+			vda_free(&merged);
+			return (-1);
+		}
+	}
+
+	vda_free(covered);
+	*covered = merged;
+	return (0);
+}
+
+static int
+vda_extent_cmp(const void *a, const void *b)
+{
+	const vd_extent_t *ea = a;
+	const vd_extent_t *eb = b;
+
+	if (ea->ve_offset < eb->ve_offset)
+		return (-1);
+	return (ea->ve_offset > eb->ve_offset);
+}
+
+/*
+ * Find the ranges of a virtual disk which hold data.
+ *	vdh - handle with the image chain opened, e.g. from vdisk_open()
+ *	image - image number in the chain (0 is the base) to look at only
+ *	    that layer, or VD_ALLOC_CHAIN for what the whole chain reads
+ *	offset, length - byte range of the virtual disk to look at;
+ *	    a length of 0 means up to the end of the disk
+ *	extentsp - returns an array of sorted, non-adjacent extents to be
+ *	    freed with vdisk_free_allocation()
+ *	nextentsp - returns number of entries in extentsp
+ *
+ * Ranges that are not returned read as zeroes.  The map may over-report
+ * data (never under-report it) when an image format is not understood.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set
+ */
+int
+vdisk_get_allocation(void *vdh, int image, uint64_t offset,
+    uint64_t length, vd_extent_t **extentsp, int *nextentsp)
+{
+	PVBOXHDD hdd;
+	char filename[MAXPATHLEN];
+	vda_list_t layer, covered, data;
+	vd_extent_t *extents = NULL;
+	uint64_t size, end;
+	int count, top, bottom, i, n;
+	int rc = -1;
+
+	if ((vdh == NULL) || (((vd_handle_t *)vdh)->hdd == NULL) ||
+	    (extentsp == NULL) || (nextentsp == NULL)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	hdd = ((vd_handle_t *)vdh)->hdd;
+
+	count = VDGetCount(hdd);
+	if (count == 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (image == VD_ALLOC_CHAIN) {
+		top = count - 1;
+		bottom = 0;
+	} else if ((image >= 0) && (image < count)) {
+		top = bottom = image;
+	} else {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	size = VDGetSize(hdd, top);
+	if (offset >= size)
+		end = offset;
+	else if ((length == 0) || (length > size - offset))
+		end = size;
+	else
+		end = offset + length;
+
+	bzero(&layer, sizeof (layer));
+	bzero(&covered, sizeof (covered));
+	bzero(&data, sizeof (data));
+
+	for (i = top; (i >= bottom) && (offset < end); i--) {
+		if (!VBOX_SUCCESS(VDGetFilename(hdd, i, filename,
+		    sizeof (filename)))) {
+			errno = EINVAL;
+			goto out;
+		}
+		if (vda_image(filename, offset, end, &layer) == -1)
+			goto out;
+
+		/* What this layer shows through the layers above it */
+		if (vda_subtract(&layer, &covered, &data) == -1)
+			goto out;
+		if (vda_union(&covered, &layer) == -1)
+			goto out;
+		layer.vl_cnt = 0;
+
+		/* Whole range resolved, lower layers don't matter */
+		if ((covered.vl_cnt == 1) &&
+		    (covered.vl_runs[0].vr_off <= offset) &&
+		    (covered.vl_runs[0].vr_off + covered.vl_runs[0].vr_len >=
+		    end))
+			break;
+	}
+
+	/* Keep the data runs, sorted and merged */
+	if (data.vl_cnt > 0) {
+		extents = malloc(data.vl_cnt * sizeof (vd_extent_t));
+		if (extents == NULL) {
+			errno = ENOMEM;
+			goto out;
+		}
+	}
+	for (i = 0, n = 0; i < data.vl_cnt; i++) {
+		if (data.vl_runs[i].vr_state != VDA_RUN_DATA)
+			continue;
+		extents[n].ve_offset = data.vl_runs[i].vr_off;
+		extents[n].ve_length = data.vl_runs[i].vr_len;
+		n++;
+	}
+	if (n > 1)
+		qsort(extents, n, sizeof (vd_extent_t), vda_extent_cmp);
+	for (i = 1, count = (n > 0) ? 1 : 0; i < n; i++) {
+		vd_extent_t *last = &extents[count - 1];
+
+		if (last->ve_offset + last->ve_length == extents[i].ve_offset)
+			last->ve_length += extents[i].ve_length;
+		else
+			extents[count++] = extents[i];
+	}
+
+	*extentsp = extents;
+	*nextentsp = count;
+	extents = NULL;
+	rc = 0;
+out:
+	free(extents);
+	vda_free(&layer);
+	vda_free(&covered);
+	vda_free(&data);
+	return (rc);
+}
+
+/*
+ * Find the ranges written between two points of an image chain, i.e.
+ * everything the images above "from" up to and including "to" hold,
+ * data or zero blocks alike.
+ *	vdh - handle with the image chain opened, e.g. from vdisk_open()
+ *	from - image number of the older point (0 is the base), or -1
+ *	    for the empty disk below the base
+ *	to - image number of the newer point, above from
+ *	extentsp - returns an array of sorted, non-adjacent extents to be
+ *	    freed with vdisk_free_allocation()
+ *	nextentsp - returns number of entries in extentsp
+ *
+ * Ranges that are not returned read the same at both points.  Like
+ * vdisk_get_allocation() the map may over-report, never under-report.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set
+ */
+int
+vdisk_get_delta(void *vdh, int from, int to, vd_extent_t **extentsp,
+    int *nextentsp)
+{
+	PVBOXHDD hdd;
+	char filename[MAXPATHLEN];
+	vda_list_t layer, covered;
+	vd_extent_t *extents = NULL;
+	uint64_t size;
+	int i;
+	int rc = -1;
+
+	if ((vdh == NULL) || (((vd_handle_t *)vdh)->hdd == NULL) ||
+	    (extentsp == NULL) || (nextentsp == NULL)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	hdd = ((vd_handle_t *)vdh)->hdd;
+	if ((from < -1) || (to <= from) || (to >= VDGetCount(hdd))) {
+		errno = EINVAL;
+		return (-1);
+	}
+	size = VDGetSize(hdd, to);
+
+	bzero(&layer, sizeof (layer));
+	bzero(&covered, sizeof (covered));
+
+	for (i = to; i > from; i--) {
+		if (!VBOX_SUCCESS(VDGetFilename(hdd, i, filename,
+		    sizeof (filename)))) {
+			errno = EINVAL;
+			goto out;
+		}
+		if (vda_image(filename, 0, size, &layer) == -1)
+			goto out;
+		if (vda_union(&covered, &layer) == -1)
+			goto out;
+		layer.vl_cnt = 0;
+	}
+
+	if (covered.vl_cnt > 0) {
+		extents = malloc(covered.vl_cnt * sizeof (vd_extent_t));
+		if (extents == NULL) {
+			errno = ENOMEM;
+			goto out;
+		}
+	}
+	for (i = 0; i < covered.vl_cnt; i++) {
+		extents[i].ve_offset = covered.vl_runs[i].vr_off;
+		extents[i].ve_length = covered.vl_runs[i].vr_len;
+	}
+
+	*extentsp = extents;
+	*nextentsp = covered.vl_cnt;
+	extents = NULL;
+	rc = 0;
+out:
+	free(extents);
+	vda_free(&layer);
+	vda_free(&covered);
+	return (rc);
+}
+
+void
+vdisk_free_allocation(vd_extent_t *extents)
+{
+	free(extents);
+}
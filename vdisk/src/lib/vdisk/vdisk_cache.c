@@ -0,0 +1,663 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+/*
+ * Compiled store.
+ *
+ * Reading the store with libxml loads the DTD and validates the whole
+ * document on every open, which costs far more than the few hundred
+ * bytes of the store are worth.  Next to the store, in
+ * <vdname>/vdisk.xml.cache, we keep the already validated tree in a
+ * form that is mapped and turned back into a tree without parsing:
+ *	header	magic, version, byte order, the device, inode, size and
+ *		modification time of the store it was made from, length
+ *		and checksum of the records; host byte order
+ *	records	the document in order: a one byte type, then for each
+ *		string of the type a 32 bit length and the bytes
+ *
+ * The cache is written whenever vdisk_write_tree() writes the store and
+ * by readers that found it missing or stale.  It's only used while the
+ * store still has the identity and time recorded in it and its records
+ * add up to the checksum, so a store changed by any other means, or a
+ * cache torn by a crash, just means the store is parsed again.  Only
+ * processes which don't change the store read the cache, see
+ * vdisk_set_store_flags(); writers always parse and validate.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#include "vdisk.h"
+
+
+#define	VSC_SUFFIX	".cache"
+#define	VSC_MAGIC	"VDXMLBIN"
+#define	VSC_VERSION	1
+#define	VSC_BYTE_ORDER	0x01020304
+
+/* Record types */
+#define	VSC_DTD		1	/* name, public and system id */
+#define	VSC_ELEM	2	/* name; following records are its children */
+#define	VSC_END		3	/* end of the current element */
+#define	VSC_ATTR	4	/* name, value */
+#define	VSC_TEXT	5	/* content */
+#define	VSC_COMMENT	6	/* content */
+
+#define	VSC_NULL	0xffffffffU	/* length of an absent string */
+#define	VSC_MAX_DEPTH	32
+
+#define	VSC_FNV_BASIS	0xcbf29ce484222325ULL
+#define	VSC_FNV_PRIME	0x100000001b3ULL
+
+typedef struct vsc_hdr {
+	char		vh_magic[8];
+	uint32_t	vh_version;
+	uint32_t	vh_byte_order;
+	uint64_t	vh_dev;		/* identity of the store */
+	uint64_t	vh_ino;
+	uint64_t	vh_size;
+	int64_t		vh_mtime;
+	int64_t		vh_mtime_nsec;
+	uint64_t	vh_len;		/* bytes of records */
+	uint64_t	vh_sum;		/* FNV-1a of the records */
+} vsc_hdr_t;
+
+/* Records being built */
+typedef struct vsc_buf {
+	uchar_t		*vb_data;
+	size_t		vb_len;
+	size_t		vb_size;
+	int		vb_error;
+} vsc_buf_t;
+
+/* Records being read */
+typedef struct vsc_cursor {
+	const uchar_t	*vc_data;
+	size_t		vc_len;
+	size_t		vc_off;
+} vsc_cursor_t;
+
+static uint64_t
+vsc_sum(const uchar_t *data, size_t len)
+{
+	uint64_t sum = VSC_FNV_BASIS;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		sum ^= data[i];
+		sum *= VSC_FNV_PRIME;
+	}
+	return (sum);
+}
+
+static void
+vsc_cache_name(char *name, const char *xmlname)
+{
+	(void) snprintf(name, MAXPATHLEN, "%s%s", xmlname, VSC_SUFFIX);
+}
+
+static void
+vsc_put(vsc_buf_t *vb, const void *data, size_t len)
+{
+	uchar_t *p;
+	size_t size;
+
+	if (vb->vb_error)
+		return;
+	if (vb->vb_len + len > vb->vb_size) {
+		size = MAX(vb->vb_size * 2, vb->vb_len + len + 1024);
+		p = realloc(vb->vb_data, size);
+		if (p == NULL) {
+			vb->vb_error = 1;
+			return;
+		}
+		vb->vb_data = p;
+		vb->vb_size = size;
+	}
+	bcopy(data, vb->vb_data + vb->vb_len, len);
+	vb->vb_len += len;
+}
+
+static void
+vsc_put_str(vsc_buf_t *vb, const xmlChar *str)
+{
+	uint32_t len;
+
+	len = (str == NULL) ? VSC_NULL : (uint32_t)xmlStrlen(str);
+	vsc_put(vb, &len, sizeof (len));
+	if (str != NULL)
+		vsc_put(vb, str, len);
+}
+
+static void
+vsc_put_type(vsc_buf_t *vb, uchar_t type)
+{
+	vsc_put(vb, &type, 1);
+}
+
+/*
+ * Add the records of a node and everything below it.
+ */
+static void
+vsc_put_node(vsc_buf_t *vb, xmlNodePtr node, int depth)
+{
+	xmlAttrPtr attr;
+	xmlChar *value;
+
+	if (depth > VSC_MAX_DEPTH) {
+		vb->vb_error = 1;
+		return;
+	}
+
+	switch (node->type) {
+	case XML_ELEMENT_NODE:
+		vsc_put_type(vb, VSC_ELEM);
+		vsc_put_str(vb, node->name);
+		for (attr = node->properties; attr != NULL;
+		    attr = attr->next) {
+			value = xmlNodeGetContent((xmlNodePtr)attr);
+			vsc_put_type(vb, VSC_ATTR);
+			vsc_put_str(vb, attr->name);
+			vsc_put_str(vb, value ? value : (xmlChar *)"");
+			xmlFree(value);
+		}
+		for (node = node->children; node != NULL; node = node->next)
+			vsc_put_node(vb, node, depth + 1);
+		vsc_put_type(vb, VSC_END);
+		break;
+
+	case XML_TEXT_NODE:
+	case XML_CDATA_SECTION_NODE:
+		vsc_put_type(vb, VSC_TEXT);
+		vsc_put_str(vb, node->content);
+		break;
+
+	case XML_COMMENT_NODE:
+		vsc_put_type(vb, VSC_COMMENT);
+		vsc_put_str(vb, node->content);
+		break;
+
+	default:
+		/* Nothing else is in a store */
+		break;
+	}
+}
+
+/*
+ * Write the cache of a store that was just read or written.  Failing to
+ * write it only costs the next reader a parse, so errors are ignored.
+ *	vdh - handle holding the tree of the store
+ *	xmlname - path of the store
+ *	stp - identity and time of the file the tree was read from or
+ *	    written to, taken from that file and not from xmlname, which
+ *	    another writer may have replaced since
+ */
+void
+vdisk_cache_write(vd_handle_t *vdh, const char *xmlname,
+    const struct stat64 *stp)
+{
+	char name[MAXPATHLEN];
+	char tmpname[MAXPATHLEN];
+	vsc_buf_t vb;
+	vsc_hdr_t vh;
+	xmlDtdPtr dtd;
+	xmlNodePtr node;
+	int fd;
+
+	if (vdh->doc == NULL)
+		return;
+
+	bzero(&vb, sizeof (vb));
+	dtd = vdh->doc->intSubset;
+	if (dtd != NULL) {
+		vsc_put_type(&vb, VSC_DTD);
+		vsc_put_str(&vb, dtd->name);
+		vsc_put_str(&vb, dtd->ExternalID);
+		vsc_put_str(&vb, dtd->SystemID);
+	}
+	for (node = vdh->doc->children; node != NULL; node = node->next) {
+		if ((node->type == XML_ELEMENT_NODE) ||
+		    (node->type == XML_COMMENT_NODE))
+			vsc_put_node(&vb, node, 0);
+	}
+	if (vb.vb_error)
+		goto out;
+
+	bzero(&vh, sizeof (vh));
+	bcopy(VSC_MAGIC, vh.vh_magic, sizeof (vh.vh_magic));
+	vh.vh_version = VSC_VERSION;
+	vh.vh_byte_order = VSC_BYTE_ORDER;
+	vh.vh_dev = stp->st_dev;
+	vh.vh_ino = stp->st_ino;
+	vh.vh_size = stp->st_size;
+	vh.vh_mtime = stp->st_mtim.tv_sec;
+	vh.vh_mtime_nsec = stp->st_mtim.tv_nsec;
+	vh.vh_len = vb.vb_len;
+	vh.vh_sum = vsc_sum(vb.vb_data, vb.vb_len);
+
+	/* Readers see the old cache or the complete new one */
+	vsc_cache_name(name, xmlname);
+	(void) snprintf(tmpname, MAXPATHLEN, "%s.%ld", name, (long)getpid());
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		goto out;
+	(void) fchown(fd, stp->st_uid, stp->st_gid);
+	(void) fchmod(fd, stp->st_mode & 0666);
+	if ((write(fd, &vh, sizeof (vh)) != sizeof (vh)) ||
+	    (write(fd, vb.vb_data, vb.vb_len) != (ssize_t)vb.vb_len)) {
+		(void) close(fd);
+		(void) unlink(tmpname);
+		goto out;
+	}
+	(void) close(fd);
+	if (rename(tmpname, name) == -1)
+		(void) unlink(tmpname);
+
+out:
+	free(vb.vb_data);
+}
+
+static int
+vsc_get_type(vsc_cursor_t *vc, uchar_t *type)
+{
+	if (vc->vc_off >= vc->vc_len)
+		return (-1);
+	*type = vc->vc_data[vc->vc_off++];
+	return (0);
+}
+
+/*
+ * Get the next string, which libxml wants as a copy.
+ */
+static int
+vsc_get_str(vsc_cursor_t *vc, xmlChar **strp)
+{
+	uint32_t len;
+
+	*strp = NULL;
+	if (vc->vc_len - vc->vc_off < sizeof (len))
+		return (-1);
+	bcopy(vc->vc_data + vc->vc_off, &len, sizeof (len));
+	vc->vc_off += sizeof (len);
+	if (len == VSC_NULL)
+		return (0);
+	if (vc->vc_len - vc->vc_off < len)
+		return (-1);
+	*strp = xmlStrndup(vc->vc_data + vc->vc_off, len);
+	if (*strp == NULL)
+		return (-1);
+	vc->vc_off += len;
+	return (0);
+}
+
+/*
+ * Rebuild the tree from the records.
+ *
+ * Returns:
+ *	the document
+ *	NULL: the records are damaged
+ */
+static xmlDocPtr
+vsc_build(vsc_cursor_t *vc)
+{
+	xmlDocPtr doc;
+	xmlNodePtr cur = NULL;
+	xmlNodePtr node;
+	xmlChar *s1 = NULL, *s2 = NULL, *s3 = NULL;
+	uchar_t type;
+	int depth = 0;
+
+	doc = xmlNewDoc((xmlChar *)"1.0");
+	if (doc == NULL)
+		return (NULL);
+
+	while (vc->vc_off < vc->vc_len) {
+		(void) vsc_get_type(vc, &type);
+		switch (type) {
+		case VSC_DTD:
+			if ((cur != NULL) || (doc->intSubset != NULL) ||
+			    (vsc_get_str(vc, &s1) == -1) ||
+			    (vsc_get_str(vc, &s2) == -1) ||
+			    (vsc_get_str(vc, &s3) == -1) ||
+			    (xmlCreateIntSubset(doc, s1, s2, s3) == NULL))
+				goto fail;
+			break;
+
+		case VSC_ELEM:
+			if ((vsc_get_str(vc, &s1) == -1) || (s1 == NULL) ||
+			    (++depth > VSC_MAX_DEPTH))
+				goto fail;
+			node = xmlNewDocNode(doc, NULL, s1, NULL);
+			if (node == NULL)
+				goto fail;
+			if (cur != NULL) {
+				(void) xmlAddChild(cur, node);
+			} else if (xmlDocGetRootElement(doc) == NULL) {
+				(void) xmlDocSetRootElement(doc, node);
+			} else {
+				xmlFreeNode(node);
+				goto fail;
+			}
+			cur = node;
+			break;
+
+		case VSC_END:
+			if (cur == NULL)
+				goto fail;
+			cur = (cur->parent == (xmlNodePtr)doc) ?
+			    NULL : cur->parent;
+			depth--;
+			break;
+
+		case VSC_ATTR:
+			if ((cur == NULL) || (vsc_get_str(vc, &s1) == -1) ||
+			    (vsc_get_str(vc, &s2) == -1) || (s1 == NULL) ||
+			    (s2 == NULL) || (xmlNewProp(cur, s1, s2) == NULL))
+				goto fail;
+			break;
+
+		case VSC_TEXT:
+		case VSC_COMMENT:
+			if ((vsc_get_str(vc, &s1) == -1) || (s1 == NULL))
+				goto fail;
+			if (type == VSC_TEXT) {
+				if (cur == NULL)
+					goto fail;
+				node = xmlNewDocText(doc, s1);
+			} else {
+				node = xmlNewDocComment(doc, s1);
+			}
+			if (node == NULL)
+				goto fail;
+			if (cur != NULL)
+				(void) xmlAddChild(cur, node);
+			else
+				(void) xmlAddChild((xmlNodePtr)doc, node);
+			break;
+
+		default:
+			goto fail;
+		}
+		xmlFree(s1);
+		xmlFree(s2);
+		xmlFree(s3);
+		s1 = s2 = s3 = NULL;
+	}
+
+	if ((cur != NULL) || (xmlDocGetRootElement(doc) == NULL))
+		goto fail;
+	return (doc);
+
+fail:
+	xmlFree(s1);
+	xmlFree(s2);
+	xmlFree(s3);
+	xmlFreeDoc(doc);
+	return (NULL);
+}
+
+/*
+ * Take the tree of a store from its cache instead of parsing the store.
+ *	vdh - handle to set the document of
+ *	xmlname - path of the store
+ *	stp - set to the identity and time of the store the tree is of
+ *
+ * Returns:
+ *	0: success, vdh->doc is set
+ *	-1: no usable cache; the store has to be parsed
+ */
+int
+vdisk_cache_read(vd_handle_t *vdh, const char *xmlname, struct stat64 *stp)
+{
+	char name[MAXPATHLEN];
+	struct stat64 cst;
+	vsc_cursor_t vc;
+	vsc_hdr_t vh;
+	void *addr;
+	int fd;
+
+	if (stat64(xmlname, stp) == -1)
+		return (-1);
+
+	vsc_cache_name(name, xmlname);
+	fd = open(name, O_RDONLY);
+	if (fd == -1)
+		return (-1);
+	if ((fstat64(fd, &cst) == -1) || (cst.st_size < sizeof (vh))) {
+		(void) close(fd);
+		return (-1);
+	}
+	addr = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void) close(fd);
+	if (addr == MAP_FAILED)
+		return (-1);
+
+	bcopy(addr, &vh, sizeof (vh));
+	if ((bcmp(vh.vh_magic, VSC_MAGIC, sizeof (vh.vh_magic)) != 0) ||
+	    (vh.vh_version != VSC_VERSION) ||
+	    (vh.vh_byte_order != VSC_BYTE_ORDER) ||
+	    (vh.vh_dev != stp->st_dev) || (vh.vh_ino != stp->st_ino) ||
+	    (vh.vh_size != stp->st_size) ||
+	    (vh.vh_mtime != stp->st_mtim.tv_sec) ||
+	    (vh.vh_mtime_nsec != stp->st_mtim.tv_nsec) ||
+	    (vh.vh_len != cst.st_size - sizeof (vh)))
+		goto out;
+
+	vc.vc_data = (const uchar_t *)addr + sizeof (vh);
+	vc.vc_len = vh.vh_len;
+	vc.vc_off = 0;
+	if (vsc_sum(vc.vc_data, vc.vc_len) != vh.vh_sum)
+		goto out;
+
+	vdh->doc = vsc_build(&vc);
+
+out:
+	(void) munmap(addr, cst.st_size);
+	return ((vdh->doc != NULL) ? 0 : -1);
+}
+
+/*
+ * Remove the cache of a store that is being removed.
+ *	vdname - path to virtual disk
+ */
+void
+vdisk_cache_remove(char *vdname)
+{
+	char xmlname[MAXPATHLEN];
+	char name[MAXPATHLEN];
+
+	vdisk_get_xmlfile(xmlname, vdname, MAXPATHLEN);
+	vsc_cache_name(name, xmlname);
+	(void) unlink(name);
+}
+
+/*
+ * Stores kept in memory.
+ *
+ * A process that reads the same stores over and over, such as vdiskadm
+ * serve, can keep the trees of the stores it read most recently, see
+ * vdisk_set_store_keep().  Each is kept with the identity and time of
+ * the store it came from and vdisk_read_tree() hands out a copy of it for
+ * as long as the store still has them; otherwise, the store is read again.
+ * Trees written by vdisk_write_tree() replace the kept ones.  The list is
+ * kept most recently used first; vsc_kept_lock lets the threads of a
+ * process that read stores at once share it.
+ */
+typedef struct vsc_kept {
+	struct vsc_kept	*vk_next;
+	char		vk_name[MAXPATHLEN];	/* path of the store */
+	dev_t		vk_dev;			/* identity of the store */
+	ino_t		vk_ino;
+	off_t		vk_size;
+	struct timespec	vk_mtime;
+	xmlDocPtr	vk_doc;
+} vsc_kept_t;
+
+static vsc_kept_t *vsc_kept = NULL;
+static int vsc_kept_max = 0;
+static pthread_mutex_t vsc_kept_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+vsc_kept_free(vsc_kept_t *vk)
+{
+	xmlFreeDoc(vk->vk_doc);
+	free(vk);
+}
+
+/*
+ * Set how many stores are kept in memory, 0 (the default) for none.
+ */
+void
+vdisk_set_store_keep(int count)
+{
+	vsc_kept_t **vkp;
+	vsc_kept_t *vk;
+	int n = 0;
+
+	(void) pthread_mutex_lock(&vsc_kept_lock);
+	vsc_kept_max = count;
+	for (vkp = &vsc_kept; (vk = *vkp) != NULL; n++) {
+		if (n < count) {
+			vkp = &vk->vk_next;
+			continue;
+		}
+		*vkp = vk->vk_next;
+		vsc_kept_free(vk);
+	}
+	(void) pthread_mutex_unlock(&vsc_kept_lock);
+}
+
+/*
+ * Take the tree of a store from the stores kept in memory.
+ *	vdh - handle to set the document of
+ *	xmlname - path of the store
+ *
+ * Returns:
+ *	0: success, vdh->doc is set to a copy of the kept tree
+ *	-1: the store isn't kept or has changed
+ */
+int
+vdisk_cache_get(vd_handle_t *vdh, const char *xmlname)
+{
+	vsc_kept_t **vkp;
+	vsc_kept_t *vk;
+	struct stat64 st;
+	int rc = -1;
+
+	if ((vsc_kept == NULL) || (stat64(xmlname, &st) == -1))
+		return (-1);
+
+	(void) pthread_mutex_lock(&vsc_kept_lock);
+
+	/* Stores are found by identity, whatever path they are named by */
+	for (vkp = &vsc_kept; (vk = *vkp) != NULL; vkp = &vk->vk_next) {
+		if ((st.st_dev == vk->vk_dev) && (st.st_ino == vk->vk_ino))
+			break;
+	}
+	if (vk == NULL)
+		goto out;
+
+	if ((st.st_size != vk->vk_size) ||
+	    (st.st_mtim.tv_sec != vk->vk_mtime.tv_sec) ||
+	    (st.st_mtim.tv_nsec != vk->vk_mtime.tv_nsec)) {
+		*vkp = vk->vk_next;
+		vsc_kept_free(vk);
+		goto out;
+	}
+
+	if ((vdh->doc = xmlCopyDoc(vk->vk_doc, 1)) == NULL)
+		goto out;
+
+	/* Move to the front of the list */
+	*vkp = vk->vk_next;
+	vk->vk_next = vsc_kept;
+	vsc_kept = vk;
+	rc = 0;
+
+out:
+	(void) pthread_mutex_unlock(&vsc_kept_lock);
+	return (rc);
+}
+
+/*
+ * Keep a copy of the tree of a store just read or written in memory, if
+ * stores are kept, dropping the least recently used one if need be.
+ *	vdh - handle with the tree
+ *	xmlname - path of the store
+ *	stp - identity and time of the file the tree was read from or
+ *	    written to, see vdisk_cache_write()
+ */
+void
+vdisk_cache_keep(vd_handle_t *vdh, const char *xmlname,
+    const struct stat64 *stp)
+{
+	vsc_kept_t **vkp;
+	vsc_kept_t *vk;
+	xmlDocPtr doc;
+	int n = 0;
+
+	if ((vsc_kept_max == 0) || (vdh->doc == NULL) ||
+	    ((doc = xmlCopyDoc(vdh->doc, 1)) == NULL))
+		return;
+
+	(void) pthread_mutex_lock(&vsc_kept_lock);
+
+	/* Drop the old tree of the store and any past the limit */
+	for (vkp = &vsc_kept; (vk = *vkp) != NULL; ) {
+		if ((strcmp(vk->vk_name, xmlname) == 0) ||
+		    ((stp->st_dev == vk->vk_dev) &&
+		    (stp->st_ino == vk->vk_ino)) ||
+		    (++n >= vsc_kept_max)) {
+			*vkp = vk->vk_next;
+			vsc_kept_free(vk);
+			continue;
+		}
+		vkp = &vk->vk_next;
+	}
+
+	if ((vk = malloc(sizeof (vsc_kept_t))) == NULL) {
+		(void) pthread_mutex_unlock(&vsc_kept_lock);
+		xmlFreeDoc(doc);
+		return;
+	}
+	(void) strlcpy(vk->vk_name, xmlname, MAXPATHLEN);
+	vk->vk_dev = stp->st_dev;
+	vk->vk_ino = stp->st_ino;
+	vk->vk_size = stp->st_size;
+	vk->vk_mtime = stp->st_mtim;
+	vk->vk_doc = doc;
+	vk->vk_next = vsc_kept;
+	vsc_kept = vk;
+	(void) pthread_mutex_unlock(&vsc_kept_lock);
+}
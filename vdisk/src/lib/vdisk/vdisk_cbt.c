@@ -0,0 +1,890 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+/*
+ * Changed block tracking.
+ *
+ * While the vdisk daemon serves a guest it sets a bit in a bitmap for
+ * every block the guest writes, so a backup can copy just the blocks
+ * changed since the last one instead of the whole disk.  The bitmap of
+ * a virtual disk lives next to its images in <vdname>/vdisk.cbt:
+ *	header	magic, version, flags, block size, disk size, generation,
+ *		name of the snapshot the generation started at; all
+ *		numbers big endian
+ *	bitmap	one bit per block from VCB_MAP_OFF, bit 0 of byte 0 for
+ *		the first block
+ *
+ * Tracking is on for a disk while its bitmap exists.  Every snapshot
+ * ends the current generation: its bitmap is kept as vdisk.cbt.<gen>
+ * and an empty one for generation <gen> + 1 takes its place, so the
+ * blocks changed since a snapshot are those set in any generation from
+ * the one it started onwards.  Renaming a snapshot renames the
+ * generation that started at it.
+ *
+ * The daemon keeps the bitmap in memory and writes the changed part of
+ * it out whenever the guest flushes, after the data, so a flush the
+ * guest has seen complete covers the bitmap too.  Writes the guest
+ * hasn't flushed may still reach the images without their bits, so the
+ * header is flagged in use while the daemon runs; a bitmap found in use
+ * when opened is left over from a crash and every block is taken to
+ * have changed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#include "vdisk.h"
+
+
+#define	VCB_MAGIC	"VDISKCBT"
+#define	VCB_VERSION	1
+#define	VCB_HDR_SIZE	296
+#define	VCB_MAP_OFF	512
+#define	VCB_NAME_LEN	256	/* snapshot name, with the NUL */
+
+#define	VCB_IN_USE	0x1	/* opened for tracking by the daemon */
+
+typedef struct vcb_hdr {
+	uint32_t	vh_flags;
+	uint32_t	vh_block;	/* bytes covered by one bit */
+	uint64_t	vh_size;	/* disk size */
+	uint64_t	vh_gen;
+	char		vh_base[VCB_NAME_LEN];
+} vcb_hdr_t;
+
+struct vd_cbt {
+	int		vc_fd;
+	vcb_hdr_t	vc_hdr;
+	uint64_t	vc_nblocks;
+	uchar_t		*vc_map;
+	size_t		vc_maplen;
+	size_t		vc_dirty_lo;	/* bytes of vc_map changed since */
+	size_t		vc_dirty_hi;	/* ... the last sync */
+};
+
+
+static void
+vcb_put32(uchar_t *p, uint32_t val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+static void
+vcb_put64(uchar_t *p, uint64_t val)
+{
+	vcb_put32(p, val >> 32);
+	vcb_put32(p + 4, (uint32_t)val);
+}
+
+static uint32_t
+vcb_get32(const uchar_t *p)
+{
+	return (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	    ((uint32_t)p[2] << 8) | p[3]);
+}
+
+static uint64_t
+vcb_get64(const uchar_t *p)
+{
+	return (((uint64_t)vcb_get32(p) << 32) | vcb_get32(p + 4));
+}
+
+static uint64_t
+vcb_nblocks(const vcb_hdr_t *vh)
+{
+	return ((vh->vh_size + vh->vh_block - 1) / vh->vh_block);
+}
+
+static size_t
+vcb_maplen(const vcb_hdr_t *vh)
+{
+	return ((size_t)((vcb_nblocks(vh) + 7) / 8));
+}
+
+/*
+ * Path of the bitmap of generation gen, or of the current one for 0.
+ */
+static void
+vcb_path(char *path, char *vdname, uint64_t gen)
+{
+	char suffix[32];
+
+	vdisk_get_vdfilebase(NULL, path, vdname, MAXPATHLEN);
+	if (gen == 0)
+		(void) strlcpy(suffix, ".cbt", sizeof (suffix));
+	else
+		(void) snprintf(suffix, sizeof (suffix), ".cbt.%llu",
+		    (unsigned long long)gen);
+	(void) strlcat(path, suffix, MAXPATHLEN);
+}
+
+static int
+vcb_pread(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	n = pread(fd, buf, len, off);
+	if (n == -1)
+		return (-1);
+	if (n != len) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+vcb_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	n = pwrite(fd, buf, len, off);
+	if (n == -1)
+		return (-1);
+	if (n != len) {
+		errno = EIO;
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+vcb_read_hdr(int fd, vcb_hdr_t *vh)
+{
+	uchar_t buf[VCB_HDR_SIZE];
+
+	if (vcb_pread(fd, buf, sizeof (buf), 0) == -1)
+		return (-1);
+	if ((bcmp(buf, VCB_MAGIC, 8) != 0) ||
+	    (vcb_get32(buf + 8) != VCB_VERSION)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	vh->vh_flags = vcb_get32(buf + 12);
+	vh->vh_block = vcb_get32(buf + 16);
+	vh->vh_size = vcb_get64(buf + 24);
+	vh->vh_gen = vcb_get64(buf + 32);
+	bcopy(buf + 40, vh->vh_base, VCB_NAME_LEN);
+	vh->vh_base[VCB_NAME_LEN - 1] = '\0';
+	if ((vh->vh_block < 512) || (vh->vh_block % 512) != 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+vcb_write_hdr(int fd, const vcb_hdr_t *vh)
+{
+	uchar_t buf[VCB_HDR_SIZE];
+
+	bzero(buf, sizeof (buf));
+	bcopy(VCB_MAGIC, buf, 8);
+	vcb_put32(buf + 8, VCB_VERSION);
+	vcb_put32(buf + 12, vh->vh_flags);
+	vcb_put32(buf + 16, vh->vh_block);
+	vcb_put64(buf + 24, vh->vh_size);
+	vcb_put64(buf + 32, vh->vh_gen);
+	(void) strlcpy((char *)buf + 40, vh->vh_base, VCB_NAME_LEN);
+	return (vcb_pwrite(fd, buf, sizeof (buf), 0));
+}
+
+/*
+ * Read the header and bitmap of the bitmap file at path.
+ *
+ * Returns:
+ *	0: success, *mapp to be freed by the caller
+ *	-1: failure, errno set
+ */
+static int
+vcb_load(const char *path, vcb_hdr_t *vh, uchar_t **mapp)
+{
+	uchar_t *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (-1);
+	if (vcb_read_hdr(fd, vh) == -1)
+		goto fail;
+	map = malloc(MAX(vcb_maplen(vh), 1));
+	if (map == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	if (vcb_pread(fd, map, vcb_maplen(vh), VCB_MAP_OFF) == -1) {
+		free(map);
+		goto fail;
+	}
+	(void) close(fd);
+	*mapp = map;
+	return (0);
+
+fail:
+	(void) close(fd);
+	return (-1);
+}
+
+/*
+ * Write a new, empty bitmap file at path, owned like the store of the
+ * virtual disk, and flush it to stable storage.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set
+ */
+static int
+vcb_create(const char *path, char *vdname, const vcb_hdr_t *vh)
+{
+	char xmlname[MAXPATHLEN];
+	struct stat64 st;
+	int fd, err;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return (-1);
+
+	/* The daemon, running as the owner of the store, updates it */
+	vdisk_get_xmlfile(xmlname, vdname, MAXPATHLEN);
+	if (stat64(xmlname, &st) == 0) {
+		(void) fchown(fd, st.st_uid, st.st_gid);
+		(void) fchmod(fd, st.st_mode & 0666);
+	}
+
+	if ((vcb_write_hdr(fd, vh) == -1) ||
+	    (ftruncate(fd, VCB_MAP_OFF + vcb_maplen(vh)) == -1) ||
+	    (fsync(fd) == -1)) {
+		err = errno;
+		(void) close(fd);
+		(void) unlink(path);
+		errno = err;
+		return (-1);
+	}
+	(void) close(fd);
+	return (0);
+}
+
+/*
+ * Open the bitmap of a virtual disk for tracking the writes of a guest.
+ *	vdisk_path - path to the virtual disk as given to vdisk_open()
+ *
+ * Returns:
+ *	non-NULL: bitmap handle for vdisk_cbt_mark(), vdisk_cbt_sync() and
+ *	    vdisk_cbt_close()
+ *	NULL: failure, errno set; ENOENT if tracking isn't enabled
+ */
+vd_cbt_t *
+vdisk_cbt_open(const char *vdisk_path)
+{
+	char vdname[MAXPATHLEN];
+	char path[MAXPATHLEN];
+	vd_cbt_t *cbt;
+	int err;
+
+	cbt = calloc(1, sizeof (vd_cbt_t));
+	if (cbt == NULL) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+
+	vdisk_get_vdname(vdname, vdisk_path, MAXPATHLEN);
+	vcb_path(path, vdname, 0);
+	cbt->vc_fd = open(path, O_RDWR);
+	if (cbt->vc_fd == -1) {
+		free(cbt);
+		return (NULL);
+	}
+	if (vcb_read_hdr(cbt->vc_fd, &cbt->vc_hdr) == -1)
+		goto fail;
+	cbt->vc_nblocks = vcb_nblocks(&cbt->vc_hdr);
+	cbt->vc_maplen = vcb_maplen(&cbt->vc_hdr);
+	cbt->vc_map = malloc(MAX(cbt->vc_maplen, 1));
+	if (cbt->vc_map == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	if (vcb_pread(cbt->vc_fd, cbt->vc_map, cbt->vc_maplen,
+	    VCB_MAP_OFF) == -1)
+		goto fail;
+
+	/* Left in use by a daemon that didn't exit cleanly */
+	if (cbt->vc_hdr.vh_flags & VCB_IN_USE) {
+		(void) memset(cbt->vc_map, 0xff, cbt->vc_maplen);
+		if (vcb_pwrite(cbt->vc_fd, cbt->vc_map, cbt->vc_maplen,
+		    VCB_MAP_OFF) == -1)
+			goto fail;
+	}
+
+	cbt->vc_hdr.vh_flags |= VCB_IN_USE;
+	if ((vcb_write_hdr(cbt->vc_fd, &cbt->vc_hdr) == -1) ||
+	    (fsync(cbt->vc_fd) == -1))
+		goto fail;
+	cbt->vc_dirty_lo = cbt->vc_maplen;
+	cbt->vc_dirty_hi = 0;
+	return (cbt);
+
+fail:
+	err = errno;
+	(void) close(cbt->vc_fd);
+	free(cbt->vc_map);
+	free(cbt);
+	errno = err;
+	return (NULL);
+}
+
+/*
+ * Record a write of length bytes at offset.
+ */
+void
+vdisk_cbt_mark(vd_cbt_t *cbt, uint64_t offset, uint64_t length)
+{
+	uint64_t first, last, b;
+
+	if ((length == 0) || (offset >= cbt->vc_hdr.vh_size))
+		return;
+	first = offset / cbt->vc_hdr.vh_block;
+	last = MIN(offset + length - 1, cbt->vc_hdr.vh_size - 1) /
+	    cbt->vc_hdr.vh_block;
+
+	for (b = first; b <= last; b++) {
+		if (cbt->vc_map[b / 8] & (1 << (b % 8)))
+			continue;
+		cbt->vc_map[b / 8] |= (1 << (b % 8));
+		cbt->vc_dirty_lo = MIN(cbt->vc_dirty_lo, b / 8);
+		cbt->vc_dirty_hi = MAX(cbt->vc_dirty_hi, b / 8 + 1);
+	}
+}
+
+/*
+ * Write the bits set since the last sync to stable storage.  Called
+ * after the images were flushed.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set
+ */
+int
+vdisk_cbt_sync(vd_cbt_t *cbt)
+{
+	if (cbt->vc_dirty_lo >= cbt->vc_dirty_hi)
+		return (0);
+	if ((vcb_pwrite(cbt->vc_fd, cbt->vc_map + cbt->vc_dirty_lo,
+	    cbt->vc_dirty_hi - cbt->vc_dirty_lo,
+	    VCB_MAP_OFF + cbt->vc_dirty_lo) == -1) ||
+	    (fdatasync(cbt->vc_fd) == -1))
+		return (-1);
+	cbt->vc_dirty_lo = cbt->vc_maplen;
+	cbt->vc_dirty_hi = 0;
+	return (0);
+}
+
+/*
+ * Write out the bitmap and mark it no longer in use.  A bitmap that
+ * can't be written stays marked in use, so every block counts as
+ * changed the next time it is opened.  The handle is freed either way.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set
+ */
+int
+vdisk_cbt_close(vd_cbt_t *cbt)
+{
+	int rc = 0;
+	int err = 0;
+
+	if (vdisk_cbt_sync(cbt) == -1) {
+		rc = -1;
+	} else {
+		cbt->vc_hdr.vh_flags &= ~VCB_IN_USE;
+		if ((vcb_write_hdr(cbt->vc_fd, &cbt->vc_hdr) == -1) ||
+		    (fsync(cbt->vc_fd) == -1))
+			rc = -1;
+	}
+	if (rc == -1)
+		err = errno;
+	(void) close(cbt->vc_fd);
+	free(cbt->vc_map);
+	free(cbt);
+	if (rc == -1)
+		errno = err;
+	return (rc);
+}
+
+/*
+ * Start tracking the blocks written to a virtual disk.
+ *	vdname - path to the virtual disk
+ *	size - size of the virtual disk
+ *	block - bytes covered by one bit, a multiple of 512
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set; EEXIST if tracking is already enabled
+ */
+int
+vdisk_cbt_enable(char *vdname, uint64_t size, uint32_t block)
+{
+	char path[MAXPATHLEN];
+	struct stat64 st;
+	vcb_hdr_t vh;
+
+	if ((block < 512) || (block % 512) != 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	vcb_path(path, vdname, 0);
+	if (stat64(path, &st) == 0) {
+		errno = EEXIST;
+		return (-1);
+	}
+
+	bzero(&vh, sizeof (vh));
+	vh.vh_block = block;
+	vh.vh_size = size;
+	vh.vh_gen = 1;
+	return (vcb_create(path, vdname, &vh));
+}
+
+/*
+ * Stop tracking a virtual disk and remove its bitmaps.
+ *
+ * Returns:
+ *	0: success, or tracking wasn't enabled
+ *	-1: failure, errno set
+ */
+int
+vdisk_cbt_disable(char *vdname)
+{
+	char path[MAXPATHLEN];
+	vcb_hdr_t vh;
+	uint64_t gen;
+	int fd;
+
+	vcb_path(path, vdname, 0);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return ((errno == ENOENT) ? 0 : -1);
+	if (vcb_read_hdr(fd, &vh) == -1)
+		vh.vh_gen = 1;
+	(void) close(fd);
+
+	if (unlink(path) == -1)
+		return (-1);
+	for (gen = 1; gen < vh.vh_gen; gen++) {
+		vcb_path(path, vdname, gen);
+		(void) unlink(path);
+	}
+	return (0);
+}
+
+/*
+ * End the current generation as snapshot snapname is taken.  The new
+ * bitmap replaces the current one atomically; a crash leaves either
+ * the old generation or the new one current.
+ *
+ * Returns:
+ *	0: success, or tracking isn't enabled
+ *	-1: failure, errno set
+ */
+int
+vdisk_cbt_snapshot(char *vdname, const char *snapname)
+{
+	char path[MAXPATHLEN];
+	char archive[MAXPATHLEN];
+	char tmp[MAXPATHLEN];
+	vcb_hdr_t vh;
+	int fd;
+
+	if (strlen(snapname) >= VCB_NAME_LEN) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	vcb_path(path, vdname, 0);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return ((errno == ENOENT) ? 0 : -1);
+	if (vcb_read_hdr(fd, &vh) == -1) {
+		(void) close(fd);
+		return (-1);
+	}
+	(void) close(fd);
+
+	/* Keep the generation ending, replacing a half-done attempt */
+	vcb_path(archive, vdname, vh.vh_gen);
+	if ((link(path, archive) == -1) && ((errno != EEXIST) ||
+	    (unlink(archive) == -1) || (link(path, archive) == -1)))
+		return (-1);
+
+	(void) snprintf(tmp, sizeof (tmp), "%s.tmp", path);
+	vh.vh_flags = 0;
+	vh.vh_gen++;
+	(void) strlcpy(vh.vh_base, snapname, VCB_NAME_LEN);
+	if (vcb_create(tmp, vdname, &vh) == -1)
+		return (-1);
+	if (rename(tmp, path) == -1) {
+		(void) unlink(tmp);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Undo vdisk_cbt_snapshot() of snapshot snapname, before anything was
+ * written to the disk: the generation it ended becomes current again.
+ *
+ * Returns:
+ *	0: success, or tracking isn't enabled
+ *	-1: failure, errno set
+ */
+int
+vdisk_cbt_unsnapshot(char *vdname, const char *snapname)
+{
+	char path[MAXPATHLEN];
+	char archive[MAXPATHLEN];
+	vcb_hdr_t vh;
+	int fd;
+
+	vcb_path(path, vdname, 0);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return ((errno == ENOENT) ? 0 : -1);
+	if (vcb_read_hdr(fd, &vh) == -1) {
+		(void) close(fd);
+		return (-1);
+	}
+	(void) close(fd);
+
+	/* Only the generation snapname started can be dropped */
+	if ((vh.vh_gen < 2) || (strncmp(vh.vh_base, snapname,
+	    VCB_NAME_LEN) != 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	vcb_path(archive, vdname, vh.vh_gen - 1);
+	return (rename(archive, path));
+}
+
+/*
+ * OR into map the bitmaps of the generations from gen up to, not
+ * including, the current one described by cur.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set; ENOENT if a generation's bitmap is gone
+ */
+static int
+vcb_merge(char *vdname, const vcb_hdr_t *cur, uint64_t gen, uchar_t *map)
+{
+	char path[MAXPATHLEN];
+	vcb_hdr_t vh;
+	uchar_t *old;
+	size_t i, len;
+
+	len = vcb_maplen(cur);
+	for (; gen < cur->vh_gen; gen++) {
+		vcb_path(path, vdname, gen);
+		if (vcb_load(path, &vh, &old) == -1)
+			return (-1);
+		if ((vh.vh_block != cur->vh_block) ||
+		    (vh.vh_size != cur->vh_size)) {
+			/* Can't line up the bits, call everything changed */
+			(void) memset(map, 0xff, len);
+		} else {
+			for (i = 0; i < len; i++)
+				map[i] |= old[i];
+		}
+		free(old);
+	}
+	return (0);
+}
+
+/*
+ * Find the generation that started at snapshot snapname.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set; ENOENT if no generation started there
+ */
+static int
+vcb_find_gen(char *vdname, const vcb_hdr_t *cur, const char *snapname,
+    uint64_t *genp)
+{
+	char path[MAXPATHLEN];
+	vcb_hdr_t vh;
+	uint64_t gen;
+	int fd, rc;
+
+	if (strcmp(cur->vh_base, snapname) == 0) {
+		*genp = cur->vh_gen;
+		return (0);
+	}
+	for (gen = cur->vh_gen - 1; gen > 0; gen--) {
+		vcb_path(path, vdname, gen);
+		fd = open(path, O_RDONLY);
+		if (fd == -1)
+			break;
+		rc = vcb_read_hdr(fd, &vh);
+		(void) close(fd);
+		if (rc == -1)
+			return (-1);
+		if (strcmp(vh.vh_base, snapname) == 0) {
+			*genp = gen;
+			return (0);
+		}
+	}
+	errno = ENOENT;
+	return (-1);
+}
+
+/*
+ * Find the blocks of a virtual disk changed since a snapshot or since a
+ * generation of its bitmap started.
+ *	vdname - path to the virtual disk
+ *	snapname - name of the snapshot, or NULL to use *genp
+ *	genp - generation to start at, 0 for the current one; returns
+ *	    the generation started at
+ *	curp - if non-NULL returns the current generation
+ *	extentsp - returns an array of sorted, non-adjacent extents to be
+ *	    freed with vdisk_free_allocation()
+ *	nextentsp - returns number of entries in extentsp
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set; ENOENT if tracking isn't enabled or the
+ *	    changes since the snapshot or generation weren't tracked
+ */
+int
+vdisk_cbt_get_changes(char *vdname, const char *snapname, uint64_t *genp,
+    uint64_t *curp, vd_extent_t **extentsp, int *nextentsp)
+{
+	char path[MAXPATHLEN];
+	vcb_hdr_t vh;
+	vd_extent_t *extents = NULL;
+	uchar_t *map;
+	uint64_t nblocks, b, start, gen;
+	int n = 0;
+	int max = 0;
+
+	vcb_path(path, vdname, 0);
+	if (vcb_load(path, &vh, &map) == -1)
+		return (-1);
+
+	if (snapname != NULL) {
+		if (vcb_find_gen(vdname, &vh, snapname, &gen) == -1)
+			goto fail;
+	} else {
+		gen = (*genp == 0) ? vh.vh_gen : *genp;
+		if (gen > vh.vh_gen) {
+			errno = ENOENT;
+			goto fail;
+		}
+	}
+	if (vcb_merge(vdname, &vh, gen, map) == -1)
+		goto fail;
+
+	/* Turn runs of set bits into extents */
+	nblocks = vcb_nblocks(&vh);
+	for (b = 0; b < nblocks; ) {
+		if (map[b / 8] == 0) {
+			b = (b / 8 + 1) * 8;
+			continue;
+		}
+		if ((map[b / 8] & (1 << (b % 8))) == 0) {
+			b++;
+			continue;
+		}
+		for (start = b; (b < nblocks) &&
+		    (map[b / 8] & (1 << (b % 8))); b++)
+			;
+		if (n == max) {
+			vd_extent_t *nx;
+
+			max = (max == 0) ? 64 : max * 2;
+			nx = realloc(extents, max * sizeof (vd_extent_t));
+			if (nx == NULL) {
+				errno = ENOMEM;
+				goto fail;
+			}
+			extents = nx;
+		}
+		extents[n].ve_offset = start * vh.vh_block;
+		extents[n].ve_length = MIN(b * vh.vh_block, vh.vh_size) -
+		    extents[n].ve_offset;
+		n++;
+	}
+
+	free(map);
+	*genp = gen;
+	if (curp != NULL)
+		*curp = vh.vh_gen;
+	*extentsp = extents;
+	*nextentsp = n;
+	return (0);
+
+fail:
+	free(map);
+	free(extents);
+	return (-1);
+}
+
+/*
+ * Account for a rollback to snapshot snapname: the blocks changed
+ * since it are changed again, back to what it holds.  If the changes
+ * since the snapshot weren't tracked every block counts as changed.
+ *
+ * Returns:
+ *	0: success, or tracking isn't enabled
+ *	-1: failure, errno set
+ */
+int
+vdisk_cbt_rollback(char *vdname, const char *snapname)
+{
+	char path[MAXPATHLEN];
+	vcb_hdr_t vh;
+	uchar_t *map;
+	uint64_t gen;
+	size_t len;
+	int fd, rc;
+
+	vcb_path(path, vdname, 0);
+	if (vcb_load(path, &vh, &map) == -1)
+		return ((errno == ENOENT) ? 0 : -1);
+	len = vcb_maplen(&vh);
+
+	if ((vcb_find_gen(vdname, &vh, snapname, &gen) == -1) ||
+	    (vcb_merge(vdname, &vh, gen, map) == -1))
+		(void) memset(map, 0xff, len);
+
+	fd = open(path, O_WRONLY);
+	if (fd == -1) {
+		free(map);
+		return (-1);
+	}
+	rc = vcb_pwrite(fd, map, len, VCB_MAP_OFF);
+	if ((rc == 0) && (fsync(fd) == -1))
+		rc = -1;
+	(void) close(fd);
+	free(map);
+	return (rc);
+}
+
+/*
+ * Set the name of the snapshot generation gen started at, gen 0 being
+ * the current one.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set
+ */
+static int
+vcb_set_base(char *vdname, uint64_t gen, const char *snapname)
+{
+	char path[MAXPATHLEN];
+	vcb_hdr_t vh;
+	int fd, rc;
+
+	vcb_path(path, vdname, gen);
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		return (-1);
+	rc = vcb_read_hdr(fd, &vh);
+	if (rc == 0) {
+		(void) strlcpy(vh.vh_base, snapname, VCB_NAME_LEN);
+		rc = vcb_write_hdr(fd, &vh);
+	}
+	if ((rc == 0) && (fsync(fd) == -1))
+		rc = -1;
+	(void) close(fd);
+	return (rc);
+}
+
+/*
+ * Follow snapshot oldsnap being renamed newsnap.  The generation that
+ * started at oldsnap is renamed; one left from an earlier snapshot named
+ * newsnap, since destroyed, first loses its name so it can't be taken
+ * for the renamed one.
+ *
+ * Returns:
+ *	0: success, or tracking isn't enabled
+ *	-1: failure, errno set
+ */
+int
+vdisk_cbt_rename(char *vdname, const char *oldsnap, const char *newsnap)
+{
+	char path[MAXPATHLEN];
+	vcb_hdr_t cur, vh;
+	uint64_t gen, found;
+	int fd, rc;
+
+	if (strlen(newsnap) >= VCB_NAME_LEN) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	vcb_path(path, vdname, 0);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return ((errno == ENOENT) ? 0 : -1);
+	rc = vcb_read_hdr(fd, &cur);
+	(void) close(fd);
+	if (rc == -1)
+		return (-1);
+
+	/* Tracking may have started after the snapshot was taken */
+	if (vcb_find_gen(vdname, &cur, oldsnap, &found) == -1)
+		return ((errno == ENOENT) ? 0 : -1);
+
+	for (gen = cur.vh_gen; gen > 0; gen--) {
+		if (gen == cur.vh_gen) {
+			vh = cur;
+		} else {
+			vcb_path(path, vdname, gen);
+			fd = open(path, O_RDONLY);
+			if (fd == -1)
+				break;
+			rc = vcb_read_hdr(fd, &vh);
+			(void) close(fd);
+			if (rc == -1)
+				return (-1);
+		}
+		if ((strcmp(vh.vh_base, newsnap) == 0) &&
+		    (vcb_set_base(vdname, (gen == cur.vh_gen) ? 0 : gen,
+		    "") == -1))
+			return (-1);
+	}
+
+	return (vcb_set_base(vdname, (found == cur.vh_gen) ? 0 : found,
+	    newsnap));
+}
@@ -0,0 +1,449 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+/*
+ * In place compaction of sparse VDI images.
+ *
+ * A sparse VDI image keeps its blocks packed after the block map: the
+ * map entry of a virtual block holds the slot its data is in, and VBox
+ * appends a new block at slot cBlocksAllocated.  Blocks a guest zeroed
+ * keep their slots, so the file never shrinks.  Compaction:
+ *
+ *	1. reads every slot in use and turns the map entry of a block
+ *	   that is all zeroes into a zero entry, which reads as zeroes
+ *	   whatever the images below hold, freeing its slot; slots no map
+ *	   entry refers to are free as well;
+ *	2. moves the blocks in the last slots into the free slots nearest
+ *	   the start of the file;
+ *	3. lowers cBlocksAllocated and truncates the file.
+ *
+ * Every step leaves a valid image behind: a block is copied and synced
+ * before its map entry points at the copy, and cBlocksAllocated only
+ * drops once no slot at or above it is used, so VBox never appends
+ * over live data.  A crash at worst leaves space unreclaimed.  Step 1
+ * reads the whole image, so the slot it reached is saved beside the
+ * image every VDC_SAVE_SLOTS slots; the next run picks up from there.
+ * Steps 2 and 3 work from the block map alone and just run again.
+ *
+ * The image must not be open anywhere else.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#include "vdisk.h"
+
+
+#define	VDC_PRE_HEADER_SIZE	72
+#define	VDC_HEADER_SIZE		320
+#define	VDC_SIGNATURE		0xbeda107fU
+#define	VDC_TYPE_FIXED		2
+#define	VDC_BLOCK_FREE		0xffffffffU
+#define	VDC_BLOCK_ZERO		0xfffffffeU
+
+/* header fields, from the end of the pre-header */
+#define	VDC_H_TYPE		4
+#define	VDC_H_OFF_BLOCKS	268
+#define	VDC_H_OFF_DATA		272
+#define	VDC_H_CB_BLOCK		304
+#define	VDC_H_CB_EXTRA		308
+#define	VDC_H_BLOCKS		312
+#define	VDC_H_ALLOCATED		316
+
+/* appended to the image name for the slot the zero scan reached */
+#define	VDC_STATE_SUFFIX	".compact"
+#define	VDC_SAVE_SLOTS		256
+
+typedef struct vdc_image {
+	int		vc_fd;
+	uchar_t		vc_hdr[VDC_PRE_HEADER_SIZE + VDC_HEADER_SIZE];
+	uint64_t	vc_off_blocks;	/* block map */
+	uint64_t	vc_off_data;	/* slot 0 */
+	uint32_t	vc_cb_block;
+	uint32_t	vc_cb_extra;
+	uint64_t	vc_slot_size;
+	uint32_t	vc_nblocks;
+	uint32_t	*vc_map;	/* block -> slot, host order */
+	uint64_t	vc_nslots;
+	uint32_t	*vc_owner;	/* slot -> block or VDC_BLOCK_FREE */
+	char		*vc_buf;	/* one slot */
+} vdc_image_t;
+
+
+static uint32_t
+vdc_le32(const uchar_t *p)
+{
+	return ((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static void
+vdc_put_le32(uchar_t *p, uint32_t val)
+{
+	p[0] = val & 0xff;
+	p[1] = (val >> 8) & 0xff;
+	p[2] = (val >> 16) & 0xff;
+	p[3] = (val >> 24) & 0xff;
+}
+
+static int
+vdc_pread(int fd, void *buf, size_t len, uint64_t off)
+{
+	ssize_t n;
+	size_t done = 0;
+
+	while (done < len) {
+		n = pread(fd, (char *)buf + done, len - done,
+		    (off_t)(off + done));
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		if (n == 0) {
+			errno = EIO;
+			return (-1);
+		}
+		done += n;
+	}
+	return (0);
+}
+
+static int
+vdc_pwrite(int fd, const void *buf, size_t len, uint64_t off)
+{
+	ssize_t n;
+	size_t done = 0;
+
+	while (done < len) {
+		n = pwrite(fd, (const char *)buf + done, len - done,
+		    (off_t)(off + done));
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		done += n;
+	}
+	return (0);
+}
+
+/*
+ * True if the buffer is all zeroes.  The words are ORed together a
+ * line at a time without a branch, which compilers turn into vector
+ * instructions, and checked once per line.
+ */
+static boolean_t
+vdc_is_zero(const char *data, size_t len)
+{
+	const uint64_t *p = (const uint64_t *)data;
+	uint64_t acc;
+	size_t i, n = len / sizeof (uint64_t);
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		acc = p[i] | p[i + 1] | p[i + 2] | p[i + 3] |
+		    p[i + 4] | p[i + 5] | p[i + 6] | p[i + 7];
+		if (acc != 0)
+			return (B_FALSE);
+	}
+	for (; i < n; i++) {
+		if (p[i] != 0)
+			return (B_FALSE);
+	}
+	for (i *= sizeof (uint64_t); i < len; i++) {
+		if (data[i] != 0)
+			return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+/*
+ * Read the header and block map and work out which block every slot
+ * holds.
+ */
+static int
+vdc_load(vdc_image_t *vc)
+{
+	const uchar_t *h = vc->vc_hdr + VDC_PRE_HEADER_SIZE;
+	struct stat64 st;
+	uint64_t slot;
+	uint32_t b;
+
+	if (vdc_pread(vc->vc_fd, vc->vc_hdr, sizeof (vc->vc_hdr), 0) == -1)
+		return (-1);
+	if ((vdc_le32(vc->vc_hdr + 64) != VDC_SIGNATURE) ||
+	    ((vdc_le32(vc->vc_hdr + 68) >> 16) != 1) ||
+	    (vdc_le32(h + VDC_H_TYPE) == VDC_TYPE_FIXED)) {
+		errno = ENOTSUP;
+		return (-1);
+	}
+
+	vc->vc_off_blocks = vdc_le32(h + VDC_H_OFF_BLOCKS);
+	vc->vc_off_data = vdc_le32(h + VDC_H_OFF_DATA);
+	vc->vc_cb_block = vdc_le32(h + VDC_H_CB_BLOCK);
+	vc->vc_cb_extra = vdc_le32(h + VDC_H_CB_EXTRA);
+	vc->vc_nblocks = vdc_le32(h + VDC_H_BLOCKS);
+	vc->vc_slot_size = (uint64_t)vc->vc_cb_block + vc->vc_cb_extra;
+	if ((vc->vc_cb_block == 0) || (vc->vc_nblocks == 0) ||
+	    (fstat64(vc->vc_fd, &st) == -1) ||
+	    ((uint64_t)st.st_size < vc->vc_off_data)) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	/* Slots past cBlocksAllocated may be left over from a crash */
+	vc->vc_nslots = MAX(vdc_le32(h + VDC_H_ALLOCATED),
+	    (st.st_size - vc->vc_off_data) / vc->vc_slot_size);
+
+	vc->vc_map = malloc(vc->vc_nblocks * sizeof (uint32_t));
+	vc->vc_owner = malloc(MAX(vc->vc_nslots, 1) * sizeof (uint32_t));
+	vc->vc_buf = malloc(vc->vc_slot_size);
+	if ((vc->vc_map == NULL) || (vc->vc_owner == NULL) ||
+	    (vc->vc_buf == NULL)) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	if (vdc_pread(vc->vc_fd, vc->vc_map, vc->vc_nblocks *
+	    sizeof (uint32_t), vc->vc_off_blocks) == -1)
+		return (-1);
+
+	for (slot = 0; slot < vc->vc_nslots; slot++)
+		vc->vc_owner[slot] = VDC_BLOCK_FREE;
+	for (b = 0; b < vc->vc_nblocks; b++) {
+		vc->vc_map[b] = vdc_le32((uchar_t *)&vc->vc_map[b]);
+		if ((vc->vc_map[b] == VDC_BLOCK_FREE) ||
+		    (vc->vc_map[b] == VDC_BLOCK_ZERO))
+			continue;
+		if ((vc->vc_map[b] >= vc->vc_nslots) ||
+		    (vc->vc_owner[vc->vc_map[b]] != VDC_BLOCK_FREE)) {
+			errno = EINVAL;
+			return (-1);
+		}
+		vc->vc_owner[vc->vc_map[b]] = b;
+	}
+	return (0);
+}
+
+/*
+ * Point the map entry of a block somewhere else.
+ */
+static int
+vdc_set_entry(vdc_image_t *vc, uint32_t b, uint32_t entry)
+{
+	uchar_t le[sizeof (uint32_t)];
+
+	vdc_put_le32(le, entry);
+	if (vdc_pwrite(vc->vc_fd, le, sizeof (le),
+	    vc->vc_off_blocks + (uint64_t)b * sizeof (uint32_t)) == -1)
+		return (-1);
+	vc->vc_map[b] = entry;
+	return (0);
+}
+
+static void
+vdc_save(const char *state, uint64_t slot, uint64_t nslots)
+{
+	FILE *fp;
+
+	if ((fp = fopen(state, "w")) == NULL)
+		return;
+	(void) fprintf(fp, "%llu %llu\n", (unsigned long long)slot,
+	    (unsigned long long)nslots);
+	(void) fclose(fp);
+}
+
+static uint64_t
+vdc_resume(const char *state, uint64_t nslots)
+{
+	unsigned long long slot, n;
+	FILE *fp;
+
+	if ((fp = fopen(state, "r")) == NULL)
+		return (0);
+	if ((fscanf(fp, "%llu %llu", &slot, &n) != 2) || (n != nslots) ||
+	    (slot > nslots))
+		slot = 0;
+	(void) fclose(fp);
+	return (slot);
+}
+
+/*
+ * Step 1: free the slots of the blocks that are all zeroes.
+ */
+static int
+vdc_zero_scan(vdc_image_t *vc, const char *state, uint64_t *donep,
+    uint64_t total, vd_copy_progress_t *progress, void *arg)
+{
+	uint64_t slot;
+	uint32_t b;
+
+	for (slot = vdc_resume(state, vc->vc_nslots); slot < vc->vc_nslots;
+	    slot++) {
+		if ((b = vc->vc_owner[slot]) == VDC_BLOCK_FREE)
+			continue;
+		if (vdc_pread(vc->vc_fd, vc->vc_buf, vc->vc_cb_block,
+		    vc->vc_off_data + slot * vc->vc_slot_size +
+		    vc->vc_cb_extra) == -1)
+			return (-1);
+		if (vdc_is_zero(vc->vc_buf, vc->vc_cb_block)) {
+			if (vdc_set_entry(vc, b, VDC_BLOCK_ZERO) == -1)
+				return (-1);
+			vc->vc_owner[slot] = VDC_BLOCK_FREE;
+		}
+		*donep += vc->vc_cb_block;
+		if (progress != NULL)
+			progress(*donep, total, arg);
+
+		/* The map entries go out before the position past them */
+		if ((slot + 1) % VDC_SAVE_SLOTS == 0) {
+			if (fdatasync(vc->vc_fd) == -1)
+				return (-1);
+			vdc_save(state, slot + 1, vc->vc_nslots);
+		}
+	}
+	if (fdatasync(vc->vc_fd) == -1)
+		return (-1);
+	vdc_save(state, vc->vc_nslots, vc->vc_nslots);
+	return (0);
+}
+
+/*
+ * Step 2: move the blocks in the last slots into the first free ones.
+ * Returns the slots in use, all below it, or -1.
+ */
+static int64_t
+vdc_pack(vdc_image_t *vc, uint64_t *donep, uint64_t total,
+    vd_copy_progress_t *progress, void *arg)
+{
+	uint64_t hole = 0, tail = vc->vc_nslots;
+	uint32_t b;
+
+	for (;;) {
+		while ((hole < tail) && (vc->vc_owner[hole] != VDC_BLOCK_FREE))
+			hole++;
+		while ((tail > hole) &&
+		    (vc->vc_owner[tail - 1] == VDC_BLOCK_FREE))
+			tail--;
+		if (hole >= tail)
+			break;
+
+		/* Data first, then the entry pointing at it */
+		b = vc->vc_owner[tail - 1];
+		if ((vdc_pread(vc->vc_fd, vc->vc_buf, vc->vc_slot_size,
+		    vc->vc_off_data + (tail - 1) * vc->vc_slot_size) == -1) ||
+		    (vdc_pwrite(vc->vc_fd, vc->vc_buf, vc->vc_slot_size,
+		    vc->vc_off_data + hole * vc->vc_slot_size) == -1) ||
+		    (fdatasync(vc->vc_fd) == -1) ||
+		    (vdc_set_entry(vc, b, (uint32_t)hole) == -1) ||
+		    (fdatasync(vc->vc_fd) == -1))
+			return (-1);
+		vc->vc_owner[hole] = b;
+		vc->vc_owner[tail - 1] = VDC_BLOCK_FREE;
+
+		*donep += vc->vc_cb_block;
+		if (progress != NULL)
+			progress(*donep, total, arg);
+	}
+	return ((int64_t)tail);
+}
+
+/*
+ * Compact a sparse VDI image in place; see the top of this file.
+ *	filename - the image file, not open anywhere else
+ *	freedp - returns the bytes the file shrank by
+ *	progress - if non-null called with the bytes done so far
+ *	arg - passed to progress
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set; ENOTSUP if the image isn't a sparse VDI
+ */
+int
+vdisk_compact(const char *filename, uint64_t *freedp,
+    vd_copy_progress_t *progress, void *arg)
+{
+	char state[MAXPATHLEN];
+	vdc_image_t vc;
+	struct stat64 st;
+	uint64_t done = 0, total, slot, old_size;
+	int64_t used;
+	int err;
+	int rc = -1;
+
+	*freedp = 0;
+	if (snprintf(state, sizeof (state), "%s%s", filename,
+	    VDC_STATE_SUFFIX) >= sizeof (state)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	bzero(&vc, sizeof (vc));
+	if ((vc.vc_fd = open(filename, O_RDWR)) == -1)
+		return (-1);
+	if ((fstat64(vc.vc_fd, &st) == -1) || (vdc_load(&vc) == -1))
+		goto out;
+	old_size = st.st_size;
+
+	/* Every slot in use is read, and some of them moved */
+	total = 0;
+	for (slot = 0; slot < vc.vc_nslots; slot++) {
+		if (vc.vc_owner[slot] != VDC_BLOCK_FREE)
+			total += 2 * (uint64_t)vc.vc_cb_block;
+	}
+
+	if ((vdc_zero_scan(&vc, state, &done, total, progress, arg) == -1) ||
+	    ((used = vdc_pack(&vc, &done, total, progress, arg)) == -1))
+		goto out;
+
+	/* Step 3: nothing at or above slot "used" is live any more */
+	vdc_put_le32(vc.vc_hdr + VDC_PRE_HEADER_SIZE + VDC_H_ALLOCATED,
+	    (uint32_t)used);
+	if ((vdc_pwrite(vc.vc_fd, vc.vc_hdr + VDC_PRE_HEADER_SIZE +
+	    VDC_H_ALLOCATED, sizeof (uint32_t), VDC_PRE_HEADER_SIZE +
+	    VDC_H_ALLOCATED) == -1) || (fsync(vc.vc_fd) == -1) ||
+	    (ftruncate(vc.vc_fd, (off_t)(vc.vc_off_data +
+	    used * vc.vc_slot_size)) == -1) || (fsync(vc.vc_fd) == -1))
+		goto out;
+
+	if (progress != NULL)
+		progress(total, total, arg);
+	if (old_size > vc.vc_off_data + used * vc.vc_slot_size)
+		*freedp = old_size - (vc.vc_off_data + used * vc.vc_slot_size);
+	(void) unlink(state);
+	rc = 0;
+out:
+	err = errno;
+	(void) close(vc.vc_fd);
+	free(vc.vc_map);
+	free(vc.vc_owner);
+	free(vc.vc_buf);
+	errno = err;
+	return (rc);
+}
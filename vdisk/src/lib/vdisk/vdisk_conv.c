@@ -0,0 +1,953 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+/*
+ * Conversion between fixed size image formats without copying the data.
+ *
+ * A raw image, a fixed VHD and a fixed VDI all keep the disk contents as
+ * one linear run of bytes:
+ *	raw	the data, nothing else
+ *	VHD	the data followed by a 512 byte footer
+ *	VDI	a header and an identity block map, then the data at offData
+ * Converting between them only needs new metadata around the same data.
+ *
+ * Where the data starts at offset 0 in both formats (raw and VHD) the
+ * image file is converted in place: the footer is added or dropped and
+ * the file gets a second name.  Going to or from a VDI the data moves, so
+ * a new file is written with vdisk_copy_range(), which clones the blocks
+ * where the file system allows and copies only the allocated data
+ * otherwise.
+ *
+ * The steps are ordered so the store always names a complete image of
+ * the format it records:
+ *	1. the new image is made complete under its new name
+ *	2. the store is rewritten, vdisk_write_tree() renames a temporary
+ *	   file over the old store
+ *	3. the old name is removed and, converting a VHD to raw in place,
+ *	   the footer is cut off
+ * A crash before step 2 leaves the old vdisk as it was, apart from an
+ * unused new file or, converting raw to VHD in place, a footer past the
+ * end of the raw data.  A crash after step 2 leaves at most a footer past
+ * the end of the new raw image.  As the raw name and the VHD name are
+ * links to one file, the raw image then reads 512 bytes larger, so
+ * vdisk_fixed_recover() cuts such a footer off, and drops the VHD name,
+ * when the vdisk is next loaded.
+ *
+ * The same layouts let a new fixed image be created without writing its
+ * data: the data is allocated with posix_fallocate(), which on most file
+ * systems only reserves blocks that read back as zeroes, and then just
+ * the metadata is written.  A fixed VMDK is a descriptor naming one flat
+ * extent, which is created the same way.  Where the file system can't
+ * allocate (ZFS for one) the data is written as large aligned runs of
+ * zeroes instead, as the VBox backends would.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <libintl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <libxml/parser.h>
+
+#include "VBox/VBoxHDD.h"
+#include "iprt/uuid.h"
+
+#include "vdisk.h"
+
+
+#define	VDV_SECTOR_SIZE		512
+
+/* VHD footer, big endian */
+#define	VDV_VHD_FOOTER_SIZE	512
+#define	VDV_VHD_COOKIE		"conectix"
+#define	VDV_VHD_FEATURES	0x00000002
+#define	VDV_VHD_VERSION		0x00010000
+#define	VDV_VHD_CREATOR_APP	"vbox"
+#define	VDV_VHD_CREATOR_VER	0x00010000
+#define	VDV_VHD_CREATOR_OS	"Wi2k"
+#define	VDV_VHD_TYPE_FIXED	2
+#define	VDV_VHD_EPOCH		946684800	/* 2000-01-01 00:00 UTC */
+#define	VDV_VHD_OFF_COOKIE	0
+#define	VDV_VHD_OFF_FEATURES	8
+#define	VDV_VHD_OFF_VERSION	12
+#define	VDV_VHD_OFF_DATAOFF	16
+#define	VDV_VHD_OFF_TIME	24
+#define	VDV_VHD_OFF_APP		28
+#define	VDV_VHD_OFF_APPVER	32
+#define	VDV_VHD_OFF_OS		36
+#define	VDV_VHD_OFF_ORIGSIZE	40
+#define	VDV_VHD_OFF_SIZE	48
+#define	VDV_VHD_OFF_GEOMETRY	56
+#define	VDV_VHD_OFF_TYPE	60
+#define	VDV_VHD_OFF_CHECKSUM	64
+#define	VDV_VHD_OFF_UUID	68
+
+/* VDI 1.1 pre-header and header, little endian */
+#define	VDV_VDI_INFO		"<<< Sun xVM VirtualBox Disk Image >>>\n"
+#define	VDV_VDI_SIGNATURE	0xbeda107f
+#define	VDV_VDI_VERSION		0x00010001
+#define	VDV_VDI_HEADER_SIZE	400
+#define	VDV_VDI_TYPE_FIXED	2
+#define	VDV_VDI_BLOCK_SIZE	(1024 * 1024)
+#define	VDV_VDI_MAP_OFF		512
+#define	VDV_VDI_DATA_ALIGN	(1024 * 1024)	/* lets the data be cloned */
+#define	VDV_VDI_OFF_SIGNATURE	64
+#define	VDV_VDI_OFF_VERSION	68
+#define	VDV_VDI_OFF_HDRSIZE	72
+#define	VDV_VDI_OFF_TYPE	76
+#define	VDV_VDI_OFF_COMMENT	84
+#define	VDV_VDI_COMMENT_SIZE	256
+#define	VDV_VDI_OFF_BLOCKS	340
+#define	VDV_VDI_OFF_DATA	344
+#define	VDV_VDI_OFF_GEOMETRY	348
+#define	VDV_VDI_OFF_DISKSIZE	368
+#define	VDV_VDI_OFF_BLOCKSIZE	376
+#define	VDV_VDI_OFF_EXTRA	380
+#define	VDV_VDI_OFF_NBLOCKS	384
+#define	VDV_VDI_OFF_NALLOC	388
+#define	VDV_VDI_OFF_UUID	392
+#define	VDV_VDI_OFF_MODUUID	408
+#define	VDV_VDI_PREFIX_SIZE	(VDV_VDI_OFF_HDRSIZE + VDV_VDI_HEADER_SIZE)
+
+/* VMDK monolithicFlat descriptor */
+#define	VDV_VMDK_FLAT_SUFFIX	"-flat"
+#define	VDV_VMDK_HW_VERSION	4
+#define	VDV_VMDK_MAX_DESC	4096
+
+/* size of the zero runs written where space can't be allocated */
+#define	VDV_ZERO_CHUNK		(1024 * 1024)
+
+/* Where the data lives in a fixed image */
+typedef struct vdv_layout {
+	uint64_t	vl_off;		/* start of the data */
+	uint64_t	vl_size;	/* disk size */
+	uint64_t	vl_file_size;	/* size of a complete image file */
+	uint64_t	vl_blocks;	/* VDI blocks */
+} vdv_layout_t;
+
+static uint32_t
+vdv_get_be32(const uchar_t *p)
+{
+	return (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	    ((uint32_t)p[2] << 8) | p[3]);
+}
+
+static uint64_t
+vdv_get_be64(const uchar_t *p)
+{
+	return (((uint64_t)vdv_get_be32(p) << 32) | vdv_get_be32(p + 4));
+}
+
+static void
+vdv_put_be32(uchar_t *p, uint32_t val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+static void
+vdv_put_be64(uchar_t *p, uint64_t val)
+{
+	vdv_put_be32(p, val >> 32);
+	vdv_put_be32(p + 4, (uint32_t)val);
+}
+
+static uint32_t
+vdv_get_le32(const uchar_t *p)
+{
+	return (((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) |
+	    ((uint32_t)p[1] << 8) | p[0]);
+}
+
+static uint64_t
+vdv_get_le64(const uchar_t *p)
+{
+	return (((uint64_t)vdv_get_le32(p + 4) << 32) | vdv_get_le32(p));
+}
+
+static void
+vdv_put_le32(uchar_t *p, uint32_t val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+	p[2] = val >> 16;
+	p[3] = val >> 24;
+}
+
+static void
+vdv_put_le64(uchar_t *p, uint64_t val)
+{
+	vdv_put_le32(p, (uint32_t)val);
+	vdv_put_le32(p + 4, val >> 32);
+}
+
+static uint32_t
+vdv_vhd_checksum(const uchar_t *footer)
+{
+	uint32_t sum = 0;
+	int i;
+
+	for (i = 0; i < VDV_VHD_FOOTER_SIZE; i++) {
+		if ((i >= VDV_VHD_OFF_CHECKSUM) &&
+		    (i < VDV_VHD_OFF_CHECKSUM + 4))
+			continue;
+		sum += footer[i];
+	}
+	return (~sum);
+}
+
+/*
+ * CHS geometry of a disk as the VHD specification computes it.
+ */
+static void
+vdv_geometry(uint64_t size, uint32_t *cyls, uint32_t *heads, uint32_t *secs)
+{
+	uint64_t total = size / VDV_SECTOR_SIZE;
+	uint64_t cyl_heads;
+
+	if (total > 65535ULL * 16 * 255)
+		total = 65535ULL * 16 * 255;
+
+	if (total >= 65535ULL * 16 * 63) {
+		*secs = 255;
+		*heads = 16;
+		cyl_heads = total / *secs;
+	} else {
+		*secs = 17;
+		cyl_heads = total / *secs;
+		*heads = (uint32_t)((cyl_heads + 1023) / 1024);
+		if (*heads < 4)
+			*heads = 4;
+		if ((cyl_heads >= (*heads * 1024ULL)) || (*heads > 16)) {
+			*secs = 31;
+			*heads = 16;
+			cyl_heads = total / *secs;
+		}
+		if (cyl_heads >= (*heads * 1024ULL)) {
+			*secs = 63;
+			*heads = 16;
+			cyl_heads = total / *secs;
+		}
+	}
+	*cyls = (uint32_t)(cyl_heads / *heads);
+}
+
+static void
+vdv_vhd_footer(uchar_t *footer, uint64_t size)
+{
+	uint32_t cyls, heads, secs;
+	RTUUID uuid;
+
+	bzero(footer, VDV_VHD_FOOTER_SIZE);
+	bcopy(VDV_VHD_COOKIE, footer + VDV_VHD_OFF_COOKIE, 8);
+	vdv_put_be32(footer + VDV_VHD_OFF_FEATURES, VDV_VHD_FEATURES);
+	vdv_put_be32(footer + VDV_VHD_OFF_VERSION, VDV_VHD_VERSION);
+	vdv_put_be64(footer + VDV_VHD_OFF_DATAOFF, ~0ULL);
+	vdv_put_be32(footer + VDV_VHD_OFF_TIME,
+	    (uint32_t)(time(NULL) - VDV_VHD_EPOCH));
+	bcopy(VDV_VHD_CREATOR_APP, footer + VDV_VHD_OFF_APP, 4);
+	vdv_put_be32(footer + VDV_VHD_OFF_APPVER, VDV_VHD_CREATOR_VER);
+	bcopy(VDV_VHD_CREATOR_OS, footer + VDV_VHD_OFF_OS, 4);
+	vdv_put_be64(footer + VDV_VHD_OFF_ORIGSIZE, size);
+	vdv_put_be64(footer + VDV_VHD_OFF_SIZE, size);
+	vdv_geometry(size, &cyls, &heads, &secs);
+	footer[VDV_VHD_OFF_GEOMETRY] = cyls >> 8;
+	footer[VDV_VHD_OFF_GEOMETRY + 1] = cyls;
+	footer[VDV_VHD_OFF_GEOMETRY + 2] = heads;
+	footer[VDV_VHD_OFF_GEOMETRY + 3] = secs;
+	vdv_put_be32(footer + VDV_VHD_OFF_TYPE, VDV_VHD_TYPE_FIXED);
+	(void) RTUuidCreate(&uuid);
+	bcopy(&uuid, footer + VDV_VHD_OFF_UUID, sizeof (uuid));
+	vdv_put_be32(footer + VDV_VHD_OFF_CHECKSUM, vdv_vhd_checksum(footer));
+}
+
+/*
+ * Build the pre-header, header and identity block map of a fixed VDI.
+ * The returned buffer is vl_off bytes long and has to be freed.
+ */
+static uchar_t *
+vdv_vdi_header(vdv_layout_t *vl)
+{
+	uint32_t cyls, heads, secs;
+	uchar_t *hdr;
+	uint64_t i;
+	RTUUID uuid;
+
+	hdr = calloc(1, vl->vl_off);
+	if (hdr == NULL) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	(void) strlcpy((char *)hdr, VDV_VDI_INFO, VDV_VDI_OFF_SIGNATURE);
+	vdv_put_le32(hdr + VDV_VDI_OFF_SIGNATURE, VDV_VDI_SIGNATURE);
+	vdv_put_le32(hdr + VDV_VDI_OFF_VERSION, VDV_VDI_VERSION);
+	vdv_put_le32(hdr + VDV_VDI_OFF_HDRSIZE, VDV_VDI_HEADER_SIZE);
+	vdv_put_le32(hdr + VDV_VDI_OFF_TYPE, VDV_VDI_TYPE_FIXED);
+	vdv_put_le32(hdr + VDV_VDI_OFF_BLOCKS, VDV_VDI_MAP_OFF);
+	vdv_put_le32(hdr + VDV_VDI_OFF_DATA, (uint32_t)vl->vl_off);
+	vdv_geometry(vl->vl_size, &cyls, &heads, &secs);
+	vdv_put_le32(hdr + VDV_VDI_OFF_GEOMETRY, MIN(cyls, 16383));
+	vdv_put_le32(hdr + VDV_VDI_OFF_GEOMETRY + 4, heads);
+	vdv_put_le32(hdr + VDV_VDI_OFF_GEOMETRY + 8, MIN(secs, 63));
+	vdv_put_le32(hdr + VDV_VDI_OFF_GEOMETRY + 12, VDV_SECTOR_SIZE);
+	vdv_put_le64(hdr + VDV_VDI_OFF_DISKSIZE, vl->vl_size);
+	vdv_put_le32(hdr + VDV_VDI_OFF_BLOCKSIZE, VDV_VDI_BLOCK_SIZE);
+	vdv_put_le32(hdr + VDV_VDI_OFF_NBLOCKS, (uint32_t)vl->vl_blocks);
+	vdv_put_le32(hdr + VDV_VDI_OFF_NALLOC, (uint32_t)vl->vl_blocks);
+	(void) RTUuidCreate(&uuid);
+	bcopy(&uuid, hdr + VDV_VDI_OFF_UUID, sizeof (uuid));
+	(void) RTUuidCreate(&uuid);
+	bcopy(&uuid, hdr + VDV_VDI_OFF_MODUUID, sizeof (uuid));
+
+	/* Block i of the disk is block i of the data */
+	for (i = 0; i < vl->vl_blocks; i++)
+		vdv_put_le32(hdr + VDV_VDI_MAP_OFF + i * 4, (uint32_t)i);
+
+	return (hdr);
+}
+
+/*
+ * Work out the layout a fixed image of the given format and size has.
+ *
+ * Returns:
+ *	0: success
+ *	-1: the size can't be stored in the format
+ */
+static int
+vdv_new_layout(const char *pszformat, uint64_t size, vdv_layout_t *vl)
+{
+	bzero(vl, sizeof (*vl));
+	vl->vl_size = size;
+	if ((size == 0) || (size % VDV_SECTOR_SIZE) != 0)
+		return (-1);
+
+	if (strcasecmp(pszformat, "RAW") == 0) {
+		vl->vl_file_size = size;
+	} else if (strcasecmp(pszformat, "VHD") == 0) {
+		vl->vl_file_size = size + VDV_VHD_FOOTER_SIZE;
+	} else if (strcasecmp(pszformat, "VDI") == 0) {
+		vl->vl_blocks = (size + VDV_VDI_BLOCK_SIZE - 1) /
+		    VDV_VDI_BLOCK_SIZE;
+		if (vl->vl_blocks > 0xffffffffULL / 4)
+			return (-1);
+		vl->vl_off = VDV_VDI_MAP_OFF + vl->vl_blocks * 4;
+		vl->vl_off = (vl->vl_off + VDV_VDI_DATA_ALIGN - 1) &
+		    ~((uint64_t)VDV_VDI_DATA_ALIGN - 1);
+		vl->vl_file_size = vl->vl_off +
+		    vl->vl_blocks * VDV_VDI_BLOCK_SIZE;
+	} else {
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Find the layout of an existing image, checking the data is linear.
+ *
+ * Returns:
+ *	0: success
+ *	-1: not a fixed image whose data can be reused
+ */
+static int
+vdv_read_layout(int fd, const char *pszformat, uint64_t file_size,
+    vdv_layout_t *vl)
+{
+	uchar_t buf[VDV_VDI_PREFIX_SIZE];
+	uchar_t footer[VDV_VHD_FOOTER_SIZE];
+	uchar_t *map = NULL;
+	uint64_t size, blocks, off, i;
+	int rc = -1;
+
+	if (strcasecmp(pszformat, "RAW") == 0)
+		return (vdv_new_layout(pszformat, file_size, vl));
+
+	if (strcasecmp(pszformat, "VHD") == 0) {
+		if ((file_size < VDV_VHD_FOOTER_SIZE) ||
+		    (pread(fd, footer, VDV_VHD_FOOTER_SIZE,
+		    file_size - VDV_VHD_FOOTER_SIZE) != VDV_VHD_FOOTER_SIZE))
+			return (-1);
+		if ((bcmp(footer, VDV_VHD_COOKIE, 8) != 0) ||
+		    (vdv_get_be32(footer + VDV_VHD_OFF_TYPE) !=
+		    VDV_VHD_TYPE_FIXED) ||
+		    (vdv_get_be32(footer + VDV_VHD_OFF_CHECKSUM) !=
+		    vdv_vhd_checksum(footer)))
+			return (-1);
+		size = vdv_get_be64(footer + VDV_VHD_OFF_SIZE);
+		if (size + VDV_VHD_FOOTER_SIZE != file_size)
+			return (-1);
+		return (vdv_new_layout(pszformat, size, vl));
+	}
+
+	if (strcasecmp(pszformat, "VDI") != 0)
+		return (-1);
+
+	if (pread(fd, buf, VDV_VDI_PREFIX_SIZE, 0) != VDV_VDI_PREFIX_SIZE)
+		return (-1);
+	if ((vdv_get_le32(buf + VDV_VDI_OFF_SIGNATURE) != VDV_VDI_SIGNATURE) ||
+	    ((vdv_get_le32(buf + VDV_VDI_OFF_VERSION) >> 16) != 1) ||
+	    (vdv_get_le32(buf + VDV_VDI_OFF_HDRSIZE) < VDV_VDI_HEADER_SIZE) ||
+	    (vdv_get_le32(buf + VDV_VDI_OFF_TYPE) != VDV_VDI_TYPE_FIXED) ||
+	    (vdv_get_le32(buf + VDV_VDI_OFF_BLOCKSIZE) != VDV_VDI_BLOCK_SIZE) ||
+	    (vdv_get_le32(buf + VDV_VDI_OFF_EXTRA) != 0))
+		return (-1);
+
+	size = vdv_get_le64(buf + VDV_VDI_OFF_DISKSIZE);
+	blocks = vdv_get_le32(buf + VDV_VDI_OFF_NBLOCKS);
+	off = vdv_get_le32(buf + VDV_VDI_OFF_BLOCKS);
+	if ((size == 0) || (size % VDV_SECTOR_SIZE) != 0 ||
+	    (blocks * VDV_VDI_BLOCK_SIZE < size))
+		return (-1);
+
+	/* Every block has to be where a linear copy would put it */
+	map = malloc(blocks * 4);
+	if (map == NULL)
+		return (-1);
+	if (pread(fd, map, blocks * 4, off) != (ssize_t)(blocks * 4))
+		goto out;
+	for (i = 0; i < blocks; i++) {
+		if (vdv_get_le32(map + i * 4) != i)
+			goto out;
+	}
+
+	bzero(vl, sizeof (*vl));
+	vl->vl_off = vdv_get_le32(buf + VDV_VDI_OFF_DATA);
+	vl->vl_size = size;
+	vl->vl_blocks = blocks;
+	vl->vl_file_size = vl->vl_off + blocks * VDV_VDI_BLOCK_SIZE;
+	if (file_size < vl->vl_off + size)
+		goto out;
+	rc = 0;
+
+out:
+	free(map);
+	return (rc);
+}
+
+/*
+ * Check whether an image is a fixed image whose data can be kept when
+ * converting it to another fixed format.
+ *	file - path of the image
+ *	pszformat - VBox format of the image
+ *	offp - if not NULL, set to the file offset of the data
+ *
+ * Returns:
+ *	0: the image can be converted by vdisk_convert_fixed()
+ *	-1: it can't
+ */
+int
+vdisk_fixed_layout(const char *file, const char *pszformat, uint64_t *offp)
+{
+	struct stat64 st;
+	vdv_layout_t vl;
+	int fd, rc = -1;
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1)
+		return (-1);
+	if ((fstat64(fd, &st) == 0) && S_ISREG(st.st_mode))
+		rc = vdv_read_layout(fd, pszformat, st.st_size, &vl);
+	(void) close(fd);
+	if ((rc == 0) && (offp != NULL))
+		*offp = vl.vl_off;
+	return (rc);
+}
+
+/*
+ * Write a new image file holding the data of the open image in.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+static int
+vdv_write_image(int in, struct stat64 *st, vdv_layout_t *from,
+    const char *to, const char *pszformat_conv, vdv_layout_t *vl,
+    vd_copy_progress_t *progress, void *arg)
+{
+	uchar_t footer[VDV_VHD_FOOTER_SIZE];
+	uchar_t *hdr = NULL;
+	int out;
+
+	out = open(to, O_RDWR | O_CREAT | O_EXCL, st->st_mode & 0777);
+	if (out == -1) {
+		(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+		    gettext("ERROR: Unable to create file"), to,
+		    strerror(errno));
+		return (-1);
+	}
+
+	if (ftruncate(out, vl->vl_file_size) == -1)
+		goto fail;
+	if (vdisk_copy_range(in, from->vl_off, out, vl->vl_off,
+	    from->vl_size, progress, arg) == -1)
+		goto fail;
+
+	if (strcasecmp(pszformat_conv, "VDI") == 0) {
+		hdr = vdv_vdi_header(vl);
+		if ((hdr == NULL) ||
+		    (pwrite(out, hdr, vl->vl_off, 0) != (ssize_t)vl->vl_off))
+			goto fail;
+		free(hdr);
+		hdr = NULL;
+	} else if (strcasecmp(pszformat_conv, "VHD") == 0) {
+		vdv_vhd_footer(footer, vl->vl_size);
+		if (pwrite(out, footer, VDV_VHD_FOOTER_SIZE, vl->vl_size) !=
+		    VDV_VHD_FOOTER_SIZE)
+			goto fail;
+	}
+
+	if (fsync(out) == -1)
+		goto fail;
+	(void) fchown(out, st->st_uid, st->st_gid);
+	(void) fchmod(out, st->st_mode & 07777);
+	(void) close(out);
+	return (0);
+
+fail:
+	(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+	    gettext("ERROR: Unable to write file"), to, strerror(errno));
+	free(hdr);
+	(void) close(out);
+	(void) unlink(to);
+	return (-1);
+}
+
+/*
+ * Convert the single fixed image of a virtual disk to another fixed
+ * format, keeping its data.  The images of the virtual disk must be
+ * closed and vdisk_fixed_layout() must have accepted the image.  The
+ * store in vdh is updated and written out.
+ *	vdh - handle of the virtual disk
+ *	vdname - path to the virtual disk
+ *	pszformat - VBox format of the image
+ *	pszformat_conv - VBox format to convert to: RAW, VHD or VDI
+ *	progress - if non-null called with the bytes copied so far
+ *	arg - passed to progress
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdisk_convert_fixed(vd_handle_t *vdh, char *vdname, char *pszformat,
+    char *pszformat_conv, vd_copy_progress_t *progress, void *arg)
+{
+	char vdfilebase[MAXPATHLEN];
+	char from[MAXPATHLEN];
+	char to[MAXPATHLEN];
+	char extname[MAXPATHLEN];
+	char extname_conv[MAXPATHLEN];
+	uchar_t footer[VDV_VHD_FOOTER_SIZE];
+	struct stat64 st;
+	vdv_layout_t vl_from, vl_to;
+	boolean_t in_place, created = B_FALSE, appended = B_FALSE;
+	char *slash;
+	int fd;
+
+	if ((vdisk_format2ext(pszformat, extname) == -1) ||
+	    (vdisk_format2ext(pszformat_conv, extname_conv) == -1))
+		return (-1);
+	vdisk_get_vdfilebase(vdh, vdfilebase, vdname, MAXPATHLEN);
+	(void) snprintf(from, MAXPATHLEN, "%s.%s", vdfilebase, extname);
+	(void) snprintf(to, MAXPATHLEN, "%s.%s", vdfilebase, extname_conv);
+
+	fd = open(from, O_RDWR);
+	if ((fd == -1) || (fstat64(fd, &st) == -1)) {
+		(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+		    gettext("ERROR: Unable to open file"), from,
+		    strerror(errno));
+		goto fail;
+	}
+	if ((vdv_read_layout(fd, pszformat, st.st_size, &vl_from) == -1) ||
+	    (vdv_new_layout(pszformat_conv, vl_from.vl_size, &vl_to) == -1)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Image can't be converted in place"), from);
+		goto fail;
+	}
+	if (access(to, F_OK) == 0) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: File already exists"), to);
+		goto fail;
+	}
+
+	/* 1. complete image under the new name */
+	in_place = ((vl_from.vl_off == 0) && (vl_to.vl_off == 0));
+	if (in_place) {
+		if (link(from, to) == -1) {
+			(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+			    gettext("ERROR: Unable to link file"), to,
+			    strerror(errno));
+			goto fail;
+		}
+		created = B_TRUE;
+		if (strcasecmp(pszformat_conv, "VHD") == 0) {
+			vdv_vhd_footer(footer, vl_to.vl_size);
+			appended = B_TRUE;
+			if ((pwrite(fd, footer, VDV_VHD_FOOTER_SIZE,
+			    vl_to.vl_size) != VDV_VHD_FOOTER_SIZE) ||
+			    (fsync(fd) == -1)) {
+				(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+				    gettext("ERROR: Unable to write file"),
+				    to, strerror(errno));
+				goto fail;
+			}
+		}
+	} else {
+		if (vdv_write_image(fd, &st, &vl_from, to, pszformat_conv,
+		    &vl_to, progress, arg) == -1)
+			goto fail;
+		created = B_TRUE;
+	}
+
+	/* 2. switch the store over to the new image */
+	slash = strrchr(to, '/');
+	if ((vdisk_set_prop_str(vdh, "vtype", extname_conv,
+	    VD_PROP_IGN_RO) == -1) ||
+	    (vdisk_set_prop_str(vdh, "sparse", "false",
+	    VD_PROP_IGN_RO) == -1) ||
+	    (vdisk_set_prop_str(vdh, "vdfile", slash ? slash + 1 : to,
+	    VD_PROP_IGN_RO) == -1) ||
+	    (vdisk_write_tree(vdh, vdname) == -1)) {
+		(void) fprintf(stderr, "\n%s: \"%s\"\n\n",
+		    gettext("ERROR: Unable to update store file"), vdname);
+		goto fail;
+	}
+
+	/* 3. drop the old name and anything past the raw data */
+	(void) unlink(from);
+	if (in_place && (strcasecmp(pszformat_conv, "RAW") == 0) &&
+	    (st.st_size > vl_to.vl_size)) {
+		if ((ftruncate(fd, vl_to.vl_size) == -1) ||
+		    (fsync(fd) == -1)) {
+			(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+			    gettext("ERROR: Unable to truncate file"), to,
+			    strerror(errno));
+			(void) close(fd);
+			return (-1);
+		}
+	}
+	if ((progress != NULL) && in_place)
+		progress(vl_to.vl_size, vl_to.vl_size, arg);
+
+	(void) close(fd);
+	return (0);
+
+fail:
+	/* The old image is still the one in use; take back the footer */
+	if (created)
+		(void) unlink(to);
+	if (appended)
+		(void) ftruncate(fd, st.st_size);
+	if (fd != -1)
+		(void) close(fd);
+	return (-1);
+}
+
+/*
+ * Undo what an in-place conversion between raw and VHD left behind
+ * when it was cut short, see the top of this file: a VHD footer past
+ * the data of the raw image of vdname and the VHD name linked to it.
+ * The footer is only cut off when it is a valid fixed VHD footer for
+ * exactly max-size bytes, so a raw image can't lose data.  The store's
+ * lock must be held.
+ *	vdh - handle of the virtual disk, whose image is raw
+ *	vdname - path to the virtual disk
+ *
+ * Returns:
+ *	0: success, or nothing to undo
+ *	-1: failure
+ */
+int
+vdisk_fixed_recover(vd_handle_t *vdh, char *vdname)
+{
+	char vdfilebase[MAXPATHLEN];
+	char file[MAXPATHLEN];
+	char vhd[MAXPATHLEN];
+	struct stat64 st, vst;
+	vdv_layout_t vl;
+	uint64_t size;
+	int fd, rc = 0;
+
+	if (vdisk_get_prop_u64(vdh, "max-size", &size) == -1)
+		return (0);
+	vdisk_get_vdfilebase(vdh, vdfilebase, vdname, MAXPATHLEN);
+	(void) snprintf(file, MAXPATHLEN, "%s.raw", vdfilebase);
+	(void) snprintf(vhd, MAXPATHLEN, "%s.vhd", vdfilebase);
+
+	/* Without write access there is nothing that can be done */
+	fd = open(file, O_RDWR);
+	if (fd == -1)
+		return (0);
+	if (fstat64(fd, &st) == -1)
+		goto out;
+
+	if ((stat64(vhd, &vst) == 0) && (vst.st_dev == st.st_dev) &&
+	    (vst.st_ino == st.st_ino))
+		(void) unlink(vhd);
+
+	if ((st.st_size != size + VDV_VHD_FOOTER_SIZE) ||
+	    (vdv_read_layout(fd, "VHD", st.st_size, &vl) == -1) ||
+	    (vl.vl_size != size))
+		goto out;
+	if ((ftruncate(fd, size) == -1) || (fsync(fd) == -1)) {
+		(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+		    gettext("ERROR: Unable to truncate file"), file,
+		    strerror(errno));
+		rc = -1;
+	}
+
+out:
+	(void) close(fd);
+	return (rc);
+}
+
+/*
+ * Allocate len bytes at off in a new, empty file so they read back as
+ * zeroes.  As the file is new, posix_fallocate() is enough; there is no
+ * old data a zero-range call would have to clear.  If the file system
+ * can't allocate, the range is written with aligned runs of zeroes.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set
+ */
+static int
+vdv_allocate(int fd, uint64_t off, uint64_t len)
+{
+	char *zero;
+	size_t n;
+	int err;
+
+	if (len == 0)
+		return (0);
+
+	err = posix_fallocate(fd, off, len);
+	if (err == 0)
+		return (0);
+	if ((err != EINVAL) && (err != ENOTSUP) && (err != EOPNOTSUPP)) {
+		errno = err;
+		return (-1);
+	}
+
+	zero = memalign(VDV_ZERO_CHUNK, VDV_ZERO_CHUNK);
+	if (zero == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	bzero(zero, VDV_ZERO_CHUNK);
+
+	/* Up to a chunk boundary first, then whole chunks */
+	while (len > 0) {
+		n = VDV_ZERO_CHUNK - (off % VDV_ZERO_CHUNK);
+		if (n > len)
+			n = len;
+		if (pwrite(fd, zero, n, off) != (ssize_t)n) {
+			free(zero);
+			return (-1);
+		}
+		off += n;
+		len -= n;
+	}
+	free(zero);
+	return (0);
+}
+
+/*
+ * Write the descriptor of a fixed VMDK with the one flat extent flat.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set
+ */
+static int
+vdv_vmdk_descriptor(int fd, const char *flat, uint64_t size,
+    const char *comment)
+{
+	char desc[VDV_VMDK_MAX_DESC];
+	char uuid_str[RTUUID_STR_LENGTH];
+	char mod_str[RTUUID_STR_LENGTH];
+	const char *slash;
+	uint32_t cyls;
+	uint32_t cid;
+	RTUUID uuid;
+	int len;
+
+	(void) RTUuidCreate(&uuid);
+	bcopy(&uuid, &cid, sizeof (cid));
+	(void) RTUuidToStr(&uuid, uuid_str, sizeof (uuid_str));
+	(void) RTUuidCreate(&uuid);
+	(void) RTUuidToStr(&uuid, mod_str, sizeof (mod_str));
+	cyls = MIN(16383, size / (16 * 63 * VDV_SECTOR_SIZE));
+
+	/* The extent is named relative to the descriptor */
+	slash = strrchr(flat, '/');
+	len = snprintf(desc, sizeof (desc),
+	    "# Disk DescriptorFile\n"
+	    "version=1\n"
+	    "CID=%08x\n"
+	    "parentCID=ffffffff\n"
+	    "createType=\"monolithicFlat\"\n"
+	    "\n"
+	    "# Extent description\n"
+	    "RW %llu FLAT \"%s\" 0\n"
+	    "\n"
+	    "# The disk Data Base \n"
+	    "#DDB\n"
+	    "\n"
+	    "ddb.virtualHWVersion = \"%d\"\n"
+	    "ddb.adapterType=\"ide\"\n"
+	    "ddb.uuid.image=\"%s\"\n"
+	    "ddb.uuid.parent=\"00000000-0000-0000-0000-000000000000\"\n"
+	    "ddb.uuid.modification=\"%s\"\n"
+	    "ddb.uuid.parentmodification="
+	    "\"00000000-0000-0000-0000-000000000000\"\n"
+	    "ddb.geometry.cylinders=\"%u\"\n"
+	    "ddb.geometry.heads=\"16\"\n"
+	    "ddb.geometry.sectors=\"63\"\n",
+	    cid, (unsigned long long)(size / VDV_SECTOR_SIZE),
+	    slash ? slash + 1 : flat, VDV_VMDK_HW_VERSION, uuid_str, mod_str,
+	    cyls);
+	if ((comment != NULL) && (strchr(comment, '"') == NULL) &&
+	    (len < sizeof (desc)))
+		len += snprintf(desc + len, sizeof (desc) - len,
+		    "ddb.comment=\"%s\"\n", comment);
+	if (len >= sizeof (desc)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	if (pwrite(fd, desc, len, 0) != len)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Create a new fixed image without writing its data.  For a VMDK, file
+ * is the descriptor and the data goes to the flat extent next to it,
+ * named <file base>-flat.vmdk.
+ *	file - path of the image to create; it must not exist
+ *	pszformat - VBox format: RAW, VHD, VDI or VMDK
+ *	size - disk size in bytes
+ *	comment - kept in the image where the format has room, or NULL
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure; errno is ENOTSUP for a format or size this can't create
+ */
+int
+vdisk_create_fixed(const char *file, const char *pszformat, uint64_t size,
+    const char *comment)
+{
+	char flat[MAXPATHLEN];
+	uchar_t footer[VDV_VHD_FOOTER_SIZE];
+	uchar_t *hdr = NULL;
+	const char *data_file = file;
+	const char *dot;
+	vdv_layout_t vl;
+	boolean_t vmdk;
+	int fd = -1, dfd;
+	int err;
+
+	vmdk = (strcasecmp(pszformat, "VMDK") == 0);
+	if (vdv_new_layout(vmdk ? "RAW" : pszformat, size, &vl) == -1) {
+		errno = ENOTSUP;
+		return (-1);
+	}
+	if (vmdk) {
+		dot = strrchr(file, '.');
+		if ((dot == NULL) || (strchr(dot, '/') != NULL))
+			dot = file + strlen(file);
+		if (snprintf(flat, sizeof (flat), "%.*s%s%s",
+		    (int)(dot - file), file, VDV_VMDK_FLAT_SUFFIX, dot) >=
+		    sizeof (flat)) {
+			errno = ENAMETOOLONG;
+			return (-1);
+		}
+		data_file = flat;
+	}
+
+	dfd = open(data_file, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (dfd == -1)
+		return (-1);
+	if (vmdk) {
+		fd = open(file, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd == -1)
+			goto fail;
+	}
+
+	/* The data first, so no metadata ever names missing space */
+	if (vdv_allocate(dfd, vl.vl_off, vl.vl_size) == -1)
+		goto fail;
+
+	if (vmdk) {
+		if ((vdv_vmdk_descriptor(fd, flat, size, comment) == -1) ||
+		    (fsync(fd) == -1))
+			goto fail;
+	} else if (strcasecmp(pszformat, "VDI") == 0) {
+		hdr = vdv_vdi_header(&vl);
+		if (hdr == NULL)
+			goto fail;
+		if (comment != NULL)
+			(void) strlcpy((char *)hdr + VDV_VDI_OFF_COMMENT,
+			    comment, VDV_VDI_COMMENT_SIZE);
+		if (pwrite(dfd, hdr, vl.vl_off, 0) != (ssize_t)vl.vl_off)
+			goto fail;
+		free(hdr);
+		hdr = NULL;
+		/* The last block may reach past the end of the disk */
+		if (ftruncate(dfd, vl.vl_file_size) == -1)
+			goto fail;
+	} else if (strcasecmp(pszformat, "VHD") == 0) {
+		vdv_vhd_footer(footer, size);
+		if (pwrite(dfd, footer, VDV_VHD_FOOTER_SIZE, size) !=
+		    VDV_VHD_FOOTER_SIZE)
+			goto fail;
+	}
+
+	if (fsync(dfd) == -1)
+		goto fail;
+	(void) close(dfd);
+	if (fd != -1)
+		(void) close(fd);
+	return (0);
+
+fail:
+	err = errno;
+	free(hdr);
+	(void) close(dfd);
+	(void) unlink(data_file);
+	if (fd != -1) {
+		(void) close(fd);
+		(void) unlink(file);
+	}
+	errno = err;
+	return (-1);
+}
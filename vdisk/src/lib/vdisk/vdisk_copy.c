@@ -0,0 +1,621 @@
+/*
+ * Copyright 2009 Sun Microsystems, Inc.  All Rights Reserved.
+ *
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS FILE HEADER.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 only, as
+ * published by the Free Software Foundation. This program is distributed in
+ * the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License version 2 for more details (a copy is
+ * included in the LICENSE file that accompanied this code).
+ *
+ * You should have received a copy of the GNU General Public License version 2
+ * along with this program; If not, see
+ *    http://doc.java.sun.com/DocWeb/license.html.
+ *
+ * Please contact Sun Microsystems, Inc., 4150 Network Circle, Santa Clara,
+ * CA 95054 USA or visit www.sun.com if you need additional information or
+ * have any questions.
+ */
+
+/*
+ * File level copies of virtual disk files.
+ *
+ * Used wherever a virtual disk file can be copied as is instead of going
+ * through VDCopy(): moves across file systems, full clones of a single
+ * image, raw to raw translations and the data of a fixed image converted
+ * to another fixed format.  The cheapest method available is used for
+ * every file:
+ *	- a reflink (FICLONE) sharing the blocks on copy-on-write file
+ *	  systems, so the copy is nearly free
+ *	- copy_file_range(), keeping the copy in the kernel
+ *	- pread/pwrite of VD_COPY_BUFSIZE chunks
+ * Holes in the source are found with SEEK_DATA/SEEK_HOLE and skipped, and
+ * all-zero chunks aren't written, whenever the target is a regular file
+ * which already reads as zeroes.  A block device target gets every byte.
+ *
+ * sendfile() isn't used; on Solaris it needs libsendfile, which every
+ * consumer of libvdisk would then have to link with.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <libintl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "vdisk.h"
+
+
+/* size of each chunk copied through user space */
+#define	VD_COPY_BUFSIZE		(1024 * 1024)
+
+typedef struct vdc_file {
+	int		vf_in;
+	int		vf_out;
+	uint64_t	vf_off;		/* start of the data in the source */
+	uint64_t	vf_out_off;	/* ... and in the target */
+	uint64_t	vf_size;	/* bytes to copy */
+	boolean_t	vf_skip_zero;	/* target reads as zeroes */
+	boolean_t	vf_kernel;	/* try copy_file_range() */
+	char		*vf_buf;
+	vd_copy_progress_t *vf_progress;
+	void		*vf_arg;
+	uint64_t	vf_base;	/* bytes done by earlier files */
+	uint64_t	vf_total;	/* bytes to do over all files */
+} vdc_file_t;
+
+static void
+vdc_progress(vdc_file_t *vf, uint64_t off)
+{
+	if (vf->vf_progress != NULL)
+		vf->vf_progress(vf->vf_base + off - vf->vf_off, vf->vf_total,
+		    vf->vf_arg);
+}
+
+static boolean_t
+vdc_is_zero(const char *data, size_t len)
+{
+	const uint64_t *p = (const uint64_t *)data;
+	size_t i;
+
+	for (i = 0; i < len / sizeof (uint64_t); i++) {
+		if (p[i] != 0)
+			return (B_FALSE);
+	}
+	for (i *= sizeof (uint64_t); i < len; i++) {
+		if (data[i] != 0)
+			return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+/*
+ * Copy len bytes at off from the source to the matching offset of the
+ * target.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set
+ */
+static int
+vdc_copy_range(vdc_file_t *vf, uint64_t off, uint64_t len)
+{
+	uint64_t end = off + len;
+	size_t n;
+	ssize_t rd, wr;
+
+#ifdef __linux__
+	while (vf->vf_kernel && (off < end)) {
+		loff_t in_off = off;
+		loff_t out_off = off - vf->vf_off + vf->vf_out_off;
+
+		n = (size_t)MIN(end - off, VD_COPY_BUFSIZE);
+		rd = copy_file_range(vf->vf_in, &in_off, vf->vf_out, &out_off,
+		    n, 0);
+		if (rd > 0) {
+			off += rd;
+			vdc_progress(vf, off);
+			continue;
+		}
+		if (rd == 0) {
+			errno = EIO;
+			return (-1);
+		}
+		if (errno == EINTR)
+			continue;
+		if ((errno != EXDEV) && (errno != ENOSYS) &&
+		    (errno != EINVAL) && (errno != EOPNOTSUPP))
+			return (-1);
+		/* not between these files, copy through user space */
+		vf->vf_kernel = B_FALSE;
+	}
+#endif
+
+	while (off < end) {
+		n = (size_t)MIN(end - off, VD_COPY_BUFSIZE);
+		rd = pread(vf->vf_in, vf->vf_buf, n, (off_t)off);
+		if (rd == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		if (rd == 0) {
+			errno = EIO;
+			return (-1);
+		}
+		if (!vf->vf_skip_zero || !vdc_is_zero(vf->vf_buf, rd)) {
+			for (n = 0; n < (size_t)rd; n += wr) {
+				wr = pwrite(vf->vf_out, vf->vf_buf + n, rd - n,
+				    (off_t)(off - vf->vf_off + vf->vf_out_off +
+				    n));
+				if (wr == -1) {
+					if (errno == EINTR) {
+						wr = 0;
+						continue;
+					}
+					return (-1);
+				}
+			}
+		}
+		off += rd;
+		vdc_progress(vf, off);
+	}
+	return (0);
+}
+
+/*
+ * Copy the data of the source, skipping holes if the target reads as
+ * zeroes there.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set
+ */
+static int
+vdc_copy_data(vdc_file_t *vf)
+{
+	uint64_t off = vf->vf_off;
+	uint64_t end = vf->vf_off + vf->vf_size;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	off_t data, hole;
+
+	while (vf->vf_skip_zero && (off < end)) {
+		data = lseek(vf->vf_in, (off_t)off, SEEK_DATA);
+		if (data == -1) {
+			if (errno == ENXIO) {
+				/* only a hole left */
+				vdc_progress(vf, end);
+				return (0);
+			}
+			/* not supported here, copy the rest */
+			break;
+		}
+		if ((uint64_t)data >= end) {
+			vdc_progress(vf, end);
+			return (0);
+		}
+		hole = lseek(vf->vf_in, data, SEEK_HOLE);
+		if ((hole == -1) || ((uint64_t)hole > end))
+			hole = (off_t)end;
+		if (vdc_copy_range(vf, data, hole - data) == -1)
+			return (-1);
+		off = hole;
+	}
+#endif
+	if (off >= end)
+		return (0);
+	return (vdc_copy_range(vf, off, end - off));
+}
+
+/*
+ * Copy one file, adding its progress to the overall progress in vf.
+ * A new target gets the mode, owner and times of the source.
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+static int
+vdc_copy_file(const char *from, const char *to, vdc_file_t *vf)
+{
+	struct stat64 st_in, st_out;
+	struct timeval tv[2];
+	boolean_t existed = B_TRUE;
+	off_t end;
+	int rc = -1;
+
+	vf->vf_out = -1;
+	vf->vf_in = open(from, O_RDONLY);
+	if ((vf->vf_in == -1) || (fstat64(vf->vf_in, &st_in) == -1)) {
+		(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+		    gettext("ERROR: Unable to open file"), from,
+		    strerror(errno));
+		goto out;
+	}
+
+	/* Block devices have no size in their stat */
+	if (S_ISREG(st_in.st_mode)) {
+		vf->vf_size = st_in.st_size;
+	} else {
+		end = lseek(vf->vf_in, 0, SEEK_END);
+		if (end == -1) {
+			(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+			    gettext("ERROR: Unable to get size of file"),
+			    from, strerror(errno));
+			goto out;
+		}
+		vf->vf_size = end;
+	}
+	if (vf->vf_total == 0)
+		vf->vf_total = vf->vf_size;
+
+	existed = (stat64(to, &st_out) == 0) ? B_TRUE : B_FALSE;
+	vf->vf_out = open(to, O_WRONLY | O_CREAT, st_in.st_mode & 0777);
+	if ((vf->vf_out == -1) || (fstat64(vf->vf_out, &st_out) == -1)) {
+		(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+		    gettext("ERROR: Unable to create file"), to,
+		    strerror(errno));
+		goto out;
+	}
+
+	if (S_ISREG(st_out.st_mode)) {
+		/* Start from an empty file, reading as zeroes throughout */
+		if ((ftruncate(vf->vf_out, 0) == -1) ||
+		    (ftruncate(vf->vf_out, vf->vf_size) == -1)) {
+			(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+			    gettext("ERROR: Unable to size file"), to,
+			    strerror(errno));
+			goto out;
+		}
+		vf->vf_skip_zero = B_TRUE;
+	} else {
+		vf->vf_skip_zero = B_FALSE;
+	}
+
+#ifdef FICLONE
+	if (vf->vf_skip_zero &&
+	    (ioctl(vf->vf_out, FICLONE, vf->vf_in) == 0)) {
+		vdc_progress(vf, vf->vf_size);
+		goto done;
+	}
+#endif
+
+	if (vdc_copy_data(vf) == -1) {
+		(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+		    gettext("ERROR: Unable to copy file"), from,
+		    strerror(errno));
+		goto out;
+	}
+
+#ifdef FICLONE
+done:
+#endif
+	if (fsync(vf->vf_out) == -1) {
+		(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+		    gettext("ERROR: Unable to copy file"), from,
+		    strerror(errno));
+		goto out;
+	}
+
+	if (!existed && S_ISREG(st_out.st_mode)) {
+		(void) fchmod(vf->vf_out, st_in.st_mode & 07777);
+		(void) fchown(vf->vf_out, st_in.st_uid, st_in.st_gid);
+		tv[0].tv_sec = st_in.st_atime;
+		tv[0].tv_usec = 0;
+		tv[1].tv_sec = st_in.st_mtime;
+		tv[1].tv_usec = 0;
+		(void) utimes(to, tv);
+	}
+	vf->vf_base += vf->vf_size;
+	rc = 0;
+
+out:
+	if (vf->vf_in != -1)
+		(void) close(vf->vf_in);
+	if (vf->vf_out != -1)
+		(void) close(vf->vf_out);
+	if ((rc == -1) && (vf->vf_out != -1) && !existed)
+		(void) unlink(to);
+	return (rc);
+}
+
+/*
+ * Copy a file, or a regular file to a block device.
+ *	from - path of file to copy
+ *	to - path of copy; an existing regular file is overwritten
+ *	progress - if non-null called with the bytes done so far
+ *	arg - passed to progress
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdisk_copy_file(const char *from, const char *to,
+    vd_copy_progress_t *progress, void *arg)
+{
+	vdc_file_t vf;
+	int rc;
+
+	bzero(&vf, sizeof (vf));
+	vf.vf_kernel = B_TRUE;
+	vf.vf_progress = progress;
+	vf.vf_arg = arg;
+	vf.vf_buf = malloc(VD_COPY_BUFSIZE);
+	if (vf.vf_buf == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	rc = vdc_copy_file(from, to, &vf);
+	free(vf.vf_buf);
+	return (rc);
+}
+
+/*
+ * Copy part of an open file into an open regular file.  The target has
+ * to read as zeroes over the range copied to, e.g. a file just extended
+ * with ftruncate(), so holes and all-zero chunks are skipped.  The range
+ * is cloned instead if the file system can share the blocks.
+ *	in - source file
+ *	in_off - offset of the data in the source
+ *	out - target file
+ *	out_off - offset to copy the data to
+ *	len - number of bytes to copy
+ *	progress - if non-null called with the bytes done so far
+ *	arg - passed to progress
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure, errno set
+ */
+int
+vdisk_copy_range(int in, uint64_t in_off, int out, uint64_t out_off,
+    uint64_t len, vd_copy_progress_t *progress, void *arg)
+{
+	vdc_file_t vf;
+	int rc;
+#ifdef FICLONERANGE
+	struct file_clone_range fcr;
+
+	fcr.src_fd = in;
+	fcr.src_offset = in_off;
+	fcr.src_length = len;
+	fcr.dest_offset = out_off;
+	/* Needs block aligned offsets, so may well fail */
+	if (ioctl(out, FICLONERANGE, &fcr) == 0) {
+		if (progress != NULL)
+			progress(len, len, arg);
+		return (0);
+	}
+#endif
+
+	bzero(&vf, sizeof (vf));
+	vf.vf_in = in;
+	vf.vf_out = out;
+	vf.vf_off = in_off;
+	vf.vf_out_off = out_off;
+	vf.vf_size = len;
+	vf.vf_total = len;
+	vf.vf_skip_zero = B_TRUE;
+	vf.vf_kernel = B_TRUE;
+	vf.vf_progress = progress;
+	vf.vf_arg = arg;
+	vf.vf_buf = malloc(VD_COPY_BUFSIZE);
+	if (vf.vf_buf == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	rc = vdc_copy_data(&vf);
+	free(vf.vf_buf);
+	return (rc);
+}
+
+/*
+ * Is the directory entry a file to be moved?
+ */
+static boolean_t
+vdc_match(const char *dir, const char *name, const char *prefix,
+    struct stat64 *st)
+{
+	char path[MAXPATHLEN];
+
+	if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0))
+		return (B_FALSE);
+	if ((prefix != NULL) && (strncmp(name, prefix, strlen(prefix)) != 0))
+		return (B_FALSE);
+	(void) snprintf(path, MAXPATHLEN, "%s/%s", dir, name);
+	if ((lstat64(path, st) == -1) || !S_ISREG(st->st_mode))
+		return (B_FALSE);
+	return (B_TRUE);
+}
+
+/*
+ * Free the names vdc_read_names() returned.
+ */
+static void
+vdc_free_names(char **names, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+}
+
+/*
+ * Read the names of the files of a directory that vdisk_move_files()
+ * moves.  All are read before any file is moved, as entries added or
+ * removed while a directory is read may or may not be returned.
+ *	dir - directory holding the files
+ *	prefix - leading part of names to move or NULL for all files
+ *	namesp - set to the names, freed with vdc_free_names()
+ *	countp - set to the number of names
+ *	totalp - set to the size of the files together
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+static int
+vdc_read_names(const char *dir, const char *prefix, char ***namesp,
+    int *countp, uint64_t *totalp)
+{
+	struct stat64 st;
+	struct dirent *dp;
+	char **names = NULL;
+	char **tmp;
+	int count = 0;
+	DIR *dirp;
+
+	*totalp = 0;
+	dirp = opendir(dir);
+	if (dirp == NULL) {
+		(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+		    gettext("ERROR: Unable to read directory"),
+		    dir, strerror(errno));
+		return (-1);
+	}
+
+	while ((dp = readdir(dirp)) != NULL) {
+		if (!vdc_match(dir, dp->d_name, prefix, &st))
+			continue;
+		tmp = realloc(names, (count + 1) * sizeof (char *));
+		if (tmp == NULL)
+			goto fail;
+		names = tmp;
+		if ((names[count] = strdup(dp->d_name)) == NULL)
+			goto fail;
+		count++;
+		*totalp += st.st_size;
+	}
+	(void) closedir(dirp);
+
+	*namesp = names;
+	*countp = count;
+	return (0);
+
+fail:
+	(void) fprintf(stderr, "%s\n", gettext(
+	    "ERROR: Unable to allocate memory."));
+	vdc_free_names(names, count);
+	(void) closedir(dirp);
+	return (-1);
+}
+
+/*
+ * Move the regular files of a directory whose names start with prefix
+ * into another directory.  Files are renamed if both directories are
+ * on the same file system.  Otherwise all files are copied first and
+ * only removed once every copy succeeded, so a failure leaves the
+ * source as it was.
+ *	from_dir - directory holding the files
+ *	prefix - leading part of names to move or NULL for all files
+ *	to_dir - existing directory to move the files to
+ *	progress - if non-null called with the bytes copied so far
+ *	arg - passed to progress
+ *
+ * Returns:
+ *	0: success
+ *	-1: failure
+ */
+int
+vdisk_move_files(const char *from_dir, const char *prefix,
+    const char *to_dir, vd_copy_progress_t *progress, void *arg)
+{
+	char from[MAXPATHLEN];
+	char to[MAXPATHLEN];
+	struct stat64 st_from, st_to;
+	vdc_file_t vf;
+	char **names;
+	int count, copied, i;
+	int rc = -1;
+
+	bzero(&vf, sizeof (vf));
+	if ((stat64(from_dir, &st_from) == -1) ||
+	    (stat64(to_dir, &st_to) == -1)) {
+		(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+		    gettext("ERROR: Directory doesn't exist"),
+		    from_dir, strerror(errno));
+		return (-1);
+	}
+	if (vdc_read_names(from_dir, prefix, &names, &count,
+	    &vf.vf_total) == -1)
+		return (-1);
+
+	/* Same file system, a rename will do */
+	if (st_from.st_dev == st_to.st_dev) {
+		for (i = 0; i < count; i++) {
+			(void) snprintf(from, MAXPATHLEN, "%s/%s", from_dir,
+			    names[i]);
+			(void) snprintf(to, MAXPATHLEN, "%s/%s", to_dir,
+			    names[i]);
+			if (rename(from, to) == -1) {
+				(void) fprintf(stderr, "\n%s: %s: %s\n\n",
+				    gettext("ERROR: Unable to move file"),
+				    from, strerror(errno));
+				goto out;
+			}
+		}
+		rc = 0;
+		goto out;
+	}
+
+	vf.vf_kernel = B_TRUE;
+	vf.vf_progress = progress;
+	vf.vf_arg = arg;
+	vf.vf_buf = malloc(VD_COPY_BUFSIZE);
+	if (vf.vf_buf == NULL) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	for (copied = 0; copied < count; copied++) {
+		(void) snprintf(from, MAXPATHLEN, "%s/%s", from_dir,
+		    names[copied]);
+		(void) snprintf(to, MAXPATHLEN, "%s/%s", to_dir,
+		    names[copied]);
+		if (vdc_copy_file(from, to, &vf) == -1)
+			break;
+	}
+
+	/*
+	 * On success remove the originals.  On failure remove the copies,
+	 * including what was written of the file that failed.
+	 */
+	if (copied == count) {
+		rc = 0;
+		for (i = 0; i < count; i++) {
+			(void) snprintf(from, MAXPATHLEN, "%s/%s", from_dir,
+			    names[i]);
+			(void) unlink(from);
+		}
+	} else {
+		for (i = 0; i <= copied; i++) {
+			(void) snprintf(to, MAXPATHLEN, "%s/%s", to_dir,
+			    names[i]);
+			(void) unlink(to);
+		}
+	}
+
+out:
+	free(vf.vf_buf);
+	vdc_free_names(names, count);
+	return (rc);
+}